@@ -0,0 +1,87 @@
+/*  Sirikata Benchmarks -- Sirikata Benchmark Suite
+ *  LZCompressionBenchmark.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cxxtest/TestSuite.h>
+#include "network/LZCompression.hpp"
+#include "task/Time.hpp"
+#include "../test/LZCompressionMixes.hpp"
+#include <iostream>
+
+using namespace Sirikata;
+using Sirikata::Network::LZCompression;
+///Prints how far each message mix compresses and how quickly
+class LZCompressionBenchmark : public CxxTest::TestSuite
+{
+    typedef LZCompressionMixes::Message Message;
+public:
+    void testMessageMixes( void ) {
+        std::vector<LZCompressionMixes::MessageMix> mixes=LZCompressionMixes::makeMixes();
+        for (size_t m=0;m<mixes.size();++m) {
+            const std::vector<Message>&messages=mixes[m].mMessages;
+            size_t originalBytes=0;
+            size_t sentBytes=0;
+            size_t numCompressed=0;
+            std::vector<Message> compressed(messages.size());
+            std::vector<size_t> compressedLengths(messages.size());
+            Task::AbsTime start=Task::AbsTime::now();
+            for (size_t i=0;i<messages.size();++i) {
+                compressed[i].resize(messages[i].size());
+                compressedLengths[i]=LZCompression::compress(&messages[i][0],messages[i].size(),&compressed[i][0],messages[i].size());
+            }
+            double compressSeconds=(double)(Task::AbsTime::now()-start);
+            start=Task::AbsTime::now();
+            Message decompressed;
+            size_t decompressedBytes=0;
+            for (size_t i=0;i<messages.size();++i) {
+                if (compressedLengths[i]) {
+                    decompressedBytes+=messages[i].size();
+                    decompressed.resize(messages[i].size());
+                    LZCompression::decompress(&compressed[i][0],compressedLengths[i],&decompressed[0],decompressed.size());
+                }
+            }
+            double decompressSeconds=(double)(Task::AbsTime::now()-start);
+            for (size_t i=0;i<messages.size();++i) {
+                originalBytes+=messages[i].size();
+                size_t sent=LZCompressionMixes::sentLength(messages[i].size(),compressedLengths[i]);
+                if (sent<messages[i].size())
+                    ++numCompressed;
+                sentBytes+=sent;
+            }
+            std::cout<<"\n"<<mixes[m].mName<<": "<<messages.size()<<" messages, "<<originalBytes<<" bytes sent as "<<sentBytes
+                     <<" ("<<100.0*sentBytes/originalBytes<<"%, "<<numCompressed<<" compressed), compress "
+                     <<originalBytes/compressSeconds/1048576.0<<"MB/s";
+            if (decompressedBytes)
+                std::cout<<", decompress "<<decompressedBytes/decompressSeconds/1048576.0<<"MB/s";
+        }
+        std::cout<<std::endl;
+    }
+};
@@ -0,0 +1,253 @@
+/*  Sirikata Benchmarks -- Sirikata Benchmark Suite
+ *  SstBenchmark.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "network/TCPStream.hpp"
+#include "network/TCPStreamListener.hpp"
+#include "network/IOServicePool.hpp"
+#include "network/TCPSocketOptions.hpp"
+#include "network/TCPDefinitions.hpp"
+#include "task/Time.hpp"
+#include <cxxtest/TestSuite.h>
+#include <boost/thread.hpp>
+#include <time.h>
+#include <iostream>
+using namespace Sirikata::Network;
+/**
+ * Times TCP-SST connections over loopback and prints what it measured.
+ * These are not unit tests: they only fail when a run does not complete, and they live in the benchmarks target so
+ * the timings never gate the tests
+ */
+class SstBenchmark : public CxxTest::TestSuite
+{
+    IOServicePool mPool;
+    unsigned short mNextPort;
+public:
+    SstBenchmark():mPool(1),mNextPort(9242) {
+        mPool.run();
+    }
+    ~SstBenchmark() {
+        //let the connections built on the pool finish closing before it stops
+        boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+        mPool.stop();
+    }
+    static SstBenchmark*createSuite() {
+        return new SstBenchmark;
+    }
+    static void destroySuite(SstBenchmark*sst) {
+        delete sst;
+    }
+    ///A loopback address on a port no other run has used, so a run never waits out the last one's lingering sockets
+    Address nextLoopback() {
+        std::ostringstream port;
+        port<<mNextPort++;
+        return Address("127.0.0.1",port.str());
+    }
+    ///Waits until value reaches target or the seconds run out, returning whether it got there
+    static bool waitFor(Sirikata::AtomicValue<int>&value,int target,int seconds) {
+        time_t start=time(NULL);
+        while (value.read()<target) {
+            if (time(NULL)>=start+seconds)
+                return false;
+            boost::this_thread::sleep(boost::posix_time::microseconds(50));
+        }
+        return true;
+    }
+    ///Echoes pings back and counts the bulk packets, keeping the accepted stream in accepted
+    static void echoNewStreamCallback (std::vector<TCPStream*>*accepted,Sirikata::AtomicValue<int>*received,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            accepted->push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstBenchmark::echoRecvCallback,newStream,received,_1));
+        }
+    }
+    static void echoRecvCallback(Stream*stream, Sirikata::AtomicValue<int>*received, const Chunk&data) {
+        if (data.size()<=64)
+            stream->send(data,ReliableOrdered);
+        else
+            ++*received;
+    }
+    ///Counts the packets of the streams it accepts, keeping them in accepted
+    static void countNewStreamCallback (std::vector<TCPStream*>*accepted,Sirikata::AtomicValue<int>*received,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            accepted->push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstBenchmark::countRecvCallback,received,_1));
+        }
+    }
+    static void countRecvCallback(Sirikata::AtomicValue<int>*received, const Chunk&data) {
+        ++*received;
+    }
+    ///Sends the next ping until there have been total round trips
+    static void pingRecvCallback(Stream*stream, Sirikata::AtomicValue<int>*roundTrips, Sirikata::AtomicValue<int>*total, const Chunk&data) {
+        if (++*roundTrips<total->read())
+            stream->send(data,ReliableOrdered);
+    }
+    /**
+     * Times ping round trips and then a bulk transfer over a single loopback connection with the given options on both sides,
+     * returning the statistics of each side, which tell which options took effect and the buffer sizes kept
+     */
+    void socketOptionsRun(const TCPSocketOptions&options,double&roundTripMicroseconds,double&megabytesPerSecond,
+                          TCPStream::ConnectionStatistics&client,TCPStream::ConnectionStatistics&listened) {
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        const int roundTrips=500,bulkPackets=2000;
+        const size_t bulkSize=16384;
+        Sirikata::AtomicValue<int> received(0),pings(0),maxPings(1);
+        std::vector<TCPStream*> accepted;
+        roundTripMicroseconds=megabytesPerSecond=-1;
+        client.mSocketOptionsApplied=listened.mSocketOptionsApplied=0;
+        client.mSendBufferSize=listened.mSendBufferSize=client.mReceiveBufferSize=listened.mReceiveBufferSize=0;
+        Address address=nextLoopback();
+        TCPStreamListener listener(mPool.service());
+        listener.setSocketOptions(options);
+        listener.listen(address,std::tr1::bind(&SstBenchmark::echoNewStreamCallback,&accepted,&received,_1,_2));
+        {
+            TCPStream r(mPool.service());
+            r.setNumConnections(1);
+            r.setSocketOptions(options);
+            r.connect(address,
+                      &Stream::ignoreSubstreamCallback,
+                      &Stream::ignoreConnectionStatus,
+                      std::tr1::bind(&SstBenchmark::pingRecvCallback,&r,&pings,&maxPings,_1));
+            //the first round trip waits for the handshake, so it is not timed
+            r.send(Chunk(64,'p'),ReliableOrdered);
+            waitFor(pings,1,10);
+            Sirikata::Task::AbsTime start=Sirikata::Task::AbsTime::now();
+            pings=0;
+            maxPings=roundTrips;
+            r.send(Chunk(64,'p'),ReliableOrdered);
+            //without TCP_NODELAY a round trip may wait out a delayed acknowledgement, so give up after a while
+            waitFor(pings,roundTrips,10);
+            if (pings.read())
+                roundTripMicroseconds=(double)(Sirikata::Task::AbsTime::now()-start)*1000000.0/pings.read();
+            maxPings=0;
+            Chunk bulk(bulkSize,'b');
+            start=Sirikata::Task::AbsTime::now();
+            for (int i=0;i<bulkPackets;++i) {
+                r.send(bulk,ReliableOrdered);
+            }
+            if (waitFor(received,bulkPackets,20))
+                megabytesPerSecond=bulkPackets*bulkSize/(double)(Sirikata::Task::AbsTime::now()-start)/1048576.0;
+            TS_ASSERT_EQUALS(received.read(),bulkPackets);
+            client=r.getConnectionStatistics();
+            if (accepted.size()==1)
+                listened=accepted[0]->getConnectionStatistics();
+            r.close();
+        }
+        for (size_t i=0;i<accepted.size();++i) {
+            delete accepted[i];
+        }
+    }
+    ///Sends count messages of the given size over two streams of a fresh connection to address, returning the seconds until all arrived or -1
+    double transportRun(const Address&address, int count, size_t size) {
+        Sirikata::AtomicValue<int> received(0);
+        std::vector<TCPStream*> accepted;
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(mPool.service());
+        listener.listen(address,std::tr1::bind(&SstBenchmark::countNewStreamCallback,&accepted,&received,_1,_2));
+        double seconds=-1;
+        {
+            TCPStream r(mPool.service());
+            r.connect(address,
+                      &Stream::ignoreSubstreamCallback,
+                      &Stream::ignoreConnectionStatus,
+                      &Stream::ignoreBytesReceived);
+            Stream*substream=r.factory();
+            substream->cloneFrom(&r,&Stream::ignoreConnectionStatus,&Stream::ignoreBytesReceived);
+            Chunk message(size,'U');
+            Sirikata::Task::AbsTime start=Sirikata::Task::AbsTime::now();
+            for (int i=0;i<count;++i) {
+                ((i&1)?substream:(Stream*)&r)->send(message,ReliableOrdered);
+            }
+            if (waitFor(received,count,20))
+                seconds=(double)(Sirikata::Task::AbsTime::now()-start);
+            TS_ASSERT_EQUALS(received.read(),count);
+            substream->close();
+            delete substream;
+            r.close();
+        }
+        for (size_t i=0;i<accepted.size();++i) {
+            delete accepted[i];
+        }
+        return seconds;
+    }
+    void testUnixDomainTransport(void) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        Address unixAddress=Address::unixDomain("sirikata_sst_benchmark.sock");
+        const int count=20000;
+        const size_t sizes[]={64,1024,16384};
+        for (size_t i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+            double tcpSeconds=transportRun(nextLoopback(),count,sizes[i]);
+            double unixSeconds=transportRun(unixAddress,count,sizes[i]);
+            if (tcpSeconds>0&&unixSeconds>0) {
+                std::cout<<"\n"<<count<<" messages of "<<sizes[i]<<" bytes: loopback TCP "<<count/tcpSeconds<<" msg/s "
+                         <<count*sizes[i]/tcpSeconds/1048576.0<<"MB/s, Unix domain "<<count/unixSeconds<<" msg/s "
+                         <<count*sizes[i]/unixSeconds/1048576.0<<"MB/s";
+            }
+        }
+        std::cout<<std::endl;
+#endif
+    }
+    void testSocketOptions(void) {
+        //each option on its own, against a socket left as the system makes it
+        std::vector<std::pair<const char*,TCPSocketOptions> > runs;
+        runs.push_back(std::make_pair("system defaults",TCPSocketOptions::systemDefaults()));
+        runs.push_back(std::make_pair("nodelay",TCPSocketOptions::systemDefaults()));
+        runs.back().second.mNoDelay=true;
+        runs.push_back(std::make_pair("1MB buffers",TCPSocketOptions::systemDefaults()));
+        runs.back().second.mSendBufferSize=runs.back().second.mReceiveBufferSize=1<<20;
+        runs.push_back(std::make_pair("quickack",TCPSocketOptions::systemDefaults()));
+        runs.back().second.mQuickAck=true;
+        runs.push_back(std::make_pair("busypoll 50us",TCPSocketOptions::systemDefaults()));
+        runs.back().second.mBusyPollMicroseconds=50;
+        runs.push_back(std::make_pair("notsentlowat 16KB",TCPSocketOptions::systemDefaults()));
+        runs.back().second.mNotSentLowWater=16384;
+        runs.push_back(std::make_pair("keepalive 30s/5s",TCPSocketOptions::systemDefaults()));
+        runs.back().second.mKeepAlive=true;
+        runs.back().second.mKeepAliveIdleSeconds=30;
+        runs.back().second.mKeepAliveIntervalSeconds=5;
+        for (size_t i=0;i<runs.size();++i) {
+            double roundTrip,throughput;
+            TCPStream::ConnectionStatistics client,listened;
+            socketOptionsRun(runs[i].second,roundTrip,throughput,client,listened);
+            std::cout<<"\n"<<runs[i].first<<": round trip "<<roundTrip<<"us, bulk "<<throughput<<"MB/s, took effect: "
+                     <<TCPSocketOptions::describe(client.mSocketOptionsApplied)<<" / "<<TCPSocketOptions::describe(listened.mSocketOptionsApplied);
+            if (runs[i].second.requested()&(TCPSocketOptions::SEND_BUFFER|TCPSocketOptions::RECEIVE_BUFFER))
+                std::cout<<", buffers kept "<<client.mSendBufferSize<<"/"<<client.mReceiveBufferSize<<" / "
+                         <<listened.mSendBufferSize<<"/"<<listened.mReceiveBufferSize<<" bytes";
+        }
+        std::cout<<std::endl;
+    }
+};
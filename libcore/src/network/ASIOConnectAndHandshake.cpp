@@ -34,9 +34,11 @@
 #include "TCPDefinitions.hpp"
 #include "TCPStream.hpp"
 #include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
 #include "ASIOSocketWrapper.hpp"
 #include "TCPStream.hpp"
 #include "MultiplexedSocket.hpp"
+#include "ASIODatagramChannel.hpp"
 #include "ASIOConnectAndHandshake.hpp"
 namespace Sirikata { namespace Network {
 using namespace boost::asio::ip;
@@ -50,16 +52,22 @@ void ASIOConnectAndHandshake::checkHeaderContents(unsigned int whichSocket,
             mFirstReceivedHeader=*buffer;
         }
         if (mFinishedCheckCount>=1) {
-            if (mFirstReceivedHeader!=*buffer) {
-                connection->connectionFailedCallback(whichSocket,"Bad header comparison "
-                                                     +std::string((char*)buffer->begin(),TCPStream::TcpSstHeaderSize)
-                                                     +" does not match "
-                                                     +std::string((char*)mFirstReceivedHeader.begin(),TCPStream::TcpSstHeaderSize));
-                mFinishedCheckCount-=connection->numSockets();
-                mFinishedCheckCount-=1;
+            if (error) {
+                connectionFailed(connection,whichSocket,error.message());
+            }else if (mFirstReceivedHeader!=*buffer) {
+                connectionFailed(connection,whichSocket,"Bad header comparison "
+                                 +std::string((char*)buffer->begin(),TCPStream::TcpSstHeaderSize)
+                                 +" does not match "
+                                 +std::string((char*)mFirstReceivedHeader.begin(),TCPStream::TcpSstHeaderSize));
             }else {
                 mFinishedCheckCount--;
-                if (mFinishedCheckCount==0) {
+                if (mEarlyConnect&&whichSocket&&!connection->baseSocketJoined(whichSocket)) {
+                    //the connection already went on without it
+                    delete buffer;
+                    return;
+                }
+                if (mEarlyConnect?whichSocket==0:mFinishedCheckCount==0) {
+                    mConnected=true;
                     connection->connectedCallback();
                 }
                 MakeASIOReadBuffer(connection,whichSocket);
@@ -71,57 +79,115 @@ void ASIOConnectAndHandshake::checkHeaderContents(unsigned int whichSocket,
     delete buffer;
 }
 
-void ASIOConnectAndHandshake::connectToIPAddress(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
-                                                 unsigned int whichSocket,
-                                                 const tcp::resolver::iterator &it,
-                                                 const ErrorCode &error) {
+void ASIOConnectAndHandshake::attemptConnected(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
+                                               TCPSocket*attempt,
+                                               const ErrorCode &error) {
+    thus->mAttempts.erase(std::find(thus->mAttempts.begin(),thus->mAttempts.end(),attempt));
     std::tr1::shared_ptr<MultiplexedSocket> connection=thus->mConnection.lock();
     if (!connection) {
+        delete attempt;
         return;
     }
-    if (error) {
-        if (it == tcp::resolver::iterator()) {
-            //this checks if anyone else has failed
-            if (thus->mFinishedCheckCount>=1) {
-                //We're the first to fail, decrement until negative
-                thus->mFinishedCheckCount-=connection->numSockets();
-                thus->mFinishedCheckCount-=1;
-                connection->connectionFailedCallback(whichSocket,error);
-            }else {
-                //keep it negative, indicate one further failure
-                thus->mFinishedCheckCount-=1;
-            }
+    unsigned int numSockets=connection->numSockets();
+    if (error||thus->mConnectedSockets>=numSockets||thus->mFinishedCheckCount<1) {
+        delete attempt;
+        if (error&&thus->mConnectedSockets+thus->mAttempts.size()<numSockets) {
+            //each failure past this point leaves one more of the last sockets without a connection
+            thus->connectionFailed(connection,thus->mConnectedSockets+(unsigned int)thus->mAttempts.size(),error.message());
+        }
+        return;
+    }
+    unsigned int whichSocket=thus->mConnectedSockets++;
+    ASIOSocketWrapper&wrapper=connection->getASIOSocketWrapper(whichSocket);
+    wrapper.destroySocket();
+    wrapper.adoptSocket(attempt);
+    if (thus->mConnectedSockets==numSockets) {
+        //their connections would only be turned away: each comes back here and is deleted
+        for (std::vector<TCPSocket*>::iterator i=thus->mAttempts.begin(),ie=thus->mAttempts.end();i!=ie;++i) {
+            ErrorCode ignored;
+            (*i)->close(ignored);
+        }
+    }
+    wrapper.applySocketOptions(connection->getSocketOptions());
+    ErrorCode endpointError;
+    tcp::endpoint remote=attempt->remote_endpoint(endpointError);
+    if (!endpointError) {
+        //connections added later dial the very address this one reached
+        connection->setRemoteEndpoint(remote);
+        if (!connection->hasDatagramChannel()) {
+            //the listener's UDP socket shares the port number of its TCP socket: the capabilities packet tells if it has one
+            connection->setDatagramChannel(ASIODatagramChannel::connect(connection->getASIOService(),
+                                                                        udp::endpoint(remote.address(),remote.port())),
+                                                remote.address());
+        }
+    }
+    sendHeader(thus,connection,whichSocket);
+}
+
+void ASIOConnectAndHandshake::connectionFailed(const std::tr1::shared_ptr<MultiplexedSocket>&connection,
+                                               unsigned int whichSocket,
+                                               const std::string &error) {
+    //this checks if anyone else has failed
+    if (mFinishedCheckCount>=1&&mConnected&&mEarlyConnect&&whichSocket&&connection->baseSocketFailed(whichSocket,error)) {
+        //the connection started without this socket and goes on without it
+        mFinishedCheckCount-=1;
+    }else if (mFinishedCheckCount>=1) {
+        //We're the first to fail, decrement until negative
+        mFinishedCheckCount-=connection->numSockets();
+        mFinishedCheckCount-=1;
+        if (mConnected) {
+            //streams already started on the sockets that did connect, and the other side waits for this one
+            connection->hostDisconnectedCallback(whichSocket,error);
         }else {
-            tcp::resolver::iterator nextIterator=it;
-            ++nextIterator;
-            connection->getASIOSocketWrapper(whichSocket).getSocket()
-                .async_connect(*it,
-                               boost::bind(&ASIOConnectAndHandshake::connectToIPAddress,
-                                           thus,
-                                           whichSocket,
-                                           nextIterator,
-                                           boost::asio::placeholders::error));
+            connection->connectionFailedCallback(whichSocket,error);
         }
-    } else {
-        connection->getASIOSocketWrapper(whichSocket).getSocket()
-            .set_option(tcp::no_delay(true));
-        connection->getASIOSocketWrapper(whichSocket)
-            .sendProtocolHeader(connection,
-                                thus->mHeaderUUID,
-                                connection->numSockets());
-        Array<uint8,TCPStream::TcpSstHeaderSize> *header=new Array<uint8,TCPStream::TcpSstHeaderSize>;
-        boost::asio::async_read(connection->getASIOSocketWrapper(whichSocket).getSocket(),
-                                boost::asio::buffer(header->begin(),TCPStream::TcpSstHeaderSize),
-                                boost::asio::transfer_at_least(TCPStream::TcpSstHeaderSize),
-                                boost::bind(&ASIOConnectAndHandshake::checkHeader,
-                                            thus,
-                                            whichSocket,
-                                            header,
-                                            boost::asio::placeholders::error,
-                                            boost::asio::placeholders::bytes_transferred));
+    }else {
+        //keep it negative, indicate one further failure
+        mFinishedCheckCount-=1;
     }
 }
 
+void ASIOConnectAndHandshake::sendHeader(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
+                                         const std::tr1::shared_ptr<MultiplexedSocket>&connection,
+                                         unsigned int whichSocket) {
+    connection->getASIOSocketWrapper(whichSocket)
+        .sendProtocolHeader(connection,
+                            thus->mHeaderUUID,
+                            connection->numSockets());
+    Array<uint8,TCPStream::TcpSstHeaderSize> *header=new Array<uint8,TCPStream::TcpSstHeaderSize>;
+    boost::asio::async_read(connection->getASIOSocketWrapper(whichSocket).getSocket(),
+                            boost::asio::buffer(header->begin(),TCPStream::TcpSstHeaderSize),
+                            boost::asio::transfer_at_least(TCPStream::TcpSstHeaderSize),
+                            connection->getStrand().wrap(boost::bind(&ASIOConnectAndHandshake::checkHeader,
+                                                                     thus,
+                                                                     whichSocket,
+                                                                     header,
+                                                                     boost::asio::placeholders::error,
+                                                                     boost::asio::placeholders::bytes_transferred)));
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+void ASIOConnectAndHandshake::connectToUnixSocket(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
+                                                  unsigned int whichSocket,
+                                                  const std::tr1::shared_ptr<UnixSocket>&local,
+                                                  const ErrorCode &error) {
+    std::tr1::shared_ptr<MultiplexedSocket> connection=thus->mConnection.lock();
+    if (!connection) {
+        return;
+    }
+    ErrorCode adoptError=error;
+    if (!adoptError) {
+        AdoptUnixSocket(connection->getASIOSocketWrapper(whichSocket).getSocket(),*local,adoptError);
+    }
+    if (adoptError) {
+        thus->connectionFailed(connection,whichSocket,adoptError.message());
+    }else {
+        //nagle and the UDP side channel only apply to TCP
+        sendHeader(thus,connection,whichSocket);
+    }
+}
+#endif
+
 void ASIOConnectAndHandshake::handleResolve(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
                                             const boost::system::error_code &error,
                                             tcp::resolver::iterator it) {
@@ -132,34 +198,76 @@ void ASIOConnectAndHandshake::handleResolve(const std::tr1::shared_ptr<ASIOConne
     if (error) {
         connection->connectionFailedCallback(error);
     }else {
+        std::vector<tcp::endpoint> endpoints(it,tcp::resolver::iterator());
+        if (endpoints.empty()) {
+            connection->connectionFailedCallback(ErrorCode(boost::asio::error::host_not_found));
+            return;
+        }
+        //every socket tries every endpoint at once, and the first connections to come up are kept
         unsigned int numSockets=connection->numSockets();
         for (unsigned int whichSocket=0;whichSocket<numSockets;++whichSocket) {
-            connectToIPAddress(thus,
-                               whichSocket,
-                               it,
-                               boost::asio::error::host_not_found);
+            for (std::vector<tcp::endpoint>::const_iterator i=endpoints.begin(),ie=endpoints.end();i!=ie;++i) {
+                TCPSocket*attempt=new TCPSocket(connection->getASIOService());
+                thus->mAttempts.push_back(attempt);
+                attempt->async_connect(*i,
+                                       connection->getStrand().wrap(boost::bind(&ASIOConnectAndHandshake::attemptConnected,
+                                                                                thus,
+                                                                                attempt,
+                                                                                boost::asio::placeholders::error)));
+            }
         }
     }
-    
+
 }
 
 void ASIOConnectAndHandshake::connect(const std::tr1::shared_ptr<ASIOConnectAndHandshake> &thus,
                                       const Address&address){
+    std::tr1::shared_ptr<MultiplexedSocket> connection=thus->mConnection.lock();
+    if (!connection) {
+        return;
+    }
+    if (address.isUnixDomain()) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        for (unsigned int whichSocket=0,numSockets=connection->numSockets();whichSocket<numSockets;++whichSocket) {
+            std::tr1::shared_ptr<UnixSocket> local(new UnixSocket(connection->getASIOService()));
+            local->async_connect(boost::asio::local::stream_protocol::endpoint(address.getService()),
+                                 connection->getStrand().wrap(boost::bind(&ASIOConnectAndHandshake::connectToUnixSocket,
+                                                                          thus,
+                                                                          whichSocket,
+                                                                          local,
+                                                                          boost::asio::placeholders::error)));
+        }
+#else
+        connection->connectionFailedCallback(ErrorCode(boost::asio::error::operation_not_supported));
+#endif
+        return;
+    }
     tcp::resolver::query query(tcp::v4(), address.getHostName(), address.getService());
     thus->mResolver.async_resolve(query,
-                                  boost::bind(&ASIOConnectAndHandshake::handleResolve,
-                                              thus,
-                                              boost::asio::placeholders::error,
-                                              boost::asio::placeholders::iterator));
+                                  connection->getStrand().wrap(boost::bind(&ASIOConnectAndHandshake::handleResolve,
+                                                                           thus,
+                                                                           boost::asio::placeholders::error,
+                                                                           boost::asio::placeholders::iterator)));
     
 }
 
 ASIOConnectAndHandshake::ASIOConnectAndHandshake(const std::tr1::shared_ptr<MultiplexedSocket> &connection,
-                                                 const UUID&sharedUuid):
+                                                 const UUID&sharedUuid,
+                                                 bool earlyConnect):
     mResolver(connection->getASIOService()),
         mConnection(connection),
         mFinishedCheckCount(connection->numSockets()),
-        mHeaderUUID(sharedUuid) {
+        mHeaderUUID(sharedUuid),
+        mEarlyConnect(earlyConnect),
+        mConnected(false),
+        mConnectedSockets(0) {
+}
+
+ASIOConnectAndHandshake::~ASIOConnectAndHandshake() {
+    //only left if the IOService was torn down with their handlers still waiting
+    for (std::vector<TCPSocket*>::iterator i=mAttempts.begin(),ie=mAttempts.end();i!=ie;++i) {
+        delete *i;
+    }
 }
 
 
@@ -38,6 +38,14 @@ class ASIOConnectAndHandshake{
     int mFinishedCheckCount;
     UUID mHeaderUUID;
     Array<uint8,TCPStream::TcpSstHeaderSize> mFirstReceivedHeader;
+    ///Whether mConnection connects once socket 0 checks out, bringing the other sockets in as they check out
+    bool mEarlyConnect;
+    ///Set once mConnection is connected, after which a socket failing its handshake disconnects it
+    bool mConnected;
+    ///The connections to resolved endpoints still under way: owned here until one is handed to a socket of mConnection
+    std::vector<TCPSocket*> mAttempts;
+    ///The number of sockets of mConnection that attempts have connected, which are filled in the order attempts connect
+    unsigned int mConnectedSockets;
     typedef boost::system::error_code ErrorCode;
                             
    /**
@@ -64,19 +72,37 @@ class ASIOConnectAndHandshake{
     }
 
    /**
-    * This function checks if a particular sockets has connected to its destination IP address
-    * If everything is successful it will decrement the first header check integer
-    * If the last resolver fails and it is the first time, it will decrement the first header check integer below zero to indiate error and call connectionFailed
-    * If anything goes wrong and the first header check integer is already below zero it will decline to take action
-    * The buffer passed in will be deleted by this function
+    * This function is a callback from the async_connect of one of mAttempts
+    * If it connected it moves the connection into the next socket of mConnection not yet connected and begins the handshake on it,
+    * closing the remaining attempts once every socket is connected
+    * If it failed and the remaining attempts are too few to connect every socket it calls connectionFailed
+    * The attempt passed in will be deleted by this function unless a socket takes it over
+    */
+    static void attemptConnected(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
+                                 TCPSocket*attempt,
+                                 const ErrorCode &error);
+    ///Counts a socket that could not connect, failing the whole connection if it is the first (or disconnecting it if it already started and cannot go on without the socket)
+    void connectionFailed(const std::tr1::shared_ptr<MultiplexedSocket>&connection,
+                          unsigned int whichSocket,
+                          const std::string &error);
+    ///Sends the protocol header on a newly connected socket and reads the other side's to check it in checkHeader
+    static void sendHeader(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
+                           const std::tr1::shared_ptr<MultiplexedSocket>&connection,
+                           unsigned int whichSocket);
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+   /**
+    * This function is a callback from a Unix domain socket's async_connect: if it connected it moves the connection
+    * into the particular socket of mConnection and begins the handshake on it, otherwise it fails like attemptConnected
     */
-    static void connectToIPAddress(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
-                                   unsigned int whichSocket,
-                                   const boost::asio::ip::tcp::resolver::iterator &it,
-                                   const ErrorCode &error);
+    static void connectToUnixSocket(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
+                                    unsigned int whichSocket,
+                                    const std::tr1::shared_ptr<UnixSocket>&local,
+                                    const ErrorCode &error);
+#endif
    /**
     * This function is a callback from the async_resolve call from ASIO initialized from the public interface connect
-    * It may get an error if the host was not found or otherwise a valid iterator to a number of ip addresses
+    * It may get an error if the host was not found or otherwise a valid iterator to a number of ip addresses,
+    * every one of which each socket tries at once rather than in turn
     */
     static void handleResolve(const std::tr1::shared_ptr<ASIOConnectAndHandshake>&thus,
                               const boost::system::error_code &error,
@@ -86,12 +112,14 @@ public:
      *  This function transforms the member mConnection from the PRECONNECTION socket phase to the CONNECTED socket phase
      *  It first performs a resolution on the address and handles the callback in handleResolve. 
      *  If the header checks out and matches with the other live sockets to the same sockets 
-     *    - MultiplexedSocket::connectedCallback() is called
+     *    - MultiplexedSocket::connectedCallback() is called, once socket 0 checks out if connecting early or else once all have
      *    - An ASIOReadBuffer is created for handling future reads
      */
     static void connect(const std::tr1::shared_ptr<ASIOConnectAndHandshake> &thus,
                         const Address&address);
     ASIOConnectAndHandshake(const std::tr1::shared_ptr<MultiplexedSocket> &connection,
-                            const UUID&sharedUuid);
+                            const UUID&sharedUuid,
+                            bool earlyConnect=false);
+    ~ASIOConnectAndHandshake();
 };
 } }
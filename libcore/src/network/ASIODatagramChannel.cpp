@@ -0,0 +1,229 @@
+/*  Sirikata Network Utilities
+ *  ASIODatagramChannel.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "util/Standard.hh"
+#include "TCPDefinitions.hpp"
+#include "Stream.hpp"
+#include "TCPStream.hpp"
+#include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
+#include "ASIOSocketWrapper.hpp"
+#include "MultiplexedSocket.hpp"
+#include "ASIODatagramChannel.hpp"
+#include <boost/version.hpp>
+
+namespace Sirikata { namespace Network {
+using namespace boost::asio::ip;
+namespace {
+///Makes sends on socket fail rather than wait for room, since an unreliable packet that cannot go right away goes over TCP, and enlarges its receive buffer
+void configureSocket(UDPSocket&socket, boost::system::error_code&error) {
+#if BOOST_VERSION >= 104700
+    socket.non_blocking(true,error);
+#else
+    socket.io_control(boost::asio::socket_base::non_blocking_io(true),error);
+#endif
+    if (!error) {
+        //the operating system may cap the buffer lower, which only costs more dropped datagrams
+        boost::system::error_code ignored;
+        socket.set_option(boost::asio::socket_base::receive_buffer_size(ASIODatagramChannel::RECEIVE_BUFFER_SIZE),ignored);
+    }
+}
+}
+
+ASIODatagramChannel::ASIODatagramChannel(IOService&io, bool connecting):mSocket(io),mConnecting(connecting),mCloseWhenUnused(connecting) {
+}
+
+std::tr1::shared_ptr<ASIODatagramChannel> ASIODatagramChannel::listen(IOService&io, const UDPEndpoint&local) {
+    std::tr1::shared_ptr<ASIODatagramChannel> retval(new ASIODatagramChannel(io,false));
+    boost::system::error_code error;
+    retval->mSocket.open(local.protocol(),error);
+    if (!error)
+        retval->mSocket.bind(local,error);
+    if (!error)
+        configureSocket(retval->mSocket,error);
+    if (error) {
+        SILOG(tcpsst,warning,"Unreliable packets will only use TCP: could not bind UDP "<<local<<": "<<error.message());
+        return std::tr1::shared_ptr<ASIODatagramChannel>();
+    }
+    receive(retval);
+    return retval;
+}
+
+std::tr1::shared_ptr<ASIODatagramChannel> ASIODatagramChannel::connect(IOService&io, const UDPEndpoint&remote) {
+    std::tr1::shared_ptr<ASIODatagramChannel> retval(new ASIODatagramChannel(io,true));
+    boost::system::error_code error;
+    retval->mSocket.open(remote.protocol(),error);
+    if (!error)
+        configureSocket(retval->mSocket,error);
+    if (error) {
+        SILOG(tcpsst,warning,"Unreliable packets will only use TCP: could not open a UDP socket: "<<error.message());
+        return std::tr1::shared_ptr<ASIODatagramChannel>();
+    }
+    retval->mRemoteEndpoint=remote;
+    receive(retval);
+    return retval;
+}
+
+void ASIODatagramChannel::addPeer(const UUID&key, const std::tr1::weak_ptr<MultiplexedSocket>&connection, const boost::asio::ip::address&address) {
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    Peer&peer=mPeers[key];
+    peer.mConnection=connection;
+    peer.mAddress=address;
+    if (mConnecting) {
+        peer.mEndpoint=mRemoteEndpoint;
+    }
+}
+
+void ASIODatagramChannel::removePeer(const UUID&key) {
+    bool unused;
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        mPeers.erase(key);
+        unused=mCloseWhenUnused&&mPeers.empty();
+    }
+    if (unused) {
+        close();
+    }
+}
+
+void ASIODatagramChannel::release() {
+    bool unused;
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        mCloseWhenUnused=true;
+        unused=mPeers.empty();
+    }
+    if (unused) {
+        close();
+    }
+}
+
+bool ASIODatagramChannel::sendLocked(const UUID&key, const UDPEndpoint&endpoint, const uint8*data, size_t length) {
+    if (!mSocket.is_open())
+        return false;
+    boost::array<boost::asio::const_buffer,2> buffers={{
+        boost::asio::buffer(key.getArray().begin(),KEY_SIZE),
+        boost::asio::buffer(data,length)
+    }};
+    boost::system::error_code error;
+    mSocket.send_to(buffers,endpoint,0,error);
+    return !error;
+}
+
+bool ASIODatagramChannel::send(const UUID&key, const uint8*data, size_t length) {
+    if (length+KEY_SIZE>MAX_DATAGRAM_SIZE)
+        return false;
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    PeerMap::iterator where=mPeers.find(key);
+    if (where==mPeers.end())
+        return false;
+    if (!where->second.mHeardFrom) {
+        if (mConnecting)
+            sendLocked(key,where->second.mEndpoint,NULL,0);
+        return false;
+    }
+    return sendLocked(key,where->second.mEndpoint,data,length);
+}
+
+void ASIODatagramChannel::sendHello(const UUID&key) {
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    PeerMap::iterator where=mPeers.find(key);
+    if (mConnecting&&where!=mPeers.end()&&!where->second.mHeardFrom)
+        sendLocked(key,where->second.mEndpoint,NULL,0);
+}
+
+void ASIODatagramChannel::close() {
+    boost::lock_guard<boost::mutex> lock(mMutex);
+    boost::system::error_code error;
+    mSocket.close(error);
+}
+
+void ASIODatagramChannel::receive(const std::tr1::shared_ptr<ASIODatagramChannel>&thus) {
+    thus->mSocket.async_receive_from(boost::asio::buffer(thus->mReceiveBuffer.begin(),MAX_DATAGRAM_SIZE),
+                                     thus->mReceiveEndpoint,
+                                     boost::bind(&ASIODatagramChannel::received,
+                                                 thus,
+                                                 boost::asio::placeholders::error,
+                                                 boost::asio::placeholders::bytes_transferred));
+}
+
+void ASIODatagramChannel::deliver(std::size_t bytes_received) {
+    if (bytes_received<KEY_SIZE||(mConnecting&&!(mReceiveEndpoint==mRemoteEndpoint)))
+        return;
+    UUID key(mReceiveBuffer.begin(),KEY_SIZE);
+    std::tr1::shared_ptr<MultiplexedSocket> connection;
+    bool hello=(bytes_received==KEY_SIZE);
+    {
+        boost::lock_guard<boost::mutex> lock(mMutex);
+        PeerMap::iterator where=mPeers.find(key);
+        //the UUID crossed the TCP connection in the clear, so only the host at the other end of it may use it
+        if (where!=mPeers.end()&&where->second.mAddress==mReceiveEndpoint.address()&&(connection=where->second.mConnection.lock())) {
+            where->second.mHeardFrom=true;
+            if (!mConnecting) {
+                //follow the connecting side if a NAT moves its port
+                where->second.mEndpoint=mReceiveEndpoint;
+                if (hello)
+                    sendLocked(key,where->second.mEndpoint,NULL,0);
+            }
+        }
+    }
+    if (connection&&!hello) {
+        PacketBuffer*packet=PacketBuffer::allocate(mReceiveBuffer.begin()+KEY_SIZE,mReceiveBuffer.begin()+bytes_received);
+        PacketView datagram(packet,0,packet->size());
+        packet->unref();
+        connection->getStrand().post(std::tr1::bind(&MultiplexedSocket::receiveDatagram,connection,datagram));
+    }
+}
+
+void ASIODatagramChannel::received(const std::tr1::shared_ptr<ASIODatagramChannel>&thus,
+                                   const boost::system::error_code&error,
+                                   std::size_t bytes_received) {
+    if (error==boost::asio::error::operation_aborted||!thus->mSocket.is_open())
+        return;
+    //a failed receive, such as an ICMP error for an earlier send, does not stop the channel
+    if (!error) {
+        thus->deliver(bytes_received);
+        //the socket does not block, so datagrams that arrived meanwhile are read without a trip through the io service
+        for (int i=1;i<MAX_RECEIVE_BATCH;++i) {
+            boost::system::error_code receiveError;
+            bytes_received=thus->mSocket.receive_from(boost::asio::buffer(thus->mReceiveBuffer.begin(),MAX_DATAGRAM_SIZE),
+                                                      thus->mReceiveEndpoint,
+                                                      0,
+                                                      receiveError);
+            if (receiveError)
+                break;
+            thus->deliver(bytes_received);
+        }
+    }
+    receive(thus);
+}
+
+} }
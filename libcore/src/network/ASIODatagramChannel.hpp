@@ -0,0 +1,121 @@
+/*  Sirikata Network Utilities
+ *  ASIODatagramChannel.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "util/UUID.hpp"
+namespace Sirikata { namespace Network {
+/**
+ * A UDP socket carrying the unreliable packets of TCPStream connections alongside their TCP sockets.
+ * A listener binds one channel to its TCP port and shares it between every connection it accepts,
+ * while a connecting side opens a channel of its own to its peer's TCP address and port.
+ * Each datagram starts with the 16 byte UUID of the connection's handshake, which the listening side
+ * looks the connection up by, followed by a packet of the connection less its length prefix.
+ * A datagram holding only the UUID is a hello: the connecting side sends hellos until it hears from the
+ * listening side, which learns the connecting side's address from them and answers each with a hello.
+ * Neither side sends packets over the channel until it has heard from the other, so a path that
+ * drops UDP traffic leaves every packet on the TCP sockets.
+ */
+class ASIODatagramChannel:public Noncopyable {
+public:
+    enum {
+        ///Datagrams are kept this small so they are not fragmented by a typical path
+        MAX_DATAGRAM_SIZE=1400,
+        ///The length of the connection UUID that starts each datagram
+        KEY_SIZE=16,
+        ///The receive buffer asked of the operating system, so bursts of small datagrams are not lost while the channel catches up
+        RECEIVE_BUFFER_SIZE=1048576,
+        ///The most datagrams already waiting in the receive buffer that are read by one receive handler
+        MAX_RECEIVE_BATCH=64
+    };
+private:
+    class Peer {
+    public:
+        std::tr1::weak_ptr<MultiplexedSocket> mConnection;
+        ///The address of the other end of the connection's TCP sockets: datagrams from any other address are ignored
+        boost::asio::ip::address mAddress;
+        ///Where datagrams to the peer are sent: the listening side learns it from the datagrams it receives
+        UDPEndpoint mEndpoint;
+        ///Whether a datagram has been received from the peer, which proves the path
+        bool mHeardFrom;
+        Peer():mHeardFrom(false){}
+    };
+    typedef std::map<UUID,Peer> PeerMap;
+    UDPSocket mSocket;
+    ///Whether the channel was opened by a connecting side for its single peer, rather than bound by a listener
+    bool mConnecting;
+    ///Whether the channel closes once its last connection is removed: a listener's channel outlives the listener until then
+    bool mCloseWhenUnused;
+    ///The listener a connecting side's channel sends to and only accepts datagrams from
+    UDPEndpoint mRemoteEndpoint;
+    ///Protects mPeers and serializes sends, which may come from any thread
+    boost::mutex mMutex;
+    PeerMap mPeers;
+    Array<uint8,MAX_DATAGRAM_SIZE> mReceiveBuffer;
+    UDPEndpoint mReceiveEndpoint;
+    ///Sends the UUID key followed by length bytes of data to endpoint without blocking: mMutex must be held
+    bool sendLocked(const UUID&key, const UDPEndpoint&endpoint, const uint8*data, size_t length);
+    ///Starts receiving the next datagram
+    static void receive(const std::tr1::shared_ptr<ASIODatagramChannel>&thus);
+    ///Hands the datagram in mReceiveBuffer to the connection named by its UUID
+    void deliver(std::size_t bytes_received);
+    ///Delivers a received datagram along with any others already waiting, and starts receiving the next one
+    static void received(const std::tr1::shared_ptr<ASIODatagramChannel>&thus,
+                         const boost::system::error_code&error,
+                         std::size_t bytes_received);
+    ASIODatagramChannel(IOService&io, bool connecting);
+public:
+    /**
+     * Binds a channel to local, the address and port of a listener's TCP acceptor, to serve the connections it accepts
+     * \returns the channel, or NULL if the endpoint could not be bound
+     */
+    static std::tr1::shared_ptr<ASIODatagramChannel> listen(IOService&io, const UDPEndpoint&local);
+    /**
+     * Opens a channel to the listener at remote for a single connecting side
+     * \returns the channel, or NULL if no socket could be opened
+     */
+    static std::tr1::shared_ptr<ASIODatagramChannel> connect(IOService&io, const UDPEndpoint&remote);
+    ///Delivers the datagrams tagged with key that come from address, the remote address of connection's TCP sockets, to connection from now on
+    void addPeer(const UUID&key, const std::tr1::weak_ptr<MultiplexedSocket>&connection, const boost::asio::ip::address&address);
+    ///Forgets the connection tagged with key, closing the channel if it was the last one and the channel is released
+    void removePeer(const UUID&key);
+    /**
+     * Sends length bytes of data to the connection tagged with key
+     * \returns false if the data was not sent because it is too large, the peer has not been heard from yet,
+     *          or the socket would block, in which case a connecting side sends a hello instead
+     */
+    bool send(const UUID&key, const uint8*data, size_t length);
+    ///Sends a hello to the listener from a connecting side that has not heard from it yet
+    void sendHello(const UUID&key);
+    ///Closes the channel once no connection uses it: a connecting side's channel is released from the start
+    void release();
+    ///Stops receiving: any further sends fail
+    void close();
+};
+} }
@@ -35,9 +35,11 @@
 #include "Stream.hpp"
 #include "TCPStream.hpp"
 #include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
 #include "ASIOSocketWrapper.hpp"
 #include "MultiplexedSocket.hpp"
 #include "ASIOReadBuffer.hpp"
+#include "PacketTrace.hpp"
 namespace Sirikata { namespace Network {
 void MakeASIOReadBuffer(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,unsigned int whichSocket) {
     new ASIOReadBuffer(parentSocket,whichSocket);
@@ -46,8 +48,94 @@ void ASIOReadBuffer::processError(MultiplexedSocket*parentSocket, const boost::s
     parentSocket->hostDisconnectedCallback(mWhichBuffer,error);
     delete this;
 }
-void ASIOReadBuffer::processFullChunk(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket, unsigned int whichSocket, const Stream::StreamID&id, const Chunk&newChunk){
+void ASIOReadBuffer::processError(MultiplexedSocket*parentSocket, const std::string &error){
+    //the other side has seen nothing wrong, so it must be shown the socket is done with
+    boost::system::error_code ignored;
+    parentSocket->getASIOSocketWrapper(mWhichBuffer).getSocket().shutdown(boost::asio::socket_base::shutdown_both,ignored);
+    parentSocket->hostDisconnectedCallback(mWhichBuffer,error);
+    delete this;
+}
+bool ASIOReadBuffer::processFullChunk(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket, unsigned int whichSocket, const Stream::StreamID&id, const PacketView&newChunk){
+    PacketTrace*trace=parentSocket->getPacketTrace();
+    if (trace) {
+        //put the framing back so the trace holds the packet as it was on the wire
+        uint8 framing[2*Stream::uint30::MAX_SERIALIZED_LENGTH];
+        unsigned int idLength=id.serialize(framing+Stream::uint30::MAX_SERIALIZED_LENGTH,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        unsigned int lengthLength=Stream::uint30((uint32)(idLength+newChunk.size())).serialize(framing,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        std::memmove(framing+lengthLength,framing+Stream::uint30::MAX_SERIALIZED_LENGTH,idLength);
+        trace->record(PacketTrace::RECEIVED,whichSocket,(Task::AbsTime::now()-Task::AbsTime::null()).toMicro(),
+                      framing,lengthLength+idLength,newChunk.data(),newChunk.size());
+    }
+    if (id==Stream::StreamID()&&newChunk.size()&&newChunk[0]==TCPStream::TCPStreamFragment) {
+        return processFragment(parentSocket,whichSocket,newChunk.data()+1,newChunk.size()-1);
+    }
     parentSocket->receiveFullChunk(whichSocket,id,newChunk);
+    return true;
+}
+
+bool ASIOReadBuffer::processFragment(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket, unsigned int whichSocket, const uint8*fragment, size_t fragmentLength){
+    Stream::StreamID sid;
+    unsigned int sidLength=(unsigned int)fragmentLength-1;
+    if (fragmentLength<2||!sid.unserialize(fragment+1,sidLength)) {
+        SILOG(tcpsst,warning,"Fragment Chunk too short");
+        return true;
+    }
+    uint8 flags=fragment[0];
+    size_t pos=1+sidLength;
+    PartialPacketMap::iterator where=mPartialPackets.find(sid);
+    if (flags&TCPStream::TCPStreamFirstFragment) {
+        Stream::uint30 totalLength;
+        unsigned int totalLengthLength=(unsigned int)(fragmentLength-pos);
+        if (pos>=fragmentLength||!totalLength.unserialize(fragment+pos,totalLengthLength)) {
+            SILOG(tcpsst,warning,"Fragment Chunk too short");
+            return true;
+        }
+        pos+=totalLengthLength;
+        if (where!=mPartialPackets.end()) {
+            SILOG(tcpsst,warning,"Dropping unfinished fragmented packet on stream "<<sid.read());
+            mPartialPacketBytes-=where->second.mPacket->size();
+            where->second.mPacket->unref();
+            mPartialPackets.erase(where);
+        }
+        //the peer picks the length, so it must not be able to make this side reserve more than a sender would ever need
+        if (totalLength.read()>MultiplexedSocket::MAX_REASSEMBLED_LENGTH
+            ||mPartialPackets.size()>=MultiplexedSocket::MAX_PARTIAL_PACKETS
+            ||mPartialPacketBytes+totalLength.read()>MultiplexedSocket::MAX_PARTIAL_PACKET_BYTES) {
+            SILOG(tcpsst,warning,"Fragmented packet of "<<totalLength.read()<<" bytes on stream "<<sid.read()
+                  <<" is past the limits with "<<mPartialPackets.size()<<" packets of "<<mPartialPacketBytes<<" bytes already arriving");
+            return false;
+        }
+        where=mPartialPackets.insert(PartialPacketMap::value_type(sid,PartialPacket())).first;
+        where->second.mPacket=PacketBuffer::allocate(totalLength.read());
+        mPartialPacketBytes+=totalLength.read();
+        where->second.mFilled=0;
+        where->second.mControl=(flags&TCPStream::TCPStreamControlFragment)!=0;
+    }else if (where==mPartialPackets.end()) {
+        SILOG(tcpsst,warning,"Fragment for stream "<<sid.read()<<" arrived without its first fragment");
+        return true;
+    }
+    PartialPacket&partial=where->second;
+    size_t dataLength=fragmentLength-pos;
+    if (partial.mFilled+dataLength>partial.mPacket->size()) {
+        SILOG(tcpsst,warning,"Fragments for stream "<<sid.read()<<" overflow their packet");
+        mPartialPacketBytes-=partial.mPacket->size();
+        partial.mPacket->unref();
+        mPartialPackets.erase(where);
+        return true;
+    }
+    if (dataLength)
+        std::memcpy(&*partial.mPacket->begin()+partial.mFilled,fragment+pos,dataLength);
+    partial.mFilled+=dataLength;
+    if (flags&TCPStream::TCPStreamLastFragment) {
+        PacketBuffer*packet=partial.mPacket;
+        size_t filled=partial.mFilled;
+        bool control=partial.mControl;
+        mPartialPacketBytes-=packet->size();
+        mPartialPackets.erase(where);
+        parentSocket->receiveFullChunk(whichSocket,control?Stream::StreamID():sid,PacketView(packet,0,filled));
+        packet->unref();
+    }
+    return true;
 }
 
 
@@ -56,74 +144,96 @@ void ASIOReadBuffer::readIntoFixedBuffer(const std::tr1::shared_ptr<MultiplexedS
      
     parentSocket
         ->getASIOSocketWrapper(mWhichBuffer).getSocket()
-        .async_receive(boost::asio::buffer(mBuffer+mBufferPos,sBufferLength-mBufferPos),
-                       std::tr1::bind(&ASIOReadBuffer::asioReadIntoFixedBuffer,
-                                   this,
-                                   _1,
-                                   _2));
+        .async_receive(boost::asio::buffer(&*mBuffer->begin()+mBufferPos,sBufferLength-mBufferPos),
+                       parentSocket->getStrand().wrap(makeAllocatingHandler(*mHandlerMemory,
+                                                                            std::tr1::bind(&ASIOReadBuffer::asioReadIntoFixedBuffer,
+                                                                                           this,
+                                                                                           _1,
+                                                                                           _2))));
 }
 void ASIOReadBuffer::readIntoChunk(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket){
      
      
-    assert(mNewChunk.size()>0);//otherwise should have been filtered out by caller
-    assert(mBufferPos<mNewChunk.size());
+    assert(mNewChunk&&mNewChunk->size()>0);//otherwise should have been filtered out by caller
+    assert(mBufferPos<mNewChunk->size());
     parentSocket
         ->getASIOSocketWrapper(mWhichBuffer).getSocket()
-        .async_receive(boost::asio::buffer(&*(mNewChunk.begin()+mBufferPos),mNewChunk.size()-mBufferPos),
-                       std::tr1::bind(&ASIOReadBuffer::asioReadIntoChunk,
-                                   this,
-                                   _1,
-                                   _2));
+        .async_receive(boost::asio::buffer(&*(mNewChunk->begin()+mBufferPos),mNewChunk->size()-mBufferPos),
+                       parentSocket->getStrand().wrap(makeAllocatingHandler(*mHandlerMemory,
+                                                                            std::tr1::bind(&ASIOReadBuffer::asioReadIntoChunk,
+                                                                                           this,
+                                                                                           _1,
+                                                                                           _2))));
 }
 
-Stream::StreamID ASIOReadBuffer::processPartialChunk(uint8* dataBuffer, uint32 packetLength, uint32 &bufferReceived, Chunk&retval) {
+Stream::StreamID ASIOReadBuffer::processPartialChunk(uint8* dataBuffer, uint32 packetLength, uint32 &bufferReceived, PacketBuffer*&retval) {
     unsigned int headerLength=bufferReceived;
     Stream::StreamID retid;
     retid.unserialize(dataBuffer,headerLength);
     assert(headerLength<=bufferReceived&&"High water mark must be greater than maximum StreamID size");
     bufferReceived-=headerLength;
     assert(headerLength<=packetLength&&"High water mark must be greater than maximum StreamID size");
-    retval.resize(packetLength-headerLength);
+    retval=PacketBuffer::allocate(packetLength-headerLength);
     if (packetLength>headerLength) {
-        std::memcpy(&*retval.begin(),dataBuffer+headerLength,bufferReceived);
+        std::memcpy(&*retval->begin(),dataBuffer+headerLength,bufferReceived);
     }
     return retid;
 }
+void ASIOReadBuffer::compactBuffer(unsigned int chunkPos) {
+    unsigned int remnant=mBufferPos-chunkPos;
+    if (mBuffer->unique()) {
+        if (chunkPos!=0&&remnant!=0) {//move partial bytes to beginning
+            std::memmove(&*mBuffer->begin(),&*mBuffer->begin()+chunkPos,remnant);
+        }
+    }else {
+        //somebody kept a view of a packet in this buffer: leave it be and continue in a fresh one
+        PacketBuffer*freshBuffer=PacketBuffer::allocate(sBufferLength);
+        if (remnant!=0) {
+            std::memcpy(&*freshBuffer->begin(),&*mBuffer->begin()+chunkPos,remnant);
+        }
+        mBuffer->unref();
+        mBuffer=freshBuffer;
+    }
+    mBufferPos=remnant;
+}
 void ASIOReadBuffer::translateBuffer(const std::tr1::shared_ptr<MultiplexedSocket> &thus) {
         unsigned int chunkPos=0;
         unsigned int packetHeaderLength;
         Stream::uint30 packetLength;
-        while ((packetHeaderLength=mBufferPos-chunkPos)!=0&&packetLength.unserialize(mBuffer+chunkPos,packetHeaderLength)) {
+        uint8*buffer=&*mBuffer->begin();
+        while ((packetHeaderLength=mBufferPos-chunkPos)!=0&&packetLength.unserialize(buffer+chunkPos,packetHeaderLength)) {
             if (mBufferPos-chunkPos<packetLength.read()+packetHeaderLength) {
                 if (mBufferPos-chunkPos<sLowWaterMark) {
-                    break;//go directly to memmov code and move remnants to beginning of buffer to read a large portion at a time
+                    break;//go directly to compaction code and move remnants to beginning of buffer to read a large portion at a time
                 }else {
-                    mBufferPos-=chunkPos;
-                    mBufferPos-=packetHeaderLength;
-                    assert(mNewChunk.size()==0);
-                    mNewChunkID = processPartialChunk(mBuffer+chunkPos+packetHeaderLength,packetLength.read(),mBufferPos,mNewChunk);
+                    uint32 bytesReceived=mBufferPos-chunkPos-packetHeaderLength;
+                    assert(mNewChunk==NULL);
+                    mNewChunkID = processPartialChunk(buffer+chunkPos+packetHeaderLength,packetLength.read(),bytesReceived,mNewChunk);
+                    compactBuffer(mBufferPos);
+                    mBufferPos=bytesReceived;
                     readIntoChunk(thus);
                     return;
                 }
             }else {
                 uint32 chunkLength=packetLength.read();
-                Chunk resultChunk;
-                Stream::StreamID resultID=processPartialChunk(mBuffer+chunkPos+packetHeaderLength,packetLength.read(),chunkLength,resultChunk);
-                processFullChunk(thus,mWhichBuffer,resultID,resultChunk);
-                chunkPos+=packetHeaderLength+packetLength.read();
+                unsigned int streamIDLength=chunkLength;
+                Stream::StreamID resultID;
+                resultID.unserialize(buffer+chunkPos+packetHeaderLength,streamIDLength);
+                assert(streamIDLength<=chunkLength);
+                if (!processFullChunk(thus,mWhichBuffer,resultID,PacketView(mBuffer,chunkPos+packetHeaderLength+streamIDLength,chunkLength-streamIDLength))) {
+                    processError(&*thus,std::string("Fragmented packets past the limits on reassembly"));
+                    return;
+                }
+                chunkPos+=packetHeaderLength+chunkLength;
             }
         }
-        if (chunkPos!=0&&mBufferPos!=chunkPos) {//move partial bytes to beginning
-            std::memmove(mBuffer,mBuffer+chunkPos,mBufferPos-chunkPos);
-        }
-        mBufferPos-=chunkPos;
+        compactBuffer(chunkPos);
         readIntoFixedBuffer(thus);
     }
 
 
 
 void ASIOReadBuffer::asioReadIntoChunk(const ErrorCode&error,std::size_t bytes_read){
-    TCPSSTLOG(this,"rcv",&mNewChunk[mBufferPos],bytes_read,error);
     mBufferPos+=bytes_read;
     std::tr1::shared_ptr<MultiplexedSocket> thus(mParentSocket.lock());
     
@@ -131,10 +241,14 @@ void ASIOReadBuffer::asioReadIntoChunk(const ErrorCode&error,std::size_t bytes_r
         if (error){
             processError(&*thus,error);
         }else {
-            if (mBufferPos>=mNewChunk.size()){
-                assert(mBufferPos==mNewChunk.size());
-                processFullChunk(thus,mWhichBuffer,mNewChunkID,mNewChunk);
-                mNewChunk.resize(0);
+            if (mBufferPos>=mNewChunk->size()){
+                assert(mBufferPos==mNewChunk->size());
+                if (!processFullChunk(thus,mWhichBuffer,mNewChunkID,PacketView(mNewChunk,0,mNewChunk->size()))) {
+                    processError(&*thus,std::string("Fragmented packets past the limits on reassembly"));
+                    return;
+                }
+                mNewChunk->unref();
+                mNewChunk=NULL;
                 mBufferPos=0;
                 readIntoFixedBuffer(thus);
             }else {
@@ -147,7 +261,6 @@ void ASIOReadBuffer::asioReadIntoChunk(const ErrorCode&error,std::size_t bytes_r
 }
 
 void ASIOReadBuffer::asioReadIntoFixedBuffer(const ErrorCode&error,std::size_t bytes_read){
-    TCPSSTLOG(this,"rcv",&mBuffer[mBufferPos],bytes_read,error);
     mBufferPos+=bytes_read;
     std::tr1::shared_ptr<MultiplexedSocket> thus(mParentSocket.lock());
     
@@ -161,10 +274,22 @@ void ASIOReadBuffer::asioReadIntoFixedBuffer(const ErrorCode&error,std::size_t b
         delete this;// the socket is deleted
     }
 }
-ASIOReadBuffer::ASIOReadBuffer(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,unsigned int whichSocket):mParentSocket(parentSocket){
+ASIOReadBuffer::ASIOReadBuffer(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,unsigned int whichSocket)
+    :mParentSocket(parentSocket),mHandlerMemory(parentSocket->getASIOSocketWrapper(whichSocket).getReceiveHandlerMemory()){
+    mBuffer=PacketBuffer::allocate(sBufferLength);
+    mNewChunk=NULL;
     mBufferPos=0;
+    mPartialPacketBytes=0;
     mWhichBuffer=whichSocket;
     readIntoFixedBuffer(parentSocket);
 }
+ASIOReadBuffer::~ASIOReadBuffer() {
+    mBuffer->unref();
+    if (mNewChunk)
+        mNewChunk->unref();
+    for (PartialPacketMap::iterator i=mPartialPackets.begin(),ie=mPartialPackets.end();i!=ie;++i) {
+        i->second.mPacket->unref();
+    }
+}
 
 } }
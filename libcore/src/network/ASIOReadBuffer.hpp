@@ -39,35 +39,67 @@ class ASIOReadBuffer {
         ///The length of the fixed buffer
         sBufferLength=1440        
     };
-    ///A fixed length buffer to read incoming requests when the data is unknown in size or so far small in size
-    uint8 mBuffer[sBufferLength];
+    /**
+     * A fixed length, reference counted buffer to read incoming requests when the data is unknown in size or so far small in size.
+     * Complete packets are handed to callbacks as PacketViews into this buffer, so it is replaced rather than overwritten while any view is alive
+     */
+    PacketBuffer* mBuffer;
     ///Where is ASIO writing to in mBuffer
     unsigned int mBufferPos;
     ///Which actual low level tcp socket from the mParentSocket is used for communication
     unsigned int mWhichBuffer;
-    ///A new chunk being read directly into--usually this member is only used to hold a large packet of information, otherwise the fixed length buffer is used
-    Chunk mNewChunk;
+    ///A new chunk being read directly into--usually this member is only used to hold a large packet of information, otherwise the fixed length buffer is used and this is NULL
+    PacketBuffer* mNewChunk;
     ///The StreamID of a new, partially examined new chunk
     Stream::StreamID mNewChunkID;
     ///The shared structure responsible for holding state about the associated TCPStream that this class reads and interprets data from
     std::tr1::weak_ptr<MultiplexedSocket> mParentSocket;
+    ///The memory asio recycles for reads on the socket, held here since reads may complete after the connection is gone
+    std::tr1::shared_ptr<HandlerMemory> mHandlerMemory;
+    ///A packet that arrived in fragments and is being put back together before it is delivered
+    struct PartialPacket {
+        PacketBuffer*mPacket;
+        ///How many bytes of mPacket have arrived so far
+        size_t mFilled;
+        ///Whether the reassembled packet is a control packet instead of data of its stream
+        bool mControl;
+    };
+    typedef std::tr1::unordered_map<Stream::StreamID,PartialPacket,Stream::StreamID::Hasher> PartialPacketMap;
+    ///The fragmented packets that have started but not finished arriving on this socket, by the stream that sent them
+    PartialPacketMap mPartialPackets;
+    ///The bytes reserved by the packets in mPartialPackets, held under MultiplexedSocket::MAX_PARTIAL_PACKET_BYTES
+    size_t mPartialPacketBytes;
     typedef boost::system::error_code ErrorCode;
     /**
      * This forwards the error message to the MultiplexedSocket so the appropriate action may be taken 
      * (including,possibly, disconnecting and shutting down the socket connections and all associated streams
      */
     void processError(MultiplexedSocket*parentSocket, const ErrorCode &error);
+    ///Drops the connection for a reason of this side's own, such as a peer that broke the limits on what it may send, shutting down the socket so the peer hears of it
+    void processError(MultiplexedSocket*parentSocket, const std::string &error);
     /**
      * This function passes the contents of a chunk to the multiplexed socket for callback handling
      * \param parentSocket is the MultiplexedSocket responsible for this stream with the relevant callback information
      * \param whichSocket is the current ASIO socket responsible for having read the data. It must equal mWhichBuffer
      * \param sid is the StreamID that sent the data which made it to this socket and got processed. It will help determine which callback to call
      * \param newChunk is the chunk that was sent from the other side to this side and is ready for client processing (or server processing if sid==Stream::StreamID())
+     * \returns false if the chunk broke the limits on reassembling fragments, in which case the connection must be dropped
      */
-    void processFullChunk(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,
+    bool processFullChunk(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,
                           unsigned int whichSocket,
                           const Stream::StreamID& sid,
-                          const Chunk&newChunk);
+                          const PacketView&newChunk);
+    /**
+     * Adds the contents of a TCPStreamFragment control packet to the matching partial packet,
+     * and hands the packet to processFullChunk when its last fragment arrives
+     * \param fragment is the control packet past its control code
+     * \returns false if the first fragment of a packet would take it past MultiplexedSocket::MAX_REASSEMBLED_LENGTH,
+     * MAX_PARTIAL_PACKETS or MAX_PARTIAL_PACKET_BYTES, in which case nothing is allocated and the connection must be dropped
+     */
+    bool processFragment(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,
+                         unsigned int whichSocket,
+                         const uint8*fragment,
+                         size_t fragmentLength);
     /**
      *  This function is called when either 0 information is known about the data to be read (such as size, etc)
      *  or if the data is known but the packet is sufficiently small that other packets may be conjoined with it in the buffer
@@ -89,10 +121,16 @@ class ASIOReadBuffer {
      * \param retval is the newly allocated chunk sized appropriately to hold all data that will ever be copied to it
      * \returns the StreamID that this chunk was sent from
      */
-    Stream::StreamID processPartialChunk(uint8* dataBuffer, uint32 packetLength, uint32 &bufferReceived, Chunk&retval);
+    Stream::StreamID processPartialChunk(uint8* dataBuffer, uint32 packetLength, uint32 &bufferReceived, PacketBuffer*&retval);
+
+    /**
+     * Discards the bytes of mBuffer before chunkPos and moves the remaining bytes up to mBufferPos to the front.
+     * If PacketViews handed out to callbacks still reference mBuffer, the remnant is copied into a fresh buffer instead
+     */
+    void compactBuffer(unsigned int chunkPos);
 
     /**
-     * Examines the class variable mBuffer from the beginning to mBufferPos and translates all packets contained within to chunks and calls the appropriate callback
+     * Examines the class variable mBuffer from the beginning to mBufferPos and hands each packet contained within to the appropriate callback as a view into mBuffer
      * If the information in the last unprocessed chunk is less than sLowWaterMark that excess information is moved to the front of the buffer and readIntoFixedBuffer is called
      * If the information in the last unprocessed chunk is greater than the sLowWaterMark 
      * then a new chunk is made specifically for the remaining data using the processPartialChunk function and readIntoChunk is called
@@ -113,6 +151,7 @@ class ASIOReadBuffer {
      * Otherwise the function farms work off to translateBuffer
      */
     void asioReadIntoFixedBuffer(const ErrorCode&error,std::size_t bytes_read);
+    ~ASIOReadBuffer();
 public:
     /**
      *  The only public interface to TCPReadBuffer is the constructor which takes in a MultiplexedSocket and an integer offset
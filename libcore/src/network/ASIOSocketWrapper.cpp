@@ -35,19 +35,14 @@
 #include "TCPDefinitions.hpp"
 #include "TCPStream.hpp"
 #include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
 #include "ASIOSocketWrapper.hpp"
 #include "MultiplexedSocket.hpp"
+#include "PacketTrace.hpp"
+#include <boost/version.hpp>
 
 namespace Sirikata { namespace Network {
 
-void ASIOLogBuffer(void * pointerkey, const char extension[16], const uint8* buffer, size_t buffersize){
-    char filename[1024];
-    sprintf(filename,"%x.%s",(unsigned int)(intptr_t)pointerkey,extension);
-    FILE*fp=fopen(filename,"ab");
-    fwrite(buffer,buffersize,1,fp);
-    fclose(fp);
-    
-}
 void copyHeader(void * destination, const UUID&key, unsigned int num) {
     std::memcpy(destination,TCPStream::STRING_PREFIX(),TCPStream::STRING_PREFIX_LENGTH);
     ((char*)destination)[TCPStream::STRING_PREFIX_LENGTH]='0'+(num/10)%10;
@@ -57,215 +52,414 @@ void copyHeader(void * destination, const UUID&key, unsigned int num) {
                 UUID::static_size);
 }
 
-void ASIOSocketWrapper::finishAsyncSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket) {
-    //When this function is called, the ASYNCHRONOUS_SEND_FLAG must be set because this particular context is the one finishing up a send
-    assert(mSendingStatus.read()&ASYNCHRONOUS_SEND_FLAG);
-    //Turn on the information that the queue is being checked and this means that further pushes to the queue may not be heeded if the queue happened to be empty
-    mSendingStatus+=QUEUE_CHECK_FLAG;
-    std::deque<Chunk*>toSend;
-    mSendQueue.swap(toSend);
-    std::size_t num_packets=toSend.size();
-    if (num_packets==0) {
-        //if there are no packets in the queue, some other send() operation will need to take the torch to send further packets
-        mSendingStatus-=(ASYNCHRONOUS_SEND_FLAG+QUEUE_CHECK_FLAG);
-    }else {
-        //there are packets in the queue, now is the chance to send them out, so get rid of the queue check flag since further items *will* be checked from the queue as soon as the
-        //send finishes
-        mSendingStatus-=QUEUE_CHECK_FLAG;
-        if (num_packets==1)
-            sendToWire(parentMultiSocket,toSend.front());
-        else
-            sendToWire(parentMultiSocket,toSend);
+void ASIOSocketWrapper::initPriorityQueues() {
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        mPriorityDeficit[i]=0;
+        mPriorityBytesSent[i]=0;
+        mFragmentTurn[i]=false;
     }
+    mCurrentPriority=0;
 }
-void ASIOSocketWrapper::sendLargeChunkItem(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, Chunk *toSend, size_t originalOffset, const ErrorCode &error, std::size_t bytes_sent) {
-    TCPSSTLOG(this,"snd",&*toSend->begin()+originalOffset,bytes_sent,error);
-    if (error)  {
-        triggerMultiplexedConnectionError(&*parentMultiSocket,this,error);
-        SILOG(tcpsst,debug,"Socket disconnected...waiting for recv to trigger error condition\n");
-    }else if (bytes_sent+originalOffset!=toSend->size()) {
-        sendToWire(parentMultiSocket,toSend,originalOffset+bytes_sent);
+
+bool ASIOSocketWrapper::takeQueuedChunks() {
+    bool retval=false;
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        for (PacketBuffer*queued=mSendQueue[i].popAll();queued;) {
+            PacketBuffer*next=queued->mNextQueued;
+            queued->mNextQueued=NULL;
+            if (queued->mStandsFor) {
+                //from here on the buffer waits in a deque, so it can take the place of its placeholder
+                PacketBuffer*placeholder=queued;
+                queued=placeholder->mStandsFor;
+                placeholder->mStandsFor=NULL;
+                placeholder->unref();
+            }
+            if (queued->mReplaceKey) {
+                PacketBuffer*&replaceable=mReplaceablePackets[queued->mReplaceKey];
+                if (replaceable)
+                    replaceable->mReplaced=true;
+                replaceable=queued;
+            }
+            mPendingChunks[i].push_back(queued);
+            queued=next;
+        }
+        if (!isPriorityEmpty(i))
+            retval=true;
+    }
+    return retval;
+}
+
+namespace {
+/**
+ * Finds the StreamID of a framed packet and the length of its framing.
+ * Sequenced and compressed packets are control packets, but they are attributed to the stream they carry data for
+ * \param id is set to the stream the packet belongs to, or Stream::StreamID() for any other control packet
+ * \param headerLength is set to the length of the length prefix and StreamID that frame the packet
+ * \param streamControl is set if the packet is a sequenced or compressed packet attributed to id
+ * \returns false if the packet is too short to hold its framing
+ */
+bool parseFraming(const PacketBuffer*packet, Stream::StreamID&id, size_t&headerLength, bool&streamControl) {
+    unsigned int lengthLength=(unsigned int)packet->size();
+    Stream::uint30 packetLength;
+    if (lengthLength==0||!packetLength.unserialize(&*packet->begin(),lengthLength))
+        return false;
+    unsigned int idLength=(unsigned int)packet->size()-lengthLength;
+    if (idLength==0||!id.unserialize(&*packet->begin()+lengthLength,idLength))
+        return false;
+    headerLength=lengthLength+idLength;
+    streamControl=false;
+    if (id==Stream::StreamID()&&packet->size()>headerLength+1&&
+        ((*packet)[headerLength]==TCPStream::TCPStreamSequenced||(*packet)[headerLength]==TCPStream::TCPStreamCompressed)) {
+        unsigned int streamIdLength=(unsigned int)(packet->size()-headerLength-1);
+        streamControl=id.unserialize(&*packet->begin()+headerLength+1,streamIdLength);
+        if (!streamControl)
+            id=Stream::StreamID();
+    }
+    return true;
+}
+}
+
+bool ASIOSocketWrapper::isStale(const PacketBuffer*packet) {
+    return packet->mReplaced||(packet->mExpiresAt&&packet->mExpiresAt<=(Task::AbsTime::now()-Task::AbsTime::null()).toMicro());
+}
+
+void ASIOSocketWrapper::forgetReplaceable(PacketBuffer*packet) {
+    if (packet->mReplaceKey) {
+        std::tr1::unordered_map<uint64,PacketBuffer*>::iterator where=mReplaceablePackets.find(packet->mReplaceKey);
+        if (where!=mReplaceablePackets.end()&&where->second==packet)
+            mReplaceablePackets.erase(where);
+    }
+}
+
+void ASIOSocketWrapper::discardStale(PacketBuffer*packet) {
+    forgetReplaceable(packet);
+    mQueuedBytes-=(uint32)packet->size();
+    ++mStalePackets;
+    packet->unref();
+}
+
+size_t ASIOSocketWrapper::nextChunkSize(int priority, size_t fragmentSize)const {
+    const std::deque<FragmentingPacket>&fragmenting=mFragmentingPackets[priority];
+    size_t retval;
+    if (!fragmenting.empty()&&(mPendingChunks[priority].empty()||mFragmentTurn[priority])) {
+        retval=fragmenting.front().mPacket->size()-fragmenting.front().mOffset;
     }else {
-        delete toSend;
-        finishAsyncSend(parentMultiSocket);
+        retval=mPendingChunks[priority].front()->size();
     }
+    if (fragmentSize&&retval>fragmentSize)
+        retval=fragmentSize;
+    return retval;
 }
 
-void ASIOSocketWrapper::sendLargeDequeItem(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const std::deque<Chunk*> &const_toSend, size_t originalOffset, const ErrorCode &error, std::size_t bytes_sent) {
-    TCPSSTLOG(this,"snd",&*const_toSend.front()->begin()+originalOffset,bytes_sent,error);
-    if (error )   {
-        triggerMultiplexedConnectionError(&*parentMultiSocket,this,error);
-        SILOG(tcpsst,debug,"Socket disconnected...waiting for recv to trigger error condition\n");
-    } else if (bytes_sent+originalOffset!=const_toSend.front()->size()) {
-        sendToWire(parentMultiSocket,const_toSend,originalOffset+bytes_sent);
-    }else if (const_toSend.size()<2) {
-        //the entire packet got sent and there's no more items left: delete the front item
-        delete const_toSend.front();
-        //and send further items on the global queue if they are there
-        finishAsyncSend(parentMultiSocket);
+PacketBuffer*ASIOSocketWrapper::popNextChunk(int priority, size_t fragmentSize) {
+    std::deque<FragmentingPacket>&fragmenting=mFragmentingPackets[priority];
+    std::deque<PacketBuffer*>&pending=mPendingChunks[priority];
+    while (!pending.empty()&&isStale(pending.front())) {
+        discardStale(pending.front());
+        pending.pop_front();
+    }
+    if (pending.empty()&&fragmenting.empty())
+        return NULL;
+    if (!pending.empty()&&(fragmenting.empty()||!mFragmentTurn[priority])) {
+        PacketBuffer*packet=pending.front();
+        Stream::StreamID id;
+        size_t headerLength=0;
+        bool streamControl=false;
+        bool framed=parseFraming(packet,id,headerLength,streamControl);
+        bool blocked=false;
+        if (!fragmenting.empty()) {
+            //control packets and later packets of a stream being fragmented must not overtake it
+            blocked=(!framed||id==Stream::StreamID());
+            for (std::deque<FragmentingPacket>::const_iterator i=fragmenting.begin(),ie=fragmenting.end();i!=ie&&!blocked;++i) {
+                blocked=(i->mStreamID==id);
+            }
+        }
+        if (!blocked) {
+            pending.pop_front();
+            forgetReplaceable(packet);
+            if (fragmentSize&&framed&&id!=Stream::StreamID()&&packet->size()-headerLength>fragmentSize&&canStartFragmenting(packet->size()-headerLength)) {
+                //the original framing never goes on the wire: each fragment brings its own
+                mQueuedBytes-=(uint32)headerLength;
+                fragmenting.push_back(FragmentingPacket(packet,headerLength,id,streamControl));
+            }else {
+                mFragmentTurn[priority]=true;
+                return packet;
+            }
+        }
+    }
+    FragmentingPacket current=fragmenting.front();
+    fragmenting.pop_front();
+    size_t dataStart=current.mOffset;
+    PacketBuffer*retval=constructFragment(current,fragmentSize);
+    //count the framing of the fragment as queued so that sending it balances out
+    mQueuedBytes+=(uint32)(retval->size()-(current.mOffset-dataStart));
+    if (current.mOffset<current.mPacket->size()) {
+        fragmenting.push_back(current);
     }else {
-        std::deque<Chunk*> toSend=const_toSend;
-        //the first item got sent out
-        delete toSend.front();
-        toSend.pop_front();
-        if (toSend.size()==1) {
-            //if there's just one item left, it may be sent by itself
-            sendToWire(parentMultiSocket,toSend.front());
-        }else {
-            //otherwise send the whole queue
-            sendToWire(parentMultiSocket,toSend);
+        current.mPacket->unref();
+    }
+    mFragmentTurn[priority]=false;
+    return retval;
+}
+
+bool ASIOSocketWrapper::canStartFragmenting(size_t dataLength)const {
+    if (dataLength>MultiplexedSocket::MAX_REASSEMBLED_LENGTH)
+        return false;
+    size_t packets=0,bytes=dataLength;
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        packets+=mFragmentingPackets[i].size();
+        for (std::deque<FragmentingPacket>::const_iterator j=mFragmentingPackets[i].begin(),je=mFragmentingPackets[i].end();j!=je;++j) {
+            bytes+=j->mPacket->size()-j->mHeaderLength;
+        }
+    }
+    return packets<MultiplexedSocket::MAX_PARTIAL_PACKETS&&bytes<=MultiplexedSocket::MAX_PARTIAL_PACKET_BYTES;
+}
+
+PacketBuffer*ASIOSocketWrapper::constructFragment(FragmentingPacket&packet, size_t fragmentSize) {
+    size_t remaining=packet.mPacket->size()-packet.mOffset;
+    size_t dataLength=(fragmentSize&&fragmentSize<remaining)?fragmentSize:remaining;
+    uint8 flags=0;
+    if (packet.mOffset==packet.mHeaderLength)
+        flags|=TCPStream::TCPStreamFirstFragment;
+    if (dataLength==remaining)
+        flags|=TCPStream::TCPStreamLastFragment;
+    if (packet.mControl)
+        flags|=TCPStream::TCPStreamControlFragment;
+    const unsigned int max_size=3*Stream::uint30::MAX_SERIALIZED_LENGTH+2;
+    uint8 header[max_size];
+    unsigned int size=Stream::StreamID().serialize(header,max_size);//control packet
+    header[size++]=TCPStream::TCPStreamFragment;
+    header[size++]=flags;
+    size+=packet.mStreamID.serialize(header+size,max_size-size);
+    if (flags&TCPStream::TCPStreamFirstFragment) {
+        Stream::uint30 totalLength((uint32)(packet.mPacket->size()-packet.mHeaderLength));
+        size+=totalLength.serialize(header+size,max_size-size);
+    }
+    assert(size<=max_size);
+    uint8 lengthHeader[Stream::uint30::MAX_SERIALIZED_LENGTH];
+    unsigned int lengthHeaderLength=Stream::uint30((uint32)(size+dataLength)).serialize(lengthHeader,Stream::uint30::MAX_SERIALIZED_LENGTH);
+    PacketBuffer*retval=PacketBuffer::allocate(lengthHeaderLength+size+dataLength);
+    retval->mQueuedAt=packet.mPacket->mQueuedAt;
+    uint8*output=&*retval->begin();
+    std::memcpy(output,lengthHeader,lengthHeaderLength);
+    std::memcpy(output+lengthHeaderLength,header,size);
+    std::memcpy(output+lengthHeaderLength+size,&*packet.mPacket->begin()+packet.mOffset,dataLength);
+    packet.mOffset+=dataLength;
+    return retval;
+}
+
+int ASIOSocketWrapper::nextPriority(const MultiplexedSocket&parentMultiSocket, size_t fragmentSize) {
+    bool anyPending=false;
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        if (!isPriorityEmpty(i)) {
+            if (parentMultiSocket.isStrictPriority())
+                return i;
+            anyPending=true;
+        }
+    }
+    if (!anyPending)
+        return -1;
+    //deficit round robin: each visit to a class with packets waiting grants it another quantum of bytes to send
+    while (true) {
+        if (isPriorityEmpty(mCurrentPriority)) {
+            mPriorityDeficit[mCurrentPriority]=0;
+        }else if (nextChunkSize(mCurrentPriority,fragmentSize)<=mPriorityDeficit[mCurrentPriority]) {
+            return mCurrentPriority;
         }
+        mCurrentPriority=(mCurrentPriority+1)%TCPStream::NumStreamPriorities;
+        if (!isPriorityEmpty(mCurrentPriority))
+            mPriorityDeficit[mCurrentPriority]+=parentMultiSocket.getPriorityQuantum(mCurrentPriority);
     }
 }
-#define ASIOSocketWrapperBuffer(pointer,size) boost::asio::buffer(pointer,(size))
-void ASIOSocketWrapper::sendStaticBuffer(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const std::deque<Chunk*>&toSend, uint8* currentBuffer, size_t bufferSize, size_t lastChunkOffset,  const ErrorCode &error, std::size_t bytes_sent) {
-    TCPSSTLOG(this,"snd",current_buffer,bytes_sent,error);
-    if (!error) {
-        //mPacketLogger.insert(mPacketLogger.end(),currentBuffer,currentBuffer+bytes_sent);
+
+PacketBuffer*ASIOSocketWrapper::scheduleNextChunk(const MultiplexedSocket&parentMultiSocket, size_t fragmentSize, int&priority) {
+    while ((priority=nextPriority(parentMultiSocket,fragmentSize))>=0) {
+        PacketBuffer*retval=popNextChunk(priority,fragmentSize);
+        if (retval==NULL) {
+            //everything the class had waiting was stale
+            continue;
+        }
+        if (!parentMultiSocket.isStrictPriority()) {
+            //fragment framing may make a packet slightly larger than estimated
+            size_t size=retval->size();
+            mPriorityDeficit[priority]=size<mPriorityDeficit[priority]?mPriorityDeficit[priority]-size:0;
+        }
+        return retval;
+    }
+    return NULL;
+}
+
+PacketBuffer*ASIOSocketWrapper::takeScheduledChunk(const MultiplexedSocket&parentMultiSocket, int&priority) {
+    takeQueuedChunks();
+    return scheduleNextChunk(parentMultiSocket,parentMultiSocket.getSendFragmentSize(),priority);
+}
+
+void ASIOSocketWrapper::finishAsyncSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket) {
+    //When this function is called, the ASYNCHRONOUS_SEND_FLAG must be set because this particular context is the one finishing up a send
+    assert(mSendingStatus.read()==ASYNCHRONOUS_SEND_FLAG);
+    assert(mSendingChunks.empty());
+    while (!takeQueuedChunks()) {
+        //nothing left to send: give up the flag so the next rawSend takes up the torch
+        mSendingStatus.compareAndSwap(ASYNCHRONOUS_SEND_FLAG,0);
+        //but a packet pushed while we still held the flag was left for us: if one is there, try to reclaim the flag and send it
+        bool anyQueued=false;
+        for (int i=0;i<TCPStream::NumStreamPriorities&&!anyQueued;++i) {
+            anyQueued=!mSendQueue[i].probablyEmpty();
+        }
+        if (!anyQueued||!mSendingStatus.compareAndSwap(0,ASYNCHRONOUS_SEND_FLAG)) {
+            //either nothing was pushed or the pushing thread claimed the flag itself
+            return;
+        }
     }
-    if ( error ) {
+    sendToWire(parentMultiSocket);
+}
+
+void ASIOSocketWrapper::sendGatheredChunks(const ErrorCode &error, std::size_t bytes_sent) {
+    //take over the reference that kept the connection alive during the send: the next send puts it back
+    std::tr1::shared_ptr<MultiplexedSocket> parentMultiSocket;
+    parentMultiSocket.swap(mSendingParent);
+    if (error)  {
+        //nothing more is in flight, so the socket must not keep looking loaded to leastOutstandingStreamStrategy or stalled to dropChance
+        mInFlightBytes=0;
         triggerMultiplexedConnectionError(&*parentMultiSocket,this,error);
         SILOG(tcpsst,debug,"Socket disconnected...waiting for recv to trigger error condition\n");
-    }else if (bytes_sent!=bufferSize) {
-		 
-		 
-        //if the previous send was not able to push the whole buffer out to the network, the rest must be sent
-        mSocket->async_send(ASIOSocketWrapperBuffer(currentBuffer+bytes_sent,bufferSize-bytes_sent),
-                            std::tr1::bind(&ASIOSocketWrapper::sendStaticBuffer,
-                                        this,
-                                        parentMultiSocket,
-                                        toSend,
-                                        currentBuffer+bytes_sent,
-                                        bufferSize-bytes_sent,
-                                        lastChunkOffset,
-                                          _1,
-                                          _2));        
-    }else {
-        if (!toSend.empty()) {
-            //if stray items are left in a deque
-            if (toSend.size()==1) {
-                //if there's one item send that
-                sendToWire(parentMultiSocket,toSend.front(),lastChunkOffset);
-            }else {
-                //otherwise send the whole lot
-                sendToWire(parentMultiSocket,toSend,lastChunkOffset);
-            }
-        }else {
-            //no items to send, check the new queue for any more and send those, otherwise sleep
-            finishAsyncSend(parentMultiSocket);
+        return;
+    }
+    //whatever part of the gather list did not make it out goes back to waiting for the next send
+    mSendLatency.record((Task::AbsTime::now()-Task::AbsTime::null()).toMicro()-mInFlightSince.read());
+    mQueuedBytes+=mInFlightBytes.read()-(uint32)bytes_sent;
+    mInFlightBytes=0;
+    //retire every packet that made it to the wire in its entirety
+    while (bytes_sent) {
+        size_t remaining=mSendingChunks.front()->size()-mSendingOffset;
+        if (bytes_sent<remaining) {
+            //the write ended partway through this packet: the rest of it leads the next send
+            mSendingOffset+=bytes_sent;
+            break;
         }
+        bytes_sent-=remaining;
+        mSendingChunks.front()->unref();
+        mSendingChunks.pop_front();
+        mSendingOffset=0;
+    }
+    if (mSendingChunks.empty()) {
+        //everything got sent, check the queue for any more packets and send those, otherwise sleep
+        finishAsyncSend(parentMultiSocket);
+    }else {
+        sendToWire(parentMultiSocket);
     }
+    //the backlog just shrank, so streams refused by trySend may be able to resume
+    parentMultiSocket->notifyWritable();
 }
-    
 
-void ASIOSocketWrapper::sendToWire(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, Chunk *toSend, size_t bytesSent) {
-    //sending a single chunk is a straightforward call directly to asio
-     
-     
-    mSocket->async_send(ASIOSocketWrapperBuffer(&*toSend->begin()+bytesSent,toSend->size()-bytesSent),
-                        std::tr1::bind(&ASIOSocketWrapper::sendLargeChunkItem,
-                                    this,
-                                    parentMultiSocket,
-                                    toSend,
-                                    bytesSent,
-                                          _1,
-                                          _2));
-}
-
-void ASIOSocketWrapper::sendToWire(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const std::deque<Chunk*>&const_toSend, size_t bytesSent){
-     
-     
-    if (const_toSend.front()->size()-bytesSent>PACKET_BUFFER_SIZE||const_toSend.size()==1) {
-        //if there's but a single packet, or a single big packet that is bigger than the mBuffer's size...send that one by itself 
-        mSocket->async_send(ASIOSocketWrapperBuffer(&*const_toSend.front()->begin()+bytesSent,const_toSend.front()->size()-bytesSent),
-                            std::tr1::bind(&ASIOSocketWrapper::sendLargeDequeItem,
-                                        this,
-                                        parentMultiSocket,
-                                        const_toSend,
-                                        bytesSent,
-                                          _1,
-                                          _2));
-    }else if (const_toSend.front()->size()){
-        //otherwise copy the packets onto the mBuffer and send from the fixed sized buffer
-        std::deque<Chunk*> toSend=const_toSend;
-        size_t bufferLocation=toSend.front()->size()-bytesSent;
-        std::memcpy(mBuffer,&*toSend.front()->begin()+bytesSent,toSend.front()->size()-bytesSent);
-        delete toSend.front();
-        toSend.pop_front();
-        bytesSent=0;
-        while (bufferLocation<PACKET_BUFFER_SIZE&&toSend.size()) {            
-            if (toSend.front()->size()>PACKET_BUFFER_SIZE-bufferLocation) {
-                //if the first packet is too large for the buffer, copy part of it but keep it around
-                bytesSent=PACKET_BUFFER_SIZE-bufferLocation;
-                std::memcpy(mBuffer+bufferLocation,&*toSend.front()->begin(),bytesSent);
-                bufferLocation=PACKET_BUFFER_SIZE;
-            }else {
-                //if the entire packets fits in the buffer, copy it there and delete the packet
-                std::memcpy(mBuffer+bufferLocation,&*toSend.front()->begin(),toSend.front()->size());
-                bufferLocation+=toSend.front()->size();
-                delete toSend.front();
-                toSend.pop_front();
-            }
+void ASIOSocketWrapper::sendToWire(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket){
+    //let packets queued since the last send compete with the ones already pending
+    takeQueuedChunks();
+    int64 now=(Task::AbsTime::now()-Task::AbsTime::null()).toMicro();
+    size_t gatheredBytes=0;
+    size_t offset=mSendingOffset;
+    for (std::deque<PacketBuffer*>::const_iterator i=mSendingChunks.begin(),ie=mSendingChunks.end();i!=ie;++i) {
+        gatheredBytes+=(*i)->size()-offset;
+        offset=0;
+    }
+    size_t fragmentSize=parentMultiSocket->getSendFragmentSize();
+    PacketTrace*trace=parentMultiSocket->getPacketTrace();
+    int priority;
+    PacketBuffer*toSend;
+    while (mSendingChunks.size()<mMaxGatherBuffers&&gatheredBytes<mMaxGatherBytes&&(toSend=scheduleNextChunk(*parentMultiSocket,fragmentSize,priority))!=NULL) {
+        size_t size=toSend->size();
+        if (size==0) {
+            //empty packets have nothing to put on the wire and would otherwise be waiting on a zero byte send forever
+            toSend->unref();
+            continue;
         }
-        //send the buffer filled with possibly many packets
-        mSocket->async_send(ASIOSocketWrapperBuffer(mBuffer,bufferLocation),
-                            std::tr1::bind(&ASIOSocketWrapper::sendStaticBuffer,
-                                          this,
-                                          parentMultiSocket,
-                                          toSend,
-                                          mBuffer,
-                                          bufferLocation,
-                                          bytesSent,
-                                          _1,
-                                          _2));
-    }
-}
-#undef ASIOSocketWrapperBuffer
-void ASIOSocketWrapper::retryQueuedSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, uint32 current_status) {
-    bool queue_check=(current_status&QUEUE_CHECK_FLAG)!=0;
-    bool sending_packet=(current_status&ASYNCHRONOUS_SEND_FLAG)!=0;
-    while (sending_packet==false||queue_check) {
-        if (sending_packet==false) {
-            //no one should check the queue without being willing to send
-            assert(queue_check==false);
-            //potentially volunteer to do the send
-            current_status=++mSendingStatus;
-            if (current_status==1) {//if this thread is the first into the system with nothing else having claimed the status
-                //then this thread should take the torch, check the queue and if not empty be willing to send
-                mSendingStatus+=(QUEUE_CHECK_FLAG+ASYNCHRONOUS_SEND_FLAG-1);
-                std::deque<Chunk*>toSend;
-                mSendQueue.swap(toSend);
-                if (toSend.empty()) {//the chunk that we put on the queue must have been sent by someone else
-                    //nothing to send, let another thread take up the torch if something was placed there by it
-                    mSendingStatus-=(QUEUE_CHECK_FLAG+ASYNCHRONOUS_SEND_FLAG);
-                    return;
-                }else {//the chunk may be on this queue, but we should promise folks to send it
-                    //we just set the asynchronous send flag, so it shouuld still be set
-                    assert(mSendingStatus.read()&ASYNCHRONOUS_SEND_FLAG);
-                    //turn off the queue check since we've got at least one packet to send off and will therefore come around again for further checks
-                    mSendingStatus-=QUEUE_CHECK_FLAG;
-                    if (toSend.size()==1) {
-                        //if there's just one packet to send: send that one
-                        sendToWire(parentMultiSocket,toSend.front());
-                    }else {
-                        //if there are more packets to send, send those
-                        sendToWire(parentMultiSocket,toSend);
-                    }
-                    return;
-                }
-            }else {
-                //it wasn't us doing the sending...see if those queue checks are still going on
-                --mSendingStatus;
-            }
+        mPriorityBytesSent[priority]+=(uint64)size;
+        if (toSend->mQueuedAt)
+            mQueueLatency.record(now-toSend->mQueuedAt);
+        if (trace)
+            trace->record(PacketTrace::SENT,parentMultiSocket->getSocketIndex(this),now,NULL,0,&*toSend->begin(),size);
+        mSendingChunks.push_back(toSend);
+        gatheredBytes+=size;
+    }
+    if (mSendingChunks.empty()) {
+        finishAsyncSend(parentMultiSocket);
+        return;
+    }
+    mGatherBuffers.resize(0);
+    offset=mSendingOffset;
+    gatheredBytes=0;
+    for (std::deque<PacketBuffer*>::const_iterator i=mSendingChunks.begin(),ie=mSendingChunks.end();
+         i!=ie&&mGatherBuffers.size()<mMaxGatherBuffers&&gatheredBytes<mMaxGatherBytes;
+         ++i) {
+        size_t size=(*i)->size()-offset;
+        mGatherBuffers.push_back(boost::asio::const_buffer(&*(*i)->begin()+offset,size));
+        gatheredBytes+=size;
+        offset=0;
+    }
+    mQueuedBytes-=(uint32)gatheredBytes;
+    mInFlightSince=now;
+    mInFlightBytes=(uint32)gatheredBytes;
+    mSendingParent=parentMultiSocket;
+    mSocket->async_send(GatherBufferSequence(mGatherBuffers),
+                        parentMultiSocket->getStrand().wrap(makeAllocatingHandler(mSendHandlerMemory,
+                                                                                  std::tr1::bind(&ASIOSocketWrapper::sendGatheredChunks,
+                                                                                                 this,
+                                                                                                 _1,
+                                                                                                 _2))));
+}
+
+Task::DeltaTime ASIOSocketWrapper::getSendStallTime(const Task::AbsTime&now)const {
+    if (mInFlightBytes.read()==0)
+        return Task::DeltaTime::seconds(0.0);
+    return now-Task::AbsTime::microseconds(mInFlightSince.read());
+}
+
+void ASIOSocketWrapper::trySend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket) {
+    if (mSendingStatus.compareAndSwap(0,ASYNCHRONOUS_SEND_FLAG)) {//we are teh chosen thread
+        if (parentMultiSocket->isCorking()&&mQueuedBytes.read()<parentMultiSocket->getCorkBytes()) {
+            //the socket was idle: hold on to the flag for a moment so packets sent shortly after this one share its write
+            mCorked=1;
+            parentMultiSocket->getStrand().post(std::tr1::bind(&ASIOSocketWrapper::armCork,this,parentMultiSocket));
+            return;
         }
-        //read the current status for another spin of the loop
-        current_status=mSendingStatus.read();
-        queue_check=(current_status&QUEUE_CHECK_FLAG)!=0;
-        sending_packet=(current_status&ASYNCHRONOUS_SEND_FLAG)!=0;
+        //send whatever is queued, or hand the flag straight back if whoever held it before us already sent our packet
+        finishAsyncSend(parentMultiSocket);
+    }else if (mCorked.read()&&mQueuedBytes.read()>=parentMultiSocket->getCorkBytes()) {
+        //enough has gathered to be worth a write of its own
+        flush(parentMultiSocket);
+    }
+}
+
+void ASIOSocketWrapper::flush(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket) {
+    if (mCorked.compareAndSwap(1,0)) {
+        //clearing mCorked handed us the ASYNCHRONOUS_SEND_FLAG the window was holding
+        finishAsyncSend(parentMultiSocket);
+    }
+}
+
+void ASIOSocketWrapper::armCork(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket) {
+    if (!mCorked.read()||mSocket==NULL) {
+        //flushed before the window even started
+        return;
     }
+    if (mCorkTimer==NULL)
+        mCorkTimer=new IODeadlineTimer(parentMultiSocket->getASIOService());
+    mCorkTimer->expires_from_now(boost::posix_time::microseconds(parentMultiSocket->getCorkWindow().toMicro()));
+    mCorkTimer->async_wait(parentMultiSocket->getStrand().wrap(std::tr1::bind(&ASIOSocketWrapper::corkExpired,
+                                                                              this,
+                                                                              parentMultiSocket,
+                                                                              _1)));
+}
+
+void ASIOSocketWrapper::corkExpired(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const ErrorCode&error) {
+    //a wait superseded by a newer window leaves the newer window's timer to finish it
+    if (error!=boost::asio::error::operation_aborted)
+        flush(parentMultiSocket);
 }
 
 void ASIOSocketWrapper::shutdownAndClose() {
+    if (mSocket==NULL)
+        return;
     try {
         mSocket->shutdown(boost::asio::ip::tcp::socket::shutdown_both);
     }catch (boost::system::system_error&err) {
@@ -280,31 +474,179 @@ void ASIOSocketWrapper::shutdownAndClose() {
 
 void ASIOSocketWrapper::createSocket(IOService&io) {
     mSocket=new TCPSocket(io);
+    mSocketOptionsApplied=0;
+    mSendBufferSize=0;
+    mReceiveBufferSize=0;
+}
+
+namespace {
+#ifdef TCP_QUICKACK
+typedef boost::asio::detail::socket_option::boolean<IPPROTO_TCP,TCP_QUICKACK> QuickAck;
+#endif
+#ifdef SO_BUSY_POLL
+typedef boost::asio::detail::socket_option::integer<SOL_SOCKET,SO_BUSY_POLL> BusyPoll;
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP,TCP_NOTSENT_LOWAT> NotSentLowWater;
+#endif
+#ifdef TCP_KEEPIDLE
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP,TCP_KEEPIDLE> KeepAliveIdle;
+#endif
+#ifdef TCP_KEEPINTVL
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP,TCP_KEEPINTVL> KeepAliveInterval;
+#endif
+/**
+ * Sets option on socket and reads it back, adding flag to applied if the system keeps the value asked for.
+ * Buffer sizes are rounded, doubled or clamped by the system, so any size it reports counts unless exact.
+ * Returns the value read back, or 0 if it could not be set or read
+ */
+template <class SocketOption> uint32 setSocketOption(TCPSocket&socket,const SocketOption&option,uint32 flag,uint32&applied,bool exact=true) {
+    boost::system::error_code error;
+    socket.set_option(option,error);
+    SocketOption inEffect;
+    if (!error)
+        socket.get_option(inEffect,error);
+    if (error) {
+        SILOG(tcpsst,debug,"Socket option "<<TCPSocketOptions::describe(flag)<<" did not take effect: "<<error.message());
+        return 0;
+    }
+    if (exact?inEffect.value()==option.value():inEffect.value()!=0) {
+        applied|=flag;
+    }else {
+        SILOG(tcpsst,debug,"Socket option "<<TCPSocketOptions::describe(flag)<<" reads back "<<inEffect.value()<<" rather than "<<option.value());
+    }
+    return (uint32)inEffect.value();
+}
+}
+
+void ASIOSocketWrapper::applySocketOptions(const TCPSocketOptions&options) {
+    uint32 applied=0;
+    if (options.mNoDelay)
+        setSocketOption(*mSocket,boost::asio::ip::tcp::no_delay(true),TCPSocketOptions::NO_DELAY,applied);
+    uint32 sendBufferSize=0,receiveBufferSize=0;
+    if (options.mSendBufferSize)
+        sendBufferSize=setSocketOption(*mSocket,boost::asio::socket_base::send_buffer_size(options.mSendBufferSize),TCPSocketOptions::SEND_BUFFER,applied,false);
+    if (options.mReceiveBufferSize)
+        receiveBufferSize=setSocketOption(*mSocket,boost::asio::socket_base::receive_buffer_size(options.mReceiveBufferSize),TCPSocketOptions::RECEIVE_BUFFER,applied,false);
+#ifdef TCP_QUICKACK
+    if (options.mQuickAck)
+        setSocketOption(*mSocket,QuickAck(true),TCPSocketOptions::QUICK_ACK,applied);
+#endif
+#ifdef SO_BUSY_POLL
+    if (options.mBusyPollMicroseconds)
+        setSocketOption(*mSocket,BusyPoll(options.mBusyPollMicroseconds),TCPSocketOptions::BUSY_POLL,applied);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    if (options.mNotSentLowWater)
+        setSocketOption(*mSocket,NotSentLowWater(options.mNotSentLowWater),TCPSocketOptions::NOT_SENT_LOW_WATER,applied);
+#endif
+    if (options.mKeepAlive) {
+        setSocketOption(*mSocket,boost::asio::socket_base::keep_alive(true),TCPSocketOptions::KEEP_ALIVE,applied);
+#ifdef TCP_KEEPIDLE
+        if (options.mKeepAliveIdleSeconds)
+            setSocketOption(*mSocket,KeepAliveIdle(options.mKeepAliveIdleSeconds),TCPSocketOptions::KEEP_ALIVE_IDLE,applied);
+#endif
+#ifdef TCP_KEEPINTVL
+        if (options.mKeepAliveIntervalSeconds)
+            setSocketOption(*mSocket,KeepAliveInterval(options.mKeepAliveIntervalSeconds),TCPSocketOptions::KEEP_ALIVE_INTERVAL,applied);
+#endif
+    }
+    mSendBufferSize=sendBufferSize;
+    mReceiveBufferSize=receiveBufferSize;
+    mSocketOptionsApplied=applied;
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+void AdoptUnixSocket(TCPSocket&socket, UnixSocket&local, boost::system::error_code&error) {
+#if BOOST_VERSION >= 104700
+    int handle=::dup(local.native_handle());
+#else
+    int handle=::dup(local.native());
+#endif
+    boost::system::error_code ignored;
+    local.close(ignored);
+    if (handle<0) {
+        error=boost::asio::error::no_descriptors;
+        return;
+    }
+    //the protocol only decides the layout of endpoints, which connections never ask a Unix domain socket for
+    socket.assign(boost::asio::ip::tcp::v4(),handle,error);
+    if (error)
+        ::close(handle);
+}
+#endif
+
+void AdoptTCPSocket(TCPSocket&socket, TCPSocket&from, boost::system::error_code&error) {
+#ifdef _WIN32
+    error=boost::asio::error::operation_not_supported;
+#else
+#if BOOST_VERSION >= 104700
+    int handle=::dup(from.native_handle());
+#else
+    int handle=::dup(from.native());
+#endif
+    if (handle<0) {
+        error=boost::asio::error::no_descriptors;
+        return;
+    }
+    //an IPv6 connection must stay one, while one taken over from a Unix domain socket has no TCP endpoint to ask
+    boost::system::error_code endpointError;
+    boost::asio::ip::tcp::endpoint local=from.local_endpoint(endpointError);
+    socket.assign(endpointError?boost::asio::ip::tcp::v4():local.protocol(),handle,error);
+    if (error) {
+        ::close(handle);
+        return;
+    }
+    boost::system::error_code ignored;
+    from.close(ignored);
+#endif
 }
 
 void ASIOSocketWrapper::destroySocket() {
+    delete mCorkTimer;
+    mCorkTimer=NULL;
+    mCorked=0;
     delete mSocket;
     mSocket=NULL;
+    while (!mSendingChunks.empty()) {
+        mSendingChunks.front()->unref();
+        mSendingChunks.pop_front();
+    }
+    mSendingOffset=0;
+    mQueuedBytes=0;
+    mInFlightBytes=0;
+    takeQueuedChunks();
+    mReplaceablePackets.clear();
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        while (!mPendingChunks[i].empty()) {
+            mPendingChunks[i].front()->unref();
+            mPendingChunks[i].pop_front();
+        }
+        while (!mFragmentingPackets[i].empty()) {
+            mFragmentingPackets[i].front().mPacket->unref();
+            mFragmentingPackets[i].pop_front();
+        }
+    }
 }
 
 
-void ASIOSocketWrapper::rawSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, Chunk * chunk) {
-    TCPSSTLOG(this,"raw",&*chunk->begin(),chunk->size(),false);
-    uint32 current_status=++mSendingStatus;
-    if (current_status==1) {//we are teh chosen thread
-        mSendingStatus+=(ASYNCHRONOUS_SEND_FLAG-1);//committed to be the sender thread
-        sendToWire(parentMultiSocket, chunk);
-    }else {//if someone else is possibly sending a packet
-        //push the packet on the queue
-        mSendQueue.push(chunk);
-        current_status=--mSendingStatus;
-        //the packet is out of our hands now...
-        //but the other thread could just have been finishing up and we have missed the send
-        //this is our opportunity to take up the torch and send if our packet is still there
-        retryQueuedSend(parentMultiSocket,current_status);
+void ASIOSocketWrapper::rawSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, PacketBuffer * chunk, int priority) {
+    chunk->mQueuedAt=(Task::AbsTime::now()-Task::AbsTime::null()).toMicro();
+    uint32 queued=(mQueuedBytes+=(uint32)(chunk->mStandsFor?chunk->mStandsFor:chunk)->size());
+    uint32 maxQueued;
+    while (queued>(maxQueued=mMaxQueuedBytes.read())&&!mMaxQueuedBytes.compareAndSwap(maxQueued,queued)) {
     }
+    //the packet always goes through the queue so that it cannot overtake packets other threads pushed before it
+    mSendQueue[priority].push(chunk);
+    trySend(parentMultiSocket);
 }
-Chunk*ASIOSocketWrapper::constructControlPacket(TCPStream::TCPStreamControlCodes code,const Stream::StreamID&sid){
+void ASIOSocketWrapper::rawSendShared(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, PacketBuffer * chunk, int priority) {
+    PacketBuffer*placeholder=PacketBuffer::allocate(0);
+    chunk->ref();
+    placeholder->mStandsFor=chunk;
+    rawSend(parentMultiSocket,placeholder,priority);
+}
+PacketBuffer*ASIOSocketWrapper::constructControlPacket(TCPStream::TCPStreamControlCodes code,const Stream::StreamID&sid){
     const unsigned int max_size=16;
     uint8 dataStream[max_size+2*Stream::uint30::MAX_SERIALIZED_LENGTH];
     unsigned int size=max_size;
@@ -322,15 +664,25 @@ Chunk*ASIOSocketWrapper::constructControlPacket(TCPStream::TCPStreamControlCodes
         unsigned int retval=streamSize.serialize(dataStream+Stream::uint30::MAX_SERIALIZED_LENGTH-actualHeaderLength,Stream::uint30::MAX_SERIALIZED_LENGTH);
         assert(retval==actualHeaderLength);
     }
-    return new Chunk(dataStream+Stream::uint30::MAX_SERIALIZED_LENGTH-actualHeaderLength,dataStream+size+cur);
+    return PacketBuffer::allocate(dataStream+Stream::uint30::MAX_SERIALIZED_LENGTH-actualHeaderLength,dataStream+size+cur);
 }
 
 void ASIOSocketWrapper::sendProtocolHeader(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const UUID&value, unsigned int numConnections) {
     UUID return_value=UUID::random();
     
-    Chunk *headerData=new Chunk(TCPStream::TcpSstHeaderSize);
+    PacketBuffer *headerData=PacketBuffer::allocate(TCPStream::TcpSstHeaderSize);
     copyHeader(&*headerData->begin(),value,numConnections);
-    rawSend(parentMultiSocket,headerData);
+    rawSend(parentMultiSocket,headerData,TCPStream::InteractivePriority);
+    //peers that predate capabilities ignore unknown control codes, so they keep speaking the original protocol
+    rawSend(parentMultiSocket,
+            constructControlPacket(TCPStream::TCPStreamCapabilities,Stream::uint30(parentMultiSocket->getLocalCapabilities())),
+            TCPStream::InteractivePriority);
+}
+
+void ASIOSocketWrapper::sendJoinHeader(const UUID&value, boost::system::error_code&error) {
+    uint8 header[TCPStream::TcpSstHeaderSize];
+    copyHeader(header,value,0);
+    boost::asio::write(*mSocket,boost::asio::buffer(header,TCPStream::TcpSstHeaderSize),boost::asio::transfer_all(),error);
 }
 
 } }
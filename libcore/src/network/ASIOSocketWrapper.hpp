@@ -30,108 +30,340 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "util/UUID.hpp"
+#include "task/Time.hpp"
+#include "util/LockFreeBatchQueue.hpp"
+#include "TCPStatistics.hpp"
+#include "HandlerMemory.hpp"
+#include "TCPSocketOptions.hpp"
 
 namespace Sirikata { namespace Network {
 class ASIOSocketWrapper;
 
 void triggerMultiplexedConnectionError(MultiplexedSocket*,ASIOSocketWrapper*,const boost::system::error_code &error);
-void ASIOLogBuffer(void * pointerkey, const char extension[16], const uint8* buffer, size_t buffersize);
 class ASIOSocketWrapper {
 
     TCPSocket*mSocket;
     /**
-     * The status of sending threads: odd number indicates asynchronous send... number >0  indicates other waiting threads number&ASYNCHRONOUS_SEND_FLAG indicates a thread is
-     * currently sending data off. number&QUEUE_CHECK_FLAG means queue is currently being swapped away and items added to the queue may not ever be processed if the queue is empty
-     * unless a thread takes up the torch and does it
+     * ASYNCHRONOUS_SEND_FLAG while some context has claimed the right to take packets off mSendQueue and send them, zero otherwise.
+     * The flag is only ever claimed by a compare and swap from zero, so exactly one context sends at a time
      */
     AtomicValue<uint32> mSendingStatus;
     /**
-     * The queue of packets to send while an active async_send is doing its job
+     * The queues of packets waiting to be picked up by the sending context, one per TCPStream::StreamPriority class.
+     * Any thread may push without taking a lock; the sending context takes each queue's contents in a single step
      */
-    ThreadSafeQueue<Chunk*>mSendQueue;
+    LockFreeBatchQueue<PacketBuffer,&PacketBuffer::mNextQueued>mSendQueue[TCPStream::NumStreamPriorities];
+    /**
+     * Packets taken off mSendQueue by the thread holding the ASYNCHRONOUS_SEND_FLAG that have not yet been scheduled onto mSendingChunks
+     */
+    std::deque<PacketBuffer*> mPendingChunks[TCPStream::NumStreamPriorities];
+    /**
+     * A packet too large to send whole that is going out one fragment at a time, taking turns with the other packets of its class
+     */
+    class FragmentingPacket {
+    public:
+        PacketBuffer*mPacket;
+        ///The length of the original length and StreamID framing at the front of mPacket, which is not sent
+        size_t mHeaderLength;
+        ///Where in mPacket the next fragment starts
+        size_t mOffset;
+        ///The stream that sent the packet
+        Stream::StreamID mStreamID;
+        ///Whether the packet is a sequenced or compressed control packet carrying data of mStreamID rather than plain data
+        bool mControl;
+        FragmentingPacket(PacketBuffer*packet, size_t headerLength, const Stream::StreamID&id, bool control):mPacket(packet),mHeaderLength(headerLength),mOffset(headerLength),mStreamID(id),mControl(control){}
+    };
+    ///The packets of each class currently being sent in fragments, served round robin
+    std::deque<FragmentingPacket> mFragmentingPackets[TCPStream::NumStreamPriorities];
+    ///Whether each class should next send a fragment rather than a whole pending packet, so the two take turns
+    bool mFragmentTurn[TCPStream::NumStreamPriorities];
+    ///The number of bytes each class may still schedule in the current round of weighted scheduling
+    size_t mPriorityDeficit[TCPStream::NumStreamPriorities];
+    ///The class weighted scheduling is currently serving
+    int mCurrentPriority;
+    ///The number of bytes of each class that have been handed to the operating system
+    AtomicValue<uint64> mPriorityBytesSent[TCPStream::NumStreamPriorities];
 	enum {
-		ASYNCHRONOUS_SEND_FLAG=(1<<29),
-		QUEUE_CHECK_FLAG=(1<<30),
-		PACKET_BUFFER_SIZE=1400
+		ASYNCHRONOUS_SEND_FLAG=1
 	};
-    uint8 mBuffer[PACKET_BUFFER_SIZE];
-
-    typedef boost::system::error_code ErrorCode;
     /**
-     * This function sets the QUEUE_CHECK_FLAG and checks the sendQueue for additional packets to send out.
-     * If nothing is in the queue then it unsets the ASYNCHRONOUS_SEND_FLAG and QUEUE_CHECK_FLAGS
-     * If something is present in the queue it calls sendToWire with the queue
+     * The packets currently being shipped to the network by the thread holding the ASYNCHRONOUS_SEND_FLAG.
+     * The front packet may have been partially written: mSendingOffset bytes of it are already on the wire
      */
-    void finishAsyncSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket);
-
+    std::deque<PacketBuffer*> mSendingChunks;
+    ///The number of bytes of mSendingChunks.front() that have already been written to the socket
+    size_t mSendingOffset;
+    ///The scatter-gather list handed to async_send: refers directly to the bytes in mSendingChunks so nothing is copied
+    std::vector<boost::asio::const_buffer> mGatherBuffers;
+    ///The maximum number of Chunks (iovecs) a single async_send may gather
+    unsigned int mMaxGatherBuffers;
+    ///Once a gather list reaches this many bytes no further Chunks are added to it
+    size_t mMaxGatherBytes;
+    ///The number of bytes passed to rawSend that have not yet been handed to an async_send
+    AtomicValue<uint32> mQueuedBytes;
+    ///The most bytes mQueuedBytes has reached
+    AtomicValue<uint32> mMaxQueuedBytes;
+    ///The number of bytes handed to the async_send currently in progress, if any
+    AtomicValue<uint32> mInFlightBytes;
+    ///When the async_send currently in progress was started, in microseconds: only meaningful while mInFlightBytes is nonzero
+    AtomicValue<int64> mInFlightSince;
+    ///Nonzero while the ASYNCHRONOUS_SEND_FLAG is held back so later packets may join the next send: whoever clears it sends
+    AtomicValue<uint32> mCorked;
+    ///Ends the coalescing window: made on first use and only touched from handlers in the connection's strand
+    IODeadlineTimer*mCorkTimer;
+    ///The ConnectionState of this socket, which only handlers in the connection's strand change
+    AtomicValue<uint32> mConnectionState;
+    ///The number of threads that have chosen this socket to send on and not yet queued their packet on it
+    AtomicValue<uint32> mChoosingSenders;
+    ///The RetireFlags of a retiring socket: only touched from handlers in the connection's strand
+    uint32 mRetireFlags;
+    ///The waiting packet each PacketBuffer replace key last named, which a later packet with that key replaces: only touched by the context holding the ASYNCHRONOUS_SEND_FLAG
+    std::tr1::unordered_map<uint64,PacketBuffer*> mReplaceablePackets;
+    ///The number of packets discarded unsent because they expired or were replaced
+    AtomicValue<uint32> mStalePackets;
+    ///The TCPSocketOptions::Option flags that took effect on the socket
+    AtomicValue<uint32> mSocketOptionsApplied;
+    ///The SO_SNDBUF the system reports keeping once it was set, or 0 if it was not
+    AtomicValue<uint32> mSendBufferSize;
+    ///The SO_RCVBUF the system reports keeping once it was set, or 0 if it was not
+    AtomicValue<uint32> mReceiveBufferSize;
+    ///How long packets waited between rawSend and being gathered into an async_send
+    AtomicLatencyHistogram mQueueLatency;
+    ///How long each async_send took the operating system to complete
+    AtomicLatencyHistogram mSendLatency;
+    ///Recycled for every async_send on the socket and the trip through the strand that completes it
+    HandlerMemory mSendHandlerMemory;
+    ///Recycled for every read on the socket: shared with its ASIOReadBuffer, which may outlive the connection
+    std::tr1::shared_ptr<HandlerMemory> mReceiveHandlerMemory;
     /**
-     * The callback for when a single Chunk was sent.
-     * If the whole Chunk was not sent then the rest of the Chunk is passed back to sendToWire
-     * If the whole Chunk was shipped off, the finishAsyncSend function is called
+     * Keeps the connection alive while an async_send is outstanding, so its completion handler need only hold this.
+     * Only touched by the context holding the ASYNCHRONOUS_SEND_FLAG, and cleared before the flag is given up
      */
-    void sendLargeChunkItem(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, Chunk *toSend, size_t originalOffset, const ErrorCode &error, std::size_t bytes_sent);
+    std::tr1::shared_ptr<MultiplexedSocket> mSendingParent;
 
     /**
-     * The callback for when a single large Chunk at the front of a chunk deque was sent.
-     * If the whole large Chunk was not sent then the rest of the Chunk is passed back to sendToWire
-     * If the whole Chunk was shipped off, the sendToWire function is called with the rest of the queue unless it is empty in which case the finishAsyncSend is called
+     * A ConstBufferSequence that refers to the mGatherBuffers storage so that asio may copy the sequence
+     * into its operation without copying the list of buffers itself
      */
-    void sendLargeDequeItem(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const std::deque<Chunk*> &const_toSend, size_t originalOffset, const ErrorCode &error, std::size_t bytes_sent);
+    class GatherBufferSequence {
+        const boost::asio::const_buffer*mBegin;
+        const boost::asio::const_buffer*mEnd;
+    public:
+        typedef boost::asio::const_buffer value_type;
+        typedef const boost::asio::const_buffer* const_iterator;
+        GatherBufferSequence(const std::vector<boost::asio::const_buffer>&buffers):mBegin(&*buffers.begin()),mEnd(&*buffers.begin()+buffers.size()){}
+        const_iterator begin()const {return mBegin;}
+        const_iterator end()const {return mEnd;}
+    };
 
+    typedef boost::system::error_code ErrorCode;
+    ///Resets the per class scheduling state and counters
+    void initPriorityQueues();
+    /**
+     * Moves every packet waiting in the mSendQueues onto the back of the matching mPendingChunks
+     * \returns true if any packets are pending afterwards
+     */
+    bool takeQueuedChunks();
+    ///Whether a waiting packet expired or was replaced, so it should be discarded rather than sent
+    static bool isStale(const PacketBuffer*packet);
+    ///Discards a stale packet taken off mPendingChunks
+    void discardStale(PacketBuffer*packet);
+    ///Stops a packet taken off mPendingChunks from being replaced
+    void forgetReplaceable(PacketBuffer*packet);
+    ///Returns true if the class has neither pending packets nor packets partway through being fragmented
+    bool isPriorityEmpty(int priority)const {
+        return mPendingChunks[priority].empty()&&mFragmentingPackets[priority].empty();
+    }
+    ///Estimates the size of the packet popNextChunk would return for a nonempty class
+    size_t nextChunkSize(int priority, size_t fragmentSize)const;
+    /**
+     * Removes the next packet to put on the wire from a nonempty class.
+     * Pending packets larger than fragmentSize are moved to mFragmentingPackets and sent one fragment at a time,
+     * alternating with whole packets from the class. A pending packet from a stream with a packet still being fragmented
+     * (or any control packet) waits until that packet is done, so the order of each stream is preserved.
+     * Stale packets at the front of the class are discarded on the way, so NULL is returned if only stale ones were left
+     * \param fragmentSize is the largest amount of data to put in a fragment, or 0 to never start fragmenting packets
+     */
+    PacketBuffer*popNextChunk(int priority, size_t fragmentSize);
+    /**
+     * Whether a packet with dataLength bytes of data may go out in fragments, keeping what the other side reassembles
+     * within MultiplexedSocket::MAX_REASSEMBLED_LENGTH, MAX_PARTIAL_PACKETS and MAX_PARTIAL_PACKET_BYTES. Other packets are sent whole
+     */
+    bool canStartFragmenting(size_t dataLength)const;
+    ///Builds the next TCPStreamFragment control packet of at most fragmentSize bytes of data from packet, advancing its offset
+    static PacketBuffer*constructFragment(FragmentingPacket&packet, size_t fragmentSize);
+    /**
+     * Picks the class whose next pending packet should be put on the wire, either the most urgent nonempty class or by deficit round robin
+     * \returns the class or -1 if nothing is pending
+     */
+    int nextPriority(const MultiplexedSocket&parentMultiSocket, size_t fragmentSize);
+    /**
+     * Takes the packet to put on the wire next off the class chosen by nextPriority, charging it to the deficit of the class
+     * \returns the packet, whose class is put in priority, or NULL if nothing but stale packets was pending
+     */
+    PacketBuffer*scheduleNextChunk(const MultiplexedSocket&parentMultiSocket, size_t fragmentSize, int&priority);
     /**
-     * The callback for when a static buffer was shipped to the network.
-     * If the whole static buffer was not sent then the rest of the static buffer is passed back to async_send and the currentBuffer is offset by the necessary ammt to finish off
-     * sending it. This could be slightly inefficient if there are tons of other packets in the deque toSend but generally the buffer size should be chosen so that it can be sent
-     * in one go.
-     * If the whole buffer was shipped off, the sendToWire function is called with the rest of the queue unless it is empty
+     * Called by the sending context once nothing is left on the wire: checks the sendQueues for additional packets to send out.
+     * If something is present in the queues it moves the packets to mPendingChunks and calls sendToWire.
+     * If nothing is in the queues then it releases the ASYNCHRONOUS_SEND_FLAG, then checks the queues once more
+     * in case a packet was pushed by a thread that saw the flag held, reclaiming the flag to send it if so
      */
-    void sendStaticBuffer(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const std::deque<Chunk*>&toSend, uint8* currentBuffer, size_t bufferSize, size_t lastChunkOffset,  const ErrorCode &error, std::size_t bytes_sent);
+    void finishAsyncSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket);
 
-/**
- * When there's a single packet to be sent to the network, mSocket->async_send is simply called upon the Chunk to be sent
- */
-    void sendToWire(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, Chunk *toSend, size_t bytesSent=0);
+    /**
+     * The callback for when a gathered list of Chunks was (possibly partially) sent.
+     * Every Chunk that was completely written is deleted and popped from mSendingChunks and mSendingOffset is advanced
+     * into the first Chunk that was only partially written, if any.
+     * If Chunks remain they are passed back to sendToWire, otherwise the finishAsyncSend function is called.
+     * The connection is the one mSendingParent kept alive during the send
+     */
+    void sendGatheredChunks(const ErrorCode &error, std::size_t bytes_sent);
 
 /**
- *  This function sends a while queue of packets to the network
- * The function first checks to see if the front packet is too large to fit in the packet-sized buffer.
- * If it's too large it sends the packet individually much like a chunk would be sent individually and it is left on the queue for data storage purposes
- * If the packet is not too large it and all subsequent packets that can fit are jammed into the packet sized mBuffer
- *  and then those packets are deleted from the queue and shipped to the network partial packets are left on the queue in that case
+ * This function sends the mSendingChunks queue of packets to the network in a single scatter-gather async_send
+ * mSendingChunks is first topped up with pending packets from each class in the order chosen by nextPriority.
+ * The unsent remainder of the front packet and as many subsequent packets as fit within mMaxGatherBuffers and mMaxGatherBytes
+ * are referenced directly by mGatherBuffers, so no bytes are copied and a burst of small packets costs a single system call
  */
-    void sendToWire(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const std::deque<Chunk*>&const_toSend, size_t bytesSent=0);
+    void sendToWire(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket);
 
 /**
- * If another thread claimed to be sending data asynchronously
- * This function checks to see if the send is still proceeding after the queue push
- * This thread waits until all queue checks are done, then it sees if someone took up the torch of sending the data
- * If no data is being sent, this thread takes up the torch and sets the queue check flag and sees if data is on the queue
- * If no data is on the queue at this point, since it pushed its own data to the queue it assumes someone else successfully sent it off
- * If data is on the queue, it goes ahead and sends the data to the wire by using the appropriate overload of the sendToWire function
- * it then unsets the QUEUE_CHECK_FLAG and if data isn't being set also the ASYNCHRONOUS_SEND_FLAG
+ * Claims the ASYNCHRONOUS_SEND_FLAG if no context holds it and sends whatever is waiting by way of finishAsyncSend.
+ * If another context holds the flag it is responsible for picking up whatever is in the queues
  */
-    void retryQueuedSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, uint32 current_status);
+    void trySend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket);
+    ///Starts the timer ending the current coalescing window: must be called from within the connection's strand
+    void armCork(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket);
+    ///The end of a coalescing window: sends whatever gathered unless a flush already did
+    void corkExpired(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const ErrorCode&error);
 
 public:
 
-    ASIOSocketWrapper(TCPSocket* socket) :mSocket(socket),mSendingStatus(0){
+    ///Where a socket is in its life: the sockets of the original handshake are always CONNECTION_ACTIVE
+    enum ConnectionState {
+        ///Packets may be sent on the socket
+        CONNECTION_ACTIVE,
+        ///An added socket still exchanging its handshake, which nothing else may be sent on
+        CONNECTION_JOINING,
+        ///An added socket being retired, which nothing new may be sent on
+        CONNECTION_RETIRING,
+        ///A socket that was destroyed, whose place may be taken by a socket added later
+        CONNECTION_CLOSED
+    };
+    ///The progress of a CONNECTION_RETIRING socket
+    enum RetireFlags {
+        ///This side sent its TCPStreamRetireConnection, the last packet it sends on the socket
+        RETIRE_SENT=1,
+        ///The other side's TCPStreamRetireConnection arrived, so nothing more will
+        RETIRE_RECEIVED=2,
+        ///The other side acknowledged having received everything this side sent on the socket
+        RETIRE_ACKNOWLEDGED=4,
+        ///Reading from the socket came to an end
+        RETIRE_READ_CLOSED=8
+    };
+    enum {
+        ///By default at most this many Chunks are gathered into a single send: matches the iovec batch asio hands to the OS
+        DEFAULT_MAX_GATHER_BUFFERS=64,
+        ///By default gathering stops once this many bytes are queued up for a single send
+        DEFAULT_MAX_GATHER_BYTES=65536
+    };
+
+    ASIOSocketWrapper(TCPSocket* socket) :mSocket(socket),mSendingStatus(0),mSendingOffset(0),mMaxGatherBuffers(DEFAULT_MAX_GATHER_BUFFERS),mMaxGatherBytes(DEFAULT_MAX_GATHER_BYTES),mQueuedBytes(0),mMaxQueuedBytes(0),mInFlightBytes(0),mInFlightSince(0),mCorked(0),mCorkTimer(NULL),mConnectionState(CONNECTION_ACTIVE),mChoosingSenders(0),mRetireFlags(0),mStalePackets(0),mSocketOptionsApplied(0),mSendBufferSize(0),mReceiveBufferSize(0),mReceiveHandlerMemory(new HandlerMemory){
+        initPriorityQueues();
         //mPacketLogger.reserve(268435456);
     }
 
-    ASIOSocketWrapper(const ASIOSocketWrapper& socket) :mSocket(socket.mSocket),mSendingStatus(0){
+    ASIOSocketWrapper(const ASIOSocketWrapper& socket) :mSocket(socket.mSocket),mSendingStatus(0),mSendingOffset(0),mMaxGatherBuffers(socket.mMaxGatherBuffers),mMaxGatherBytes(socket.mMaxGatherBytes),mQueuedBytes(0),mMaxQueuedBytes(0),mInFlightBytes(0),mInFlightSince(0),mCorked(0),mCorkTimer(NULL),mConnectionState(socket.mConnectionState.read()),mChoosingSenders(0),mRetireFlags(0),mStalePackets(0),mSocketOptionsApplied(0),mSendBufferSize(0),mReceiveBufferSize(0),mReceiveHandlerMemory(new HandlerMemory){
+        initPriorityQueues();
         //mPacketLogger.reserve(268435456);
     }
 
     ASIOSocketWrapper&operator=(const ASIOSocketWrapper& socket){
         mSocket=socket.mSocket;
+        mMaxGatherBuffers=socket.mMaxGatherBuffers;
+        mMaxGatherBytes=socket.mMaxGatherBytes;
+        mConnectionState=socket.mConnectionState.read();
         return *this;
     }
 
-    ASIOSocketWrapper() :mSocket(NULL),mSendingStatus(0){
+    ASIOSocketWrapper() :mSocket(NULL),mSendingStatus(0),mSendingOffset(0),mMaxGatherBuffers(DEFAULT_MAX_GATHER_BUFFERS),mMaxGatherBytes(DEFAULT_MAX_GATHER_BYTES),mQueuedBytes(0),mMaxQueuedBytes(0),mInFlightBytes(0),mInFlightSince(0),mCorked(0),mCorkTimer(NULL),mConnectionState(CONNECTION_ACTIVE),mChoosingSenders(0),mRetireFlags(0),mStalePackets(0),mSocketOptionsApplied(0),mSendBufferSize(0),mReceiveBufferSize(0),mReceiveHandlerMemory(new HandlerMemory){
+        initPriorityQueues();
+    }
+    /**
+     * Limits how much queued data a single scatter-gather send may hand to the operating system
+     * \param maxBuffers is the maximum number of Chunks (iovecs) gathered per send (at least 1)
+     * \param maxBytes is the number of bytes after which no further Chunks are gathered into the send (at least 1)
+     */
+    void setGatherLimits(unsigned int maxBuffers, size_t maxBytes) {
+        //a send that may gather nothing would hand the queue straight back to sendToWire forever
+        mMaxGatherBuffers=maxBuffers?maxBuffers:1;
+        mMaxGatherBytes=maxBytes?maxBytes:1;
     }
 
+    ///The number of bytes waiting to be handed to the operating system
+    uint32 getQueuedBytes()const {return mQueuedBytes.read();}
+    ///The number of bytes in the send currently being performed by the operating system
+    uint32 getInFlightBytes()const {return mInFlightBytes.read();}
+    ///The number of bytes a newly sent packet would have to wait behind before reaching the wire
+    uint32 getOutstandingBytes()const {return mQueuedBytes.read()+mInFlightBytes.read();}
+    ///The number of bytes of the given TCPStream::StreamPriority class this socket has handed to the operating system
+    uint64 getPriorityBytesSent(int priority)const {return mPriorityBytesSent[priority].read();}
+    ///The number of packets this socket discarded unsent because they expired or were replaced
+    uint32 getStalePackets()const {return mStalePackets.read();}
+    ///The most bytes that have waited to be handed to the operating system at once
+    uint32 getMaxQueuedBytes()const {return mMaxQueuedBytes.read();}
+    ///Adds the time packets spent queued and the time each async_send took to the given histograms
+    void readLatencies(LatencyHistogram&queueLatency, LatencyHistogram&sendLatency)const {
+        mQueueLatency.readInto(queueLatency);
+        mSendLatency.readInto(sendLatency);
+    }
+    ///The memory the socket's ASIOReadBuffer recycles for its reads
+    const std::tr1::shared_ptr<HandlerMemory>&getReceiveHandlerMemory()const {return mReceiveHandlerMemory;}
+    ///The number of send and receive completion handlers that did not fit in the memory recycled for them
+    uint32 getHandlerHeapAllocations()const {
+        return mSendHandlerMemory.heapAllocations()+mReceiveHandlerMemory->heapAllocations();
+    }
+    ///How long the operating system has been working on the current send, or zero if the socket is idle
+    Task::DeltaTime getSendStallTime(const Task::AbsTime&now)const;
+    ///Sends the packets being held back for coalescing, if any, without waiting for the window to end
+    void flush(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket);
+
     TCPSocket&getSocket() {return *mSocket;}
 
+    ConnectionState getConnectionState()const {return (ConnectionState)mConnectionState.read();}
+    ///Changes the ConnectionState: must be called from within the connection's strand
+    void setConnectionState(ConnectionState state) {mConnectionState=state;}
+    bool isActive()const {return mConnectionState.read()==CONNECTION_ACTIVE;}
+    uint32 getRetireFlags()const {return mRetireFlags;}
+    void addRetireFlags(uint32 flags) {mRetireFlags|=flags;}
+    void clearRetireFlags() {mRetireFlags=0;}
+    /**
+     * Claims the right to queue a packet on an added socket that may be retired at any moment
+     * \returns false if the socket may not be sent on, otherwise endSend must be called once the packet is queued
+     */
+    bool beginSend() {
+        ++mChoosingSenders;
+        if (isActive())
+            return true;
+        --mChoosingSenders;
+        return false;
+    }
+    void endSend() {
+        --mChoosingSenders;
+    }
+    ///Marks the socket CONNECTION_RETIRING: threads that had already chosen it may still be queueing their packets, which isSendIdle waits out
+    void stopSending() {
+        mConnectionState=CONNECTION_RETIRING;
+    }
+    /**
+     * Whether everything queued on the socket has been handed to the operating system.
+     * A socket that stopped sending is not idle while a thread that chose it before then has yet to queue its packet
+     */
+    bool isSendIdle()const {
+        //checked first, since whoever leaves it has already queued their packet
+        return mChoosingSenders.read()==0&&mSendingStatus.read()==0&&getOutstandingBytes()==0;
+    }
+
     const TCPSocket&getSocket()const {return *mSocket;}
 
     ///close this socket by disallowing sends, then closing
@@ -140,26 +372,64 @@ public:
     ///Creates a lowlevel TCPSocket using the following io service
     void createSocket(IOService&io);
 
-    ///Destroys the lowlevel TCPSocket
+    ///Takes over a TCPSocket connected by someone else
+    void adoptSocket(TCPSocket*socket) {
+        mSocket=socket;
+        mSocketOptionsApplied=0;
+        mSendBufferSize=0;
+        mReceiveBufferSize=0;
+    }
+
+    /**
+     * Gives the open socket the options, reading each back to remember which took effect and the buffer sizes kept.
+     * A socket adopted later starts over and must be given them again
+     */
+    void applySocketOptions(const TCPSocketOptions&options);
+    ///The TCPSocketOptions::Option flags that took effect the last time options were applied
+    uint32 getSocketOptionsApplied()const {return mSocketOptionsApplied.read();}
+    ///The SO_SNDBUF the system kept the last time options were applied, which it may have doubled or clamped, or 0 if none was set
+    uint32 getSendBufferSize()const {return mSendBufferSize.read();}
+    ///The SO_RCVBUF the system kept the last time options were applied, which it may have doubled or clamped, or 0 if none was set
+    uint32 getReceiveBufferSize()const {return mReceiveBufferSize.read();}
+
+    ///Destroys the lowlevel TCPSocket and any packets that never made it to the wire
     void destroySocket();
     /**
      * Sends the exact bytes contained within the typedeffed vector
      * \param chunk is the exact bytes to put on the network (including streamID and framing data)
+     * \param priority is the TCPStream::StreamPriority class the packet is queued in: packets within a class go out in order
      */
-    void rawSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, Chunk * chunk);
+    void rawSend(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, PacketBuffer * chunk, int priority);
+    /**
+     * Sends chunk like rawSend even though it may already be waiting in another socket's send queue, by queueing a
+     * placeholder that stands in for it. The caller keeps its reference to chunk, whose bytes must not change
+     */
+    void rawSendShared(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, PacketBuffer * chunk, int priority);
+    /**
+     * Takes the packet a send would put on the wire next off the queues of a socket that never sends, such as one held
+     * back by a coalescing window on a service nobody runs, so the scheduler may be checked without a connection
+     * \returns the packet, which the caller unrefs and whose class is put in priority, or NULL if nothing is waiting
+     */
+    PacketBuffer*takeScheduledChunk(const MultiplexedSocket&parentMultiSocket, int&priority);
 
-    static Chunk*constructControlPacket(TCPStream::TCPStreamControlCodes code,const Stream::StreamID&sid);
+    static PacketBuffer*constructControlPacket(TCPStream::TCPStreamControlCodes code,const Stream::StreamID&sid);
     /**
      *  Sends a streamID #0 packet with further control data on it. 
      *  To start with only stream disconnect and the ack thereof are allowed
      */
     void sendControlPacket(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, TCPStream::TCPStreamControlCodes code,const Stream::StreamID&sid) {
-        rawSend(parentMultiSocket,constructControlPacket(code,sid));
+        rawSend(parentMultiSocket,constructControlPacket(code,sid),TCPStream::DefaultPriority);
     }
     /**
      * Sends 24 byte header that indicates version of SST, a unique ID and how many TCP connections should be established
+     * followed by the TCPStreamCapabilities control packet advertising which optional features this side understands
      */
     void sendProtocolHeader(const std::tr1::shared_ptr<MultiplexedSocket>&parentMultiSocket, const UUID&value, unsigned int numConnections);
+    /**
+     * Writes the 24 byte header adding this socket to the live connection named by value, before anything else is
+     * sent on it. The header is short enough for a fresh socket to take it without waiting, so it is written directly
+     */
+    void sendJoinHeader(const UUID&value, boost::system::error_code&error);
 
 };
 } }
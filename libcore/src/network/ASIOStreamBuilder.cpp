@@ -34,75 +34,123 @@
 #include "TCPDefinitions.hpp"
 #include "TCPStream.hpp"
 #include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
 #include "ASIOSocketWrapper.hpp"
 #include "MultiplexedSocket.hpp"
 #include "TCPSetCallbacks.hpp"
 namespace Sirikata { namespace Network { namespace ASIOStreamBuilder{
 
-class IncompleteStreamState {
-public:
-    int mNumSockets;
-    std::vector<TCPSocket*>mSockets;
-};
-
 namespace {
-typedef std::map<UUID,IncompleteStreamState> IncompleteStreamMap;
-std::deque<UUID> sStaleUUIDs;
-IncompleteStreamMap sIncompleteStreams;
+///Live connections by the UUID of their handshake, so the rest of the handshake and sockets added later can find them
+typedef std::map<UUID,std::tr1::weak_ptr<MultiplexedSocket> > LiveStreamMap;
+LiveStreamMap sLiveStreams;
+///Protects sLiveStreams since headers may arrive on several IOService threads at once
+boost::mutex sLiveStreamsMutex;
+
+void registerLiveStream(const UUID&context,const std::tr1::shared_ptr<MultiplexedSocket>&shared_socket) {
+    for (LiveStreamMap::iterator i=sLiveStreams.begin();i!=sLiveStreams.end();) {
+        if (i->second.expired()) {
+            sLiveStreams.erase(i++);
+        }else {
+            ++i;
+        }
+    }
+    sLiveStreams[context]=shared_socket;
+}
+
+///Moves a socket accepted on io onto the service of the connection it joins, so all of a connection's sockets are serviced together
+TCPSocket*moveToConnectionService(TCPSocket*socket,IOService*io,const std::tr1::shared_ptr<MultiplexedSocket>&connection) {
+    if (&connection->getASIOService()==io)
+        return socket;
+    TCPSocket*moved=new TCPSocket(connection->getASIOService());
+    boost::system::error_code error;
+    AdoptTCPSocket(*moved,*socket,error);
+    if (error) {
+        //it still works from the acceptor's service, since every handler is wrapped in the connection's strand
+        delete moved;
+        return socket;
+    }
+    delete socket;
+    return moved;
 }
-///gets called when a complete 24 byte header is actually received: uses the UUID within to match up appropriate sockets
+}
+///Runs in the strand of the new connection: starts it reading and hands the first stream to the client
+void finishBuildingStream(const std::tr1::shared_ptr<MultiplexedSocket>&shared_socket,
+                          Stream::SubstreamCallback callback) {
+    MultiplexedSocket::sendAllProtocolHeaders(shared_socket,UUID::random());
+    Stream::StreamID newID=Stream::StreamID(1);
+    TCPStream * strm=new TCPStream(shared_socket,newID);
+
+    TCPSetCallbacks setCallbackFunctor(&*shared_socket,strm);
+    callback(strm,setCallbackFunctor);
+    if (setCallbackFunctor.mCallbacks==NULL) {
+        SILOG(tcpsst,error,"Client code for stream "<<newID.read()<<" did not set listener on socket");
+        shared_socket->rejectStream(newID);
+    }
+}
+/**
+ * gets called when a complete 24 byte header is actually received: uses the UUID within to match up appropriate sockets.
+ * The connection is built by the first socket of a handshake, so its streams may start while the rest are still on their way
+ */
 void buildStream(Array<uint8,TCPStream::TcpSstHeaderSize> *buffer,
                  TCPSocket *socket,
                  IOService *ioService,
                  Stream::SubstreamCallback callback,
+                 const std::tr1::shared_ptr<ASIODatagramChannel>&datagrams,
+                 const TCPSocketOptions&options,
                  const boost::system::error_code &error,
                  std::size_t bytes_transferred) {
     if (error || std::memcmp(buffer->begin(),TCPStream::STRING_PREFIX(),TCPStream::STRING_PREFIX_LENGTH)!=0) {
         SILOG(tcpsst,warning,"Connection received with incomprehensible header");
     }else {
         UUID context=UUID(buffer->begin()+(TCPStream::TcpSstHeaderSize-16),16);
-        IncompleteStreamMap::iterator where=sIncompleteStreams.find(context);
         unsigned int numConnections=(((*buffer)[TCPStream::STRING_PREFIX_LENGTH]-'0')%10)*10+(((*buffer)[TCPStream::STRING_PREFIX_LENGTH+1]-'0')%10);
         if (numConnections>99) numConnections=99;//FIXME: some option in options
-        if (where==sIncompleteStreams.end()){
-            sIncompleteStreams[context].mNumSockets=numConnections;
-            where=sIncompleteStreams.find(context);
-            assert(where!=sIncompleteStreams.end());
+        boost::lock_guard<boost::mutex> liveStreamsLock(sLiveStreamsMutex);
+        std::tr1::shared_ptr<MultiplexedSocket> joinedStream;
+        LiveStreamMap::iterator live=sLiveStreams.find(context);
+        if (live!=sLiveStreams.end())
+            joinedStream=live->second.lock();
+        if (joinedStream) {
+            //the connection may have been built from another acceptor
+            socket=moveToConnectionService(socket,ioService,joinedStream);
         }
-        if ((int)numConnections!=where->second.mNumSockets) {
-            SILOG(tcpsst,warning,"Single client disagrees on number of connections to establish: "<<numConnections<<" != "<<where->second.mNumSockets);
-            sIncompleteStreams.erase(where);
-        }else {
-            where->second.mSockets.push_back(socket);
-            if (numConnections==(unsigned int)where->second.mSockets.size()) {
-                std::tr1::shared_ptr<MultiplexedSocket> shared_socket(MultiplexedSocket::construct(ioService,context,where->second.mSockets,callback));
-                MultiplexedSocket::sendAllProtocolHeaders(shared_socket,UUID::random());
-                sIncompleteStreams.erase(where);
-                Stream::StreamID newID=Stream::StreamID(1);
-                TCPStream * strm=new TCPStream(shared_socket,newID);
-                
-                TCPSetCallbacks setCallbackFunctor(&*shared_socket,strm);
-                callback(strm,setCallbackFunctor);
-                if (setCallbackFunctor.mCallbacks==NULL) {
-                    SILOG(tcpsst,error,"Client code for stream "<<newID.read()<<" did not set listener on socket");
-                    shared_socket->closeStream(shared_socket,newID);
-                }
-            }else{
-                sStaleUUIDs.push_back(context);
+        if (numConnections==0) {
+            //a connection being added to a stream that is already up
+            if (joinedStream) {
+                joinedStream->getStrand().post(std::tr1::bind(&MultiplexedSocket::acceptAddedSocket,joinedStream,socket));
+            }else {
+                SILOG(tcpsst,warning,"Added connection names no live stream");
+                delete socket;
             }
+        }else if (joinedStream) {
+            //the rest of a handshake whose first socket already built the connection
+            joinedStream->getStrand().post(std::tr1::bind(&MultiplexedSocket::acceptBaseSocket,joinedStream,socket,numConnections));
+        }else {
+            std::vector<TCPSocket*> sockets(1,socket);
+            std::tr1::shared_ptr<MultiplexedSocket> shared_socket(MultiplexedSocket::construct(ioService,context,sockets,numConnections,callback));
+            shared_socket->setSocketOptions(options);
+            shared_socket->getASIOSocketWrapper(0).applySocketOptions(options);
+            registerLiveStream(context,shared_socket);
+            boost::system::error_code endpointError;
+            boost::asio::ip::tcp::endpoint remote=socket->remote_endpoint(endpointError);
+            if (!endpointError)
+                shared_socket->setDatagramChannel(datagrams,remote.address());
+            //posted under the lock, so the headers go out before the rest of the handshake is answered
+            shared_socket->getStrand().post(std::tr1::bind(&finishBuildingStream,shared_socket,callback));
         }
     }
     delete buffer;
 }
 
-void beginNewStream(TCPSocket * socket, IOService*ioService,const Stream::SubstreamCallback& cb) {
+void beginNewStream(TCPSocket * socket, IOService*ioService,const Stream::SubstreamCallback& cb,const std::tr1::shared_ptr<ASIODatagramChannel>&datagrams,const TCPSocketOptions&options) {
     Array<uint8,TCPStream::TcpSstHeaderSize> *buffer=new Array<uint8,TCPStream::TcpSstHeaderSize>;
      
      
     boost::asio::async_read(*socket,
                             boost::asio::buffer(buffer->begin(),TCPStream::TcpSstHeaderSize),
                             boost::asio::transfer_at_least(TCPStream::TcpSstHeaderSize),
-                            std::tr1::bind(&ASIOStreamBuilder::buildStream,buffer,socket,ioService,cb,_1,_2));
+                            std::tr1::bind(&ASIOStreamBuilder::buildStream,buffer,socket,ioService,cb,datagrams,options,_1,_2));
 }
 
 } } } 
@@ -30,12 +30,17 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-namespace Sirikata { namespace Network { namespace ASIOStreamBuilder {
+namespace Sirikata { namespace Network {
+class ASIODatagramChannel;
+class TCPSocketOptions;
+namespace ASIOStreamBuilder {
 /**
  * Begins a new stream based on a TCPSocket connection acception with the following substream callback for stream creation
  * Only creates the stream if the handshake is complete and it has all the resources (udp, tcp sockets, etc) necessary at the time
+ * The listener's datagram channel, if it has one, is shared with the new stream's connection, and its socket options
+ * are given to every TCP connection the new connection gets
  */
-void beginNewStream(TCPSocket *socket,IOService*ioService,const Stream::SubstreamCallback&);
+void beginNewStream(TCPSocket *socket,IOService*ioService,const Stream::SubstreamCallback&,const std::tr1::shared_ptr<ASIODatagramChannel>&datagrams,const TCPSocketOptions&options);
 
 
 } }  }
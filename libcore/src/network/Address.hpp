@@ -34,11 +34,22 @@ namespace Sirikata { namespace Network {
 /**
  * Provides a protocol-independent address layer for connecting to a target
  * Takes a name and a service (for TCP that would be computer ip address and numeric port
+ * A name of UNIX_DOMAIN_SCHEME() selects a Unix domain socket for processes on the same machine: the service is then its path
  */
 class Address {
     String mName;
     String mService;
 public:
+    static const char*UNIX_DOMAIN_SCHEME() {
+        return "unix";
+    }
+    ///The address of the Unix domain socket at path
+    static Address unixDomain(const String&path) {
+        return Address(UNIX_DOMAIN_SCHEME(),path);
+    }
+    bool isUnixDomain()const {
+        return mName==UNIX_DOMAIN_SCHEME();
+    }
     const String &getHostName()const {
         return mName;
     }
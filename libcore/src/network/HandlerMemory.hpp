@@ -0,0 +1,104 @@
+/*  Sirikata Network Utilities
+ *  HandlerMemory.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIRIKATA_HandlerMemory_HPP__
+#define SIRIKATA_HandlerMemory_HPP__
+#include "util/AtomicTypes.hpp"
+#include <boost/type_traits/aligned_storage.hpp>
+namespace Sirikata { namespace Network {
+
+/**
+ * A block of memory that asio recycles for the completion handlers of one kind of operation on one socket.
+ * Operations of a kind follow one another, so the memory for each is nearly always free by the time the next is started:
+ * a handler that finds it taken or too small goes to the heap instead, and is counted so the block can be sized to fit
+ */
+class HandlerMemory : public Noncopyable {
+public:
+    enum {
+        ///Large enough for a gathered send or a receive completing through a strand
+        SIZE=512
+    };
+private:
+    boost::aligned_storage<SIZE>::type mStorage;
+    ///Set while a handler occupies mStorage
+    AtomicValue<uint32> mInUse;
+    ///The number of handlers that went to the heap because mStorage was taken or too small
+    AtomicValue<uint32> mHeapAllocations;
+public:
+    HandlerMemory():mInUse(0),mHeapAllocations(0) {}
+    void*allocate(std::size_t size) {
+        if (size<=SIZE&&mInUse.compareAndSwap(0,1))
+            return &mStorage;
+        ++mHeapAllocations;
+        return ::operator new(size);
+    }
+    void deallocate(void*pointer) {
+        if (pointer==&mStorage)
+            mInUse=0;
+        else
+            ::operator delete(pointer);
+    }
+    uint32 heapAllocations()const {
+        return mHeapAllocations.read();
+    }
+};
+
+/**
+ * Wraps a completion handler so that asio allocates the operations it is passed to from a HandlerMemory.
+ * The HandlerMemory must outlive every operation the handler is passed to.
+ * When the handler is also wrapped in a strand, wrap the strand around this so the strand's own queueing is recycled too
+ */
+template <class Handler> class AllocatingHandler {
+    HandlerMemory*mMemory;
+    Handler mHandler;
+public:
+    AllocatingHandler(HandlerMemory&memory, const Handler&handler):mMemory(&memory),mHandler(handler) {}
+    template <class Arg1> void operator()(const Arg1&arg1) {
+        mHandler(arg1);
+    }
+    template <class Arg1, class Arg2> void operator()(const Arg1&arg1, const Arg2&arg2) {
+        mHandler(arg1,arg2);
+    }
+    friend void*asio_handler_allocate(std::size_t size, AllocatingHandler<Handler>*thus) {
+        return thus->mMemory->allocate(size);
+    }
+    friend void asio_handler_deallocate(void*pointer, std::size_t size, AllocatingHandler<Handler>*thus) {
+        thus->mMemory->deallocate(pointer);
+    }
+};
+
+template <class Handler> AllocatingHandler<Handler> makeAllocatingHandler(HandlerMemory&memory, const Handler&handler) {
+    return AllocatingHandler<Handler>(memory,handler);
+}
+
+} }
+#endif
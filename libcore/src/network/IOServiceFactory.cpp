@@ -81,6 +81,6 @@ void IOServiceFactory::dispatchServiceMessage(IOService*ios,const std::tr1::func
 }
 
 
-IOService::IOService():boost::asio::io_service(1){}
+IOService::IOService(std::size_t concurrencyHint):boost::asio::io_service(concurrencyHint){}
 IOService::~IOService(){}
 } }
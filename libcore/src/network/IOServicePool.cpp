@@ -0,0 +1,93 @@
+/*  Sirikata Network Utilities
+ *  IOServicePool.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "util/Standard.hh"
+#include "options/Options.hpp"
+#include "TCPDefinitions.hpp"
+#include "IOServicePool.hpp"
+namespace Sirikata { namespace Network {
+namespace {
+OptionValue*sIOServiceThreads;
+InitializeGlobalOptions gIOServicePoolOptions("",
+    sIOServiceThreads=new OptionValue("ioservicethreads","0",OptionValueType<uint32>(),"Number of threads an IOServicePool runs its network service on: 0 uses one per processor"),
+    NULL);
+}
+
+class IOServicePool::Work {
+public:
+    InternalIOService::work mWork;
+    Work(IOService&io):mWork(io){}
+};
+
+unsigned int IOServicePool::defaultNumThreads() {
+    unsigned int retval=sIOServiceThreads->as<uint32>();
+    if (retval==0)
+        retval=boost::thread::hardware_concurrency();
+    return retval?retval:1;
+}
+
+IOServicePool::IOServicePool(unsigned int numThreads):mWork(NULL),mNumThreads(numThreads?numThreads:defaultNumThreads()) {
+    mIO=new IOService(mNumThreads);
+}
+
+IOServicePool::~IOServicePool() {
+    stop();
+    delete mIO;
+}
+
+void IOServicePool::runThread(IOService*io) {
+    io->run();
+}
+
+void IOServicePool::run() {
+    if (mWork)
+        return;
+    mIO->reset();
+    mWork=new Work(*mIO);
+    for (unsigned int i=0;i<mNumThreads;++i) {
+        mThreads.push_back(new boost::thread(std::tr1::bind(&IOServicePool::runThread,mIO)));
+    }
+}
+
+void IOServicePool::stop() {
+    if (mWork==NULL)
+        return;
+    delete mWork;
+    mWork=NULL;
+    mIO->stop();
+    for (std::vector<boost::thread*>::iterator i=mThreads.begin(),ie=mThreads.end();i!=ie;++i) {
+        (*i)->join();
+        delete *i;
+    }
+    mThreads.clear();
+}
+
+} }
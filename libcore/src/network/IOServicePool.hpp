@@ -0,0 +1,73 @@
+/*  Sirikata Network Utilities
+ *  IOServicePool.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SIRIKATA_IOSERVICEPOOL_HPP_
+#define _SIRIKATA_IOSERVICEPOOL_HPP_
+
+namespace boost {
+class thread;
+}
+namespace Sirikata { namespace Network {
+class IOService;
+/**
+ * An IOService run by a pool of threads so that independent connections are serviced on several cores at once.
+ * Each MultiplexedSocket wraps its handlers in its own strand, so the callbacks of any one connection still never run concurrently
+ */
+class SIRIKATA_EXPORT IOServicePool {
+    class Work;
+    ///The service every thread in the pool runs
+    IOService*mIO;
+    ///Keeps the threads running while the service has nothing to do: NULL when the pool is not running
+    Work*mWork;
+    std::vector<boost::thread*>mThreads;
+    unsigned int mNumThreads;
+    ///The body of each thread in the pool
+    static void runThread(IOService*io);
+public:
+    ///Makes a pool of numThreads threads, or as many as the ioservicethreads option asks for if numThreads is 0
+    explicit IOServicePool(unsigned int numThreads=0);
+    ///Stops the pool if it is still running
+    ~IOServicePool();
+    IOService&service() {
+        return *mIO;
+    }
+    unsigned int numThreads()const {
+        return mNumThreads;
+    }
+    ///Starts the threads running the service: they keep running even while there is nothing to do until stop is called
+    void run();
+    ///Stops the service and waits for every thread to return
+    void stop();
+    ///Returns the number of threads the ioservicethreads option asks for, or the number of processors if it is 0
+    static unsigned int defaultNumThreads();
+};
+} }
+#endif
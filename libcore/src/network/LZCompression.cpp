@@ -0,0 +1,152 @@
+/*  Sirikata Network Utilities
+ *  LZCompression.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "util/Standard.hh"
+#include "LZCompression.hpp"
+namespace Sirikata { namespace Network {
+
+namespace {
+enum {
+    MAX_HASH_BITS=13,
+    MIN_HASH_BITS=6
+};
+inline unsigned int hashTriple(const uint8*data, unsigned int hashBits) {
+    uint32 triple=(data[0]<<16)|(data[1]<<8)|data[2];
+    return (triple*2654435761U)>>(32-hashBits);
+}
+}
+
+size_t LZCompression::compress(const uint8*input, size_t length, uint8*output, size_t maxOutput) {
+    //one more than the last position each hash of three bytes was seen at, so zero means never.
+    //short packets use a smaller table, since clearing the whole table would cost more than compressing them
+    unsigned int hashBits=MIN_HASH_BITS;
+    while (hashBits<MAX_HASH_BITS&&((size_t)1<<hashBits)<length)
+        ++hashBits;
+    uint32 lastSeen[1<<MAX_HASH_BITS];
+    std::memset(lastSeen,0,sizeof(uint32)<<hashBits);
+    size_t ip=0;
+    size_t op=0;
+    //the current literal run is counted in lit and its control byte is written once the run ends
+    size_t lit=0;
+    if (maxOutput==0)
+        return 0;
+    output[op++]=0;
+    while (ip<length) {
+        if (ip+2<length) {
+            unsigned int hash=hashTriple(input+ip,hashBits);
+            size_t ref=lastSeen[hash];
+            lastSeen[hash]=(uint32)(ip+1);
+            if (ref&&ip-ref<MAX_OFFSET&&
+                input[ref-1]==input[ip]&&input[ref]==input[ip+1]&&input[ref+1]==input[ip+2]) {
+                --ref;
+                size_t maxMatch=length-ip;
+                if (maxMatch>MAX_MATCH)
+                    maxMatch=MAX_MATCH;
+                size_t matchLength=3;
+                while (matchLength<maxMatch&&input[ref+matchLength]==input[ip+matchLength])
+                    ++matchLength;
+                //close off the literal run, reusing its control byte slot if it is empty
+                if (lit)
+                    output[op-lit-1]=(uint8)(lit-1);
+                else
+                    --op;
+                //a match takes at most 3 bytes and the next literal run needs its control byte
+                if (op+4>maxOutput)
+                    return 0;
+                size_t offset=ip-ref-1;
+                size_t encodedLength=matchLength-2;
+                if (encodedLength<7) {
+                    output[op++]=(uint8)((offset>>8)+(encodedLength<<5));
+                }else {
+                    output[op++]=(uint8)((offset>>8)+(7<<5));
+                    output[op++]=(uint8)(encodedLength-7);
+                }
+                output[op++]=(uint8)(offset&0xff);
+                output[op++]=0;
+                lit=0;
+                ip+=matchLength;
+                continue;
+            }
+        }
+        if (op>=maxOutput)
+            return 0;
+        output[op++]=input[ip++];
+        if (++lit==MAX_LITERAL) {
+            output[op-lit-1]=(uint8)(lit-1);
+            lit=0;
+            if (op>=maxOutput)
+                return 0;
+            output[op++]=0;
+        }
+    }
+    if (lit)
+        output[op-lit-1]=(uint8)(lit-1);
+    else
+        --op;
+    return op;
+}
+
+bool LZCompression::decompress(const uint8*input, size_t length, uint8*output, size_t outputLength) {
+    size_t ip=0;
+    size_t op=0;
+    while (ip<length) {
+        unsigned int control=input[ip++];
+        if (control<MAX_LITERAL) {
+            size_t literalLength=control+1;
+            if (ip+literalLength>length||op+literalLength>outputLength)
+                return false;
+            std::memcpy(output+op,input+ip,literalLength);
+            ip+=literalLength;
+            op+=literalLength;
+        }else {
+            size_t matchLength=control>>5;
+            if (matchLength==7) {
+                if (ip>=length)
+                    return false;
+                matchLength+=input[ip++];
+            }
+            matchLength+=2;
+            if (ip>=length)
+                return false;
+            size_t offset=((control&31)<<8)+input[ip++]+1;
+            if (offset>op||op+matchLength>outputLength)
+                return false;
+            //matches may overlap the bytes they produce, so copy forward one byte at a time
+            const uint8*ref=output+op-offset;
+            for (size_t i=0;i<matchLength;++i)
+                output[op+i]=ref[i];
+            op+=matchLength;
+        }
+    }
+    return op==outputLength;
+}
+
+} }
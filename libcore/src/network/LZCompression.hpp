@@ -0,0 +1,66 @@
+/*  Sirikata Network Utilities
+ *  LZCompression.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SIRIKATA_LZCOMPRESSION_HPP_
+#define _SIRIKATA_LZCOMPRESSION_HPP_
+
+namespace Sirikata { namespace Network {
+/**
+ * A small, fast LZ77 compressor in the style of LZF, used to shrink the packets of streams that ask for compression.
+ * It trades compression ratio for speed, so that compressing every packet of a busy stream costs less than sending it.
+ * The compressed form is a series of items, each starting with a control byte c:
+ *      if c is below 32, c+1 literal bytes follow
+ *      otherwise the top 3 bits of c (plus a following byte if they are all set) are 2 less than the length of a
+ *            match, and the low 5 bits of c and the next byte are one less than how far back in the output it starts
+ */
+class SIRIKATA_EXPORT LZCompression {
+public:
+    enum {
+        ///The longest run of literal bytes a single control byte covers
+        MAX_LITERAL=32,
+        ///How far back a match may reach
+        MAX_OFFSET=8192,
+        ///The longest match a single item covers
+        MAX_MATCH=264
+    };
+    /**
+     * Compresses length bytes of input into output
+     * \returns the compressed length, or 0 if it would not fit in maxOutput bytes
+     */
+    static size_t compress(const uint8*input, size_t length, uint8*output, size_t maxOutput);
+    /**
+     * Decompresses length bytes of input into exactly outputLength bytes of output
+     * \returns false if the input is corrupt or does not decompress to exactly outputLength bytes
+     */
+    static bool decompress(const uint8*input, size_t length, uint8*output, size_t outputLength);
+};
+} }
+#endif
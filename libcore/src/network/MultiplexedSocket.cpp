@@ -34,15 +34,34 @@
 #include "Stream.hpp"
 #include "TCPStream.hpp"
 #include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
 #include "ASIOSocketWrapper.hpp"
 #include "MultiplexedSocket.hpp"
+#include "LZCompression.hpp"
+#include "ASIODatagramChannel.hpp"
 #include "ASIOConnectAndHandshake.hpp"
 #include "TCPSetCallbacks.hpp"
+#include "PacketTrace.hpp"
 
 namespace Sirikata { namespace Network {
 
 
 boost::mutex MultiplexedSocket::sConnectingMutex; 
+namespace {
+typedef std::map<std::pair<IOService*,std::string>,std::tr1::weak_ptr<MultiplexedSocket> > SharedConnectionMap;
+///The connections TCPStream::connect may hand out, by the IOService they run on and the host and service they reach
+SharedConnectionMap sSharedConnections;
+boost::mutex sSharedConnectionsMutex;
+std::string sharedAddress(const Address&address) {
+    return address.getHostName()+":"+address.getService();
+}
+///The address at the other end of socket, or the unspecified address if it has none, as a Unix domain socket does not
+boost::asio::ip::address peerAddress(TCPSocket&socket) {
+    boost::system::error_code error;
+    boost::asio::ip::tcp::endpoint remote=socket.remote_endpoint(error);
+    return error?boost::asio::ip::address():remote.address();
+}
+}
 
 
 void triggerMultiplexedConnectionError(MultiplexedSocket*socket,ASIOSocketWrapper*wrapper,const boost::system::error_code &error){
@@ -51,23 +70,21 @@ void triggerMultiplexedConnectionError(MultiplexedSocket*socket,ASIOSocketWrappe
 
 void MultiplexedSocket::ioReactorThreadCommitCallback(StreamIDCallbackPair& newcallback){
     if (newcallback.mCallback==NULL) {
-        //make sure that a new substream callback won't be sent for outstanding closing streams
-        mOneSidedClosingStreams.insert(newcallback.mID);
-        CallbackMap::iterator where=mCallbacks.find(newcallback.mID);
-        if (where!=mCallbacks.end()) {
-            delete where->second;
-            mCallbacks.erase(where);
-        }else {
-            assert("ERROR in finding callback to erase for stream ID"&&false);
+        TCPStream::Callbacks*callbacks=mCallbacks.remove(newcallback.mID);
+        if (callbacks) {
+            //make sure that a new substream callback won't be sent for outstanding closing streams
+            mOneSidedClosingStreams.insert(newcallback.mID);
+            delete callbacks;
         }
+        //otherwise the other side's close crossed ours and already shut the stream down, leaving our close nothing to wait on
     }else {
-        mCallbacks.insert(newcallback.pair());
+        if (mCallbacks.get(newcallback.mID)==NULL)
+            mCallbacks.set(newcallback.mID,newcallback.mCallback);
     }
 }
 
 bool MultiplexedSocket::CommitCallbacks(std::deque<StreamIDCallbackPair> &registration, SocketConnectionPhase status, bool setConnectedStatus) {
-    static boost::thread::id reactorThread=boost::this_thread::get_id();
-    assert(boost::this_thread::get_id()==reactorThread);//this function must happen from the IO reactor so it can copy over registrations without a lock
+    //this function must happen from within mStrand so it can copy over registrations without a lock
     bool statusChanged=false;
     if (setConnectedStatus||!mCallbackRegistration.empty()) {
         if (status==CONNECTED) {
@@ -106,42 +123,305 @@ bool MultiplexedSocket::CommitCallbacks(std::deque<StreamIDCallbackPair> &regist
     return statusChanged;
 }
 
+size_t MultiplexedSocket::leastOutstandingStreamStrategy(const std::vector<ASIOSocketWrapper>&sockets, size_t numSockets, uint32 rotation) {
+    //the first socket belongs to the original handshake, so it is always active
+    size_t retval=0;
+    bool found=false;
+    uint32 leastOutstanding=0;
+    for (size_t i=0;i<numSockets&&!(found&&leastOutstanding==0);++i) {
+        size_t which=(rotation+i)%numSockets;
+        if (!sockets[which].isActive())
+            continue;
+        uint32 outstanding=sockets[which].getOutstandingBytes();
+        if (!found||outstanding<leastOutstanding) {
+            found=true;
+            leastOutstanding=outstanding;
+            retval=which;
+        }
+    }
+    return retval;
+}
+size_t MultiplexedSocket::randomStreamStrategy(const std::vector<ASIOSocketWrapper>&sockets, size_t numSockets, uint32 rotation) {
+    size_t start=rand()%numSockets;
+    for (size_t i=0;i<numSockets;++i) {
+        size_t which=(start+i)%numSockets;
+        if (sockets[which].isActive())
+            return which;
+    }
+    return 0;
+}
 size_t MultiplexedSocket::leastBusyStream() {
-        ///FIXME look at bytes to be sent or recently used, etc
-        return rand()%mSockets.size();
- }
+    size_t numSockets=mNumSockets.read();
+    size_t retval=mStreamSelectionStrategy(mSockets,numSockets,mStreamSelectionRotation++);
+    assert(retval<numSockets);
+    return retval;
+}
+void MultiplexedSocket::setUnreliableDropThresholds(uint32 lowWater, uint32 highWater, const Task::DeltaTime&stallStart, const Task::DeltaTime&stallLimit) {
+    mUnreliableDropLowWater=lowWater;
+    mUnreliableDropHighWater=highWater>lowWater?highWater:lowWater+1;
+    mUnreliableStallStart=stallStart;
+    mUnreliableStallLimit=stallStart<stallLimit?stallLimit:stallStart+Task::DeltaTime::milliseconds(1.0);
+}
 float MultiplexedSocket::dropChance(const Chunk*data,size_t whichStream) {
-    return .25;
+    const ASIOSocketWrapper&socket=mSockets[whichStream];
+    uint32 outstanding=socket.getOutstandingBytes()+(uint32)data->size();
+    float retval=0;
+    if (outstanding>mUnreliableDropLowWater) {
+        if (outstanding>=mUnreliableDropHighWater)
+            return 1.0;
+        retval=(outstanding-mUnreliableDropLowWater)/(float)(mUnreliableDropHighWater-mUnreliableDropLowWater);
+    }
+    Task::DeltaTime stall=socket.getSendStallTime(Task::AbsTime::now());
+    if (mUnreliableStallStart<stall) {
+        if (!(stall<mUnreliableStallLimit))
+            return 1.0;
+        float stallChance=(float)((double)(stall-mUnreliableStallStart)/(double)(mUnreliableStallLimit-mUnreliableStallStart));
+        if (stallChance>retval)
+            retval=stallChance;
+    }
+    return retval;
 }
 
+void MultiplexedSocket::setPriorityScheduling(bool strict, const uint32 weights[TCPStream::NumStreamPriorities]) {
+    mStrictPriority=strict;
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        mPriorityWeights[i]=weights[i]?weights[i]:1;
+    }
+}
+void MultiplexedSocket::setGatherLimits(unsigned int maxBuffers, size_t maxBytes) {
+    mMaxGatherBuffers=maxBuffers?maxBuffers:1;
+    mMaxGatherBytes=maxBytes?maxBytes:1;
+    for (unsigned int i=0,ie=mNumSockets.read();i<ie;++i) {
+        mSockets[i].setGatherLimits(mMaxGatherBuffers,mMaxGatherBytes);
+    }
+}
+void MultiplexedSocket::setSendWatermarks(uint32 lowWater, uint32 highWater) {
+    mSendLowWater=lowWater;
+    mSendHighWater=highWater<lowWater?lowWater:highWater;
+}
+uint32 MultiplexedSocket::getOutstandingBytes()const {
+    uint32 retval=0;
+    for (unsigned int i=0,ie=mNumSockets.read();i<ie;++i) {
+        retval+=mSockets[i].getOutstandingBytes();
+    }
+    return retval;
+}
+uint32 MultiplexedSocket::getStalePacketsDiscarded()const {
+    uint32 retval=0;
+    for (unsigned int i=0,ie=mNumSockets.read();i<ie;++i) {
+        retval+=mSockets[i].getStalePackets();
+    }
+    return retval;
+}
+TCPStream::ConnectionStatistics MultiplexedSocket::getConnectionStatistics()const {
+    TCPStream::ConnectionStatistics retval;
+    retval.mTraffic=mTraffic.read();
+    retval.mMaxQueuedBytes=0;
+    retval.mHandlerHeapAllocations=0;
+    retval.mSocketOptionsApplied=mSocketOptions.requested();
+    bool anyActive=false;
+    retval.mSendBufferSize=retval.mReceiveBufferSize=0;
+    for (unsigned int i=0,ie=mNumSockets.read();i<ie;++i) {
+        retval.mHandlerHeapAllocations+=mSockets[i].getHandlerHeapAllocations();
+        if (mSockets[i].isActive()) {
+            retval.mSocketOptionsApplied&=mSockets[i].getSocketOptionsApplied();
+            uint32 sendBufferSize=mSockets[i].getSendBufferSize(),receiveBufferSize=mSockets[i].getReceiveBufferSize();
+            if (!anyActive||sendBufferSize<retval.mSendBufferSize)
+                retval.mSendBufferSize=sendBufferSize;
+            if (!anyActive||receiveBufferSize<retval.mReceiveBufferSize)
+                retval.mReceiveBufferSize=receiveBufferSize;
+            anyActive=true;
+        }
+        uint32 maxQueued=mSockets[i].getMaxQueuedBytes();
+        if (maxQueued>retval.mMaxQueuedBytes)
+            retval.mMaxQueuedBytes=maxQueued;
+        mSockets[i].readLatencies(retval.mQueueLatency,retval.mSendLatency);
+    }
+    return retval;
+}
+unsigned int MultiplexedSocket::numActiveSockets()const {
+    unsigned int retval=0;
+    for (unsigned int i=0,ie=mNumSockets.read();i<ie;++i) {
+        if (mSockets[i].isActive())
+            ++retval;
+    }
+    return retval;
+}
+void MultiplexedSocket::waitForWritable(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const std::tr1::shared_ptr<TCPStream::WritableWaiter>&waiter) {
+    if (waiter->mWaiting.compareAndSwap(0,1)) {
+        thus->mWritableWaiters.push(waiter);
+    }
+    //the backlog may have drained before the waiter was pushed, in which case no finishing send will look for it
+    if (thus->getOutstandingBytes()<=thus->mSendLowWater.read()) {
+        thus->mStrand.post(std::tr1::bind(&MultiplexedSocket::notifyWritable,thus));
+    }
+}
+void MultiplexedSocket::flush(const std::tr1::shared_ptr<MultiplexedSocket>&thus) {
+    for (unsigned int i=0,ie=thus->mNumSockets.read();i<ie;++i) {
+        thus->mSockets[i].flush(thus);
+    }
+}
+void MultiplexedSocket::notifyWritable() {
+    if (mWritableWaiters.probablyEmpty()||getOutstandingBytes()>mSendLowWater.read())
+        return;
+    std::deque<std::tr1::weak_ptr<TCPStream::WritableWaiter> > waiting;
+    mWritableWaiters.swap(waiting);
+    for (std::deque<std::tr1::weak_ptr<TCPStream::WritableWaiter> >::iterator i=waiting.begin(),ie=waiting.end();i!=ie;++i) {
+        std::tr1::shared_ptr<TCPStream::WritableWaiter> waiter=i->lock();
+        if (waiter) {
+            //cleared first so a callback that is refused again waits anew
+            waiter->mWaiting=0;
+            if (waiter->mCallback)
+                waiter->mCallback();
+        }
+    }
+}
+uint64 MultiplexedSocket::getPriorityBytesSent(int priority)const {
+    uint64 retval=0;
+    for (unsigned int i=0,ie=mNumSockets.read();i<ie;++i) {
+        retval+=mSockets[i].getPriorityBytesSent(priority);
+    }
+    return retval;
+}
+int MultiplexedSocket::getStreamPriority(const Stream::StreamID&id)const {
+    TCPStream::Callbacks*callbacks=mCallbacks.get(id);
+    if (callbacks&&callbacks->mPriority) {
+        return callbacks->mPriority->read();
+    }
+    return TCPStream::DefaultPriority;
+}
 void MultiplexedSocket::sendBytesNow(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const RawRequest&data) {
-    TCPSSTLOG(this,"sendnow",&*data.data->begin(),data.data->size(),false);
-    TCPSSTLOG(this,"sendnow","\n",1,false);
     static Stream::StreamID::Hasher hasher;
     if (data.originStream==Stream::StreamID()) {
-        unsigned int socket_size=(unsigned int)thus->mSockets.size();
-        for(unsigned int i=1;i<socket_size;++i) {                
-            thus->mSockets[i].rawSend(thus,new Chunk(*data.data));
-        }
-        thus->mSockets[0].rawSend(thus,data.data);
+        broadcastControlPacket(thus,data);
     }else {
-        size_t whichStream=data.unordered?thus->leastBusyStream():hasher(data.originStream)%thus->mSockets.size();
-        if (data.unreliable==false||rand()/(float)RAND_MAX>thus->dropChance(data.data,whichStream)) {
-            thus->mSockets[whichStream].rawSend(thus,data.data);
-        }        
+        if (data.datagram&&thus->sendDatagram(data)) {
+            data.data->unref();
+            return;
+        }
+        //ordered packets that are not sequenced stay on the sockets of the original handshake, which are never retired,
+        //as do packets that may replace one another, so that a replacement always lands in the same queue as what it replaces
+        size_t whichStream=hasher(data.originStream)%thus->mBaseSockets;
+        if (data.firstSocket||thus->mSockets[whichStream].getConnectionState()==ASIOSocketWrapper::CONNECTION_JOINING) {
+            //the stream's socket has yet to join a connection that started early
+            whichStream=0;
+        }
+        bool addedSocket=false;
+        if ((data.unordered&&!data.data->getReplaceKey())||data.striped) {
+            size_t leastBusy=thus->leastBusyStream();
+            if (leastBusy<thus->mBaseSockets) {
+                whichStream=leastBusy;
+            }else if (thus->mSockets[leastBusy].beginSend()) {
+                whichStream=leastBusy;
+                addedSocket=true;
+            }
+        }
+        bool drop=false;
+        if (data.unreliable) {
+            float chance=thus->dropChance(data.data,whichStream);
+            drop=chance>=1.0||(chance>0&&rand()/(float)RAND_MAX<chance);
+        }
+        if (!drop) {
+            thus->mSockets[whichStream].rawSend(thus,data.data,data.priority);
+        }else {
+            data.data->unref();
+        }
+        if (addedSocket)
+            thus->mSockets[whichStream].endSend();
+    }
+}
+
+namespace {
+///Copies a framed control packet with a uint30 appended to its data
+PacketBuffer*appendToControlPacket(const PacketBuffer*packet,uint32 value) {
+    Stream::uint30 packetLength;
+    unsigned int lengthLength=(unsigned int)packet->size();
+    packetLength.unserialize(&*packet->begin(),lengthLength);
+    uint8 valueBytes[Stream::uint30::MAX_SERIALIZED_LENGTH];
+    unsigned int valueLength=Stream::uint30(value).serialize(valueBytes,Stream::uint30::MAX_SERIALIZED_LENGTH);
+    uint8 newLengthBytes[Stream::uint30::MAX_SERIALIZED_LENGTH];
+    unsigned int newLengthLength=Stream::uint30(packetLength.read()+valueLength).serialize(newLengthBytes,Stream::uint30::MAX_SERIALIZED_LENGTH);
+    PacketBuffer*retval=PacketBuffer::allocate(newLengthLength+packetLength.read()+valueLength);
+    uint8*output=&*retval->begin();
+    std::memcpy(output,newLengthBytes,newLengthLength);
+    std::memcpy(output+newLengthLength,&*packet->begin()+lengthLength,packetLength.read());
+    std::memcpy(output+newLengthLength+packetLength.read(),valueBytes,valueLength);
+    return retval;
+}
+}
+
+void MultiplexedSocket::broadcastControlPacket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const RawRequest&data) {
+    boost::lock_guard<boost::mutex> retireLock(thus->mRetireMutex);
+    if (thus->mUnacknowledgedRetires||thus->mJoiningBaseSockets.read()) {
+        //the other side must receive everything sent on the retiring sockets before it can count this packet,
+        //and counts it on every socket of the handshake
+        thus->mHeldControlPackets.push_back(data);
+        return;
+    }
+    //no socket may begin retiring while the lock is held, but sockets may still become active
+    std::vector<unsigned int> activeSockets;
+    for (unsigned int i=1,ie=thus->mNumSockets.read();i<ie;++i) {
+        if (thus->mSockets[i].isActive())
+            activeSockets.push_back(i);
+    }
+    PacketBuffer*packet=data.data;
+    if (thus->canResize()) {
+        packet=appendToControlPacket(data.data,(uint32)activeSockets.size()+1);
+        data.data->unref();
+    }
+    //the first socket stamps the packet before the others may read it, and the reference held here keeps it alive
+    //should that socket send it at once
+    packet->ref();
+    thus->mSockets[0].rawSend(thus,packet,data.priority);
+    for (std::vector<unsigned int>::const_iterator i=activeSockets.begin(),ie=activeSockets.end();i!=ie;++i) {
+        thus->mSockets[*i].rawSendShared(thus,packet,data.priority);
     }
+    packet->unref();
 }
 
+bool MultiplexedSocket::sendDatagram(const RawRequest&data) {
+    if (!mDatagramChannel||(mRemoteCapabilities.read()&TCPStream::TCPStreamCapableOfDatagrams)==0)
+        return false;
+    Stream::uint30 packetLength;
+    unsigned int lengthLength=(unsigned int)data.data->size();
+    if (!packetLength.unserialize(&*data.data->begin(),lengthLength))
+        return false;
+    if (!mDatagramChannel->send(mDatagramKey,&*data.data->begin()+lengthLength,data.data->size()-lengthLength))
+        return false;
+    ++mDatagramsSent;
+    return true;
+}
+void MultiplexedSocket::setDatagramChannel(const std::tr1::shared_ptr<ASIODatagramChannel>&channel, const boost::asio::ip::address&peerAddress) {
+    if (channel) {
+        mDatagramChannel=channel;
+        channel->addPeer(mDatagramKey,getWeakPtr(),peerAddress);
+    }
+}
+uint32 MultiplexedSocket::getLocalCapabilities()const {
+    uint32 retval=TCPStream::TCPStreamCapableOfFragments|TCPStream::TCPStreamCapableOfSequencing|TCPStream::TCPStreamCapableOfCompression|TCPStream::TCPStreamCapableOfResizing;
+    if (mDatagramChannel)
+        retval|=TCPStream::TCPStreamCapableOfDatagrams;
+    return retval;
+}
 
-void MultiplexedSocket::closeStream(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Stream::StreamID&sid,TCPStream::TCPStreamControlCodes code) {
+void MultiplexedSocket::closeStream(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Stream::StreamID&sid,TCPStream::TCPStreamControlCodes code,int priority) {
     RawRequest closeRequest;
     closeRequest.originStream=Stream::StreamID();//control packet
+    closeRequest.priority=priority;//must trail the stream's own data in its class
     closeRequest.unordered=false;
     closeRequest.unreliable=false;
+    closeRequest.striped=false;
+    closeRequest.datagram=false;
+    closeRequest.firstSocket=false;
     closeRequest.data=ASIOSocketWrapper::constructControlPacket(code,sid);
     sendBytes(thus,closeRequest);
 }
 
+void MultiplexedSocket::rejectStream(const Stream::StreamID&sid) {
+    //the acknowledgement finishes the stream as it does one closed by TCPStream::close
+    mOneSidedClosingStreams.insert(sid);
+    closeStream(getSharedPtr(),sid);
+}
 
 void MultiplexedSocket::sendBytes(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const RawRequest&data) {
     if (thus->mSocketConnectionPhase==CONNECTED) {
@@ -155,14 +435,10 @@ void MultiplexedSocket::sendBytes(const std::tr1::shared_ptr<MultiplexedSocket>&
             }else if(thus->mSocketConnectionPhase==DISCONNECTED) {
                 //retval=false;
                 //FIXME is this the correct thing to do?
-                TCPSSTLOG(this,"sendnvr",&*data.data->begin(),data.data->size(),false);                
-                TCPSSTLOG(this,"sendnvr","\n",1,false);
                 thus->mNewRequests.push_back(data);
             }else {
                 //with the connectionMutex acquired, no socket is allowed to be in the mSocketConnectionPhase
                 assert(thus->mSocketConnectionPhase==PRECONNECTION);
-                TCPSSTLOG(this,"sendl8r",&*data.data->begin(),data.data->size(),false);
-                TCPSSTLOG(this,"sendl8r","\n",1,false);
                 thus->mNewRequests.push_back(data);
             }
         }
@@ -190,28 +466,108 @@ Stream::StreamID MultiplexedSocket::getNewID() {
     assert(retval>1);
     return Stream::StreamID(retval);
 }
-MultiplexedSocket::MultiplexedSocket(IOService*io, const Stream::SubstreamCallback&substreamCallback):mIO(io),mNewSubstreamCallback(substreamCallback),mHighestStreamID(1) {
+void MultiplexedSocket::initPriorityScheduling() {
+    //each class gets twice the share of the class after it
+    uint32 weights[TCPStream::NumStreamPriorities];
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        weights[i]=1<<(TCPStream::NumStreamPriorities-1-i);
+    }
+    setPriorityScheduling(false,weights);
+}
+MultiplexedSocket::MultiplexedSocket(IOService*io, const Stream::SubstreamCallback&substreamCallback):mIO(io),mStrand(*io),mNewSubstreamCallback(substreamCallback),mHighestStreamID(1),mStreamSelectionStrategy(&MultiplexedSocket::leastOutstandingStreamStrategy),mStreamSelectionRotation(0),
+     mUnreliableDropLowWater(DEFAULT_UNRELIABLE_DROP_LOW_WATER),mUnreliableDropHighWater(DEFAULT_UNRELIABLE_DROP_HIGH_WATER),
+     mUnreliableStallStart(Task::DeltaTime::milliseconds(50.0)),mUnreliableStallLimit(Task::DeltaTime::milliseconds(500.0)),
+     mCorkWindow(0.0),mCorkBytes(DEFAULT_CORK_BYTES),
+     mCanAddSockets(false),mMaxAdaptiveSockets(0),mAdaptiveTimer(NULL),mAdaptiveBytesSent(0),mAdaptiveBytesReceived(0),mBackloggedChecks(0),mUnacknowledgedRetires(0),mStatisticsTimer(NULL),mStatisticsPeriod(0.0),mPacketTrace(NULL),mSharedIdleTimeout(0.0),mSharedIdleTimer(NULL) {
     mSocketConnectionPhase=PRECONNECTION;
+    mNumSockets=0;
+    mBaseSockets=0;
+    mJoiningBaseSockets=0;
+    initPriorityScheduling();
+    mRemoteCapabilities=0;
+    mFragmentSize=DEFAULT_FRAGMENT_SIZE;
+    mMaxGatherBuffers=ASIOSocketWrapper::DEFAULT_MAX_GATHER_BUFFERS;
+    mMaxGatherBytes=ASIOSocketWrapper::DEFAULT_MAX_GATHER_BYTES;
+    mMaxReorderPackets=DEFAULT_MAX_REORDER_PACKETS;
+    mReorderedPackets=0;
+    mReorderDepth=0;
+    mMaxReorderDepth=0;
+    mReorderOverflows=0;
+    mSendHighWater=DEFAULT_SEND_HIGH_WATER;
+    mSendLowWater=DEFAULT_SEND_LOW_WATER;
+    mDatagramsSent=0;
 }
-MultiplexedSocket::MultiplexedSocket(IOService*io,const UUID&uuid,const std::vector<TCPSocket*>&sockets, const Stream::SubstreamCallback &substreamCallback)
+MultiplexedSocket::MultiplexedSocket(IOService*io,const UUID&uuid,const std::vector<TCPSocket*>&sockets, unsigned int baseSockets, const Stream::SubstreamCallback &substreamCallback)
     : mIO(io),
+     mStrand(*io),
      mNewSubstreamCallback(substreamCallback),
-     mHighestStreamID(0) {
+     mHighestStreamID(0),
+     mStreamSelectionStrategy(&MultiplexedSocket::leastOutstandingStreamStrategy),
+     mStreamSelectionRotation(0),
+     mUnreliableDropLowWater(DEFAULT_UNRELIABLE_DROP_LOW_WATER),
+     mUnreliableDropHighWater(DEFAULT_UNRELIABLE_DROP_HIGH_WATER),
+     mUnreliableStallStart(Task::DeltaTime::milliseconds(50.0)),
+     mUnreliableStallLimit(Task::DeltaTime::milliseconds(500.0)),
+     mCorkWindow(0.0),
+     mCorkBytes(DEFAULT_CORK_BYTES),
+     mDatagramKey(uuid),
+     mCanAddSockets(false),
+     mMaxAdaptiveSockets(0),
+     mAdaptiveTimer(NULL),
+     mAdaptiveBytesSent(0),
+     mAdaptiveBytesReceived(0),
+     mBackloggedChecks(0),
+     mUnacknowledgedRetires(0),
+     mStatisticsTimer(NULL),
+     mStatisticsPeriod(0.0),
+     mPacketTrace(NULL),
+     mSharedIdleTimeout(0.0),
+     mSharedIdleTimer(NULL) {
     mSocketConnectionPhase=PRECONNECTION;
+    initPriorityScheduling();
+    mRemoteCapabilities=0;
+    mFragmentSize=DEFAULT_FRAGMENT_SIZE;
+    mMaxGatherBuffers=ASIOSocketWrapper::DEFAULT_MAX_GATHER_BUFFERS;
+    mMaxGatherBytes=ASIOSocketWrapper::DEFAULT_MAX_GATHER_BYTES;
+    mMaxReorderPackets=DEFAULT_MAX_REORDER_PACKETS;
+    mReorderedPackets=0;
+    mReorderDepth=0;
+    mMaxReorderDepth=0;
+    mReorderOverflows=0;
+    mSendHighWater=DEFAULT_SEND_HIGH_WATER;
+    mSendLowWater=DEFAULT_SEND_LOW_WATER;
+    mDatagramsSent=0;
+    if (baseSockets<sockets.size())
+        baseSockets=(unsigned int)sockets.size();
+    mSockets.reserve(baseSockets>MAX_CONNECTIONS?baseSockets:MAX_CONNECTIONS);
     for (unsigned int i=0;i<(unsigned int)sockets.size();++i) {
         mSockets.push_back(ASIOSocketWrapper(sockets[i]));
     }
+    //the rest of the handshake has yet to arrive: nothing is sent on their places until it does
+    for (unsigned int i=(unsigned int)sockets.size();i<baseSockets;++i) {
+        mSockets.push_back(ASIOSocketWrapper());
+        mSockets.back().createSocket(*io);
+        mSockets.back().setConnectionState(ASIOSocketWrapper::CONNECTION_JOINING);
+    }
+    if (!sockets.empty())
+        mPeerAddress=peerAddress(*sockets[0]);
+    mBaseSockets=baseSockets;
+    mJoiningBaseSockets=baseSockets-(unsigned int)sockets.size();
+    mNumSockets=mBaseSockets;
 }
 void MultiplexedSocket::sendAllProtocolHeaders(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const UUID&syncedUUID) {
-    unsigned int numSockets=(unsigned int)thus->mSockets.size();
+    thus->mHandshakeUUID=syncedUUID;
     for (std::vector<ASIOSocketWrapper>::iterator i=thus->mSockets.begin(),ie=thus->mSockets.end();i!=ie;++i) {
-        i->sendProtocolHeader(thus,syncedUUID,numSockets);
+        if (i->isActive())
+            i->sendProtocolHeader(thus,syncedUUID,thus->mBaseSockets);
     }
     boost::lock_guard<boost::mutex> connectingMutex(sConnectingMutex);
     thus->mSocketConnectionPhase=CONNECTED;
     for (unsigned int i=0,ie=thus->mSockets.size();i!=ie;++i) {
-        MakeASIOReadBuffer(thus,i);
+        if (thus->mSockets[i].isActive())
+            MakeASIOReadBuffer(thus,i);
     }
+    thus->startJoinTimer();
     assert (thus->mNewRequests.size()==0);//would otherwise need to empty out new requests--but no one should have a reference to us here
 }
 ///erase all sockets and callbacks since the refcount is now zero;
@@ -220,6 +576,9 @@ MultiplexedSocket::~MultiplexedSocket() {
     mNewSubstreamCallback=&Stream::ignoreSubstreamCallback;
     TCPSetCallbacks setCallbackFunctor(this,NULL);        
     callbackToBeDeleted(NULL,setCallbackFunctor);
+    delete mAdaptiveTimer;
+    delete mStatisticsTimer;
+    delete mSharedIdleTimer;
     for (unsigned int i=0;i<(unsigned int)mSockets.size();++i){
         mSockets[i].shutdownAndClose();
     }        
@@ -228,118 +587,309 @@ MultiplexedSocket::~MultiplexedSocket() {
         mSockets[i].destroySocket();
     }
     mSockets.clear();
+    delete mPacketTrace.read();
     
     while (!mCallbackRegistration.empty()){
         delete mCallbackRegistration.front().mCallback;
         mCallbackRegistration.pop_front();
     }
     for (size_t i=0;i<mNewRequests.size();++i) {
-        delete mNewRequests[i].data;
+        mNewRequests[i].data->unref();
     }
     mNewRequests.clear();
-    while(!mCallbacks.empty()) {
-        delete mCallbacks.begin()->second;
-        mCallbacks.erase(mCallbacks.begin());
-    }    
+    for (size_t i=0;i<mHeldControlPackets.size();++i) {
+        mHeldControlPackets[i].data->unref();
+    }
+    mHeldControlPackets.clear();
+    for (CallbackMap::const_iterator i=mCallbacks.begin(),ie=mCallbacks.end();i!=ie;++i) {
+        delete i.value();
+    }
+    for (ReorderBufferMap::const_iterator i=mReorderBuffers.begin(),ie=mReorderBuffers.end();i!=ie;++i) {
+        delete i.value();
+    }
+    if (mDatagramChannel) {
+        mDatagramChannel->removePeer(mDatagramKey);
+    }
 }
 
 void MultiplexedSocket::shutDownClosedStream(unsigned int controlCode,const Stream::StreamID &id) {
+    std::tr1::unordered_set<Stream::StreamID>::iterator where=mOneSidedClosingStreams.find(id);
+    bool awaitingAck=(where!=mOneSidedClosingStreams.end());
     if (controlCode==TCPStream::TCPStreamCloseStream){
         std::deque<StreamIDCallbackPair> registrations;
         CommitCallbacks(registrations,CONNECTED,false);
-        CallbackMap::iterator where=mCallbacks.find(id);
-        if (where!=mCallbacks.end()) {
-            std::tr1::shared_ptr<AtomicValue<int> > sendStatus=where->second->mSendStatus.lock();
+        TCPStream::Callbacks*callbacks=mCallbacks.get(id);
+        if (callbacks) {
+            std::tr1::shared_ptr<AtomicValue<int> > sendStatus=callbacks->mSendStatus.lock();
             if (sendStatus) {
                 TCPStream::closeSendStatus(*sendStatus);
             }
-            where->second->mConnectionCallback(Stream::Disconnected,"Remote Host Disconnected");
+            callbacks->mConnectionCallback(Stream::Disconnected,"Remote Host Disconnected");
             
             CommitCallbacks(registrations,CONNECTED,false);//just in case stream committed new callbacks during callback
-            where=mCallbacks.find(id);
-            delete where->second;
-            mCallbacks.erase(where);
+            delete mCallbacks.remove(id);
         }                                    
+        if (awaitingAck) {
+            //both sides closed the stream at once: it is done once our own close is acknowledged as well
+            return;
+        }
+    }else if (!awaitingAck) {
+        //acknowledges a close of ours that crossed the other side's, which already finished the stream
+        return;
     }
-    std::tr1::unordered_set<Stream::StreamID>::iterator where=mOneSidedClosingStreams.find(id);
-    if (where!=mOneSidedClosingStreams.end()) {
+    ReorderBuffer*reorder=mReorderBuffers.remove(id);
+    if (reorder) {
+        //every socket has passed the close, so nothing held back can ever be delivered in order
+        if (!reorder->mWaiting.empty()) {
+            SILOG(tcpsst,warning,"Discarding "<<reorder->mWaiting.size()<<" held back packets of closed stream "<<id.read());
+            mReorderDepth-=(uint32)reorder->mWaiting.size();
+        }
+        delete reorder;
+    }
+    if (awaitingAck) {
         mOneSidedClosingStreams.erase(where);
     }
     if (id.odd()==((mHighestStreamID.read()&1)?true:false)) {
         mFreeStreamIDs.push(id);
     }
 }
-void MultiplexedSocket::receiveFullChunk(unsigned int whichSocket, Stream::StreamID id,const Chunk&newChunk){
+void MultiplexedSocket::receiveFullChunk(unsigned int whichSocket, Stream::StreamID id,const PacketView&newChunk){
     if (id==Stream::StreamID()) {//control packet
         if(newChunk.size()) {
             unsigned int controlCode=*newChunk.begin();
             switch (controlCode) {
               case TCPStream::TCPStreamCloseStream:
               case TCPStream::TCPStreamAckCloseStream:
+                {
+                //a side that may add and retire sockets says how many sockets it sent the packet on
+                unsigned int expectedSockets=mBaseSockets;
                 if (newChunk.size()>1) {
                     unsigned int avail_len=newChunk.size()-1;
                     id.unserialize((const uint8*)&(newChunk[1]),avail_len);
                     if (avail_len+1>newChunk.size()) {
                         SILOG(tcpsst,warning,"Control Chunk too short");
+                    }else if (avail_len+1<newChunk.size()) {
+                        Stream::uint30 numSockets;
+                        unsigned int countLength=newChunk.size()-1-avail_len;
+                        if (numSockets.unserialize((const uint8*)&(newChunk[1+avail_len]),countLength)&&numSockets.read())
+                            expectedSockets=numSockets.read();
                     }
                 }
                 if (id!=Stream::StreamID()) {
-                    std::tr1::unordered_map<Stream::StreamID,unsigned int>::iterator where=mAckedClosingStreams.find(id);
-                    if (where!=mAckedClosingStreams.end()){
-                        where->second++;
-                        int how_much=where->second;
-                        if (where->second==mSockets.size()) {
-                            mAckedClosingStreams.erase(where);        
-                            shutDownClosedStream(controlCode,id);
-                            if (controlCode==TCPStream::TCPStreamCloseStream) {
-                                closeStream(getSharedPtr(),id,TCPStream::TCPStreamAckCloseStream);
-                            }
+                    //the acknowledgement follows the stream's data in its class, so callbacks it registered since the last packet must be in place
+                    std::deque<StreamIDCallbackPair> registrations;
+                    CommitCallbacks(registrations,CONNECTED,false);
+                    std::pair<unsigned int,unsigned int>&arrived=mAckedClosingStreams[id];
+                    unsigned int&count=controlCode==TCPStream::TCPStreamCloseStream?arrived.first:arrived.second;
+                    if (++count>=expectedSockets) {
+                        count=0;
+                        if (arrived.first==0&&arrived.second==0)
+                            mAckedClosingStreams.erase(id);
+                        int priority=getStreamPriority(id);
+                        shutDownClosedStream(controlCode,id);
+                        if (controlCode==TCPStream::TCPStreamCloseStream) {
+                            closeStream(getSharedPtr(),id,TCPStream::TCPStreamAckCloseStream,priority);
                         }
-                    }else{
-                        if (mSockets.size()==1) {
-                            shutDownClosedStream(controlCode,id);
-                            if (controlCode==TCPStream::TCPStreamCloseStream) {
-                                closeStream(getSharedPtr(),id,TCPStream::TCPStreamAckCloseStream);
-                            }
-                        }else {
-                            mAckedClosingStreams[id]=1;
+                    }
+                }
+                }
+                break;
+              case TCPStream::TCPStreamRetireConnection:
+              case TCPStream::TCPStreamAckRetireConnection:
+              case TCPStream::TCPStreamAddConnection:
+                if (newChunk.size()>1) {
+                    Stream::uint30 value;
+                    unsigned int avail_len=newChunk.size()-1;
+                    if (value.unserialize((const uint8*)&(newChunk[1]),avail_len)) {
+                        receiveResizePacket(whichSocket,controlCode,value.read());
+                        break;
+                    }
+                }
+                SILOG(tcpsst,warning,"Resize Chunk too short");
+                break;
+              case TCPStream::TCPStreamCapabilities:
+                if (newChunk.size()>1) {
+                    Stream::uint30 capabilities;
+                    unsigned int avail_len=newChunk.size()-1;
+                    if (capabilities.unserialize((const uint8*)&(newChunk[1]),avail_len)) {
+                        mRemoteCapabilities=capabilities.read();
+                        if (mDatagramChannel&&(capabilities.read()&TCPStream::TCPStreamCapableOfDatagrams)) {
+                            mDatagramChannel->sendHello(mDatagramKey);
                         }
+                    }else {
+                        SILOG(tcpsst,warning,"Capabilities Chunk too short");
                     }
                 }
                 break;
+              case TCPStream::TCPStreamSequenced:
+                if (newChunk.size()>1) {
+                    unsigned int avail_len=newChunk.size()-1;
+                    Stream::uint30 sequence;
+                    if (id.unserialize((const uint8*)&(newChunk[1]),avail_len)&&id!=Stream::StreamID()) {
+                        size_t offset=1+avail_len;
+                        avail_len=newChunk.size()-offset;
+                        if (avail_len&&sequence.unserialize((const uint8*)&(newChunk[offset]),avail_len)) {
+                            offset+=avail_len;
+                            receiveSequencedChunk(id,sequence.read(),PacketView(newChunk,offset,newChunk.size()-offset));
+                            break;
+                        }
+                    }
+                }
+                SILOG(tcpsst,warning,"Sequenced Chunk too short");
+                break;
+              case TCPStream::TCPStreamCompressed:
+                {
+                    Stream::StreamID originalId;
+                    PacketView original;
+                    //only stream data and the sequenced packets carrying it are compressed: other control packets, compressed ones included, are refused
+                    if (decompressChunk(PacketView(newChunk,1,newChunk.size()-1),originalId,original)&&
+                        (originalId!=Stream::StreamID()||(original.size()>1&&original[0]==TCPStream::TCPStreamSequenced))) {
+                        receiveFullChunk(whichSocket,originalId,original);
+                        break;
+                    }
+                }
+                SILOG(tcpsst,warning,"Compressed Chunk corrupt");
+                break;
               default:
                 break;
             }
         }
     }else {
-        std::deque<StreamIDCallbackPair> registrations;
-        CommitCallbacks(registrations,CONNECTED,false);
-        CallbackMap::iterator where=mCallbacks.find(id);
-        if (where!=mCallbacks.end()) {
-            where->second->mBytesReceivedCallback(newChunk);
-        }else if (mOneSidedClosingStreams.find(id)==mOneSidedClosingStreams.end()) {
-            //new substream
-            TCPStream*newStream=new TCPStream(getSharedPtr(),id);
-            TCPSetCallbacks setCallbackFunctor(this,newStream);
-            mNewSubstreamCallback(newStream,setCallbackFunctor);
-            if (setCallbackFunctor.mCallbacks != NULL) {
-                CommitCallbacks(registrations,CONNECTED,false);//make sure bytes are received
-                setCallbackFunctor.mCallbacks->mBytesReceivedCallback(newChunk);
-            }else {
-                closeStream(getSharedPtr(),id);
-            }
+        deliverChunk(id,newChunk);
+    }
+}
+
+bool MultiplexedSocket::decompressChunk(const PacketView&compressed, Stream::StreamID&originalId, PacketView&original) {
+    //the StreamID only lets the sender fragment the packet as part of its stream: the original packet names it again
+    Stream::StreamID fragmentId;
+    unsigned int avail_len=(unsigned int)compressed.size();
+    if (avail_len==0||!fragmentId.unserialize(compressed.data(),avail_len))
+        return false;
+    size_t offset=avail_len;
+    avail_len=(unsigned int)(compressed.size()-offset);
+    Stream::uint30 uncompressedLength;
+    if (avail_len==0||!uncompressedLength.unserialize(compressed.data()+offset,avail_len))
+        return false;
+    offset+=avail_len;
+    //every two compressed bytes inflate to at most one match, so a length the data cannot reach is refused before allocating it
+    size_t compressedLength=compressed.size()-offset;
+    if (uncompressedLength.read()==0||uncompressedLength.read()>MAX_UNCOMPRESSED_LENGTH||
+        uncompressedLength.read()>compressedLength*(LZCompression::MAX_MATCH/2))
+        return false;
+    PacketBuffer*packet=PacketBuffer::allocate(uncompressedLength.read());
+    unsigned int idLength=(unsigned int)packet->size();
+    bool valid=LZCompression::decompress(compressed.data()+offset,compressedLength,&*packet->begin(),packet->size())
+        &&originalId.unserialize(&*packet->begin(),idLength);
+    if (valid)
+        original=PacketView(packet,idLength,packet->size()-idLength);
+    packet->unref();
+    return valid;
+}
+
+void MultiplexedSocket::receiveDatagram(const PacketView&datagram) {
+    Stream::StreamID id;
+    unsigned int idLength=(unsigned int)datagram.size();
+    if (!id.unserialize(datagram.data(),idLength))
+        return;
+    PacketView body(datagram,idLength,datagram.size()-idLength);
+    Stream::StreamID streamId=id;
+    if (id==Stream::StreamID()) {
+        //compressed stream data is the only control packet that may be sent in datagrams, which are never sequenced
+        if (body.size()<2||body[0]!=TCPStream::TCPStreamCompressed||
+            !decompressChunk(PacketView(body,1,body.size()-1),streamId,body)||streamId==Stream::StreamID())
+            return;
+    }
+    std::deque<StreamIDCallbackPair> registrations;
+    CommitCallbacks(registrations,CONNECTED,false);
+    //a datagram may outrace the packets opening or closing its stream, so it is only delivered to a stream that is open
+    if (mCallbacks.get(streamId)&&mOneSidedClosingStreams.find(streamId)==mOneSidedClosingStreams.end()) {
+        receiveFullChunk(0,streamId,body);
+    }
+}
+
+void MultiplexedSocket::deliverChunk(const Stream::StreamID&id,const PacketView&newChunk) {
+    mAdaptiveBytesReceived+=newChunk.size();
+    std::deque<StreamIDCallbackPair> registrations;
+    CommitCallbacks(registrations,CONNECTED,false);
+    mTraffic.countReceived(newChunk.size());
+    TCPStream::Callbacks*callbacks=mCallbacks.get(id);
+    if (callbacks) {
+        callbacks->mTraffic->countReceived(newChunk.size());
+        callbacks->mBytesReceivedCallback(newChunk);
+    }else if (mOneSidedClosingStreams.find(id)==mOneSidedClosingStreams.end()) {
+        //new substream
+        TCPStream*newStream=new TCPStream(getSharedPtr(),id);
+        TCPSetCallbacks setCallbackFunctor(this,newStream);
+        mNewSubstreamCallback(newStream,setCallbackFunctor);
+        if (setCallbackFunctor.mCallbacks != NULL) {
+            CommitCallbacks(registrations,CONNECTED,false);//make sure bytes are received
+            setCallbackFunctor.mCallbacks->mTraffic->countReceived(newChunk.size());
+            setCallbackFunctor.mCallbacks->mBytesReceivedCallback(newChunk);
         }else {
-            //IGNORED MESSAGE
+            rejectStream(id);
+        }
+    }else {
+        //IGNORED MESSAGE
+    }
+}
+
+void MultiplexedSocket::receiveSequencedChunk(const Stream::StreamID&id,uint32 sequence,const PacketView&newChunk) {
+    ReorderBuffer*reorder=mReorderBuffers.get(id);
+    if (!reorder) {
+        reorder=new ReorderBuffer;
+        mReorderBuffers.set(id,reorder);
+    }
+    uint32 distance=(sequence-reorder->mNextSequence)&SEQUENCE_MASK;
+    if (distance>=SEQUENCE_WINDOW) {
+        //a packet skipped over when the buffer overflowed: late is better than never
+        deliverChunk(id,newChunk);
+        return;
+    }
+    if (distance) {
+        reorder->mWaiting.insert(std::map<uint32,PacketView>::value_type(sequence,newChunk));
+        ++mReorderedPackets;
+        uint32 depth=++mReorderDepth;
+        uint32 maxDepth;
+        while (depth>(maxDepth=mMaxReorderDepth.read())&&!mMaxReorderDepth.compareAndSwap(maxDepth,depth)) {
         }
+        if (reorder->mWaiting.size()<=mMaxReorderPackets)
+            return;
+        //give up on the missing packet and resume from the earliest one held back, which is the next one after it modulo wraparound
+        std::map<uint32,PacketView>::iterator earliest=reorder->mWaiting.lower_bound(reorder->mNextSequence);
+        if (earliest==reorder->mWaiting.end())
+            earliest=reorder->mWaiting.begin();
+        SILOG(tcpsst,warning,"Reorder buffer for stream "<<id.read()<<" overflowed: skipping from packet "<<reorder->mNextSequence<<" to "<<earliest->first);
+        ++mReorderOverflows;
+        reorder->mNextSequence=earliest->first;
+    }else {
+        deliverChunk(id,newChunk);
+        reorder->mNextSequence=(reorder->mNextSequence+1)&SEQUENCE_MASK;
+    }
+    std::map<uint32,PacketView>::iterator next;
+    while ((next=reorder->mWaiting.find(reorder->mNextSequence))!=reorder->mWaiting.end()) {
+        PacketView nextChunk=next->second;
+        reorder->mWaiting.erase(next);
+        --mReorderDepth;
+        reorder->mNextSequence=(reorder->mNextSequence+1)&SEQUENCE_MASK;
+        deliverChunk(id,nextChunk);
     }
 }
+
+TCPStream::ReorderStatistics MultiplexedSocket::getReorderStatistics()const {
+    TCPStream::ReorderStatistics retval;
+    retval.mReorderedPackets=mReorderedPackets.read();
+    retval.mReorderDepth=mReorderDepth.read();
+    retval.mMaxReorderDepth=mMaxReorderDepth.read();
+    retval.mReorderOverflows=mReorderOverflows.read();
+    return retval;
+}
 void MultiplexedSocket::connectionFailureOrSuccessCallback(SocketConnectionPhase status, Stream::ConnectionStatus reportedProblem, const std::string&errorMessage) {
     Stream::ConnectionStatus stat=reportedProblem;
     std::deque<StreamIDCallbackPair> registrations;
     bool actuallyDoSend=CommitCallbacks(registrations,status,true);
     if (actuallyDoSend) {
-        for (CallbackMap::iterator i=mCallbacks.begin(),ie=mCallbacks.end();i!=ie;++i) {
-            i->second->mConnectionCallback(stat,errorMessage);
+        for (CallbackMap::const_iterator i=mCallbacks.begin(),ie=mCallbacks.end();i!=ie;++i) {
+            i.value()->mConnectionCallback(stat,errorMessage);
         }
     }else {
         //SILOG(tcpsst,debug,"Did not call callbacks because callback message already sent for "<<errorMessage);
@@ -355,29 +905,544 @@ void MultiplexedSocket::connectionFailedCallback(unsigned int whichSocket, const
 }
 
 void MultiplexedSocket::hostDisconnectedCallback(const std::string& error) {
-    
+    PacketTrace*trace=mPacketTrace.read();
+    if (trace)
+        trace->writeErrorTrace();
     connectionFailureOrSuccessCallback(DISCONNECTED,Stream::Disconnected,error);
 }
 void MultiplexedSocket::hostDisconnectedCallback(unsigned int whichSocket, const std::string& error) {
+    if (whichSocket>=mBaseSockets&&whichSocket<mSockets.size()) {
+        ASIOSocketWrapper&socket=mSockets[whichSocket];
+        if (socket.getConnectionState()==ASIOSocketWrapper::CONNECTION_RETIRING&&(socket.getRetireFlags()&ASIOSocketWrapper::RETIRE_RECEIVED)) {
+            //the other side had nothing more to send on a socket it was done with
+            socket.addRetireFlags(ASIOSocketWrapper::RETIRE_READ_CLOSED);
+            advanceRetirement(getSharedPtr(),whichSocket);
+            return;
+        }
+    }
     hostDisconnectedCallback(error);
     //FIXME do something with the socket specifically that failed.
 }
 
 
-void MultiplexedSocket::connect(const Address&address, unsigned int numSockets) {
+void MultiplexedSocket::connect(const Address&address, unsigned int numSockets, bool earlyConnect) {
     mSocketConnectionPhase=PRECONNECTION;
+    mSockets.reserve(numSockets>MAX_CONNECTIONS?numSockets:MAX_CONNECTIONS);
     mSockets.resize(numSockets);
+    mBaseSockets=numSockets;
+    mNumSockets=numSockets;
     for (unsigned int i=0;i<numSockets;++i) {
         mSockets[i].createSocket(getASIOService());
+        if (earlyConnect&&i)
+            mSockets[i].setConnectionState(ASIOSocketWrapper::CONNECTION_JOINING);
     }
+    mJoiningBaseSockets=earlyConnect?numSockets-1:0;
+    mDatagramKey=UUID::random();
     std::tr1::shared_ptr<ASIOConnectAndHandshake> 
         headerCheck(new ASIOConnectAndHandshake(getSharedPtr(),
-                                                UUID::random()));
+                                                mDatagramKey,
+                                                earlyConnect));
     //will notify connectionFailureOrSuccessCallback when resolved
     ASIOConnectAndHandshake::connect(headerCheck,address);
     
 }
 
+void MultiplexedSocket::setAdaptiveConnections(const std::tr1::shared_ptr<MultiplexedSocket>&thus, unsigned int maxSockets, uint32 growBacklog, uint32 idleBytesPerSecond) {
+    thus->mStrand.post(std::tr1::bind(&MultiplexedSocket::startAdapting,thus,maxSockets,growBacklog,idleBytesPerSecond));
+}
+
+void MultiplexedSocket::startAdapting(unsigned int maxSockets, uint32 growBacklog, uint32 idleBytesPerSecond) {
+    mMaxAdaptiveSockets=maxSockets<(unsigned int)MAX_CONNECTIONS?maxSockets:(unsigned int)MAX_CONNECTIONS;
+    mGrowBacklog=growBacklog?growBacklog:1;
+    mIdleBytesPerSecond=idleBytesPerSecond;
+    if (mAdaptiveTimer)
+        return;
+    mAdaptiveTimer=new IODeadlineTimer(*mIO);
+    mAdaptiveTimer->expires_from_now(boost::posix_time::milliseconds((int)ADAPTIVE_PERIOD_MILLISECONDS));
+    mAdaptiveTimer->async_wait(mStrand.wrap(std::tr1::bind(&MultiplexedSocket::adaptSockets,
+                                                           std::tr1::weak_ptr<MultiplexedSocket>(getSharedPtr()),
+                                                           _1)));
+}
+
+void MultiplexedSocket::adaptSockets(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,const boost::system::error_code&error) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=weakThus.lock();
+    if (!thus||error==boost::asio::error::operation_aborted||thus->mSocketConnectionPhase==DISCONNECTED)
+        return;
+    uint64 bytesSent=0;
+    for (int i=0;i<TCPStream::NumStreamPriorities;++i) {
+        bytesSent+=thus->getPriorityBytesSent(i);
+    }
+    //traffic in either direction keeps added sockets, since the other side may be the one sending over them
+    double bytesPerSecond=(double)(bytesSent-thus->mAdaptiveBytesSent+thus->mAdaptiveBytesReceived)*1000.0/ADAPTIVE_PERIOD_MILLISECONDS;
+    thus->mAdaptiveBytesSent=bytesSent;
+    thus->mAdaptiveBytesReceived=0;
+    if (thus->canResize()&&thus->mMaxAdaptiveSockets>thus->mBaseSockets) {
+        unsigned int active=0,joining=0,retirable=thus->mSockets.size();
+        for (unsigned int i=0,ie=thus->mSockets.size();i<ie;++i) {
+            switch (thus->mSockets[i].getConnectionState()) {
+              case ASIOSocketWrapper::CONNECTION_ACTIVE:
+                ++active;
+                if (i>=thus->mBaseSockets)
+                    retirable=i;
+                break;
+              case ASIOSocketWrapper::CONNECTION_JOINING:
+                ++joining;
+                break;
+              default:
+                break;
+            }
+        }
+        uint32 backlog=thus->getOutstandingBytes();
+        if (backlog>=thus->mGrowBacklog*active) {
+            ++thus->mBackloggedChecks;
+        }else {
+            thus->mBackloggedChecks=0;
+        }
+        if (thus->mBackloggedChecks>=2) {
+            thus->mBackloggedChecks=0;
+            if (joining==0&&active<thus->mMaxAdaptiveSockets) {
+                if (thus->mCanAddSockets) {
+                    addSocket(thus);
+                }else {
+                    thus->mSockets[0].sendControlPacket(thus,TCPStream::TCPStreamAddConnection,Stream::uint30(active+1));
+                }
+            }
+        }else if (backlog==0&&bytesPerSecond<thus->mIdleBytesPerSecond&&retirable<thus->mSockets.size()) {
+            retireSocket(thus,retirable);
+        }
+    }
+    thus->mAdaptiveTimer->expires_from_now(boost::posix_time::milliseconds((int)ADAPTIVE_PERIOD_MILLISECONDS));
+    thus->mAdaptiveTimer->async_wait(thus->mStrand.wrap(std::tr1::bind(&MultiplexedSocket::adaptSockets,weakThus,_1)));
+}
+
+void MultiplexedSocket::setPacketTrace(size_t capacity, const std::string&errorTraceFile) {
+    PacketTrace*trace=mPacketTrace.read();
+    if (trace==NULL) {
+        trace=new PacketTrace(capacity,errorTraceFile);
+        if (mPacketTrace.compareAndSwap(NULL,trace))
+            return;
+        //another thread started the trace first
+        delete trace;
+        trace=mPacketTrace.read();
+    }
+    trace->setErrorTraceFile(errorTraceFile);
+}
+
+void MultiplexedSocket::setStatisticsDump(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Task::DeltaTime&period) {
+    thus->mStrand.post(std::tr1::bind(&MultiplexedSocket::startStatisticsDump,thus,period));
+}
+
+void MultiplexedSocket::startStatisticsDump(const Task::DeltaTime&period) {
+    mStatisticsPeriod=period;
+    if (period.toMicro()<=0) {
+        if (mStatisticsTimer)
+            mStatisticsTimer->cancel();
+        return;
+    }
+    if (mStatisticsTimer==NULL)
+        mStatisticsTimer=new IODeadlineTimer(*mIO);
+    //a wait already under way is cancelled, so only the new period keeps logging
+    mStatisticsTimer->expires_from_now(boost::posix_time::microseconds(period.toMicro()));
+    mStatisticsTimer->async_wait(mStrand.wrap(std::tr1::bind(&MultiplexedSocket::dumpStatistics,
+                                                             std::tr1::weak_ptr<MultiplexedSocket>(getSharedPtr()),
+                                                             _1)));
+}
+
+void MultiplexedSocket::dumpStatistics(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,const boost::system::error_code&error) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=weakThus.lock();
+    if (!thus||error==boost::asio::error::operation_aborted||thus->mSocketConnectionPhase==DISCONNECTED)
+        return;
+    //streams opened since the last packet arrived are still waiting to be committed
+    std::deque<StreamIDCallbackPair> registrations;
+    thus->CommitCallbacks(registrations,CONNECTED,false);
+    TCPStream::ConnectionStatistics stats=thus->getConnectionStatistics();
+    SILOG(tcpsst,info,"Connection "<<thus->mDatagramKey.readableHexData()<<" over "<<thus->numActiveSockets()<<" sockets sent "
+          <<stats.mTraffic.mBytesSent<<" bytes in "<<stats.mTraffic.mPacketsSent<<" packets, received "
+          <<stats.mTraffic.mBytesReceived<<" bytes in "<<stats.mTraffic.mPacketsReceived<<" packets, queued at most "
+          <<stats.mMaxQueuedBytes<<" bytes, "<<stats.mHandlerHeapAllocations<<" handlers on the heap, socket options "<<TCPSocketOptions::describe(stats.mSocketOptionsApplied)<<" with buffers of "<<stats.mSendBufferSize<<"/"<<stats.mReceiveBufferSize<<" bytes; time queued: "<<stats.mQueueLatency<<"; send time: "<<stats.mSendLatency);
+    for (CallbackMap::const_iterator i=thus->mCallbacks.begin(),ie=thus->mCallbacks.end();i!=ie;++i) {
+        TrafficStatistics traffic=i.value()->mTraffic->read();
+        SILOG(tcpsst,info,"Stream "<<i.id().read()<<" sent "<<traffic.mBytesSent<<" bytes in "<<traffic.mPacketsSent
+              <<" packets, received "<<traffic.mBytesReceived<<" bytes in "<<traffic.mPacketsReceived<<" packets");
+    }
+    thus->mStatisticsTimer->expires_from_now(boost::posix_time::microseconds(thus->mStatisticsPeriod.toMicro()));
+    thus->mStatisticsTimer->async_wait(thus->mStrand.wrap(std::tr1::bind(&MultiplexedSocket::dumpStatistics,weakThus,_1)));
+}
+
+unsigned int MultiplexedSocket::reserveAddedSocket() {
+    unsigned int which=mBaseSockets;
+    while (which<mSockets.size()&&mSockets[which].getConnectionState()!=ASIOSocketWrapper::CONNECTION_CLOSED) {
+        ++which;
+    }
+    if (which==mSockets.size()) {
+        if (mSockets.size()>=mSockets.capacity()) {
+            //growing any further would move the sockets other threads are sending on
+            return which;
+        }
+        mSockets.push_back(ASIOSocketWrapper());
+    }
+    mSockets[which].setConnectionState(ASIOSocketWrapper::CONNECTION_JOINING);
+    mSockets[which].clearRetireFlags();
+    mSockets[which].setGatherLimits(mMaxGatherBuffers,mMaxGatherBytes);
+    //only now may other threads look at the new entry
+    mNumSockets=mSockets.size();
+    return which;
+}
+
+void MultiplexedSocket::addSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus) {
+    unsigned int which=thus->reserveAddedSocket();
+    if (which==thus->mSockets.size())
+        return;
+    ASIOSocketWrapper&socket=thus->mSockets[which];
+    socket.createSocket(*thus->mIO);
+    socket.getSocket().async_connect(thus->mRemoteEndpoint,
+                                     thus->mStrand.wrap(boost::bind(&MultiplexedSocket::addedSocketConnected,
+                                                                    std::tr1::weak_ptr<MultiplexedSocket>(thus),
+                                                                    which,
+                                                                    boost::asio::placeholders::error)));
+}
+
+void MultiplexedSocket::addedSocketConnected(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,unsigned int whichSocket,const boost::system::error_code&error) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=weakThus.lock();
+    if (!thus)
+        return;
+    ASIOSocketWrapper&socket=thus->mSockets[whichSocket];
+    boost::system::error_code headerError=error;
+    if (!headerError) {
+        socket.applySocketOptions(thus->mSocketOptions);
+        socket.sendJoinHeader(thus->mDatagramKey,headerError);
+    }
+    if (headerError) {
+        SILOG(tcpsst,warning,"Could not add a connection: "<<headerError.message());
+        thus->abandonAddedSocket(whichSocket);
+        return;
+    }
+    Array<uint8,TCPStream::TcpSstHeaderSize> *header=new Array<uint8,TCPStream::TcpSstHeaderSize>;
+    boost::asio::async_read(socket.getSocket(),
+                            boost::asio::buffer(header->begin(),TCPStream::TcpSstHeaderSize),
+                            boost::asio::transfer_at_least(TCPStream::TcpSstHeaderSize),
+                            thus->mStrand.wrap(boost::bind(&MultiplexedSocket::addedSocketAnswered,
+                                                           weakThus,
+                                                           whichSocket,
+                                                           header,
+                                                           boost::asio::placeholders::error,
+                                                           boost::asio::placeholders::bytes_transferred)));
+}
+
+void MultiplexedSocket::addedSocketAnswered(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,unsigned int whichSocket,Array<uint8,TCPStream::TcpSstHeaderSize>*header,const boost::system::error_code&error,std::size_t bytes_received) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=weakThus.lock();
+    bool valid=!error
+        &&std::memcmp(header->begin(),TCPStream::STRING_PREFIX(),TCPStream::STRING_PREFIX_LENGTH)==0
+        &&(*header)[TCPStream::STRING_PREFIX_LENGTH]=='0'
+        &&(*header)[TCPStream::STRING_PREFIX_LENGTH+1]=='0'
+        &&thus
+        &&UUID(header->begin()+(TCPStream::TcpSstHeaderSize-16),16)==thus->mDatagramKey;
+    delete header;
+    if (!thus)
+        return;
+    if (!valid) {
+        SILOG(tcpsst,warning,"Added connection was refused");
+        thus->abandonAddedSocket(whichSocket);
+        return;
+    }
+    thus->mSockets[whichSocket].setConnectionState(ASIOSocketWrapper::CONNECTION_ACTIVE);
+    MakeASIOReadBuffer(thus,whichSocket);
+}
+
+void MultiplexedSocket::abandonAddedSocket(unsigned int whichSocket) {
+    mSockets[whichSocket].shutdownAndClose();
+    mSockets[whichSocket].destroySocket();
+    mSockets[whichSocket].setConnectionState(ASIOSocketWrapper::CONNECTION_CLOSED);
+}
+
+void MultiplexedSocket::acceptAddedSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,TCPSocket*socket) {
+    if (!(peerAddress(*socket)==thus->mPeerAddress)) {
+        //the UUID naming the connection crossed the network in the clear, so it alone does not admit a socket
+        SILOG(tcpsst,warning,"Added connection comes from another host than the connection it names");
+        delete socket;
+        return;
+    }
+    unsigned int which=thus->mSockets.size();
+    if (thus->canResize()&&thus->mSocketConnectionPhase==CONNECTED)
+        which=thus->reserveAddedSocket();
+    if (which==thus->mSockets.size()) {
+        SILOG(tcpsst,warning,"No room to add a connection");
+        delete socket;
+        return;
+    }
+    ASIOSocketWrapper&wrapper=thus->mSockets[which];
+    wrapper.adoptSocket(socket);
+    wrapper.applySocketOptions(thus->mSocketOptions);
+    boost::system::error_code error;
+    wrapper.sendJoinHeader(thus->mDatagramKey,error);
+    if (error) {
+        SILOG(tcpsst,warning,"Could not answer added connection: "<<error.message());
+        thus->abandonAddedSocket(which);
+        return;
+    }
+    wrapper.setConnectionState(ASIOSocketWrapper::CONNECTION_ACTIVE);
+    MakeASIOReadBuffer(thus,which);
+}
+
+bool MultiplexedSocket::baseSocketJoined(unsigned int whichSocket) {
+    std::vector<RawRequest> held;
+    {
+        boost::lock_guard<boost::mutex> retireLock(mRetireMutex);
+        if (mSockets[whichSocket].getConnectionState()!=ASIOSocketWrapper::CONNECTION_JOINING)
+            return false;
+        mSockets[whichSocket].setConnectionState(ASIOSocketWrapper::CONNECTION_ACTIVE);
+        if (--mJoiningBaseSockets==0&&mUnacknowledgedRetires==0)
+            held.swap(mHeldControlPackets);
+    }
+    std::tr1::shared_ptr<MultiplexedSocket> thus=getSharedPtr();
+    for (std::vector<RawRequest>::const_iterator i=held.begin(),ie=held.end();i!=ie;++i) {
+        broadcastControlPacket(thus,*i);
+    }
+    return true;
+}
+
+bool MultiplexedSocket::baseSocketFailed(unsigned int whichSocket, const std::string&error) {
+    if (mSockets[whichSocket].getConnectionState()!=ASIOSocketWrapper::CONNECTION_JOINING)
+        return true;
+    if (!canResize())
+        return false;
+    //control packets are counted on the sockets they are sent on, so both sides go on with the ones that made it
+    SILOG(tcpsst,warning,"Going on without socket "<<whichSocket<<" of the handshake: "<<error);
+    abandonAddedSocket(whichSocket);
+    std::vector<RawRequest> held;
+    {
+        boost::lock_guard<boost::mutex> retireLock(mRetireMutex);
+        if (--mJoiningBaseSockets==0&&mUnacknowledgedRetires==0)
+            held.swap(mHeldControlPackets);
+    }
+    std::tr1::shared_ptr<MultiplexedSocket> thus=getSharedPtr();
+    for (std::vector<RawRequest>::const_iterator i=held.begin(),ie=held.end();i!=ie;++i) {
+        broadcastControlPacket(thus,*i);
+    }
+    return true;
+}
+
+void MultiplexedSocket::startJoinTimer() {
+    if (!isJoiningBaseSockets())
+        return;
+    std::tr1::shared_ptr<IODeadlineTimer> timer(new IODeadlineTimer(*mIO));
+    timer->expires_from_now(boost::posix_time::milliseconds((int)BASE_JOIN_TIMEOUT_MILLISECONDS));
+    timer->async_wait(mStrand.wrap(std::tr1::bind(&MultiplexedSocket::joinTimedOut,
+                                                  std::tr1::weak_ptr<MultiplexedSocket>(getSharedPtr()),
+                                                  timer,
+                                                  _1)));
+}
+
+void MultiplexedSocket::joinTimedOut(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,const std::tr1::shared_ptr<IODeadlineTimer>&timer,const boost::system::error_code&error) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=weakThus.lock();
+    if (!thus||error==boost::asio::error::operation_aborted)
+        return;
+    const std::string timedOut("Timed out waiting for the rest of the handshake");
+    for (unsigned int i=1;i<thus->mBaseSockets;++i) {
+        if (!thus->baseSocketFailed(i,timedOut)) {
+            thus->hostDisconnectedCallback(i,timedOut);
+            return;
+        }
+    }
+}
+
+void MultiplexedSocket::acceptBaseSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,TCPSocket*socket,unsigned int numConnections) {
+    if (!(peerAddress(*socket)==thus->mPeerAddress)) {
+        SILOG(tcpsst,warning,"Connection of a handshake comes from another host than the rest of it");
+        delete socket;
+        return;
+    }
+    unsigned int which=0;
+    while (which<thus->mBaseSockets&&thus->mSockets[which].getConnectionState()!=ASIOSocketWrapper::CONNECTION_JOINING) {
+        ++which;
+    }
+    if (numConnections!=thus->mBaseSockets||which==thus->mBaseSockets) {
+        SILOG(tcpsst,warning,"Single client disagrees on number of connections to establish: "<<numConnections<<" != "<<thus->mBaseSockets);
+        delete socket;
+        return;
+    }
+    ASIOSocketWrapper&wrapper=thus->mSockets[which];
+    wrapper.destroySocket();
+    wrapper.adoptSocket(socket);
+    wrapper.applySocketOptions(thus->mSocketOptions);
+    wrapper.sendProtocolHeader(thus,thus->mHandshakeUUID,thus->mBaseSockets);
+    thus->baseSocketJoined(which);
+    MakeASIOReadBuffer(thus,which);
+}
+
+void MultiplexedSocket::retireSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,unsigned int whichSocket) {
+    ASIOSocketWrapper&socket=thus->mSockets[whichSocket];
+    if (whichSocket<thus->mBaseSockets||!socket.isActive())
+        return;
+    {
+        boost::lock_guard<boost::mutex> retireLock(thus->mRetireMutex);
+        ++thus->mUnacknowledgedRetires;
+    }
+    socket.stopSending();
+    advanceRetirement(thus,whichSocket);
+}
+
+void MultiplexedSocket::advanceRetirement(const std::tr1::shared_ptr<MultiplexedSocket>&thus,unsigned int whichSocket) {
+    ASIOSocketWrapper&socket=thus->mSockets[whichSocket];
+    if (socket.getConnectionState()!=ASIOSocketWrapper::CONNECTION_RETIRING)
+        return;
+    uint32 flags=socket.getRetireFlags();
+    const uint32 finished=ASIOSocketWrapper::RETIRE_SENT|ASIOSocketWrapper::RETIRE_RECEIVED|ASIOSocketWrapper::RETIRE_ACKNOWLEDGED;
+    if ((flags&ASIOSocketWrapper::RETIRE_SENT)&&(flags&finished)!=finished&&!(flags&ASIOSocketWrapper::RETIRE_READ_CLOSED)) {
+        //waiting on the other side
+        return;
+    }
+    if (socket.isSendIdle()) {
+        if (!(flags&ASIOSocketWrapper::RETIRE_SENT)) {
+            //everything queued on the socket is on the wire, so the retire is the last thing the other side reads there
+            socket.addRetireFlags(ASIOSocketWrapper::RETIRE_SENT);
+            socket.sendControlPacket(thus,TCPStream::TCPStreamRetireConnection,Stream::uint30(whichSocket));
+        }else if (!(flags&ASIOSocketWrapper::RETIRE_READ_CLOSED)) {
+            //the read in progress fails, which comes back here through hostDisconnectedCallback
+            socket.shutdownAndClose();
+        }else if (flags&ASIOSocketWrapper::RETIRE_ACKNOWLEDGED) {
+            socket.destroySocket();
+            socket.setConnectionState(ASIOSocketWrapper::CONNECTION_CLOSED);
+        }
+        return;
+    }
+    std::tr1::shared_ptr<IODeadlineTimer> timer(new IODeadlineTimer(*thus->mIO));
+    timer->expires_from_now(boost::posix_time::milliseconds((int)RETIRE_POLL_MILLISECONDS));
+    timer->async_wait(thus->mStrand.wrap(std::tr1::bind(&MultiplexedSocket::retirementTimer,
+                                                        std::tr1::weak_ptr<MultiplexedSocket>(thus),
+                                                        whichSocket,
+                                                        timer,
+                                                        _1)));
+}
 
+void MultiplexedSocket::retirementTimer(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,unsigned int whichSocket,const std::tr1::shared_ptr<IODeadlineTimer>&timer,const boost::system::error_code&error) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=weakThus.lock();
+    if (thus)
+        advanceRetirement(thus,whichSocket);
+}
+
+void MultiplexedSocket::receiveResizePacket(unsigned int whichSocket,unsigned int controlCode,uint32 value) {
+    std::tr1::shared_ptr<MultiplexedSocket> thus=getSharedPtr();
+    switch (controlCode) {
+      case TCPStream::TCPStreamRetireConnection:
+        if (whichSocket<mBaseSockets||whichSocket>=mSockets.size()) {
+            SILOG(tcpsst,warning,"Retire received on a socket of the original handshake");
+            return;
+        }
+        //the retire is the last packet the other side sends on the socket, so everything it sent there has arrived
+        mSockets[0].sendControlPacket(thus,TCPStream::TCPStreamAckRetireConnection,Stream::uint30(value));
+        mSockets[whichSocket].addRetireFlags(ASIOSocketWrapper::RETIRE_RECEIVED);
+        if (mSockets[whichSocket].isActive()) {
+            retireSocket(thus,whichSocket);
+        }else {
+            advanceRetirement(thus,whichSocket);
+        }
+        break;
+      case TCPStream::TCPStreamAckRetireConnection:
+        if (value<mBaseSockets||value>=mSockets.size()
+            ||mSockets[value].getConnectionState()!=ASIOSocketWrapper::CONNECTION_RETIRING
+            ||(mSockets[value].getRetireFlags()&(ASIOSocketWrapper::RETIRE_SENT|ASIOSocketWrapper::RETIRE_ACKNOWLEDGED))!=ASIOSocketWrapper::RETIRE_SENT) {
+            SILOG(tcpsst,warning,"Unexpected retire acknowledgement for socket "<<value);
+            return;
+        }
+        mSockets[value].addRetireFlags(ASIOSocketWrapper::RETIRE_ACKNOWLEDGED);
+        {
+            std::vector<RawRequest> held;
+            {
+                boost::lock_guard<boost::mutex> retireLock(mRetireMutex);
+                if (--mUnacknowledgedRetires==0&&mJoiningBaseSockets.read()==0)
+                    held.swap(mHeldControlPackets);
+            }
+            for (std::vector<RawRequest>::const_iterator i=held.begin(),ie=held.end();i!=ie;++i) {
+                broadcastControlPacket(thus,*i);
+            }
+        }
+        advanceRetirement(thus,value);
+        break;
+      case TCPStream::TCPStreamAddConnection:
+        if (mCanAddSockets&&canResize()) {
+            unsigned int live=0;
+            for (unsigned int i=0,ie=mSockets.size();i<ie;++i) {
+                ASIOSocketWrapper::ConnectionState state=mSockets[i].getConnectionState();
+                if (state==ASIOSocketWrapper::CONNECTION_ACTIVE||state==ASIOSocketWrapper::CONNECTION_JOINING)
+                    ++live;
+            }
+            if (live<value)
+                addSocket(thus);
+        }
+        break;
+    }
+}
+
+
+
+
+void MultiplexedSocket::shareConnection(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Address&address,const Task::DeltaTime&idleTimeout) {
+    thus->mSharedAddress=sharedAddress(address);
+    thus->mSharedIdleTimeout=idleTimeout;
+    boost::lock_guard<boost::mutex> sharedConnectionsLock(sSharedConnectionsMutex);
+    sSharedConnections[std::make_pair(thus->mIO,thus->mSharedAddress)]=thus;
+}
+
+std::tr1::shared_ptr<MultiplexedSocket> MultiplexedSocket::findSharedConnection(IOService*io,const Address&address) {
+    boost::lock_guard<boost::mutex> sharedConnectionsLock(sSharedConnectionsMutex);
+    SharedConnectionMap::iterator where=sSharedConnections.find(std::make_pair(io,sharedAddress(address)));
+    if (where==sSharedConnections.end())
+        return std::tr1::shared_ptr<MultiplexedSocket>();
+    std::tr1::shared_ptr<MultiplexedSocket> retval=where->second.lock();
+    if (!retval||retval->mSocketConnectionPhase==DISCONNECTED) {
+        sSharedConnections.erase(where);
+        return std::tr1::shared_ptr<MultiplexedSocket>();
+    }
+    return retval;
+}
+
+void MultiplexedSocket::joinSharedConnection(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Stream::StreamID&sid,TCPStream::Callbacks*callbacks) {
+    SocketConnectionPhase phase=thus->addCallbacks(sid,callbacks);
+    //a connection still connecting tells every stream it has when it is done
+    if (phase!=PRECONNECTION)
+        thus->mStrand.post(std::tr1::bind(&MultiplexedSocket::announceJoinedStream,thus,sid,phase));
+}
+
+void MultiplexedSocket::announceJoinedStream(const Stream::StreamID&sid,SocketConnectionPhase phase) {
+    std::deque<StreamIDCallbackPair> registrations;
+    CommitCallbacks(registrations,mSocketConnectionPhase,false);
+    TCPStream::Callbacks*callbacks=mCallbacks.get(sid);
+    if (callbacks==NULL)
+        return;
+    if (phase==DISCONNECTED) {
+        callbacks->mConnectionCallback(Stream::ConnectionFailed,"Shared connection was lost");
+    }else if (mSocketConnectionPhase==CONNECTED) {
+        //had the connection been lost since, the stream would have been told along with the others
+        callbacks->mConnectionCallback(Stream::Connected,std::string());
+    }
+}
+
+void MultiplexedSocket::holdSharedConnection(const std::tr1::shared_ptr<MultiplexedSocket>&thus) {
+    if (!thus->mSharedAddress.empty())
+        thus->mStrand.post(std::tr1::bind(&MultiplexedSocket::startSharedIdleTimer,thus));
+}
+
+void MultiplexedSocket::startSharedIdleTimer() {
+    if (mSharedIdleTimer==NULL)
+        mSharedIdleTimer=new IODeadlineTimer(*mIO);
+    //a wait already under way is cancelled and lets go of its hold, so only the newest one keeps the connection
+    mSharedIdleTimer->expires_from_now(boost::posix_time::microseconds(mSharedIdleTimeout.toMicro()));
+    mSharedIdleTimer->async_wait(mStrand.wrap(std::tr1::bind(&MultiplexedSocket::sharedIdleTimeout,getSharedPtr(),_1)));
+}
+
+void MultiplexedSocket::sharedIdleTimeout(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const boost::system::error_code&error) {
+    if (error==boost::asio::error::operation_aborted)
+        return;
+    std::deque<StreamIDCallbackPair> registrations;
+    thus->CommitCallbacks(registrations,thus->mSocketConnectionPhase,false);
+    if (!thus->mCallbacks.empty())
+        return;
+    SILOG(tcpsst,debug,"Shared connection to "<<thus->mSharedAddress<<" is idle: no longer sharing it");
+    boost::lock_guard<boost::mutex> sharedConnectionsLock(sSharedConnectionsMutex);
+    SharedConnectionMap::iterator where=sSharedConnections.find(std::make_pair(thus->mIO,thus->mSharedAddress));
+    if (where!=sSharedConnections.end()&&where->second.lock()==thus)
+        sSharedConnections.erase(where);
+}
 
 } }
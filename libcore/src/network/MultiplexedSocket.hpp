@@ -29,17 +29,74 @@
  * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include "StreamIDMap.hpp"
 
 namespace Sirikata { namespace Network {
-
+class ASIODatagramChannel;
+class PacketTrace;
 class MultiplexedSocket:public SelfWeakPtr<MultiplexedSocket> {
 public:
     class RawRequest {
     public:
         bool unordered;
         bool unreliable;
+        ///A sequenced ordered packet that may be sent on any connection rather than only its stream's own
+        bool striped;
+        ///An unreliable packet that may be sent in a datagram, since the other side knows of its stream
+        bool datagram;
+        ///An ordered packet of a stream that sent while sockets of the handshake were still joining, which keeps to socket 0
+        bool firstSocket;
         Stream::StreamID originStream;
-        Chunk * data;
+        ///The TCPStream::StreamPriority class of service the packet is queued in
+        int priority;
+        PacketBuffer * data;
+    };
+    /**
+     * A policy choosing which of the TCP connections should carry the next unordered packet.
+     * It is passed the connections themselves, how many of them may be looked at and a counter that advances with every choice,
+     * which may be used to rotate among equally good connections. Connections that are not ASIOSocketWrapper::isActive should not be chosen
+     * \returns an index into sockets less than numSockets
+     */
+    typedef std::tr1::function<size_t(const std::vector<ASIOSocketWrapper>&sockets, size_t numSockets, uint32 rotation)> StreamSelectionStrategy;
+    enum {
+        ///By default unreliable packets are never dropped while their connection has fewer than this many bytes outstanding
+        DEFAULT_UNRELIABLE_DROP_LOW_WATER=16384,
+        ///By default unreliable packets are always dropped once their connection has this many bytes outstanding
+        DEFAULT_UNRELIABLE_DROP_HIGH_WATER=262144,
+        ///The number of bytes each unit of weight entitles a class of service to per round of weighted scheduling
+        PRIORITY_QUANTUM=4096,
+        ///By default packets with more data than this are fragmented if the other side supports it
+        DEFAULT_FRAGMENT_SIZE=16384,
+        ///Sequence numbers of sequenced packets wrap around after this mask
+        SEQUENCE_MASK=(1<<30)-1,
+        ///A received sequence number less than this far ahead of the expected one is early, otherwise it is late
+        SEQUENCE_WINDOW=(1<<29),
+        ///By default each stream may hold back this many early sequenced packets before skipping ahead of a missing one
+        DEFAULT_MAX_REORDER_PACKETS=4096,
+        ///By default trySend refuses data once this many bytes are outstanding over all the connections
+        DEFAULT_SEND_HIGH_WATER=1048576,
+        ///By default streams refused by trySend are told to resume once this few bytes are outstanding over all the connections
+        DEFAULT_SEND_LOW_WATER=262144,
+        ///Streams that ask for compression only compress packets with at least this much data
+        COMPRESSION_THRESHOLD=48,
+        ///The most bytes a compressed packet may inflate to: larger packets are sent uncompressed
+        MAX_UNCOMPRESSED_LENGTH=(1<<24),
+        ///The most bytes a fragmented packet may be reassembled into: larger packets are sent whole
+        MAX_REASSEMBLED_LENGTH=(1<<24),
+        ///The most fragmented packets a TCP connection may be putting back together at once
+        MAX_PARTIAL_PACKETS=64,
+        ///The most bytes the fragmented packets a TCP connection is putting back together may reserve between them
+        MAX_PARTIAL_PACKET_BYTES=(1<<26),
+        ///By default a coalescing window ends early once this many bytes have gathered
+        DEFAULT_CORK_BYTES=16384,
+        ///The most TCP connections adaptive resizing may grow a connection to: room for this many is reserved up front
+        MAX_CONNECTIONS=16,
+        ///How often a connection with adaptive resizing turned on checks its backlog and send rate
+        ADAPTIVE_PERIOD_MILLISECONDS=250,
+        ///How often a retiring connection checks whether its queued packets have made it to the wire
+        RETIRE_POLL_MILLISECONDS=5,
+        ///How long a connection that started early waits for the rest of its handshake before going on without it
+        BASE_JOIN_TIMEOUT_MILLISECONDS=5000
     };
     enum SocketConnectionPhase{
         PRECONNECTION,
@@ -51,14 +108,27 @@ private:
 
 //Begin Members//
 
-    ///ASIO io service running in a single thread we can expect callbacks from
+    ///ASIO io service, possibly run by several threads, that we can expect callbacks from
     IOService*mIO;
-    ///a vector of ASIO sockets (wrapped in with a simple send-full-packet abstraction)
+    ///Every handler touching this connection is wrapped in this strand so they never run concurrently, even when mIO is run by an IOServicePool
+    IOStrand mStrand;
+    /**
+     * a vector of ASIO sockets (wrapped in with a simple send-full-packet abstraction).
+     * Room for every socket it may grow to is reserved up front, so sockets added later never move the others
+     */
     std::vector<ASIOSocketWrapper> mSockets;
+    ///The number of entries of mSockets that threads outside mStrand may look at: only mStrand adds entries
+    AtomicValue<uint32> mNumSockets;
+    ///The number of sockets of the original handshake, which carry the ordered packets that are not sequenced and are never retired
+    unsigned int mBaseSockets;
+    ///The sockets of the original handshake still joining after the connection started early: only changed under mRetireMutex
+    AtomicValue<uint32> mJoiningBaseSockets;
+    ///The UUID the listening side answers the handshake with, repeated on sockets of the handshake that arrive late
+    UUID mHandshakeUUID;
 
     ///This callback is called whenever a newly encountered StreamID is picked up
     Stream::SubstreamCallback mNewSubstreamCallback;
-    typedef std::tr1::unordered_map<Stream::StreamID,TCPStream::Callbacks*,Stream::StreamID::Hasher> CallbackMap;
+    typedef StreamIDMap<TCPStream::Callbacks> CallbackMap;
 	///Workaround for VC8 bug that does not define std::pair<Stream::StreamID,Callbacks*>::operator=
     class StreamIDCallbackPair{
     public:
@@ -79,10 +149,10 @@ private:
     volatile SocketConnectionPhase mSocketConnectionPhase;
     ///This is a list of items for callback registration so that when packets are received by those streamIDs the appropriate callback may be called
     std::deque<StreamIDCallbackPair> mCallbackRegistration;
-    ///a map of ID to callback, only to be touched by the io reactor thread
+    ///a dense table of ID to callback, consulted for every received packet: only to be touched by handlers running in mStrand
     CallbackMap mCallbacks;
-    ///a map from StreamID to count of number of acked close requests--to avoid any unordered packets coming in
-    std::tr1::unordered_map<Stream::StreamID,unsigned int,Stream::StreamID::Hasher>mAckedClosingStreams;
+    ///a map from StreamID to count of number of close requests (first) and acks (second) received--to avoid any unordered packets coming in. Both sides may close a stream at once, so they are counted apart
+    std::tr1::unordered_map<Stream::StreamID,std::pair<unsigned int,unsigned int>,Stream::StreamID::Hasher>mAckedClosingStreams;
     ///a set of StreamIDs to hold the streams that were requested closed but have not been acknowledged, to prevent received packets triggering NewStream callbacks as if a new ID were received
     std::tr1::unordered_set<Stream::StreamID,Stream::StreamID::Hasher>mOneSidedClosingStreams;
 #define ThreadSafeStack ThreadSafeQueue //FIXME this can be way more efficient
@@ -91,19 +161,125 @@ private:
     ///actually free stream IDs that will not be sent out until recalimed by this side
     ThreadSafeStack<Stream::StreamID>mFreeStreamIDs;
 #undef ThreadSafeStack
+    ///The policy deciding which connection unordered packets are sent on
+    StreamSelectionStrategy mStreamSelectionStrategy;
+    ///Advanced by every call to leastBusyStream to break ties between equally loaded connections
+    AtomicValue<uint32> mStreamSelectionRotation;
+    ///Below this many outstanding bytes on a connection unreliable packets are never dropped for queue depth
+    uint32 mUnreliableDropLowWater;
+    ///At this many outstanding bytes on a connection unreliable packets are always dropped
+    uint32 mUnreliableDropHighWater;
+    ///Once a connection's current send has been stuck this long unreliable packets begin to be dropped
+    Task::DeltaTime mUnreliableStallStart;
+    ///Once a connection's current send has been stuck this long unreliable packets are always dropped
+    Task::DeltaTime mUnreliableStallLimit;
+    ///If set every connection drains its most urgent nonempty class first, otherwise classes share each connection in proportion to mPriorityWeights
+    bool mStrictPriority;
+    ///The relative share of each TCPStream::StreamPriority class when scheduling is weighted
+    uint32 mPriorityWeights[TCPStream::NumStreamPriorities];
+    ///The TCPStream::TCPStreamCapabilityFlags the other side advertised, zero until its capabilities packet arrives
+    AtomicValue<uint32> mRemoteCapabilities;
+    ///Packets with more data than this are split into fragments if the other side supports it: zero never fragments
+    size_t mFragmentSize;
+    ///The most packets each socket gathers into a single send, given to sockets added later too
+    unsigned int mMaxGatherBuffers;
+    ///The bytes after which each socket gathers no more packets into a send, given to sockets added later too
+    size_t mMaxGatherBytes;
+    ///The sequenced packets of a stream that arrived ahead of an earlier packet of the stream
+    class ReorderBuffer:public Noncopyable {
+    public:
+        ///The sequence number of the next packet to deliver
+        uint32 mNextSequence;
+        ///The early packets by sequence number
+        std::map<uint32,PacketView> mWaiting;
+        ReorderBuffer():mNextSequence(0){}
+    };
+    typedef StreamIDMap<ReorderBuffer> ReorderBufferMap;
+    ///the reorder state of each stream that has received sequenced packets: only to be touched by handlers running in mStrand
+    ReorderBufferMap mReorderBuffers;
+    ///The number of early packets a single stream may hold back before delivery skips ahead of a missing packet
+    size_t mMaxReorderPackets;
+    ///The number of sequenced packets that had to wait for an earlier packet of their stream
+    AtomicValue<uint32> mReorderedPackets;
+    ///The number of packets currently held back across all streams
+    AtomicValue<uint32> mReorderDepth;
+    ///The most packets ever held back at once
+    AtomicValue<uint32> mMaxReorderDepth;
+    ///The number of times a reorder buffer filled up and delivery skipped ahead of a missing packet
+    AtomicValue<uint32> mReorderOverflows;
+    ///Once this many bytes are outstanding over all the connections trySend refuses data
+    AtomicValue<uint32> mSendHighWater;
+    ///Once outstanding bytes fall to this many, streams refused by trySend are notified
+    AtomicValue<uint32> mSendLowWater;
+    ///The streams refused by trySend, waiting for the outstanding bytes to fall to mSendLowWater
+    ThreadSafeQueue<std::tr1::weak_ptr<TCPStream::WritableWaiter> > mWritableWaiters;
+    ///How long an idle connection holds a packet back in case more follow that could share its write: zero never waits
+    Task::DeltaTime mCorkWindow;
+    ///A coalescing window ends early once this many bytes are waiting
+    uint32 mCorkBytes;
+    ///The UDP socket unreliable packets may be sent over, shared by every connection of a listener: NULL if there is none
+    std::tr1::shared_ptr<ASIODatagramChannel> mDatagramChannel;
+    ///The UUID the connecting side sent in its handshake, which names this connection in datagrams
+    UUID mDatagramKey;
+    ///The number of unreliable packets sent in datagrams
+    AtomicValue<uint32> mDatagramsSent;
+    ///Where added sockets connect to: only the connecting side of a TCP connection may add sockets
+    boost::asio::ip::tcp::endpoint mRemoteEndpoint;
+    ///The host the listening side accepted the first socket from: sockets joining the connection later must come from it too
+    boost::asio::ip::address mPeerAddress;
+    ///The options every TCP connection is given as it comes up
+    TCPSocketOptions mSocketOptions;
+    bool mCanAddSockets;
+    ///The most sockets adaptive resizing grows to, or 0 if this side never adds or retires sockets of its own accord
+    unsigned int mMaxAdaptiveSockets;
+    ///The bytes outstanding per active socket, over two checks in a row, that adds a socket
+    uint32 mGrowBacklog;
+    ///The send rate below which an added socket is retired
+    uint32 mIdleBytesPerSecond;
+    ///Wakes up adaptive resizing: made when it is turned on and only touched from handlers in mStrand
+    IODeadlineTimer*mAdaptiveTimer;
+    ///The bytes sent over all sockets as of the previous adaptive check
+    uint64 mAdaptiveBytesSent;
+    ///The bytes delivered to streams since the previous adaptive check: only touched from handlers in mStrand
+    uint64 mAdaptiveBytesReceived;
+    ///The number of adaptive checks in a row that found a deep backlog
+    unsigned int mBackloggedChecks;
+    ///Held while sending close packets or changing mUnacknowledgedRetires or mJoiningBaseSockets, so a close cannot slip past a retire or a join
+    boost::mutex mRetireMutex;
+    ///The number of sockets this side has begun retiring that the other side has not acknowledged
+    uint32 mUnacknowledgedRetires;
+    ///The close and close ack packets held back until every retire is acknowledged and every socket of the handshake has joined or been given up on
+    std::vector<RawRequest> mHeldControlPackets;
+    ///The data every stream has sent and received over this connection
+    TrafficCounters mTraffic;
+    ///Wakes up the periodic statistics dump: made when it is turned on and only touched from handlers in mStrand
+    IODeadlineTimer*mStatisticsTimer;
+    ///How often the statistics are logged, or zero if they are not: only touched from handlers in mStrand
+    Task::DeltaTime mStatisticsPeriod;
+    ///The packets sent and received recently, or NULL if they are not being traced: once set it stays until destruction
+    AtomicValue<PacketTrace*> mPacketTrace;
+    ///The host and service TCPStream::connect may hand this connection out for, or empty if it is not shared
+    std::string mSharedAddress;
+    ///How long a shared connection stays up after one of its streams closes: only set before the connection is shared
+    Task::DeltaTime mSharedIdleTimeout;
+    ///Keeps a shared connection alive while it waits out mSharedIdleTimeout: made on first use and only touched from handlers in mStrand
+    IODeadlineTimer*mSharedIdleTimer;
 
 //Begin helper functions//
 
-    ///Copies items from newcallback to mCallbacks: must be called from the single io thread so no one would be looking to call the callbacks at the same time
+    ///Copies items from newcallback to mCallbacks: must be called from within mStrand so no one would be looking to call the callbacks at the same time
     void ioReactorThreadCommitCallback(StreamIDCallbackPair& newcallback);
     ///reads the current list of id-callback pairs to the registration list and if setConectedStatus is set, changes the status of the overall MultiplexedSocket at the same time
     bool CommitCallbacks(std::deque<StreamIDCallbackPair> &registration, SocketConnectionPhase status, bool setConnectedStatus=false);
-    ///Returns the least busy stream upon which unordered data may be piled
+    ///Sets up the default weighted sharing of connections between classes of service
+    void initPriorityScheduling();
+    ///Returns the least busy stream upon which unordered data may be piled, as chosen by mStreamSelectionStrategy
     size_t leastBusyStream();
     /**
-     *chance in the current load that an unreliable packet may be dropped 
-     * (due to busy queues, etc). 
-     * \returns drop chance which must be less than 1.0 and greater or equal to 0.0 
+     * chance in the current load that an unreliable packet may be dropped.
+     * The chance is zero while the chosen connection has headroom and climbs to 1.0 as either the bytes outstanding on it
+     * approach mUnreliableDropHighWater or its current send stays stuck in the operating system for mUnreliableStallLimit
+     * \returns drop chance between 0.0 (always send) and 1.0 (always drop) inclusive
      */
     float dropChance(const Chunk*data,size_t whichStream);
     /**
@@ -111,6 +287,56 @@ private:
      *  assumes that the mSocketConnectionPhase in the CONNECTED state    
      */
     static void sendBytesNow(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const RawRequest&data);
+    ///Sends an unreliable packet in a datagram: returns false if it must go over TCP instead
+    bool sendDatagram(const RawRequest&data);
+    ///Sends a control packet on every active socket, or holds it back while a retire is unacknowledged
+    static void broadcastControlPacket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const RawRequest&data);
+    ///Whether sockets may be added and retired, which needs both sides to support it: must be called from within mStrand
+    bool canResize()const {
+        return (mRemoteCapabilities.read()&TCPStream::TCPStreamCapableOfResizing)!=0;
+    }
+    ///Finds room in mSockets for an added socket, marking it CONNECTION_JOINING: returns mSockets.size() if there is none
+    unsigned int reserveAddedSocket();
+    ///Connects another socket to mRemoteEndpoint and adds it to this connection
+    static void addSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus);
+    static void addedSocketConnected(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,unsigned int whichSocket,const boost::system::error_code&error);
+    static void addedSocketAnswered(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,unsigned int whichSocket,Array<uint8,TCPStream::TcpSstHeaderSize>*header,const boost::system::error_code&error,std::size_t bytes_received);
+    ///Gives up on a socket that could not be added
+    void abandonAddedSocket(unsigned int whichSocket);
+    ///Stops sending on an added socket and starts the exchange of retires: must be called from within mStrand
+    static void retireSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,unsigned int whichSocket);
+    ///Takes whatever step of retiring a socket is due, checking back later if its queued packets are not on the wire yet
+    static void advanceRetirement(const std::tr1::shared_ptr<MultiplexedSocket>&thus,unsigned int whichSocket);
+    static void retirementTimer(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,unsigned int whichSocket,const std::tr1::shared_ptr<IODeadlineTimer>&timer,const boost::system::error_code&error);
+    ///Gives the sockets of the original handshake still joining BASE_JOIN_TIMEOUT_MILLISECONDS to do so: must be called from within mStrand
+    void startJoinTimer();
+    static void joinTimedOut(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,const std::tr1::shared_ptr<IODeadlineTimer>&timer,const boost::system::error_code&error);
+    ///Handles a TCPStreamRetireConnection, TCPStreamAckRetireConnection or TCPStreamAddConnection control packet
+    void receiveResizePacket(unsigned int whichSocket,unsigned int controlCode,uint32 value);
+    ///Checks the backlog and send rate and adds or retires a socket accordingly
+    static void adaptSockets(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,const boost::system::error_code&error);
+    ///Sets the adaptive resizing limits and starts its timer if it is not already running: must be called from within mStrand
+    void startAdapting(unsigned int maxSockets, uint32 growBacklog, uint32 idleBytesPerSecond);
+    ///Changes how often the statistics are logged: must be called from within mStrand
+    void startStatisticsDump(const Task::DeltaTime&period);
+    ///Logs the statistics of the connection and each of its streams and waits out another period
+    static void dumpStatistics(const std::tr1::weak_ptr<MultiplexedSocket>&weakThus,const boost::system::error_code&error);
+    ///Holds on to a shared connection for another mSharedIdleTimeout: must be called from within mStrand
+    void startSharedIdleTimer();
+    ///Stops sharing the connection if it has no open streams left, and lets go of it so it is torn down once no stream refers to it
+    static void sharedIdleTimeout(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const boost::system::error_code&error);
+    /**
+     * Tells a stream that joined the connection after it was already resolved whether it is connected: must be called from within mStrand
+     * \param phase is what the connection was when the stream's callbacks were added
+     */
+    void announceJoinedStream(const Stream::StreamID&sid,SocketConnectionPhase phase);
+    ///Hands a packet of data to the callbacks of stream id, making a new substream if id has not been seen before
+    void deliverChunk(const Stream::StreamID&id,const PacketView&newChunk);
+    /**
+     * Delivers a sequenced packet of stream id along with any held back packets that follow it,
+     * or holds it back if an earlier packet of the stream has not arrived yet
+     */
+    void receiveSequencedChunk(const Stream::StreamID&id,uint32 sequence,const PacketView&newChunk);
     /**
      * Calls the connected callback with the succeess or failure status. Sets status while holding the sConnectingMutex lock so that after that point no more Connected responses
      * will be sent out. Then inserts the registrations into the mCallbacks map during the ioReactor thread.
@@ -129,12 +355,192 @@ private:
 public:
     ///public io service accessor for new stream construction
     IOService&getASIOService(){return *mIO;}
+    ///The strand all asynchronous handlers for this connection must be wrapped in
+    IOStrand&getStrand(){return mStrand;}
+    /**
+     * The default StreamSelectionStrategy: picks the connection with the fewest bytes queued or in flight,
+     * starting the search at a rotating position so that ties are spread across connections
+     */
+    static size_t leastOutstandingStreamStrategy(const std::vector<ASIOSocketWrapper>&sockets, size_t numSockets, uint32 rotation);
+    ///A StreamSelectionStrategy that picks a connection at random without regard for load
+    static size_t randomStreamStrategy(const std::vector<ASIOSocketWrapper>&sockets, size_t numSockets, uint32 rotation);
+    ///Replaces the policy used to choose a connection for unordered packets: should be called before sending data
+    void setStreamSelectionStrategy(const StreamSelectionStrategy&strategy) {
+        mStreamSelectionStrategy=strategy;
+    }
+    /**
+     * Sets how congested a connection must be before unreliable packets sent on it are shed: should be called before sending data
+     * \param lowWater is the number of outstanding bytes below which no packets are dropped for queue depth
+     * \param highWater is the number of outstanding bytes at which every packet is dropped
+     * \param stallStart is how long a send may sit in the operating system before packets begin to be dropped
+     * \param stallLimit is how long a send may sit in the operating system before every packet is dropped
+     */
+    void setUnreliableDropThresholds(uint32 lowWater, uint32 highWater, const Task::DeltaTime&stallStart, const Task::DeltaTime&stallLimit);
+    /**
+     * Sets how each TCP connection shares its bandwidth between the TCPStream::StreamPriority classes: should be called before sending data
+     * \param strict if true always sends from the most urgent nonempty class first, which may starve less urgent classes
+     * \param weights is the relative share of each class when strict is false, each at least 1
+     */
+    void setPriorityScheduling(bool strict, const uint32 weights[TCPStream::NumStreamPriorities]);
+    bool isStrictPriority()const {
+        return mStrictPriority;
+    }
+    ///The number of bytes a class of service may send per round of weighted scheduling
+    size_t getPriorityQuantum(int priority)const {
+        return mPriorityWeights[priority]*(size_t)PRIORITY_QUANTUM;
+    }
+    ///Sets the largest piece of data sent in one fragment, or 0 to never fragment packets: should be called before sending data
+    void setFragmentSize(size_t fragmentSize) {
+        mFragmentSize=fragmentSize;
+    }
+    ///Limits how much each socket hands the operating system in a single send, as ASIOSocketWrapper::setGatherLimits: should be called before sending data
+    void setGatherLimits(unsigned int maxBuffers, size_t maxBytes);
+    ///The size to fragment large packets into, or 0 if packets may not be fragmented because of local settings or an old peer
+    size_t getSendFragmentSize()const {
+        return (mRemoteCapabilities.read()&TCPStream::TCPStreamCapableOfFragments)?mFragmentSize:0;
+    }
+    ///Whether streams may send sequenced packets, which requires both several connections and a peer that reorders them
+    bool canSequence()const {
+        return (mRemoteCapabilities.read()&TCPStream::TCPStreamCapableOfSequencing)&&mNumSockets.read()>1;
+    }
+    /**
+     * Sets how long a packet sent on an idle TCP connection may be held back so that packets sent shortly after it
+     * share its write: should be called before sending data
+     * \param window is the longest a packet is held back, or zero to always send right away
+     * \param maxBytes is the number of bytes waiting at which the window ends early
+     */
+    void setCorking(const Task::DeltaTime&window, uint32 maxBytes) {
+        mCorkWindow=window;
+        mCorkBytes=maxBytes;
+    }
+    bool isCorking()const {
+        return (double)mCorkWindow>0;
+    }
+    const Task::DeltaTime&getCorkWindow()const {
+        return mCorkWindow;
+    }
+    uint32 getCorkBytes()const {
+        return mCorkBytes;
+    }
+    ///Sends every packet held back for coalescing right away
+    static void flush(const std::tr1::shared_ptr<MultiplexedSocket>&thus);
+    /**
+     * Adopts channel as the UDP socket this connection's unreliable packets may be sent over, and
+     * has it deliver the datagrams naming this connection that come from peerAddress, the remote address of
+     * the TCP sockets: must be called before the protocol headers are sent
+     */
+    void setDatagramChannel(const std::tr1::shared_ptr<ASIODatagramChannel>&channel, const boost::asio::ip::address&peerAddress);
+    bool hasDatagramChannel()const {
+        return mDatagramChannel?true:false;
+    }
+    ///Delivers the packet in a datagram received from the other side: must be called from within mStrand
+    void receiveDatagram(const PacketView&datagram);
+    ///Sets the options each TCP connection is given as it comes up: sockets already up keep theirs
+    void setSocketOptions(const TCPSocketOptions&options) {
+        mSocketOptions=options;
+    }
+    const TCPSocketOptions&getSocketOptions()const {
+        return mSocketOptions;
+    }
+    ///Remembers where the first socket of a connecting side connected to, so that sockets may be added later
+    void setRemoteEndpoint(const boost::asio::ip::tcp::endpoint&remote) {
+        mRemoteEndpoint=remote;
+        mCanAddSockets=true;
+    }
+    /**
+     * Lets this side add sockets while the backlog stays deep and retire added ones while the connection is idle
+     * \param maxSockets is the most sockets to grow to, or no more than the sockets of the original handshake to stop resizing
+     * \param growBacklog is the number of bytes outstanding per active socket, over two checks in a row, that adds a socket
+     * \param idleBytesPerSecond is the send rate below which an added socket is retired
+     */
+    static void setAdaptiveConnections(const std::tr1::shared_ptr<MultiplexedSocket>&thus, unsigned int maxSockets, uint32 growBacklog, uint32 idleBytesPerSecond);
+    /**
+     * Adds a socket the other side connected to this live connection, answering its handshake: must be called from within mStrand.
+     * The socket is closed instead if it comes from another host than the connection's first socket or the connection has no room for it
+     */
+    static void acceptAddedSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,TCPSocket*socket);
+    /**
+     * Brings a socket of the original handshake that arrived after the connection was built into the first slot still
+     * joining, answering its handshake: must be called from within mStrand.
+     * The socket is closed instead if it comes from another host than the first socket, its handshake disagrees on the
+     * number of sockets or every slot is taken
+     */
+    static void acceptBaseSocket(const std::tr1::shared_ptr<MultiplexedSocket>&thus,TCPSocket*socket,unsigned int numConnections);
+    ///The number of sockets packets may currently be sent on
+    unsigned int numActiveSockets()const;
+    uint32 getDatagramsSent()const {
+        return mDatagramsSent.read();
+    }
+    ///The number of packets the sockets discarded unsent because they expired or were replaced
+    uint32 getStalePacketsDiscarded()const;
+    ///The trace packets are recorded in, or NULL if they are not being traced
+    PacketTrace*getPacketTrace()const {
+        return mPacketTrace.read();
+    }
+    /**
+     * Starts tracing the packets of the connection in a ring of capacity bytes, or changes the file a trace already
+     * under way is written to when the connection is lost
+     */
+    void setPacketTrace(size_t capacity, const std::string&errorTraceFile);
+    ///Which of mSockets socket is
+    unsigned int getSocketIndex(const ASIOSocketWrapper*socket)const {
+        return (unsigned int)(socket-&mSockets[0]);
+    }
+    ///The counters every stream adds the data it sends to
+    TrafficCounters&getTraffic() {
+        return mTraffic;
+    }
+    ///The traffic of every stream and the send latency of every socket so far
+    TCPStream::ConnectionStatistics getConnectionStatistics()const;
+    ///Logs the statistics of the connection and each of its streams every period, or stops if period is zero
+    static void setStatisticsDump(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Task::DeltaTime&period);
+    /**
+     * Lets findSharedConnection hand this connection to streams connecting to address over the same IOService.
+     * Once a stream of the connection closes, the connection is held for idleTimeout: if it has no open streams left by
+     * then it is no longer shared, and is torn down as soon as no stream refers to it
+     */
+    static void shareConnection(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Address&address,const Task::DeltaTime&idleTimeout);
+    ///Returns the shared connection to address over io that has not been lost, or NULL if there is none
+    static std::tr1::shared_ptr<MultiplexedSocket> findSharedConnection(IOService*io,const Address&address);
+    ///Adds a stream made by TCPStream::connect to a shared connection: it is told the connection is up just as its first stream was
+    static void joinSharedConnection(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Stream::StreamID&sid,TCPStream::Callbacks*callbacks);
+    ///Holds a shared connection for its idle timeout after one of its streams closes: does nothing to a connection that is not shared
+    static void holdSharedConnection(const std::tr1::shared_ptr<MultiplexedSocket>&thus);
+    ///The TCPStream::TCPStreamCapabilityFlags this side advertises in its capabilities packet
+    uint32 getLocalCapabilities()const;
+    ///Whether streams may send compressed packets
+    bool canCompress()const {
+        return (mRemoteCapabilities.read()&TCPStream::TCPStreamCapableOfCompression)!=0;
+    }
+    ///Sets how many early sequenced packets each stream may hold back waiting for a missing one: should be called before receiving data
+    void setMaxReorderPackets(size_t maxReorderPackets) {
+        mMaxReorderPackets=maxReorderPackets;
+    }
+    ///Sets the outstanding byte counts at which trySend starts refusing data and refused streams are notified: may be called while sending
+    void setSendWatermarks(uint32 lowWater, uint32 highWater);
+    ///The number of bytes queued or in flight over all the connections
+    uint32 getOutstandingBytes()const;
+    bool isOverSendHighWater()const {
+        return getOutstandingBytes()>=mSendHighWater.read();
+    }
+    ///Holds on to waiter until the outstanding bytes fall to the low water mark, then calls its WritableCallback
+    static void waitForWritable(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const std::tr1::shared_ptr<TCPStream::WritableWaiter>&waiter);
+    ///Calls the WritableCallbacks of waiting streams if the outstanding bytes have fallen to the low water mark: must be called from within mStrand
+    void notifyWritable();
+    ///The reordering done so far for sequenced packets received on this connection
+    TCPStream::ReorderStatistics getReorderStatistics()const;
+    ///The number of bytes all connections have handed to the operating system in the given class of service
+    uint64 getPriorityBytesSent(int priority)const;
+    ///The class of service of a stream with committed callbacks on this side, or TCPStream::DefaultPriority: must be called from within mStrand
+    int getStreamPriority(const Stream::StreamID&id)const;
     
     /**
      * Sends a packet telling the other side that this stream is closed (or alternatively if its a closeAck that the close request was received and no further packets for that
      * stream will be sent with that streamID
      */
-    static void closeStream(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Stream::StreamID&sid,TCPStream::TCPStreamControlCodes code=TCPStream::TCPStreamCloseStream);
+    static void closeStream(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const Stream::StreamID&sid,TCPStream::TCPStreamControlCodes code=TCPStream::TCPStreamCloseStream,int priority=TCPStream::DefaultPriority);
+    ///Closes a stream the client turned down, which never had callbacks to unregister: must be called from within mStrand
+    void rejectStream(const Stream::StreamID&sid);
 
     /**
      * Either sends or queues bytes in the data request depending on the connection state 
@@ -150,9 +556,13 @@ public:
     Stream::StreamID getNewID();
     ///Constructor for a connecting stream
     MultiplexedSocket(IOService*io, const Stream::SubstreamCallback&substreamCallback);
-    ///Constructor for a listening stream with a prebuilt connection of ASIO sockets
-    MultiplexedSocket(IOService*io, const UUID&uuid,const std::vector<TCPSocket*>&sockets, const Stream::SubstreamCallback &substreamCallback);
-    ///Sends the protocol headers to all ASIO socket wrappers when a known fully open connection has been listened for
+    /**
+     * Constructor for a listening stream with a prebuilt connection of ASIO sockets
+     * \param baseSockets is the number of sockets the connecting side opens in its handshake: the ones not among sockets
+     *        are left joining until acceptBaseSocket brings them in
+     */
+    MultiplexedSocket(IOService*io, const UUID&uuid,const std::vector<TCPSocket*>&sockets, unsigned int baseSockets, const Stream::SubstreamCallback &substreamCallback);
+    ///Sends the protocol headers to all ASIO socket wrappers that have arrived when a connection has been listened for
     static void sendAllProtocolHeaders(const std::tr1::shared_ptr<MultiplexedSocket>&thus,const UUID&syncedUUID);
     ///erase all sockets and callbacks since the refcount is now zero;
     ~MultiplexedSocket();
@@ -163,7 +573,13 @@ public:
      * Control packets come in on Stream::StreamID() and others should be directed
      * to the appropriate callback
      */
-    void receiveFullChunk(unsigned int whichSocket, Stream::StreamID id,const Chunk&newChunk);
+    void receiveFullChunk(unsigned int whichSocket, Stream::StreamID id,const PacketView&newChunk);
+    /**
+     * Inflates the body of a TCPStreamCompressed control packet, which follows its control code
+     * \returns false if it is corrupt or would inflate past MAX_UNCOMPRESSED_LENGTH, otherwise sets originalId and
+     *          original to the StreamID and data of the packet it carries
+     */
+    static bool decompressChunk(const PacketView&compressed, Stream::StreamID&originalId, PacketView&original);
    /**
     * The a particular socket's connection failed
     * This function will call all substreams disconnected methods
@@ -228,16 +644,32 @@ public:
     */
     void connectedCallback() {
         connectionFailureOrSuccessCallback(CONNECTED,Stream::Connected);
+        startJoinTimer();
     }
 /**
  *  Connect a newly constructed MultiplexedSocket to a given address
  * \param address is a protocol-agnostic string of endpoint and service ID
  * \param numSockets indicates how many TCP sockets should manage the orderlessness of this connection
+ * \param earlyConnect connects as soon as socket 0 finishes its handshake, bringing the others in as theirs finish
  */
-    void connect(const Address&address, unsigned int numSockets);
+    void connect(const Address&address, unsigned int numSockets, bool earlyConnect=false);
+    ///Marks a socket of the original handshake that was joining active, releasing held control packets if it was the last: returns false if it was given up on
+    bool baseSocketJoined(unsigned int whichSocket);
+    /**
+     * Gives up on a socket of the original handshake that was joining, releasing held control packets if it was the last.
+     * Must be called from within mStrand
+     * \returns false, leaving the socket be, if either side cannot resize: the other side then counts control packets
+     *          on every socket of the handshake, so the connection cannot go on without it
+     */
+    bool baseSocketFailed(unsigned int whichSocket, const std::string&error);
+    ///Whether some socket of the original handshake has yet to join a connection that started early
+    bool isJoiningBaseSockets()const {
+        return mJoiningBaseSockets.read()!=0;
+    }
 
+    ///The number of sockets, including ones being added or retired and places left by retired ones
     unsigned int numSockets() const {
-        return mSockets.size();
+        return mNumSockets.read();
     }
     ASIOSocketWrapper&getASIOSocketWrapper(unsigned int whichSocket){
         return mSockets[whichSocket];
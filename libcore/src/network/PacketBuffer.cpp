@@ -0,0 +1,124 @@
+/*  Sirikata Network Utilities
+ *  PacketBuffer.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "util/Standard.hh"
+#include "Stream.hpp"
+#include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
+namespace Sirikata { namespace Network {
+
+/**
+ * Holds a free list of unused PacketBuffers for every size class.
+ * Each free list is bounded to about MAX_POOLED_BYTES of memory so that a burst of traffic does not pin memory forever
+ */
+class PacketBufferPool {
+    enum {
+        MAX_POOLED_BYTES=(1<<20),
+        MIN_POOLED_BUFFERS=16
+    };
+    ThreadSafeQueue<PacketBuffer*> mFreeBuffers[PacketBuffer::NUM_SIZE_CLASSES];
+    AtomicValue<int> mNumFreeBuffers[PacketBuffer::NUM_SIZE_CLASSES];
+    static size_t capacity(unsigned int sizeClass) {
+        return ((size_t)PacketBuffer::MIN_POOLED_SIZE)<<sizeClass;
+    }
+    static int maxFreeBuffers(unsigned int sizeClass) {
+        size_t retval=MAX_POOLED_BYTES/capacity(sizeClass);
+        return retval<MIN_POOLED_BUFFERS?MIN_POOLED_BUFFERS:(int)retval;
+    }
+public:
+    PacketBufferPool() {
+        for (unsigned int i=0;i<PacketBuffer::NUM_SIZE_CLASSES;++i) {
+            mNumFreeBuffers[i]=0;
+        }
+    }
+    ///The pool is never destroyed, so buffers released during static destruction still have somewhere to go
+    static PacketBufferPool&getSingleton() {
+        static PacketBufferPool*sPool=new PacketBufferPool;
+        return *sPool;
+    }
+    PacketBuffer*allocate(size_t size) {
+        unsigned int sizeClass=0;
+        while (sizeClass<PacketBuffer::NUM_SIZE_CLASSES&&capacity(sizeClass)<size) {
+            ++sizeClass;
+        }
+        PacketBuffer*retval=NULL;
+        if (sizeClass<PacketBuffer::NUM_SIZE_CLASSES&&mFreeBuffers[sizeClass].pop(retval)) {
+            --mNumFreeBuffers[sizeClass];
+            retval->mRefCount=1;
+            retval->mExpiresAt=0;
+            retval->mReplaceKey=0;
+            retval->mReplaced=false;
+            retval->mQueuedAt=0;
+            retval->mStandsFor=NULL;
+        }else {
+            retval=new PacketBuffer(sizeClass);
+            if (sizeClass<PacketBuffer::NUM_SIZE_CLASSES)
+                retval->reserve(capacity(sizeClass));
+        }
+        retval->resize(size);
+        return retval;
+    }
+    void release(PacketBuffer*buffer) {
+        unsigned int sizeClass=buffer->mSizeClass;
+        if (sizeClass<PacketBuffer::NUM_SIZE_CLASSES&&++mNumFreeBuffers[sizeClass]<=maxFreeBuffers(sizeClass)) {
+            buffer->resize(0);
+            mFreeBuffers[sizeClass].push(buffer);
+        }else {
+            if (sizeClass<PacketBuffer::NUM_SIZE_CLASSES)
+                --mNumFreeBuffers[sizeClass];
+            delete buffer;
+        }
+    }
+};
+
+PacketBuffer* PacketBuffer::allocate(size_t size) {
+    return PacketBufferPool::getSingleton().allocate(size);
+}
+
+PacketBuffer* PacketBuffer::allocate(const uint8*begin, const uint8*end) {
+    PacketBuffer*retval=PacketBufferPool::getSingleton().allocate(end-begin);
+    if (begin!=end)
+        std::memcpy(&*retval->begin(),begin,end-begin);
+    return retval;
+}
+
+void PacketBuffer::unref() {
+    if (--mRefCount==0) {
+        if (mStandsFor) {
+            mStandsFor->unref();
+            mStandsFor=NULL;
+        }
+        PacketBufferPool::getSingleton().release(this);
+    }
+}
+
+} }
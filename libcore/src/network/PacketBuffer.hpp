@@ -0,0 +1,181 @@
+/*  Sirikata Network Utilities
+ *  PacketBuffer.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIRIKATA_PacketBuffer_HPP__
+#define SIRIKATA_PacketBuffer_HPP__
+#include "util/AtomicTypes.hpp"
+namespace Sirikata { namespace Network {
+typedef std::vector<uint8> Chunk;
+
+/**
+ * A Chunk that is shared by intrusive reference count and recycled through a size-classed pool instead of being deleted.
+ * PacketBuffers are used on the send path wherever a Chunk* used to be newed and queued so that steady state sending
+ * performs no heap allocation.
+ * A buffer waiting in a socket's send queue is linked through mNextQueued, so it may only wait in one send queue at a time:
+ * other queues are handed an empty placeholder that stands in for it (see mStandsFor).
+ * Never delete a PacketBuffer: call unref() when done with a reference
+ */
+class SIRIKATA_EXPORT PacketBuffer : public Chunk {
+    ///The number of outstanding references: the buffer returns to the pool when this drops to zero
+    AtomicValue<int> mRefCount;
+    ///Which pool free list this buffer returns to, or NUM_SIZE_CLASSES if it is too large to be pooled
+    unsigned int mSizeClass;
+    ///The link to the next buffer in the LockFreeBatchQueue this buffer is waiting in
+    PacketBuffer*mNextQueued;
+    ///When an unreliable packet still waiting in a send queue is no longer worth sending, in microseconds, or 0 if never
+    int64 mExpiresAt;
+    ///Nonzero if a later packet with the same key replaces this one while it waits to be sent
+    uint64 mReplaceKey;
+    ///Set once a later packet with the same mReplaceKey has been queued behind this one
+    bool mReplaced;
+    ///When the packet was handed to a socket's send queue, in microseconds, so the time it waits there may be measured
+    int64 mQueuedAt;
+    ///The buffer this empty placeholder carries through a send queue on its behalf, holding a reference to it, or NULL
+    PacketBuffer*mStandsFor;
+    PacketBuffer(unsigned int sizeClass):mRefCount(1),mSizeClass(sizeClass),mNextQueued(NULL),mExpiresAt(0),mReplaceKey(0),mReplaced(false),mQueuedAt(0),mStandsFor(NULL){}
+    ~PacketBuffer(){}
+    friend class PacketBufferPool;
+    friend class ASIOSocketWrapper;
+public:
+    enum {
+        ///The capacity of the smallest size class: each following class doubles in capacity
+        MIN_POOLED_SIZE=64,
+        ///The number of size classes: buffers larger than MIN_POOLED_SIZE<<(NUM_SIZE_CLASSES-1) are not pooled
+        NUM_SIZE_CLASSES=11
+    };
+    /**
+     * Returns a buffer of exactly size bytes with a reference count of one, recycled from the pool if possible.
+     * The contents of the buffer are unspecified
+     */
+    static PacketBuffer* allocate(size_t size);
+    ///Returns a buffer holding a copy of the bytes between begin and end with a reference count of one
+    static PacketBuffer* allocate(const uint8*begin, const uint8*end);
+    ///Returns true if the caller holds the only reference, so the contents may be rewritten in place
+    bool unique() const {
+        return mRefCount.read()==1;
+    }
+    ///Adds another reference to this buffer, to be released with a matching call to unref()
+    void ref() {
+        ++mRefCount;
+    }
+    ///Releases a reference to this buffer: the last release returns the buffer to the pool
+    void unref();
+    /**
+     * Lets the send queue discard this packet rather than send it once it is stale
+     * \param expiresAt is when the packet is no longer worth sending in microseconds since Task::AbsTime::null(), or 0 if never
+     * \param replaceKey if nonzero, a later packet with the same key replaces this one while it is unsent: the key should
+     *        name the stream as well as what the packet is about
+     */
+    void setStaleness(int64 expiresAt, uint64 replaceKey) {
+        mExpiresAt=expiresAt;
+        mReplaceKey=replaceKey;
+    }
+    ///The key set by setStaleness, or 0 if no later packet replaces this one
+    uint64 getReplaceKey()const {
+        return mReplaceKey;
+    }
+};
+
+/**
+ * A lightweight (buffer, offset, length) slice of a PacketBuffer handed to BytesReceivedCallbacks.
+ * Each PacketView holds a reference on its buffer, so a callback may copy the view to retain the bytes past the
+ * callback without copying them; the buffer is only recycled once every view into it is destroyed.
+ * Legacy code expecting a Chunk may convert a view implicitly, at the cost of a copy
+ */
+class SIRIKATA_EXPORT PacketView {
+    PacketBuffer*mBuffer;
+    size_t mOffset;
+    size_t mLength;
+public:
+    typedef uint8 value_type;
+    typedef const uint8* const_iterator;
+    PacketView():mBuffer(NULL),mOffset(0),mLength(0){}
+    ///Makes a view of length bytes of buffer starting at offset, adding a reference to buffer
+    PacketView(PacketBuffer*buffer,size_t offset,size_t length):mBuffer(buffer),mOffset(offset),mLength(length){
+        if (mBuffer)
+            mBuffer->ref();
+    }
+    ///Makes a view of length bytes of whole starting offset bytes into it
+    PacketView(const PacketView&whole,size_t offset,size_t length):mBuffer(whole.mBuffer),mOffset(whole.mOffset+offset),mLength(length){
+        assert(offset+length<=whole.mLength);
+        if (mBuffer)
+            mBuffer->ref();
+    }
+    PacketView(const PacketView&other):mBuffer(other.mBuffer),mOffset(other.mOffset),mLength(other.mLength){
+        if (mBuffer)
+            mBuffer->ref();
+    }
+    PacketView&operator=(const PacketView&other) {
+        if (other.mBuffer)
+            other.mBuffer->ref();
+        if (mBuffer)
+            mBuffer->unref();
+        mBuffer=other.mBuffer;
+        mOffset=other.mOffset;
+        mLength=other.mLength;
+        return *this;
+    }
+    ~PacketView() {
+        if (mBuffer)
+            mBuffer->unref();
+    }
+    ///The first byte of the view, or NULL if the view is empty
+    const uint8*data()const {
+        return mLength?&(*mBuffer)[mOffset]:NULL;
+    }
+    size_t size()const {
+        return mLength;
+    }
+    bool empty()const {
+        return mLength==0;
+    }
+    const_iterator begin()const {
+        return data();
+    }
+    const_iterator end()const {
+        return data()+mLength;
+    }
+    const uint8&operator[](size_t i)const {
+        return (*mBuffer)[mOffset+i];
+    }
+    ///The underlying shared buffer, which must not be modified while the view is live
+    PacketBuffer*buffer()const {
+        return mBuffer;
+    }
+    ///Copies the viewed bytes out into a standalone Chunk
+    operator Chunk()const {
+        return Chunk(begin(),end());
+    }
+};
+
+} }
+#endif
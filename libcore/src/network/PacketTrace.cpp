@@ -0,0 +1,374 @@
+/*  Sirikata Network Utilities
+ *  PacketTrace.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "util/Standard.hh"
+#include "TCPDefinitions.hpp"
+#include "TCPStream.hpp"
+#include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
+#include "ASIOSocketWrapper.hpp"
+#include "MultiplexedSocket.hpp"
+#include "PacketTrace.hpp"
+#include <fstream>
+
+namespace Sirikata { namespace Network {
+
+namespace {
+const char TRACE_MAGIC[]="SSTTRACE";
+const unsigned int TRACE_MAGIC_LENGTH=8;
+const uint8 TRACE_VERSION=1;
+///The largest gap between packets a trace file records: longer gaps are shortened to it
+const int64 MAX_TRACE_GAP=(1<<30)-1;
+}
+
+PacketTrace::PacketTrace(size_t capacity, const std::string&errorTraceFile):mRing(capacity),mBegin(0),mUsed(0),mDroppedRecords(0),mErrorTraceFile(errorTraceFile) {
+}
+
+void PacketTrace::copyIn(size_t offset, const uint8*source, size_t length) {
+    size_t first=std::min(length,mRing.size()-offset);
+    if (first)
+        std::memcpy(&mRing[offset],source,first);
+    if (length>first)
+        std::memcpy(&mRing[0],source+first,length-first);
+}
+
+void PacketTrace::copyOut(size_t offset, uint8*destination, size_t length)const {
+    size_t first=std::min(length,mRing.size()-offset);
+    if (first)
+        std::memcpy(destination,&mRing[offset],first);
+    if (length>first)
+        std::memcpy(destination+first,&mRing[0],length-first);
+}
+
+void PacketTrace::record(Direction direction, unsigned int whichSocket, int64 time, const uint8*header, size_t headerLength, const uint8*data, size_t dataLength) {
+    size_t total=RECORD_HEADER_SIZE+headerLength+dataLength;
+    if (total>mRing.size()) {
+        ++mDroppedRecords;
+        return;
+    }
+    uint8 recordHeader[RECORD_HEADER_SIZE];
+    uint32 length=(uint32)(headerLength+dataLength);
+    std::memcpy(recordHeader,&time,sizeof(time));
+    std::memcpy(recordHeader+sizeof(time),&length,sizeof(length));
+    recordHeader[sizeof(time)+sizeof(length)]=(uint8)direction;
+    recordHeader[sizeof(time)+sizeof(length)+1]=(uint8)whichSocket;
+    boost::lock_guard<boost::mutex> lok(mMutex);
+    while (mRing.size()-mUsed<total) {
+        uint32 oldLength;
+        copyOut((mBegin+sizeof(int64))%mRing.size(),(uint8*)&oldLength,sizeof(oldLength));
+        size_t oldTotal=RECORD_HEADER_SIZE+oldLength;
+        mBegin=(mBegin+oldTotal)%mRing.size();
+        mUsed-=oldTotal;
+        ++mDroppedRecords;
+    }
+    size_t end=(mBegin+mUsed)%mRing.size();
+    copyIn(end,recordHeader,RECORD_HEADER_SIZE);
+    copyIn((end+RECORD_HEADER_SIZE)%mRing.size(),header,headerLength);
+    copyIn((end+RECORD_HEADER_SIZE+headerLength)%mRing.size(),data,dataLength);
+    mUsed+=total;
+}
+
+void PacketTrace::snapshot(std::vector<Record>&records)const {
+    boost::lock_guard<boost::mutex> lok(mMutex);
+    size_t offset=mBegin;
+    for (size_t used=0;used<mUsed;) {
+        uint8 recordHeader[RECORD_HEADER_SIZE];
+        copyOut(offset,recordHeader,RECORD_HEADER_SIZE);
+        records.push_back(Record());
+        Record&record=records.back();
+        uint32 length;
+        std::memcpy(&record.mTime,recordHeader,sizeof(record.mTime));
+        std::memcpy(&length,recordHeader+sizeof(record.mTime),sizeof(length));
+        record.mDirection=(Direction)recordHeader[sizeof(record.mTime)+sizeof(length)];
+        record.mSocket=recordHeader[sizeof(record.mTime)+sizeof(length)+1];
+        record.mData.resize(length);
+        if (length)
+            copyOut((offset+RECORD_HEADER_SIZE)%mRing.size(),&record.mData[0],length);
+        offset=(offset+RECORD_HEADER_SIZE+length)%mRing.size();
+        used+=RECORD_HEADER_SIZE+length;
+    }
+}
+
+void PacketTrace::setErrorTraceFile(const std::string&errorTraceFile) {
+    boost::lock_guard<boost::mutex> lok(mMutex);
+    mErrorTraceFile=errorTraceFile;
+}
+
+void PacketTrace::writeErrorTrace() {
+    std::string filename;
+    {
+        boost::lock_guard<boost::mutex> lok(mMutex);
+        //every socket of the connection reports the loss, but one trace is enough
+        filename.swap(mErrorTraceFile);
+    }
+    if (filename.empty())
+        return;
+    if (write(filename)) {
+        SILOG(tcpsst,info,"Wrote packet trace of lost connection to "<<filename);
+    }else {
+        SILOG(tcpsst,error,"Could not write packet trace of lost connection to "<<filename);
+    }
+}
+
+/**
+ * A trace file starts with TRACE_MAGIC, TRACE_VERSION and the time of the first packet as 8 bytes, most significant first.
+ * Each packet follows as a byte holding its Direction in the low bit and its socket above it, the microseconds since the
+ * previous packet and its length as Stream::uint30s, and then its bytes
+ */
+bool PacketTrace::write(const std::string&filename)const {
+    std::vector<Record> records;
+    snapshot(records);
+    std::ofstream file(filename.c_str(),std::ios::out|std::ios::binary|std::ios::trunc);
+    if (!file)
+        return false;
+    uint8 header[TRACE_MAGIC_LENGTH+1+sizeof(int64)];
+    std::memcpy(header,TRACE_MAGIC,TRACE_MAGIC_LENGTH);
+    header[TRACE_MAGIC_LENGTH]=TRACE_VERSION;
+    int64 previous=records.empty()?0:records.front().mTime;
+    for (unsigned int i=0;i<sizeof(int64);++i) {
+        header[TRACE_MAGIC_LENGTH+1+i]=(uint8)(previous>>(8*(sizeof(int64)-1-i)));
+    }
+    file.write((const char*)header,sizeof(header));
+    for (std::vector<Record>::const_iterator i=records.begin(),ie=records.end();i!=ie;++i) {
+        uint8 framing[1+2*Stream::uint30::MAX_SERIALIZED_LENGTH];
+        framing[0]=(uint8)(i->mDirection|(i->mSocket<<1));
+        //sockets send on their own threads, so packets may have been recorded slightly out of order
+        int64 gap=std::max(std::min(i->mTime-previous,MAX_TRACE_GAP),(int64)0);
+        previous+=gap;
+        unsigned int size=1;
+        size+=Stream::uint30((uint32)gap).serialize(framing+size,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        size+=Stream::uint30((uint32)i->mData.size()).serialize(framing+size,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        file.write((const char*)framing,size);
+        if (!i->mData.empty())
+            file.write((const char*)&i->mData[0],i->mData.size());
+    }
+    return file.good();
+}
+
+bool PacketTrace::read(const std::string&filename, std::vector<Record>&records) {
+    std::ifstream file(filename.c_str(),std::ios::in|std::ios::binary);
+    std::vector<uint8> contents((std::istreambuf_iterator<char>(file)),std::istreambuf_iterator<char>());
+    const size_t headerLength=TRACE_MAGIC_LENGTH+1+sizeof(int64);
+    if (!file.is_open()||contents.size()<headerLength||std::memcmp(&contents[0],TRACE_MAGIC,TRACE_MAGIC_LENGTH)!=0||contents[TRACE_MAGIC_LENGTH]!=TRACE_VERSION)
+        return false;
+    int64 time=0;
+    for (unsigned int i=0;i<sizeof(int64);++i) {
+        time=(time<<8)|contents[TRACE_MAGIC_LENGTH+1+i];
+    }
+    size_t pos=headerLength;
+    while (pos<contents.size()) {
+        uint8 flags=contents[pos++];
+        Stream::uint30 gap,length;
+        unsigned int gapLength=(unsigned int)(contents.size()-pos);
+        if (pos>=contents.size()||!gap.unserialize(&contents[pos],gapLength))
+            return false;
+        pos+=gapLength;
+        unsigned int lengthLength=(unsigned int)(contents.size()-pos);
+        if (pos>=contents.size()||!length.unserialize(&contents[pos],lengthLength))
+            return false;
+        pos+=lengthLength;
+        if (contents.size()-pos<length.read())
+            return false;
+        time+=gap.read();
+        records.push_back(Record());
+        Record&record=records.back();
+        record.mTime=time;
+        record.mDirection=(Direction)(flags&1);
+        record.mSocket=flags>>1;
+        record.mData.assign(contents.begin()+pos,contents.begin()+pos+length.read());
+        pos+=length.read();
+    }
+    return true;
+}
+
+class PacketTraceReplay::Player {
+public:
+    IOStrand mStrand;
+    ///The sockets the packets are written to, one for each socket of the traced connection
+    std::vector<TCPSocket*> mFeeders;
+    ///Where whatever the connection sends back is read into and forgotten
+    std::vector<Chunk> mDiscard;
+    std::vector<PacketTrace::Record> mRecords;
+    ///The next packet to play
+    size_t mNext;
+    std::vector<boost::asio::const_buffer> mGather;
+    IODeadlineTimer mTimer;
+    double mPace;
+    ///When play started, in microseconds
+    int64 mStart;
+    AtomicValue<uint32> mPlayed;
+    AtomicValue<uint32> mFinished;
+    ///Set once the replay is destroyed, after which nothing more is written: only touched from handlers in mStrand
+    bool mStopped;
+    enum {
+        ///The most packets gathered into a single write
+        MAX_GATHER_PACKETS=64,
+        ///No further packets are gathered into a write once it has this many bytes
+        MAX_GATHER_BYTES=65536,
+        DISCARD_BUFFER_SIZE=4096
+    };
+    Player(IOService&io):mStrand(io),mNext(0),mTimer(io),mPace(0.0),mStart(0),mPlayed(0),mFinished(0),mStopped(false) {
+    }
+    ~Player() {
+        for (std::vector<TCPSocket*>::iterator i=mFeeders.begin(),ie=mFeeders.end();i!=ie;++i) {
+            delete *i;
+        }
+    }
+    static void playNext(const std::tr1::shared_ptr<Player>&thus) {
+        if (thus->mStopped)
+            return;
+        if (thus->mNext==thus->mRecords.size()) {
+            thus->mFinished=1;
+            return;
+        }
+        int64 now=(Task::AbsTime::now()-Task::AbsTime::null()).toMicro();
+        int64 firstTime=thus->mRecords.front().mTime;
+        if (thus->mPace>0.0) {
+            int64 due=thus->mStart+(int64)((thus->mRecords[thus->mNext].mTime-firstTime)*thus->mPace);
+            if (due>now) {
+                thus->mTimer.expires_from_now(boost::posix_time::microseconds(due-now));
+                thus->mTimer.async_wait(thus->mStrand.wrap(std::tr1::bind(&Player::waited,thus,_1)));
+                return;
+            }
+        }
+        //packets bound for the same socket that are already due share a write
+        unsigned int whichSocket=thus->mRecords[thus->mNext].mSocket;
+        size_t count=0,bytes=0;
+        thus->mGather.resize(0);
+        for (size_t i=thus->mNext;i<thus->mRecords.size()&&count<MAX_GATHER_PACKETS&&bytes<MAX_GATHER_BYTES;++i,++count) {
+            const PacketTrace::Record&record=thus->mRecords[i];
+            if (record.mSocket!=whichSocket)
+                break;
+            if (thus->mPace>0.0&&thus->mStart+(int64)((record.mTime-firstTime)*thus->mPace)>now)
+                break;
+            if (!record.mData.empty())
+                thus->mGather.push_back(boost::asio::const_buffer(&record.mData[0],record.mData.size()));
+            bytes+=record.mData.size();
+        }
+        boost::asio::async_write(*thus->mFeeders[whichSocket],
+                                 thus->mGather,
+                                 thus->mStrand.wrap(std::tr1::bind(&Player::written,thus,count,_1,_2)));
+    }
+    static void waited(const std::tr1::shared_ptr<Player>&thus, const boost::system::error_code&error) {
+        if (!error)
+            playNext(thus);
+    }
+    static void written(const std::tr1::shared_ptr<Player>&thus, size_t count, const boost::system::error_code&error, std::size_t bytes_written) {
+        if (error) {
+            if (!thus->mStopped)
+                SILOG(tcpsst,warning,"Replayed connection stopped taking packets: "<<error.message());
+            thus->mFinished=1;
+            return;
+        }
+        thus->mNext+=count;
+        thus->mPlayed+=(uint32)count;
+        playNext(thus);
+    }
+    static void discard(const std::tr1::shared_ptr<Player>&thus, unsigned int whichSocket, const boost::system::error_code&error, std::size_t bytes_read) {
+        if (error||thus->mStopped)
+            return;
+        thus->mFeeders[whichSocket]->async_read_some(boost::asio::buffer(&thus->mDiscard[whichSocket][0],DISCARD_BUFFER_SIZE),
+                                                     thus->mStrand.wrap(std::tr1::bind(&Player::discard,thus,whichSocket,_1,_2)));
+    }
+    static void stop(const std::tr1::shared_ptr<Player>&thus) {
+        thus->mStopped=true;
+        thus->mTimer.cancel();
+        for (std::vector<TCPSocket*>::iterator i=thus->mFeeders.begin(),ie=thus->mFeeders.end();i!=ie;++i) {
+            boost::system::error_code ignored;
+            (*i)->close(ignored);
+        }
+    }
+};
+
+PacketTraceReplay::PacketTraceReplay(IOService&io):mIO(&io) {
+}
+
+PacketTraceReplay::~PacketTraceReplay() {
+    if (mPlayer)
+        mPlayer->mStrand.post(std::tr1::bind(&Player::stop,mPlayer));
+}
+
+bool PacketTraceReplay::play(const std::vector<PacketTrace::Record>&records, const Stream::SubstreamCallback&substreamCallback, double pace) {
+    if (mPlayer)
+        return false;
+    std::tr1::shared_ptr<Player> player(new Player(*mIO));
+    unsigned int numSockets=0;
+    for (std::vector<PacketTrace::Record>::const_iterator i=records.begin(),ie=records.end();i!=ie;++i) {
+        if (i->mDirection==PacketTrace::RECEIVED) {
+            player->mRecords.push_back(*i);
+            if (i->mSocket>=numSockets)
+                numSockets=i->mSocket+1;
+        }
+    }
+    if (numSockets==0)
+        numSockets=1;
+    std::vector<TCPSocket*> sockets;
+    boost::system::error_code error;
+    TCPListener acceptor(*mIO,boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(),0));
+    for (unsigned int i=0;i<numSockets&&!error;++i) {
+        player->mFeeders.push_back(new TCPSocket(*mIO));
+        player->mDiscard.push_back(Chunk(Player::DISCARD_BUFFER_SIZE));
+        //the connection waits in the backlog, so it may be accepted after it is made
+        player->mFeeders.back()->connect(acceptor.local_endpoint(),error);
+        if (!error) {
+            sockets.push_back(new TCPSocket(*mIO));
+            acceptor.accept(*sockets.back(),error);
+        }
+    }
+    if (error) {
+        SILOG(tcpsst,error,"Could not connect a socket to replay a trace into: "<<error.message());
+        for (std::vector<TCPSocket*>::iterator i=sockets.begin(),ie=sockets.end();i!=ie;++i) {
+            delete *i;
+        }
+        return false;
+    }
+    player->mPace=pace;
+    player->mStart=(Task::AbsTime::now()-Task::AbsTime::null()).toMicro();
+    mConnection=MultiplexedSocket::construct(mIO,UUID::random(),sockets,numSockets,substreamCallback);
+    mConnection->getStrand().dispatch(std::tr1::bind(&MultiplexedSocket::sendAllProtocolHeaders,mConnection,UUID::random()));
+    mPlayer=player;
+    for (unsigned int i=0;i<numSockets;++i) {
+        player->mStrand.post(std::tr1::bind(&Player::discard,player,i,boost::system::error_code(),0));
+    }
+    player->mStrand.post(std::tr1::bind(&Player::playNext,player));
+    return true;
+}
+
+bool PacketTraceReplay::finished()const {
+    return mPlayer&&mPlayer->mFinished.read();
+}
+
+size_t PacketTraceReplay::packetsPlayed()const {
+    return mPlayer?mPlayer->mPlayed.read():0;
+}
+
+} }
@@ -0,0 +1,136 @@
+/*  Sirikata Network Utilities
+ *  PacketTrace.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SIRIKATA_PACKETTRACE_HPP_
+#define _SIRIKATA_PACKETTRACE_HPP_
+#include "Stream.hpp"
+#include <boost/thread/mutex.hpp>
+
+namespace Sirikata { namespace Network {
+class IOService;
+class MultiplexedSocket;
+/**
+ * Remembers the most recent packets a connection sent and received, each exactly as it was framed on the wire,
+ * in a ring of fixed size so it may be left on under load: once the ring is full the oldest packets make room.
+ * The packets may be written to a compact binary trace file at any time, or when the connection is lost,
+ * and played back into a connection with PacketTraceReplay
+ */
+class SIRIKATA_EXPORT PacketTrace : public Noncopyable {
+public:
+    enum Direction {
+        SENT=0,
+        RECEIVED=1
+    };
+    ///A packet of the trace
+    class Record {
+    public:
+        ///When the packet was sent or received, in microseconds since Task::AbsTime::null()
+        int64 mTime;
+        Direction mDirection;
+        ///Which TCP connection of the MultiplexedSocket carried the packet
+        unsigned int mSocket;
+        ///The packet, including its length and StreamID framing
+        Chunk mData;
+    };
+    ///The packets traced so far are written to this file if the connection is lost, unless it is empty
+    explicit PacketTrace(size_t capacity, const std::string&errorTraceFile=std::string());
+    /**
+     * Adds a packet to the ring, which is framed by header followed by data: either may be empty.
+     * Packets longer than the whole ring are not kept
+     */
+    void record(Direction direction, unsigned int whichSocket, int64 time, const uint8*header, size_t headerLength, const uint8*data, size_t dataLength);
+    ///Copies the packets in the ring, oldest first
+    void snapshot(std::vector<Record>&records)const;
+    ///The number of packets that were pushed out of the ring or were too long to keep
+    uint32 getDroppedRecords()const {
+        return mDroppedRecords.read();
+    }
+    void setErrorTraceFile(const std::string&errorTraceFile);
+    ///Writes the trace to the error trace file, if one was given and the trace was not written there already
+    void writeErrorTrace();
+    ///Writes the packets in the ring to a trace file, returning false if the file could not be written
+    bool write(const std::string&filename)const;
+    ///Reads the packets of a trace file, returning false if it is not a whole trace file
+    static bool read(const std::string&filename, std::vector<Record>&records);
+private:
+    ///The size of the fields stored ahead of each packet in the ring
+    enum {
+        RECORD_HEADER_SIZE=sizeof(int64)+sizeof(uint32)+2
+    };
+    ///Copies length bytes into the ring at offset, wrapping around its end
+    void copyIn(size_t offset, const uint8*source, size_t length);
+    ///Copies length bytes out of the ring at offset, wrapping around its end
+    void copyOut(size_t offset, uint8*destination, size_t length)const;
+    ///Protects everything but mDroppedRecords, since every socket of a connection may send on its own thread
+    mutable boost::mutex mMutex;
+    std::vector<uint8> mRing;
+    ///Where the oldest packet starts
+    size_t mBegin;
+    ///The number of bytes in use, starting at mBegin
+    size_t mUsed;
+    AtomicValue<uint32> mDroppedRecords;
+    std::string mErrorTraceFile;
+};
+
+/**
+ * Plays the packets a connection received, as captured by a PacketTrace, into a fresh connection over loopback TCP, so that
+ * the read path and the streams the packets open handle them exactly as they did live.
+ * The connection is built as a listener builds one and the streams the packets open are handed to a SubstreamCallback.
+ * Whatever the connection sends in answer is discarded. The other side stays up after the last packet is played,
+ * since a connection that loses any of its sockets drops what the others have yet to deliver: it hangs up once the replay is destroyed
+ */
+class SIRIKATA_EXPORT PacketTraceReplay : public Noncopyable {
+public:
+    class Player;
+private:
+    IOService*mIO;
+    std::tr1::shared_ptr<Player> mPlayer;
+    std::tr1::shared_ptr<MultiplexedSocket> mConnection;
+public:
+    ///The io service must be run by another thread for the replay to make progress
+    explicit PacketTraceReplay(IOService&io);
+    ///Stops playing any packets that remain
+    ~PacketTraceReplay();
+    /**
+     * Starts playing the RECEIVED packets of records into a new connection
+     * \param substreamCallback is handed each stream the packets open
+     * \param pace scales the recorded time between packets: 1.0 plays them as fast as they arrived, 0.0 as fast as possible
+     * \returns false if the connection could not be set up
+     */
+    bool play(const std::vector<PacketTrace::Record>&records, const Stream::SubstreamCallback&substreamCallback, double pace=0.0);
+    ///Whether every packet has been handed to the operating system
+    bool finished()const;
+    ///The number of packets handed to the operating system so far
+    size_t packetsPlayed()const;
+};
+
+} }
+#endif
@@ -38,7 +38,7 @@ void Stream::ignoreSubstreamCallback(Stream * stream, SetCallbacks&) {
 }
 void Stream::ignoreConnectionStatus(Stream::ConnectionStatus status, const std::string&) {
 }
-void Stream::ignoreBytesReceived(const Chunk&c) {
+void Stream::ignoreBytesReceived(const PacketView&c) {
 #if 0
     std::stringstream ss;
     ss<<"ignoring: ";
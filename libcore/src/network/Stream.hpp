@@ -33,10 +33,11 @@
 #ifndef SIRIKATA_Stream_HPP__
 #define SIRIKATA_Stream_HPP__
 #include "Address.hpp"
+#include "PacketBuffer.hpp"
+#include "task/Time.hpp"
 namespace Sirikata {
 /// Network contains Stream and TCPStream.
 namespace Network {
-typedef std::vector<uint8> Chunk;
 
 
 ///Codes indicating if packet sending should be reliable or not,and in order or not
@@ -133,8 +134,14 @@ public:
     };
     ///Callback type for when a connection happens (or doesn't) Callees will receive a ConnectionStatus code indicating connection successful, rejected or a later disconnection event
     typedef std::tr1::function<void(ConnectionStatus,const std::string&reason)> ConnectionCallback;
-    ///Callback type for when a full chunk of bytes are waiting on the stream
-    typedef std::tr1::function<void(const Chunk&)> BytesReceivedCallback;
+    /**
+     * Callback type for when a full chunk of bytes are waiting on the stream.
+     * The PacketView may be copied to keep the bytes alive after the callback returns without copying the data,
+     * and functions taking a const Chunk& may still be bound, in which case the bytes are copied out
+     */
+    typedef std::tr1::function<void(const PacketView&)> BytesReceivedCallback;
+    ///Callback type for when a stream that refused data from trySend is ready to accept more
+    typedef std::tr1::function<void()> WritableCallback;
     /**
      *  This class is passed into any newSubstreamCallback functions so they may 
      *  immediately setup callbacks for connetion events and possibly start sending immediate responses.     
@@ -160,7 +167,7 @@ public:
     ///Simple example function to ignore connection requests
     static void ignoreConnectionStatus(ConnectionStatus status,const std::string&reason);
     ///Simple example function to ignore incoming bytes on a connection
-    static void ignoreBytesReceived(const Chunk&);
+    static void ignoreBytesReceived(const PacketView&);
     /**
      * Will attempt to connect to the given provided address, specifying all callbacks for the first successful stream
      * The stream is immediately active and may have bytes sent on it immediately. 
@@ -181,6 +188,23 @@ public:
     
     ///Send a chunk of data to the receiver
     virtual void send(const Chunk&data,StreamReliability)=0;
+    /**
+     * Send a chunk of data that goes stale: Unreliable data still waiting in a send queue once timeToLive has passed is
+     * discarded rather than sent. Reliable data is sent exactly as by send(data,reliability)
+     * \param replaceKey if nonzero, Unreliable data this stream sent with the same key that is still waiting to be sent is
+     *        discarded in favor of this data, so only the newest update about something goes out
+     */
+    virtual void send(const Chunk&data,StreamReliability,const Task::DeltaTime&timeToLive,uint32 replaceKey=0)=0;
+    /**
+     * Sends a chunk of data to the receiver unless too much data is already waiting to go out.
+     * \returns true if the data was queued, or false if it was refused, in which case the WritableCallback
+     *          will be called once the backlog drains and trySend may be expected to succeed again
+     */
+    virtual bool trySend(const Chunk&data,StreamReliability)=0;
+    ///Sets the function called when a stream that refused data from trySend is ready to accept more
+    virtual void setWritableCallback(const WritableCallback&writableCallback)=0;
+    ///Sends anything this stream's connection is holding back to coalesce with later data, for latency sensitive callers
+    virtual void flush()=0;
     ///close this stream: if it is the last stream, close the connection as well
     virtual void close()=0;
     virtual ~Stream(){};
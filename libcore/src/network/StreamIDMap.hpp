@@ -0,0 +1,202 @@
+/*  Sirikata Network Utilities
+ *  StreamIDMap.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SIRIKATA_STREAM_ID_MAP_HPP_
+#define _SIRIKATA_STREAM_ID_MAP_HPP_
+
+namespace Sirikata { namespace Network {
+
+/**
+ * A table from StreamID to T* laid out as pages of consecutive IDs.
+ * Each side of a connection hands out StreamIDs densely and reuses freed ones, so looking up a stream is
+ * an index into a page rather than a hash and a chain walk, and neighboring streams share cache lines.
+ * Pages are allocated when an ID in them is first set and kept until the table is destroyed.
+ * IDs are chosen by the remote side too, so only IDs below MAX_DENSE_ID are paged: larger ones go to a hash table,
+ * keeping the memory a peer can make the table hold proportional to the number of streams it opens
+ */
+template <class T> class StreamIDMap {
+    enum {
+        PAGE_BITS=8,
+        PAGE_SIZE=(1<<PAGE_BITS),
+        MAX_PAGES=64
+    };
+    class Page {
+    public:
+        T*mSlots[PAGE_SIZE];
+        Page() {
+            std::fill(mSlots,mSlots+PAGE_SIZE,(T*)NULL);
+        }
+    };
+    typedef std::tr1::unordered_map<unsigned int,T*> SparseMap;
+    ///The pages indexed by the high bits of the StreamID: NULL where no ID in the page has been set
+    std::vector<Page*> mPages;
+    ///The values of IDs too large to be paged
+    SparseMap mSparse;
+    ///The number of IDs holding a value
+    size_t mSize;
+    StreamIDMap(const StreamIDMap&);
+    StreamIDMap&operator=(const StreamIDMap&);
+public:
+    enum {
+        ///IDs from here up are kept in a hash table rather than pages
+        MAX_DENSE_ID=(MAX_PAGES<<PAGE_BITS)
+    };
+    ///Iterates over the IDs that hold a value: paged IDs in increasing order, then the rest in no particular order
+    class const_iterator {
+        const StreamIDMap*mMap;
+        size_t mIndex;
+        typename SparseMap::const_iterator mSparse;
+        void skipEmpty() {
+            size_t limit=mMap->mPages.size()<<PAGE_BITS;
+            while (mIndex<limit) {
+                const Page*page=mMap->mPages[mIndex>>PAGE_BITS];
+                if (page==NULL) {
+                    mIndex=((mIndex>>PAGE_BITS)+1)<<PAGE_BITS;
+                }else if (page->mSlots[mIndex&(PAGE_SIZE-1)]==NULL) {
+                    ++mIndex;
+                }else break;
+            }
+        }
+        bool paged()const {
+            return mIndex<(mMap->mPages.size()<<PAGE_BITS);
+        }
+    public:
+        const_iterator(const StreamIDMap*map, size_t index, typename SparseMap::const_iterator sparse):mMap(map),mIndex(index),mSparse(sparse) {
+            skipEmpty();
+        }
+        Stream::StreamID id()const {
+            return Stream::StreamID(paged()?(unsigned int)mIndex:mSparse->first);
+        }
+        T*value()const {
+            if (paged())
+                return mMap->mPages[mIndex>>PAGE_BITS]->mSlots[mIndex&(PAGE_SIZE-1)];
+            return mSparse->second;
+        }
+        const_iterator&operator++() {
+            if (paged()) {
+                ++mIndex;
+                skipEmpty();
+            }else {
+                ++mSparse;
+            }
+            return *this;
+        }
+        bool operator==(const const_iterator&other)const {
+            return mIndex==other.mIndex&&mSparse==other.mSparse;
+        }
+        bool operator!=(const const_iterator&other)const {
+            return !(*this==other);
+        }
+    };
+    StreamIDMap():mSize(0) {
+    }
+    ///Frees the pages but not the values they point to
+    ~StreamIDMap() {
+        for (typename std::vector<Page*>::iterator i=mPages.begin(),ie=mPages.end();i!=ie;++i) {
+            delete *i;
+        }
+    }
+    ///Returns the value for id, or NULL if it has none
+    T*get(const Stream::StreamID&id)const {
+        size_t page=id.read()>>PAGE_BITS;
+        if (page<mPages.size()) {
+            if (mPages[page])
+                return mPages[page]->mSlots[id.read()&(PAGE_SIZE-1)];
+        }else if (id.read()>=MAX_DENSE_ID) {
+            typename SparseMap::const_iterator where=mSparse.find((unsigned int)id.read());
+            if (where!=mSparse.end())
+                return where->second;
+        }
+        return NULL;
+    }
+    ///Sets the value for id, replacing any previous value. Setting NULL removes the value
+    void set(const Stream::StreamID&id, T*value) {
+        if (id.read()>=MAX_DENSE_ID) {
+            if (value==NULL) {
+                mSize-=mSparse.erase((unsigned int)id.read());
+            }else {
+                T*&slot=mSparse[(unsigned int)id.read()];
+                if (slot==NULL)
+                    ++mSize;
+                slot=value;
+            }
+            return;
+        }
+        size_t page=id.read()>>PAGE_BITS;
+        if (page>=mPages.size()) {
+            if (value==NULL)
+                return;
+            mPages.resize(page+1,NULL);
+        }
+        if (mPages[page]==NULL) {
+            if (value==NULL)
+                return;
+            mPages[page]=new Page;
+        }
+        T*&slot=mPages[page]->mSlots[id.read()&(PAGE_SIZE-1)];
+        if (slot==NULL&&value!=NULL)
+            ++mSize;
+        else if (slot!=NULL&&value==NULL)
+            --mSize;
+        slot=value;
+    }
+    ///Removes the value for id and returns it, or NULL if it had none
+    T*remove(const Stream::StreamID&id) {
+        T*retval=get(id);
+        if (retval)
+            set(id,NULL);
+        return retval;
+    }
+    size_t size()const {
+        return mSize;
+    }
+    bool empty()const {
+        return mSize==0;
+    }
+    ///The number of pages allocated for small IDs, which never exceeds MAX_DENSE_ID>>PAGE_BITS
+    size_t numPages()const {
+        size_t retval=0;
+        for (typename std::vector<Page*>::const_iterator i=mPages.begin(),ie=mPages.end();i!=ie;++i) {
+            if (*i)
+                ++retval;
+        }
+        return retval;
+    }
+    const_iterator begin()const {
+        return const_iterator(this,0,mSparse.begin());
+    }
+    const_iterator end()const {
+        return const_iterator(this,mPages.size()<<PAGE_BITS,mSparse.end());
+    }
+};
+
+} }
+#endif
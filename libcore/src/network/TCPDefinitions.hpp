@@ -39,11 +39,18 @@
 #include <boost/thread.hpp>
 namespace Sirikata { namespace Network {
 typedef boost::asio::ip::tcp::socket TCPSocket;
+typedef boost::asio::ip::udp::socket UDPSocket;
+typedef boost::asio::ip::udp::endpoint UDPEndpoint;
 typedef boost::asio::io_service InternalIOService;
+///Serializes the handlers of a single connection when its IOService is run by several threads
+typedef boost::asio::io_service::strand IOStrand;
+typedef boost::asio::deadline_timer IODeadlineTimer;
 class IOServiceFactory;
+class IOServicePool;
 class SIRIKATA_EXPORT IOService:public InternalIOService {
     friend class IOServiceFactory;
-    IOService();
+    friend class IOServicePool;
+    IOService(std::size_t concurrencyHint=1);
     ~IOService();
 public:
 };
@@ -51,10 +58,33 @@ class TCPListener :public boost::asio::ip::tcp::acceptor {
 public:
     template <class Endpoint> TCPListener(IOService&io,Endpoint ep):
         boost::asio::ip::tcp::acceptor(io,ep){}
+    ///Makes an acceptor that is not yet open, for socket options that must be set before it binds
+    explicit TCPListener(IOService&io):
+        boost::asio::ip::tcp::acceptor(io){}
 };
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+typedef boost::asio::local::stream_protocol::socket UnixSocket;
+class UnixListener :public boost::asio::local::stream_protocol::acceptor {
+public:
+    template <class Endpoint> UnixListener(IOService&io,Endpoint ep):
+        boost::asio::local::stream_protocol::acceptor(io,ep){}
+    ///Makes an acceptor that is not yet open, so that a failure to bind may be reported rather than thrown
+    explicit UnixListener(IOService&io):
+        boost::asio::local::stream_protocol::acceptor(io){}
+};
+/**
+ * Moves the connection of the Unix domain socket local into socket, leaving local closed.
+ * Connections only read, write and shut down their sockets, which a Unix domain socket does just like a TCP socket,
+ * so the same connection code serves processes on the same machine
+ */
+void AdoptUnixSocket(TCPSocket&socket, UnixSocket&local, boost::system::error_code&error);
+#endif
+/**
+ * Moves the connection of from into socket, which may belong to another IOService, leaving from closed.
+ * Fails with operation_not_supported where descriptors cannot be duplicated
+ */
+void AdoptTCPSocket(TCPSocket&socket, TCPSocket&from, boost::system::error_code&error);
 class MultiplexedSocket;
-#define TCPSSTLOG(thisname,extension,buffer,buffersize,error)
-// #define TCPSSTLOG(thisname,extension,buffer,buffersize,error)  if (!error) {Sirikata::Network::ASIOLogBuffer(thisname,extension,(buffersize)?(buffer):NULL,buffersize);}
 
 void MakeASIOReadBuffer(const std::tr1::shared_ptr<MultiplexedSocket> &parentSocket,unsigned int whichSocket);
 
@@ -42,7 +42,9 @@ public:
                             const Stream::BytesReceivedCallback &bytesReceivedCallback){
         mCallbacks=new TCPStream::Callbacks(connectionCallback,
                                             bytesReceivedCallback,
-                                            mStream->mSendStatus);
+                                            mStream->mSendStatus,
+                                            mStream->mPriority,
+                                            mStream->mTraffic);
         mMultiSocket->addCallbacks(mStream->getID(),mCallbacks);
     }
 };
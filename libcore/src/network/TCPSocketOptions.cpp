@@ -0,0 +1,156 @@
+/*  Sirikata Network Utilities
+ *  TCPSocketOptions.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "util/Standard.hh"
+#include "options/Options.hpp"
+#include "TCPSocketOptions.hpp"
+#include <boost/program_options.hpp>
+namespace Sirikata { namespace Network {
+namespace {
+OptionValue*sNoDelay;
+OptionValue*sSendBuffer;
+OptionValue*sReceiveBuffer;
+OptionValue*sQuickAck;
+OptionValue*sBusyPoll;
+OptionValue*sNotSentLowWater;
+OptionValue*sKeepAlive;
+OptionValue*sKeepAliveIdle;
+OptionValue*sKeepAliveInterval;
+InitializeGlobalOptions gTCPSocketOptions("",
+    sNoDelay=new OptionValue("tcpnodelay","true",OptionValueType<bool>(),"Sets TCP_NODELAY on TCP-SST connections so small packets are not held back"),
+    sSendBuffer=new OptionValue("tcpsendbuffer","0",OptionValueType<uint32>(),"SO_SNDBUF of TCP-SST connections in bytes: 0 leaves the system default"),
+    sReceiveBuffer=new OptionValue("tcpreceivebuffer","0",OptionValueType<uint32>(),"SO_RCVBUF of TCP-SST connections in bytes: 0 leaves the system default"),
+    sQuickAck=new OptionValue("tcpquickack","false",OptionValueType<bool>(),"Sets TCP_QUICKACK on TCP-SST connections as they come up"),
+    sBusyPoll=new OptionValue("tcpbusypoll","0",OptionValueType<uint32>(),"SO_BUSY_POLL of TCP-SST connections in microseconds: 0 does not busy poll"),
+    sNotSentLowWater=new OptionValue("tcpnotsentlowat","0",OptionValueType<uint32>(),"TCP_NOTSENT_LOWAT of TCP-SST connections in bytes: 0 leaves the system default"),
+    sKeepAlive=new OptionValue("tcpkeepalive","false",OptionValueType<bool>(),"Sets SO_KEEPALIVE on TCP-SST connections so a vanished peer is found out while idle"),
+    sKeepAliveIdle=new OptionValue("tcpkeepaliveidle","0",OptionValueType<uint32>(),"TCP_KEEPIDLE of kept alive TCP-SST connections in seconds: 0 leaves the system default"),
+    sKeepAliveInterval=new OptionValue("tcpkeepaliveinterval","0",OptionValueType<uint32>(),"TCP_KEEPINTVL of kept alive TCP-SST connections in seconds: 0 leaves the system default"),
+    NULL);
+
+//reads values the way OptionValueType does for the global options
+void readOption(const boost::program_options::variables_map&values,const char*name,bool&value) {
+    if (values.count(name)) {
+        const String&text=values[name].as<String>();
+        value=text.size()&&(text[0]=='T'||text[0]=='t'||text[0]=='1'||text[0]=='Y'||text[0]=='y');
+    }
+}
+void readOption(const boost::program_options::variables_map&values,const char*name,uint32&value) {
+    if (values.count(name)) {
+        value=0;
+        std::istringstream text(values[name].as<String>());
+        text>>value;
+    }
+}
+}
+
+TCPSocketOptions::TCPSocketOptions():
+        mNoDelay(sNoDelay->as<bool>()),
+        mSendBufferSize(sSendBuffer->as<uint32>()),
+        mReceiveBufferSize(sReceiveBuffer->as<uint32>()),
+        mQuickAck(sQuickAck->as<bool>()),
+        mBusyPollMicroseconds(sBusyPoll->as<uint32>()),
+        mNotSentLowWater(sNotSentLowWater->as<uint32>()),
+        mKeepAlive(sKeepAlive->as<bool>()),
+        mKeepAliveIdleSeconds(sKeepAliveIdle->as<uint32>()),
+        mKeepAliveIntervalSeconds(sKeepAliveInterval->as<uint32>()) {
+}
+
+TCPSocketOptions::TCPSocketOptions(const String&options) {
+    *this=TCPSocketOptions();
+    //parsed into plain values rather than an OptionSet, whose values would be stashed until shutdown on every parse
+    static const char*names[]={"tcpnodelay","tcpsendbuffer","tcpreceivebuffer","tcpquickack","tcpbusypoll","tcpnotsentlowat",
+                               "tcpkeepalive","tcpkeepaliveidle","tcpkeepaliveinterval"};
+    boost::program_options::options_description description;
+    for (unsigned int i=0;i<sizeof(names)/sizeof(names[0]);++i) {
+        description.add_options()(names[i],boost::program_options::value<String>());
+    }
+    boost::program_options::variables_map values;
+    try {
+        boost::program_options::store(boost::program_options::command_line_parser(boost::program_options::split_unix(options))
+                                      .options(description).run(),values);
+    }catch (std::exception&err) {
+        SILOG(tcpsst,error,"Could not parse socket options \""<<options<<"\": "<<err.what());
+        return;
+    }
+    readOption(values,"tcpnodelay",mNoDelay);
+    readOption(values,"tcpsendbuffer",mSendBufferSize);
+    readOption(values,"tcpreceivebuffer",mReceiveBufferSize);
+    readOption(values,"tcpquickack",mQuickAck);
+    readOption(values,"tcpbusypoll",mBusyPollMicroseconds);
+    readOption(values,"tcpnotsentlowat",mNotSentLowWater);
+    readOption(values,"tcpkeepalive",mKeepAlive);
+    readOption(values,"tcpkeepaliveidle",mKeepAliveIdleSeconds);
+    readOption(values,"tcpkeepaliveinterval",mKeepAliveIntervalSeconds);
+}
+
+TCPSocketOptions TCPSocketOptions::systemDefaults() {
+    TCPSocketOptions retval;
+    retval.mNoDelay=false;
+    retval.mSendBufferSize=0;
+    retval.mReceiveBufferSize=0;
+    retval.mQuickAck=false;
+    retval.mBusyPollMicroseconds=0;
+    retval.mNotSentLowWater=0;
+    retval.mKeepAlive=false;
+    retval.mKeepAliveIdleSeconds=0;
+    retval.mKeepAliveIntervalSeconds=0;
+    return retval;
+}
+
+uint32 TCPSocketOptions::requested()const {
+    uint32 retval=0;
+    if (mNoDelay) retval|=NO_DELAY;
+    if (mSendBufferSize) retval|=SEND_BUFFER;
+    if (mReceiveBufferSize) retval|=RECEIVE_BUFFER;
+    if (mQuickAck) retval|=QUICK_ACK;
+    if (mBusyPollMicroseconds) retval|=BUSY_POLL;
+    if (mNotSentLowWater) retval|=NOT_SENT_LOW_WATER;
+    if (mKeepAlive) retval|=KEEP_ALIVE;
+    if (mKeepAlive&&mKeepAliveIdleSeconds) retval|=KEEP_ALIVE_IDLE;
+    if (mKeepAlive&&mKeepAliveIntervalSeconds) retval|=KEEP_ALIVE_INTERVAL;
+    return retval;
+}
+
+String TCPSocketOptions::describe(uint32 options) {
+    static const char*names[]={"nodelay","sendbuffer","receivebuffer","quickack","busypoll","notsentlowat","keepalive","keepaliveidle","keepaliveinterval"};
+    String retval;
+    for (unsigned int i=0;i<sizeof(names)/sizeof(names[0]);++i) {
+        if (options&(1<<i)) {
+            if (!retval.empty())
+                retval+=' ';
+            retval+=names[i];
+        }
+    }
+    return retval.empty()?String("none"):retval;
+}
+
+} }
@@ -0,0 +1,88 @@
+/*  Sirikata Network Utilities
+ *  TCPSocketOptions.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SIRIKATA_TCPSOCKETOPTIONS_HPP_
+#define _SIRIKATA_TCPSOCKETOPTIONS_HPP_
+
+namespace Sirikata { namespace Network {
+/**
+ * The operating system options each TCP connection of a TCP-SST connection is given as it comes up.
+ * The defaults come from the global tcpnodelay, tcpsendbuffer, tcpreceivebuffer, tcpquickack, tcpbusypoll,
+ * tcpnotsentlowat, tcpkeepalive, tcpkeepaliveidle and tcpkeepaliveinterval options, and a listener or a connecting
+ * stream may override them with an options string of its own.
+ * Options the platform lacks or refuses are left alone. Each option is read back once set, and the connection reports
+ * which took effect and the buffer sizes the system actually keeps
+ */
+class SIRIKATA_EXPORT TCPSocketOptions {
+public:
+    ///Flags naming each option, for reporting which were asked for and which took effect
+    enum Option {
+        NO_DELAY=1,
+        SEND_BUFFER=2,
+        RECEIVE_BUFFER=4,
+        QUICK_ACK=8,
+        BUSY_POLL=16,
+        NOT_SENT_LOW_WATER=32,
+        KEEP_ALIVE=64,
+        KEEP_ALIVE_IDLE=128,
+        KEEP_ALIVE_INTERVAL=256
+    };
+    ///Sets TCP_NODELAY so small packets go out without waiting for the previous ones to be acknowledged
+    bool mNoDelay;
+    ///The SO_SNDBUF size in bytes, or 0 to leave the system default
+    uint32 mSendBufferSize;
+    ///The SO_RCVBUF size in bytes, or 0 to leave the system default
+    uint32 mReceiveBufferSize;
+    ///Sets TCP_QUICKACK as the connection comes up: the system may still delay acknowledgements later on
+    bool mQuickAck;
+    ///The SO_BUSY_POLL time in microseconds a blocked read spins on the device queue, or 0 not to
+    uint32 mBusyPollMicroseconds;
+    ///The TCP_NOTSENT_LOWAT bytes not yet sent below which the socket counts as writable, or 0 to leave the system default
+    uint32 mNotSentLowWater;
+    ///Sets SO_KEEPALIVE so a connection whose other side vanished without a word is found out while it is idle
+    bool mKeepAlive;
+    ///The TCP_KEEPIDLE seconds a kept alive connection is idle before the first probe, or 0 to leave the system default
+    uint32 mKeepAliveIdleSeconds;
+    ///The TCP_KEEPINTVL seconds between unanswered probes of a kept alive connection, or 0 to leave the system default
+    uint32 mKeepAliveIntervalSeconds;
+    ///Takes the global defaults
+    TCPSocketOptions();
+    ///Takes the global defaults, overridden by options such as "--tcpnodelay=false --tcpsendbuffer=262144"
+    explicit TCPSocketOptions(const String&options);
+    ///Options that leave every socket exactly as the system makes it
+    static TCPSocketOptions systemDefaults();
+    ///The Option flags of the options that change a socket: the keepalive times only count with mKeepAlive
+    uint32 requested()const;
+    ///Lists the names of the Option flags set in options, separated by spaces
+    static String describe(uint32 options);
+};
+} }
+#endif
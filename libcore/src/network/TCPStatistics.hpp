@@ -0,0 +1,180 @@
+/*  Sirikata Network Utilities
+ *  TCPStatistics.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SIRIKATA_TCPSTATISTICS_HPP_
+#define _SIRIKATA_TCPSTATISTICS_HPP_
+#include "util/AtomicTypes.hpp"
+
+namespace Sirikata { namespace Network {
+/**
+ * A snapshot of how long some operation took, kept as counts in buckets of doubling width.
+ * Bucket 0 counts samples under a microsecond, bucket i>0 samples of at least 2^(i-1) and under 2^i microseconds,
+ * and the last bucket everything longer
+ */
+class SIRIKATA_EXPORT LatencyHistogram {
+public:
+    enum {
+        NUM_BUCKETS=24
+    };
+    uint32 mBuckets[NUM_BUCKETS];
+    ///The number of samples
+    uint64 mCount;
+    ///The sum of every sample, in microseconds
+    uint64 mTotalMicroseconds;
+    ///The longest sample, in microseconds
+    uint64 mMaxMicroseconds;
+    LatencyHistogram() {
+        clear();
+    }
+    void clear() {
+        for (int i=0;i<NUM_BUCKETS;++i) {
+            mBuckets[i]=0;
+        }
+        mCount=mTotalMicroseconds=mMaxMicroseconds=0;
+    }
+    ///Which bucket a sample of the given length falls in
+    static unsigned int bucket(int64 microseconds) {
+        unsigned int retval=0;
+        while (microseconds>0&&retval<NUM_BUCKETS-1) {
+            microseconds>>=1;
+            ++retval;
+        }
+        return retval;
+    }
+    ///The length every sample in the bucket is at most, in microseconds: no more than the longest sample
+    uint64 bucketLimit(unsigned int whichBucket)const {
+        uint64 limit=((uint64)1)<<whichBucket;
+        return whichBucket<NUM_BUCKETS-1&&limit<mMaxMicroseconds?limit:mMaxMicroseconds;
+    }
+    ///The mean sample in microseconds, or 0 if there are none
+    double mean()const {
+        return mCount?(double)mTotalMicroseconds/mCount:0.0;
+    }
+    ///The length fraction of the samples are at most, to the resolution of the buckets, in microseconds
+    uint64 percentile(double fraction)const {
+        uint64 wanted=(uint64)(fraction*mCount);
+        uint64 seen=0;
+        for (unsigned int i=0;i<NUM_BUCKETS;++i) {
+            seen+=mBuckets[i];
+            if (seen>wanted||(seen==mCount&&mBuckets[i]))
+                return bucketLimit(i);
+        }
+        return 0;
+    }
+    ///Adds the samples of another histogram to this one
+    void merge(const LatencyHistogram&other) {
+        for (int i=0;i<NUM_BUCKETS;++i) {
+            mBuckets[i]+=other.mBuckets[i];
+        }
+        mCount+=other.mCount;
+        mTotalMicroseconds+=other.mTotalMicroseconds;
+        if (other.mMaxMicroseconds>mMaxMicroseconds)
+            mMaxMicroseconds=other.mMaxMicroseconds;
+    }
+};
+
+///Prints the number of samples and their mean, median, 99th percentile and longest in microseconds
+inline std::ostream&operator<<(std::ostream&os, const LatencyHistogram&histogram) {
+    return os<<histogram.mCount<<" samples, mean "<<histogram.mean()<<"us, median at most "<<histogram.percentile(0.5)
+             <<"us, 99% at most "<<histogram.percentile(0.99)<<"us, max "<<histogram.mMaxMicroseconds<<"us";
+}
+
+///A LatencyHistogram one thread records into while any other reads it
+class AtomicLatencyHistogram {
+    AtomicValue<uint32> mBuckets[LatencyHistogram::NUM_BUCKETS];
+    AtomicValue<uint64> mCount;
+    AtomicValue<uint64> mTotalMicroseconds;
+    AtomicValue<uint64> mMaxMicroseconds;
+public:
+    AtomicLatencyHistogram():mCount(0),mTotalMicroseconds(0),mMaxMicroseconds(0) {
+        for (int i=0;i<LatencyHistogram::NUM_BUCKETS;++i) {
+            mBuckets[i]=0;
+        }
+    }
+    void record(int64 microseconds) {
+        if (microseconds<0)
+            microseconds=0;
+        ++mBuckets[LatencyHistogram::bucket(microseconds)];
+        ++mCount;
+        mTotalMicroseconds+=(uint64)microseconds;
+        uint64 longest;
+        while ((uint64)microseconds>(longest=mMaxMicroseconds.read())&&!mMaxMicroseconds.compareAndSwap(longest,(uint64)microseconds)) {
+        }
+    }
+    ///Adds the samples recorded so far to histogram
+    void readInto(LatencyHistogram&histogram)const {
+        LatencyHistogram current;
+        for (int i=0;i<LatencyHistogram::NUM_BUCKETS;++i) {
+            current.mBuckets[i]=mBuckets[i].read();
+        }
+        current.mCount=mCount.read();
+        current.mTotalMicroseconds=mTotalMicroseconds.read();
+        current.mMaxMicroseconds=mMaxMicroseconds.read();
+        histogram.merge(current);
+    }
+};
+
+///The bytes and packets of data a stream or connection was asked to send and delivered to its receiver
+class SIRIKATA_EXPORT TrafficStatistics {
+public:
+    uint64 mBytesSent;
+    uint64 mPacketsSent;
+    uint64 mBytesReceived;
+    uint64 mPacketsReceived;
+};
+
+///The live counts behind a TrafficStatistics, which any thread may add to
+class TrafficCounters {
+    AtomicValue<uint64> mBytesSent;
+    AtomicValue<uint64> mPacketsSent;
+    AtomicValue<uint64> mBytesReceived;
+    AtomicValue<uint64> mPacketsReceived;
+public:
+    TrafficCounters():mBytesSent(0),mPacketsSent(0),mBytesReceived(0),mPacketsReceived(0){}
+    void countSent(size_t bytes) {
+        mBytesSent+=(uint64)bytes;
+        ++mPacketsSent;
+    }
+    void countReceived(size_t bytes) {
+        mBytesReceived+=(uint64)bytes;
+        ++mPacketsReceived;
+    }
+    TrafficStatistics read()const {
+        TrafficStatistics retval;
+        retval.mBytesSent=mBytesSent.read();
+        retval.mPacketsSent=mPacketsSent.read();
+        retval.mBytesReceived=mBytesReceived.read();
+        retval.mPacketsReceived=mPacketsReceived.read();
+        return retval;
+    }
+};
+} }
+#endif
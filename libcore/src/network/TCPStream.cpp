@@ -36,19 +36,72 @@
 #include "TCPDefinitions.hpp"
 #include "TCPStream.hpp"
 #include "util/ThreadSafeQueue.hpp"
+#include "PacketBuffer.hpp"
 #include "ASIOSocketWrapper.hpp"
 #include "MultiplexedSocket.hpp"
+#include "LZCompression.hpp"
 #include "TCPSetCallbacks.hpp"
+#include "PacketTrace.hpp"
 #include <boost/thread.hpp>
 namespace Sirikata { namespace Network {
 
 using namespace boost::asio::ip;
-TCPStream::TCPStream(const std::tr1::shared_ptr<MultiplexedSocket>&shared_socket,const Stream::StreamID&sid):mSocket(shared_socket),mID(sid),mSendStatus(new AtomicValue<int>(0)) {
+namespace {
+/**
+ * Replaces packet, which has a length prefix of lengthLength bytes, with a compressed packet of stream id,
+ * or returns packet untouched if it does not compress
+ */
+PacketBuffer*compressPacket(PacketBuffer*packet, unsigned int lengthLength, const Stream::StreamID&id) {
+    size_t bodyLength=packet->size()-lengthLength;
+    uint8 header[2*Stream::StreamID::MAX_SERIALIZED_LENGTH+Stream::uint30::MAX_SERIALIZED_LENGTH+1];
+    unsigned int headerLength=Stream::StreamID().serialize(header,Stream::StreamID::MAX_SERIALIZED_LENGTH);//control packet
+    header[headerLength++]=TCPStream::TCPStreamCompressed;
+    headerLength+=id.serialize(header+headerLength,Stream::StreamID::MAX_SERIALIZED_LENGTH);
+    headerLength+=Stream::uint30((uint32)bodyLength).serialize(header+headerLength,Stream::uint30::MAX_SERIALIZED_LENGTH);
+    size_t reserved=Stream::uint30::MAX_SERIALIZED_LENGTH+headerLength;
+    if (reserved>=packet->size())
+        return packet;
+    //compress behind room for the largest possible framing: anything that does not come out smaller than the original is not worth sending
+    PacketBuffer*retval=PacketBuffer::allocate(packet->size());
+    uint8*output=&*retval->begin();
+    size_t compressedLength=LZCompression::compress(&*packet->begin()+lengthLength,bodyLength,output+reserved,packet->size()-reserved);
+    if (compressedLength==0) {
+        retval->unref();
+        return packet;
+    }
+    uint8 lengthSerialized[Stream::uint30::MAX_SERIALIZED_LENGTH];
+    unsigned int newLengthLength=Stream::uint30((uint32)(headerLength+compressedLength)).serialize(lengthSerialized,Stream::uint30::MAX_SERIALIZED_LENGTH);
+    std::memcpy(output,lengthSerialized,newLengthLength);
+    std::memcpy(output+newLengthLength,header,headerLength);
+    std::memmove(output+newLengthLength+headerLength,output+reserved,compressedLength);
+    retval->resize(newLengthLength+headerLength+compressedLength);
+    packet->unref();
+    return retval;
+}
+}
+TCPStream::TCPStream(const std::tr1::shared_ptr<MultiplexedSocket>&shared_socket,const Stream::StreamID&sid):mSocket(shared_socket),mID(sid),mSendStatus(new AtomicValue<int>(0)),mPriority(new AtomicValue<int>(DefaultPriority)),mTraffic(new TrafficCounters),mNextSequence(0),mSequencing(false),mStripeOrdered(false),mCompress(false),mAnnounced(true),mOnFirstSocket(false),mNumConnections(3),mShareConnection(false),mSharedIdleTimeout(Task::DeltaTime::seconds(30.0)),mEarlyConnect(false),mWritableWaiter(new WritableWaiter) {
 
 }
 
 void TCPStream::send(const Chunk&data, StreamReliability reliability) {
+    sendPacket(data,reliability,0,0);
+}
+void TCPStream::send(const Chunk&data, StreamReliability reliability, const Task::DeltaTime&timeToLive, uint32 replaceKey) {
+    int64 expiresAt=0;
+    if (reliability==Unreliable) {
+        expiresAt=(Task::AbsTime::now()+timeToLive-Task::AbsTime::null()).toMicro();
+        //0 means the packet never expires
+        if (expiresAt==0)
+            expiresAt=1;
+    }
+    sendPacket(data,reliability,expiresAt,replaceKey);
+}
+void TCPStream::sendPacket(const Chunk&data, StreamReliability reliability, int64 expiresAt, uint32 replaceKey) {
     MultiplexedSocket::RawRequest toBeSent;
+    if (reliability==Unreliable&&!mAnnounced) {
+        //datagrams never open a stream on the other side, so the first packet goes over TCP and might as well be reliable
+        reliability=ReliableUnordered;
+    }
     // only allow 3 of the four possibilities because unreliable ordered is tricky and usually useless
     switch(reliability) {
       case Unreliable:
@@ -65,12 +118,36 @@ void TCPStream::send(const Chunk&data, StreamReliability reliability) {
         break;
     }
     toBeSent.originStream=getID();
-    uint8 serializedStreamId[StreamID::MAX_SERIALIZED_LENGTH];
-    unsigned int streamIdLength=StreamID::MAX_SERIALIZED_LENGTH;
-    unsigned int successLengthNeeded=toBeSent.originStream.serialize(serializedStreamId,streamIdLength);
+    toBeSent.priority=mPriority->read();
+    toBeSent.striped=false;
+    toBeSent.datagram=toBeSent.unreliable;
+    bool joining=mSocket&&mSocket->isJoiningBaseSockets();
+    if (!toBeSent.unordered&&joining)
+        mOnFirstSocket=true;
+    //once a stream has sequenced a packet all its later ordered packets must be sequenced, so none can overtake it
+    bool sequenced=!toBeSent.unordered&&(mSequencing||((mStripeOrdered||(mOnFirstSocket&&!joining))&&mSocket&&mSocket->canSequence()));
+    uint32 sequence=0;
+    if (sequenced) {
+        mSequencing=true;
+        sequence=mNextSequence++;
+        //the first sequenced packet follows the unsequenced ones on their socket, later ones may take any socket
+        toBeSent.striped=(sequence!=0&&(mStripeOrdered||mOnFirstSocket));
+    }
+    toBeSent.firstSocket=mOnFirstSocket&&!toBeSent.unordered&&!toBeSent.striped;
+    //sequenced packets are control packets naming the stream, followed by the sequence number
+    uint8 header[2*StreamID::MAX_SERIALIZED_LENGTH+uint30::MAX_SERIALIZED_LENGTH+1];
+    unsigned int streamIdLength=0;
+    if (sequenced) {
+        streamIdLength=StreamID().serialize(header,StreamID::MAX_SERIALIZED_LENGTH);
+        header[streamIdLength++]=TCPStreamSequenced;
+    }
+    unsigned int successLengthNeeded=toBeSent.originStream.serialize(header+streamIdLength,StreamID::MAX_SERIALIZED_LENGTH);
     ///this function should never return something larger than the  MAX_SERIALIZED_LEGNTH
-    assert(successLengthNeeded<=streamIdLength);
-    streamIdLength=successLengthNeeded;
+    assert(successLengthNeeded<=StreamID::MAX_SERIALIZED_LENGTH);
+    streamIdLength+=successLengthNeeded;
+    if (sequenced) {
+        streamIdLength+=uint30(sequence&MultiplexedSocket::SEQUENCE_MASK).serialize(header+streamIdLength,uint30::MAX_SERIALIZED_LENGTH);
+    }
     size_t totalSize=data.size();
     totalSize+=streamIdLength;
     uint30 packetLength=uint30(totalSize);
@@ -78,32 +155,75 @@ void TCPStream::send(const Chunk&data, StreamReliability reliability) {
     unsigned int packetHeaderLength=packetLength.serialize(packetLengthSerialized,uint30::MAX_SERIALIZED_LENGTH);
     //allocate a packet long enough to take both the length of the packet and the stream id as well as the packet data. totalSize = size of streamID + size of data and
     //packetHeaderLength = the length of the length component of the packet
-    toBeSent.data=new Chunk(totalSize+packetHeaderLength);
+    toBeSent.data=PacketBuffer::allocate(totalSize+packetHeaderLength);
     
     uint8 *outputBuffer=&(*toBeSent.data)[0];
     std::memcpy(outputBuffer,packetLengthSerialized,packetHeaderLength);
-    std::memcpy(outputBuffer+packetHeaderLength,serializedStreamId,streamIdLength);
+    std::memcpy(outputBuffer+packetHeaderLength,header,streamIdLength);
     if (data.size())
         std::memcpy(&outputBuffer[packetHeaderLength+streamIdLength],
                     &data[0],
                     data.size());
+    if (mCompress&&data.size()>=MultiplexedSocket::COMPRESSION_THRESHOLD&&totalSize<=MultiplexedSocket::MAX_UNCOMPRESSED_LENGTH&&mSocket->canCompress()) {
+        toBeSent.data=compressPacket(toBeSent.data,packetHeaderLength,toBeSent.originStream);
+    }
+    if (toBeSent.unreliable) {
+        //replace keys of different streams must never match
+        toBeSent.data->setStaleness(expiresAt,replaceKey?((uint64)toBeSent.originStream.read()<<32)|replaceKey:0);
+    }
     bool didsend=false;
     //indicate to other would-be TCPStream::close()ers that we are sending and they will have to wait until we give up control to actually ack the close and shut down the stream
     unsigned int sendStatus=++(*mSendStatus);
     if ((sendStatus&(3*SendStatusClosing))==0) {///max of 3 entities can close the stream at once (FIXME: should implement |= on atomic ints), but as of now at most the recv thread the sender responsible and a user close() is all that is allowed at once...so 3 is fine)
         MultiplexedSocket::sendBytes(mSocket,toBeSent);
         didsend=true;
+        mAnnounced=true;
+        mTraffic->countSent(data.size());
+        mSocket->getTraffic().countSent(data.size());
     }
     //relinquish control to a potential closer
     --(*mSendStatus);
     if (!didsend) {
         //if the data was not sent, its our job to clean it up
-        delete toBeSent.data;
+        toBeSent.data->unref();
         SILOG(tcpsst,debug,"printing to closed stream id "<<getID().read());
     }
 }
+bool TCPStream::trySend(const Chunk&data, StreamReliability reliability) {
+    if (!mSocket)
+        return false;
+    if (mSocket->isOverSendHighWater()) {
+        MultiplexedSocket::waitForWritable(mSocket,mWritableWaiter);
+        return false;
+    }
+    send(data,reliability);
+    return true;
+}
+void TCPStream::setWritableCallback(const WritableCallback&writableCallback) {
+    mWritableWaiter->mCallback=writableCallback;
+}
+void TCPStream::setSendWatermarks(uint32 lowWater, uint32 highWater) {
+    if (mSocket)
+        mSocket->setSendWatermarks(lowWater,highWater);
+}
+void TCPStream::setUnreliableDropThresholds(uint32 lowWater, uint32 highWater, const Task::DeltaTime&stallStart, const Task::DeltaTime&stallLimit) {
+    if (mSocket)
+        mSocket->setUnreliableDropThresholds(lowWater,highWater,stallStart,stallLimit);
+}
+void TCPStream::setGatherLimits(unsigned int maxBuffers, size_t maxBytes) {
+    if (mSocket)
+        mSocket->setGatherLimits(maxBuffers,maxBytes);
+}
+void TCPStream::flush() {
+    if (mSocket)
+        MultiplexedSocket::flush(mSocket);
+}
+void TCPStream::setCorking(const Task::DeltaTime&window, uint32 maxBytes) {
+    if (mSocket)
+        mSocket->setCorking(window,maxBytes);
+}
 ///This function waits on the sendStatus clearing up so no outstanding sends are being made (and no further ones WILL be made cus of the SendStatusClosing flag that is on
-void TCPStream::closeSendStatus(AtomicValue<int>&vSendStatus) {
+bool TCPStream::closeSendStatus(AtomicValue<int>&vSendStatus) {
     int sendStatus=vSendStatus.read();
     bool incd=false;
     if ((sendStatus&(SendStatusClosing*3))==0) {
@@ -117,28 +237,114 @@ void TCPStream::closeSendStatus(AtomicValue<int>&vSendStatus) {
            sendStatus!=3*SendStatusClosing) {
         
     }
+    return incd;
 }
 void TCPStream::close() {
     //set the stream closed as soon as sends are done
-    closeSendStatus(*mSendStatus);
-    //obliterate all incoming callback to this stream
-    mSocket->addCallbacks(getID(),NULL);
-    //send out that the stream is now closed on all sockets
-    MultiplexedSocket::closeStream(mSocket,getID());
+    if (closeSendStatus(*mSendStatus)) {
+        //obliterate all incoming callback to this stream
+        mSocket->addCallbacks(getID(),NULL);
+        //send out that the stream is now closed on all sockets, behind any data of ours still queued in our class
+        MultiplexedSocket::closeStream(mSocket,getID(),TCPStream::TCPStreamCloseStream,mPriority->read());
+    }
+    //otherwise it was closed already, most likely by the other side, which has let its ID go
+    //this may have been the last stream of a shared connection, which should outlive it in case another connect wants it
+    MultiplexedSocket::holdSharedConnection(mSocket);
+}
+TCPStream::TCPStream(IOService&io):mIO(&io),mSendStatus(new AtomicValue<int>(0)),mPriority(new AtomicValue<int>(DefaultPriority)),mTraffic(new TrafficCounters),mNextSequence(0),mSequencing(false),mStripeOrdered(false),mCompress(false),mAnnounced(false),mOnFirstSocket(false),mNumConnections(3),mShareConnection(false),mSharedIdleTimeout(Task::DeltaTime::seconds(30.0)),mEarlyConnect(false),mWritableWaiter(new WritableWaiter) {
+}
+uint64 TCPStream::getPriorityBytesSent(StreamPriority priority)const {
+    if (!mSocket)
+        return 0;
+    return mSocket->getPriorityBytesSent(priority);
+}
+TCPStream::ReorderStatistics TCPStream::getReorderStatistics()const {
+    if (!mSocket) {
+        ReorderStatistics retval={0,0,0,0};
+        return retval;
+    }
+    return mSocket->getReorderStatistics();
+}
+uint32 TCPStream::getDatagramsSent()const {
+    if (!mSocket)
+        return 0;
+    return mSocket->getDatagramsSent();
 }
-TCPStream::TCPStream(IOService&io):mIO(&io),mSendStatus(new AtomicValue<int>(0)) {
+uint32 TCPStream::getStalePacketsDiscarded()const {
+    if (!mSocket)
+        return 0;
+    return mSocket->getStalePacketsDiscarded();
+}
+TCPStream::ConnectionStatistics TCPStream::getConnectionStatistics()const {
+    if (!mSocket) {
+        ConnectionStatistics retval;
+        retval.mTraffic=TrafficCounters().read();
+        retval.mMaxQueuedBytes=0;
+        retval.mHandlerHeapAllocations=0;
+        retval.mSocketOptionsApplied=0;
+        retval.mSendBufferSize=0;
+        retval.mReceiveBufferSize=0;
+        return retval;
+    }
+    return mSocket->getConnectionStatistics();
+}
+TrafficStatistics TCPStream::getStreamStatistics()const {
+    return mTraffic->read();
+}
+void TCPStream::setStatisticsDump(const Task::DeltaTime&period) {
+    if (mSocket)
+        MultiplexedSocket::setStatisticsDump(mSocket,period);
+}
+void TCPStream::setPacketTrace(size_t capacity, const std::string&errorTraceFile) {
+    if (mSocket)
+        mSocket->setPacketTrace(capacity,errorTraceFile);
+}
+bool TCPStream::writePacketTrace(const std::string&filename)const {
+    PacketTrace*trace=mSocket?mSocket->getPacketTrace():NULL;
+    return trace&&trace->write(filename);
+}
+void TCPStream::setAdaptiveConnections(unsigned int maxConnections, uint32 growBacklog, uint32 idleBytesPerSecond) {
+    if (mSocket)
+        MultiplexedSocket::setAdaptiveConnections(mSocket,maxConnections,growBacklog,idleBytesPerSecond);
+}
+unsigned int TCPStream::getNumConnections()const {
+    if (!mSocket)
+        return 0;
+    return mSocket->numActiveSockets();
 }
 void TCPStream::connect(const Address&addy,
                         const SubstreamCallback &substreamCallback,
                         const ConnectionCallback &connectionCallback,
                         const BytesReceivedCallback&bytesReceivedCallback) {
+    if (mShareConnection) {
+        mSocket=MultiplexedSocket::findSharedConnection(mIO,addy);
+        if (mSocket) {
+            //no handshake: the stream is opened on the other side by its first packet, just like a cloned one
+            *mSendStatus=0;
+            mID=mSocket->getNewID();
+            mAnnounced=false;
+            MultiplexedSocket::joinSharedConnection(mSocket,getID(),new Callbacks(connectionCallback,
+                                                                                  bytesReceivedCallback,
+                                                                                  mSendStatus,
+                                                                                  mPriority,
+                                                                                  mTraffic));
+            return;
+        }
+    }
     mSocket=MultiplexedSocket::construct(mIO,substreamCallback);
+    mSocket->setSocketOptions(mSocketOptions);
     *mSendStatus=0;
     mID=StreamID(1);
+    //the listening side makes its end of the first stream as soon as the connection is built
+    mAnnounced=true;
     mSocket->addCallbacks(getID(),new Callbacks(connectionCallback,
                                                 bytesReceivedCallback,
-                                                mSendStatus));
-    mSocket->connect(addy,3);
+                                                mSendStatus,
+                                                mPriority,
+                                                mTraffic));
+    if (mShareConnection)
+        MultiplexedSocket::shareConnection(mSocket,addy,mSharedIdleTimeout);
+    mSocket->connect(addy,mNumConnections,mEarlyConnect);
 }
 Stream* TCPStream::factory() {
     return new TCPStream(*mIO);
@@ -155,10 +361,13 @@ bool TCPStream::cloneFrom(Stream*otherStream,
     }
     StreamID newID=mSocket->getNewID();
     mID=newID;
+    mAnnounced=false;
     //check from addCallbacks if the socket is already disconnected--if so let the user know
     return mSocket->addCallbacks(newID,new Callbacks(connectionCallback,
                                                      bytesReceivedCallback,
-                                                     mSendStatus))!=MultiplexedSocket::DISCONNECTED;
+                                                     mSendStatus,
+                                                     mPriority,
+                                                     mTraffic))!=MultiplexedSocket::DISCONNECTED;
 }
 
 
@@ -33,6 +33,8 @@
 #define SIRIKATA_TCPStream_HPP__
 #include "Stream.hpp"
 #include "util/AtomicTypes.hpp"
+#include "TCPStatistics.hpp"
+#include "TCPSocketOptions.hpp"
 namespace Sirikata { namespace Network {
 class MultiplexedSocket;
 class TCPSetCallbacks;
@@ -55,6 +57,9 @@ class IOService;
  * The other side respinds in turn on each connection with a similar handshake (though the 16 bytes may be different)
  * now the connection is online. The remote host may immediately follow the handshake with live packets and 
  * the other side may respond as soon as it receives the remote hosts handshake response
+ * The listening side answers each connection as it arrives rather than once all N have, so a side may start sending on
+ * the connections that are up before the rest join. Ordered packets sent before every connection has joined stay on
+ * the first one, and close packets are held back until every connection has joined, since they are counted on each
  *
  * --Live Phase--
  * The first live stream has StreamID of 1. New streams coming from listener must have even StreamID's and new 
@@ -82,6 +87,56 @@ class IOService;
  * 
  * If all streams are shut down, the sockets may be deactivated
  * If the socket disconnects due to error, then Disconnect callbacks must be called
+ *
+ * --Capabilities--
+ * Immediately after its handshake each side sends a control packet with control code 3 followed by a uint30 of
+ * TCPStreamCapabilityFlags naming the optional protocol features it understands. Older implementations ignore
+ * unknown control codes, so a side that never receives this packet must assume no optional features.
+ *
+ * --Fragments--
+ * If the other side advertised TCPStreamCapableOfFragments, a large packet may instead be sent as a series of control
+ * packets with control code 4, a byte of TCPStreamFragmentFlags, the variable length StreamID of the packet and,
+ * in the first fragment only, a uint30 total length of the reassembled data, followed by a piece of the data.
+ * All fragments of a packet are sent in order on a single socket but may be interleaved with packets of other streams.
+ * Sequenced and compressed packets (below) are fragmented like any other packet of their stream, with
+ * TCPStreamControlFragment set so the reassembled data is interpreted as a control packet.
+ *
+ * --Sequenced Packets--
+ * If the other side advertised TCPStreamCapableOfSequencing, a stream may send its ordered packets as control packets
+ * with control code 5, the variable length StreamID of the packet and a uint30 sequence number, followed by the data.
+ * A stream's sequence numbers start at 0 and count up modulo 2^30. The packet numbered 0 must be sent on the socket
+ * the stream's unsequenced ordered packets use, but later ones may be sent on any socket: the receiver holds them back
+ * until every lower numbered packet of the stream has been delivered. Once a stream sends a sequenced packet all its
+ * later ordered packets must be sequenced.
+ *
+ * --Compressed Packets--
+ * If the other side advertised TCPStreamCapableOfCompression, any packet of a stream may instead be sent as a control
+ * packet with control code 6, the variable length StreamID of the packet and a uint30 length, followed by the
+ * LZCompression of that many bytes: the original packet less its length prefix, beginning with its own StreamID.
+ *
+ * --Datagrams--
+ * A side advertises TCPStreamCapableOfDatagrams if it has a UDP socket for the connection, which on the listening side
+ * is bound to the same port number as its TCP listener. An unreliable packet that fits may instead be sent in a UDP
+ * datagram made of the 16 byte UUID the connecting side sent in its handshake followed by the packet less its length
+ * prefix. The connecting side sends datagrams of the UUID alone to the listening side until it receives one back, and
+ * neither side sends packets in datagrams before it has received a datagram from the other. Datagrams never open a
+ * new stream, so the first packet of a stream is always sent over TCP.
+ *
+ * --Adding and Retiring Connections--
+ * If both sides advertised TCPStreamCapableOfResizing the connecting side may open another TCP connection to a live
+ * connection by sending the handshake with a connection count of 00 and the UUID of the original handshake. The
+ * listening side answers with the same 24 bytes, after which either side may send on the new connection. Ordered
+ * packets that are not sequenced only ever use the connections of the original handshake, so adding and retiring
+ * connections never reorders them.
+ * Either side may retire an added connection: it stops sending on it and, once everything it queued there is on the
+ * wire, sends a control packet with control code 7 followed by a uint30 naming the connection in its own numbering.
+ * The receiver answers on the first connection with control code 8 and the same uint30, and retires the connection
+ * itself if it has not already. A side closes the connection once it has sent a retire, received one and had its own
+ * acknowledged. Until its retires are acknowledged a side holds back close and close ack packets, so they cannot
+ * overtake packets it sent on a retiring connection. Close and close ack packets to a side that advertised
+ * TCPStreamCapableOfResizing are followed by a uint30 of the number of connections they were sent on, which the
+ * receiver waits for in place of its own number of connections. The listening side may ask for another connection
+ * with control code 9 followed by a uint30 of the number of connections it would like.
  */
 class SIRIKATA_EXPORT TCPStream:public Stream {
 public:
@@ -95,7 +150,41 @@ public:
     };
     enum TCPStreamControlCodes {
         TCPStreamCloseStream=1,
-        TCPStreamAckCloseStream=2
+        TCPStreamAckCloseStream=2,
+        TCPStreamCapabilities=3,
+        TCPStreamFragment=4,
+        TCPStreamSequenced=5,
+        TCPStreamCompressed=6,
+        TCPStreamRetireConnection=7,
+        TCPStreamAckRetireConnection=8,
+        TCPStreamAddConnection=9
+    };
+    ///Optional protocol features a side may advertise in its TCPStreamCapabilities control packet
+    enum TCPStreamCapabilityFlags {
+        TCPStreamCapableOfFragments=1,
+        TCPStreamCapableOfSequencing=2,
+        TCPStreamCapableOfCompression=4,
+        TCPStreamCapableOfDatagrams=8,
+        TCPStreamCapableOfResizing=16
+    };
+    ///Flags byte carried by each TCPStreamFragment control packet
+    enum TCPStreamFragmentFlags {
+        TCPStreamFirstFragment=1,
+        TCPStreamLastFragment=2,
+        ///The reassembled data is a control packet rather than data of the fragment's stream
+        TCPStreamControlFragment=4
+    };
+    /**
+     * The class of service a stream's packets are queued in on each TCP connection.
+     * Lower values are more urgent: the connection drains classes by strict priority or by weighted fair share
+     * as configured with MultiplexedSocket::setPriorityScheduling
+     */
+    enum StreamPriority {
+        InteractivePriority=0,
+        DefaultPriority=1,
+        BulkPriority=2,
+        BackgroundPriority=3,
+        NumStreamPriorities=4
     };
 private:
     friend class MultiplexedSocket;
@@ -114,9 +203,53 @@ private:
     };
     ///incremented while sending: or'd in SendStatusClosing when close function triggered so no further packets will be sent using old ID.
     std::tr1::shared_ptr<AtomicValue<int> >mSendStatus;
+    /**
+     * Frames and sends data for both send functions
+     * \param expiresAt is when Unreliable data goes stale in microseconds since Task::AbsTime::null(), or 0 if never
+     * \param replaceKey is the key Unreliable data replaces earlier unsent data of this stream with, or 0
+     */
+    void sendPacket(const Chunk&data,StreamReliability reliability,int64 expiresAt,uint32 replaceKey);
+    ///The StreamPriority this stream's packets are sent with, shared with the Callbacks so control packets for this stream may follow its data
+    std::tr1::shared_ptr<AtomicValue<int> >mPriority;
+    ///The data this stream has sent and received, shared with the Callbacks so the connection may count what it delivers
+    std::tr1::shared_ptr<TrafficCounters> mTraffic;
+    ///The sequence number of the next sequenced packet
+    AtomicValue<uint32> mNextSequence;
+    ///Set once this stream has sent a sequenced packet, after which every ordered packet must be sequenced
+    volatile bool mSequencing;
+    ///Whether ordered packets should be sequenced and spread over every TCP connection when the other side supports it
+    volatile bool mStripeOrdered;
+    ///Whether packets should be compressed when the other side supports it
+    volatile bool mCompress;
+    ///Whether the other side has been sent a packet of this stream over TCP, after which its unreliable packets may be sent in datagrams
+    volatile bool mAnnounced;
+    ///Set once this stream has sent an ordered packet while sockets of the handshake were still joining, after which they stay on socket 0 until sequenced
+    volatile bool mOnFirstSocket;
+    ///The number of TCP connections connect() opens in its handshake
+    unsigned int mNumConnections;
+    ///Whether connect() may make this stream a new stream of a live connection to the same address rather than opening its own
+    bool mShareConnection;
+    ///How long a connection opened by a sharing connect() stays up after its last stream closes
+    Task::DeltaTime mSharedIdleTimeout;
+    ///Whether connect() reports the connection as soon as the first TCP connection of its handshake is up
+    bool mEarlyConnect;
+    ///The options the TCP connections a connect() opens are given
+    TCPSocketOptions mSocketOptions;
 public:
-    ///Atomically sets the sendStatus for this socket to closed. FIXME: should use atomic compare and swap for |= instead of += right now only supports 2 non-io threads closing at once
-    static void closeSendStatus(AtomicValue<int>&vSendStatus);
+    ///The WritableCallback of a stream, which the connection holds on to while the stream waits for its backlog to drain
+    class WritableWaiter:public Noncopyable {
+    public:
+        Stream::WritableCallback mCallback;
+        ///Nonzero while the connection holds this waiter, so a stream refused repeatedly is notified once
+        AtomicValue<uint32> mWaiting;
+        WritableWaiter():mWaiting(0){}
+    };
+private:
+    ///This stream's WritableCallback, which the connection only keeps a weak reference to
+    std::tr1::shared_ptr<WritableWaiter> mWritableWaiter;
+public:
+    ///Atomically sets the sendStatus for this socket to closed. FIXME: should use atomic compare and swap for |= instead of += right now only supports 2 non-io threads closing at once. Returns false if the stream was closed already
+    static bool closeSendStatus(AtomicValue<int>&vSendStatus);
     ///Returns the active stream ID
     StreamID getID()const {return mID;}
     /**
@@ -128,12 +261,18 @@ public:
         Stream::ConnectionCallback mConnectionCallback;
         Stream::BytesReceivedCallback mBytesReceivedCallback;
         std::tr1::weak_ptr<AtomicValue<int> > mSendStatus;
+        std::tr1::shared_ptr<AtomicValue<int> > mPriority;
+        std::tr1::shared_ptr<TrafficCounters> mTraffic;
         Callbacks(const Stream::ConnectionCallback &connectionCallback,
                   const Stream::BytesReceivedCallback &bytesReceivedCallback,
-                  const std::tr1::weak_ptr<AtomicValue<int> >&sendStatus):
+                  const std::tr1::weak_ptr<AtomicValue<int> >&sendStatus,
+                  const std::tr1::shared_ptr<AtomicValue<int> >&priority,
+                  const std::tr1::shared_ptr<TrafficCounters>&traffic):
             mConnectionCallback(connectionCallback),
             mBytesReceivedCallback(bytesReceivedCallback),
-            mSendStatus(sendStatus){
+            mSendStatus(sendStatus),
+            mPriority(priority),
+            mTraffic(traffic){
         }
     };
     ///Constructor which leaves socket in a disconnection state, prepared for a connect() or a clone()
@@ -142,6 +281,76 @@ public:
     TCPStream(const std::tr1::shared_ptr<MultiplexedSocket> &shared_socket, const Stream::StreamID&);
     ///Implementation of send interface
     virtual void send(const Chunk&data,StreamReliability);
+    ///Implementation of send interface for data that goes stale: Unreliable data that goes out in a UDP datagram never waits, so only data queued over TCP goes stale
+    virtual void send(const Chunk&data,StreamReliability,const Task::DeltaTime&timeToLive,uint32 replaceKey=0);
+    ///Implementation of trySend interface: refuses data while the whole connection is over its send high water mark or before it exists
+    virtual bool trySend(const Chunk&data,StreamReliability);
+    ///Implementation of setWritableCallback interface: should be called before trySend, since the callback runs on the io reactor thread
+    virtual void setWritableCallback(const WritableCallback&writableCallback);
+    /**
+     * Sets when trySend on any stream of this connection refuses data and when refused streams are told to resume
+     * \param lowWater is the number of bytes outstanding over all the TCP connections at which WritableCallbacks are called
+     * \param highWater is the number of bytes outstanding over all the TCP connections at which trySend refuses data
+     */
+    void setSendWatermarks(uint32 lowWater, uint32 highWater);
+    /**
+     * Sets how congested a TCP connection of this stream must be before Unreliable packets sent over it are dropped,
+     * as MultiplexedSocket::setUnreliableDropThresholds: should be called before sending data
+     */
+    void setUnreliableDropThresholds(uint32 lowWater, uint32 highWater, const Task::DeltaTime&stallStart, const Task::DeltaTime&stallLimit);
+    /**
+     * Limits how much queued data each TCP connection hands the operating system in one write: should be called before sending data
+     * \param maxBuffers is the most packets gathered into one write, at least 1
+     * \param maxBytes is the number of bytes after which no more packets are gathered into the write, at least 1
+     */
+    void setGatherLimits(unsigned int maxBuffers, size_t maxBytes);
+    ///Implementation of flush interface: sends whatever every TCP connection is holding back for coalescing
+    virtual void flush();
+    /**
+     * Lets each TCP connection of this stream hold a packet sent while it is idle back for up to window, or until
+     * maxBytes gather, so that small packets sent shortly after it go out in the same write. A zero window turns this off
+     */
+    void setCorking(const Task::DeltaTime&window, uint32 maxBytes);
+    /**
+     * Lets a subsequent connect join a live connection to the same address that another sharing connect opened,
+     * skipping the handshake: the stream is then a new stream of that connection, and substreams the other side opens
+     * go to the SubstreamCallback of the connect that opened it.
+     * A connection this stream opens is kept up for idleTimeout once its last stream closes, in case another connect wants it
+     */
+    void setConnectionSharing(bool share, const Task::DeltaTime&idleTimeout=Task::DeltaTime::seconds(30.0)) {
+        mShareConnection=share;
+        mSharedIdleTimeout=idleTimeout;
+    }
+    /**
+     * Lets a subsequent connect report the connection, and start sending, as soon as the first TCP connection of its
+     * handshake is up: the others are brought in as their handshakes finish. Ordered packets sent before they all are
+     * stay on the first connection, until the stream can sequence them over every connection if the other side supports it
+     */
+    void setEarlyConnect(bool early) {
+        mEarlyConnect=early;
+    }
+    /**
+     * Sets the options the TCP connections a subsequent connect opens are given, in place of the global defaults.
+     * getConnectionStatistics reports which took effect
+     */
+    void setSocketOptions(const TCPSocketOptions&options) {
+        mSocketOptions=options;
+    }
+    ///Sets the number of TCP connections a subsequent connect opens in its handshake, at most 99
+    void setNumConnections(unsigned int numConnections) {
+        mNumConnections=numConnections?(numConnections>99?99:numConnections):1;
+    }
+    /**
+     * Lets the whole connection add TCP connections while its backlog stays deep and retire the added ones while it is
+     * idle, if the other side supports it. The connections of the original handshake are never retired.
+     * Either side may call this: the listening side asks the connecting side to open connections on its behalf
+     * \param maxConnections is the most TCP connections to grow to, at most MultiplexedSocket::MAX_CONNECTIONS
+     * \param growBacklog is the number of bytes outstanding per connection, over two checks in a row, that adds a connection
+     * \param idleBytesPerSecond is the rate of bytes sent and received below which an added connection is retired
+     */
+    void setAdaptiveConnections(unsigned int maxConnections, uint32 growBacklog, uint32 idleBytesPerSecond);
+    ///Returns the number of TCP connections the whole connection is currently sending on
+    unsigned int getNumConnections()const;
     ///Implementation of connect interface
     virtual void connect(
         const Address& addy,
@@ -156,6 +365,94 @@ public:
         const BytesReceivedCallback&chunkReceivedCallback);
     //Shuts down the socket, allowing StreamID to be reused and opposing stream to get disconnection callback
     virtual void close();
+    /**
+     * Sets the class of service for packets subsequently sent on this stream.
+     * Packets already queued in the previous class may be overtaken by packets sent afterwards
+     */
+    void setPriority(StreamPriority priority) {
+        *mPriority=priority;
+    }
+    StreamPriority getPriority()const {
+        return (StreamPriority)mPriority->read();
+    }
+    ///Returns the number of bytes the whole connection has handed to the operating system in the given class of service
+    uint64 getPriorityBytesSent(StreamPriority priority)const;
+    /**
+     * Lets ordered packets subsequently sent on this stream use every TCP connection instead of just one, if the other
+     * side supports sequenced packets. Each ordered packet then carries a sequence number and the other side restores
+     * their order before delivering them. Turning this back off only stops the spreading: sequencing, once begun, continues
+     */
+    void setOrderedStriping(bool stripe) {
+        mStripeOrdered=stripe;
+    }
+    bool getOrderedStriping()const {
+        return mStripeOrdered;
+    }
+    /**
+     * Compresses the packets subsequently sent on this stream if the other side supports compressed packets.
+     * Packets too short to benefit, longer than MultiplexedSocket::MAX_UNCOMPRESSED_LENGTH, or that do not shrink, are sent as they are
+     */
+    void setCompression(bool compress) {
+        mCompress=compress;
+    }
+    bool getCompression()const {
+        return mCompress;
+    }
+    ///How much the whole connection has had to reorder sequenced packets it received
+    class ReorderStatistics {
+    public:
+        ///Number of sequenced packets that arrived before an earlier packet of their stream and had to wait
+        uint32 mReorderedPackets;
+        ///Number of packets currently waiting for an earlier packet of their stream
+        uint32 mReorderDepth;
+        ///The most packets ever waiting at once
+        uint32 mMaxReorderDepth;
+        ///Number of times a stream's reorder buffer filled up and delivery had to skip ahead of a missing packet
+        uint32 mReorderOverflows;
+    };
+    ///Returns the reordering the whole connection has done for the streams sent to this side
+    ReorderStatistics getReorderStatistics()const;
+    ///Returns the number of unreliable packets the whole connection has sent in UDP datagrams rather than over TCP
+    uint32 getDatagramsSent()const;
+    ///Returns the number of packets the whole connection discarded unsent because they outlived their time to live or were replaced
+    uint32 getStalePacketsDiscarded()const;
+    ///The traffic and send latency of the whole connection
+    class ConnectionStatistics {
+    public:
+        ///The data every stream of the connection has sent and received, not counting framing or control packets
+        TrafficStatistics mTraffic;
+        ///The most bytes ever waiting to be handed to the operating system on any one TCP connection
+        uint32 mMaxQueuedBytes;
+        ///How long packets waited in a send queue before being handed to the operating system
+        LatencyHistogram mQueueLatency;
+        ///How long the operating system took to complete each send
+        LatencyHistogram mSendLatency;
+        ///The number of asio completion handlers that did not fit in the memory each socket recycles for them and went to the heap
+        uint32 mHandlerHeapAllocations;
+        ///The TCPSocketOptions::Option flags that took effect on every active TCP connection
+        uint32 mSocketOptionsApplied;
+        ///The smallest SO_SNDBUF the system kept on an active TCP connection, which it may have doubled or clamped from the size asked for, or 0 if one was not set
+        uint32 mSendBufferSize;
+        ///The smallest SO_RCVBUF the system kept on an active TCP connection, which it may have doubled or clamped from the size asked for, or 0 if one was not set
+        uint32 mReceiveBufferSize;
+    };
+    ///Returns the traffic and send latency of the whole connection so far
+    ConnectionStatistics getConnectionStatistics()const;
+    ///Returns the data this stream has sent and received so far
+    TrafficStatistics getStreamStatistics()const;
+    /**
+     * Logs the statistics of the whole connection and each of its streams every period at the info level, or stops if period is zero.
+     * The counters are always kept, so this only costs the periodic log line
+     */
+    void setStatisticsDump(const Task::DeltaTime&period);
+    /**
+     * Starts keeping the most recent packets the whole connection sends and receives in a ring of capacity bytes.
+     * If errorTraceFile is not empty the packets are written to it should the connection be lost.
+     * Calling this again only changes errorTraceFile
+     */
+    void setPacketTrace(size_t capacity, const std::string&errorTraceFile=std::string());
+    ///Writes the packets traced so far to a file PacketTrace::read understands, returning false if there is no trace or the file could not be written
+    bool writePacketTrace(const std::string&filename)const;
 };
 } }
 #endif
@@ -35,57 +35,254 @@
 #include "TCPStream.hpp"
 #include "TCPStreamListener.hpp"
 #include "ASIOStreamBuilder.hpp"
+#include "ASIODatagramChannel.hpp"
 #include "options/Options.hpp"
+#include <cstdio>
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+#include <sys/stat.h>
+#endif
 namespace Sirikata { namespace Network {
 using namespace boost::asio::ip;
 
+/**
+ * An acceptor shared by its listener and the accept handler waiting on it, which keeps it alive until it has run.
+ * The lock keeps a listener that is closing from closing it while a handler is starting the next accept
+ */
+template <class Listener> class SharedAcceptor:public Noncopyable {
+public:
+    Listener mAcceptor;
+    boost::mutex mLock;
+    ///Whether the listener has closed the acceptor, after which no accept may start on it
+    bool mClosed;
+    explicit SharedAcceptor(IOService&io):mAcceptor(io),mClosed(false){}
+    ///Closes the acceptor, which aborts the accept waiting on it
+    void close() {
+        boost::lock_guard<boost::mutex> guard(mLock);
+        mClosed=true;
+        boost::system::error_code ignored;
+        mAcceptor.close(ignored);
+    }
+};
 TCPStreamListener::TCPStreamListener(IOService&io) {
     mIOService=&io;
-    mTCPAcceptor=NULL;
 }
-bool newAcceptPhase(TCPListener*listen, IOService* io,const Stream::SubstreamCallback &cb);
-void handleAccept(TCPSocket*socket,TCPListener*listen, IOService* io,const Stream::SubstreamCallback &cb,const boost::system::error_code& error){
-    if(error) {
+namespace {
+#ifdef SO_REUSEPORT
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET,SO_REUSEPORT> ReusePort;
+#endif
+/**
+ * Binds acceptor to endpoint, sharing the port among the acceptors of one listener with SO_REUSEPORT if reusePort.
+ * The first acceptor turns it on only once its bind has succeeded, so it never joins a port another socket already holds,
+ * and the rest turn it on before binding alongside the first.
+ * Connections are accepted with the buffer sizes of their acceptor, which settle the window scale they offer
+ */
+void openAcceptor(TCPListener&acceptor,const tcp::endpoint&endpoint,bool reusePort,bool firstAcceptor,const TCPSocketOptions&options,boost::system::error_code&error) {
+    acceptor.open(endpoint.protocol(),error);
+    if (!error)
+        acceptor.set_option(tcp::acceptor::reuse_address(true),error);
+#ifdef SO_REUSEPORT
+    if (!error&&reusePort&&!firstAcceptor)
+        acceptor.set_option(ReusePort(true),error);
+#endif
+    if (!error) {
+        //each accepted connection reports whether its buffer sizes took effect
+        boost::system::error_code ignored;
+        if (options.mSendBufferSize)
+            acceptor.set_option(boost::asio::socket_base::send_buffer_size(options.mSendBufferSize),ignored);
+        if (options.mReceiveBufferSize)
+            acceptor.set_option(boost::asio::socket_base::receive_buffer_size(options.mReceiveBufferSize),ignored);
+        acceptor.bind(endpoint,error);
+    }
+#ifdef SO_REUSEPORT
+    //the group of sockets sharing the port is formed when the first listens
+    if (!error&&reusePort&&firstAcceptor)
+        acceptor.set_option(ReusePort(true),error);
+#endif
+    if (!error)
+        acceptor.listen(boost::asio::socket_base::max_connections,error);
+}
+/**
+ * Owns the socket a pending accept fills in until it is handed on, so that it is freed
+ * even if the service is torn down without ever running the accept handler
+ */
+template <class Socket> class AcceptingSocket:public Noncopyable {
+    Socket*mSocket;
+public:
+    explicit AcceptingSocket(Socket*socket):mSocket(socket){}
+    ~AcceptingSocket(){delete mSocket;}
+    Socket&operator*()const{return *mSocket;}
+    Socket*release(){Socket*socket=mSocket;mSocket=NULL;return socket;}
+};
+}
+bool newAcceptPhase(const std::tr1::shared_ptr<SharedAcceptor<TCPListener> >&listen, IOService* io,const Stream::SubstreamCallback &cb,const std::tr1::shared_ptr<ASIODatagramChannel>&datagrams,const TCPSocketOptions&options);
+void handleAccept(const std::tr1::shared_ptr<AcceptingSocket<TCPSocket> >&socket,const std::tr1::shared_ptr<SharedAcceptor<TCPListener> >&listen, IOService* io,const Stream::SubstreamCallback &cb,const std::tr1::shared_ptr<ASIODatagramChannel>&datagrams,const TCPSocketOptions&options,const boost::system::error_code& error){
+    if (error==boost::asio::error::operation_aborted) {
+        //the listener closed
+    }else if(error) {
 		boost::system::system_error se(error);
 		SILOG(tcpsst,error, "ERROR IN THE TCP STREAM ACCEPTING PROCESS"<<se.what() << std::endl);
         //FIXME: attempt more?
     }else {
-        ASIOStreamBuilder::beginNewStream(socket,io,cb);
-        newAcceptPhase(listen,io,cb);
+        ASIOStreamBuilder::beginNewStream(socket->release(),io,cb,datagrams,options);
+        newAcceptPhase(listen,io,cb,datagrams,options);
     }
 }
-bool newAcceptPhase(TCPListener*listen, IOService* io, const Stream::SubstreamCallback &cb) {
-    TCPSocket*socket=new TCPSocket(*io);
+bool newAcceptPhase(const std::tr1::shared_ptr<SharedAcceptor<TCPListener> >&listen, IOService* io, const Stream::SubstreamCallback &cb,const std::tr1::shared_ptr<ASIODatagramChannel>&datagrams,const TCPSocketOptions&options) {
+    boost::lock_guard<boost::mutex> guard(listen->mLock);
+    if (listen->mClosed)
+        return false;
+    std::tr1::shared_ptr<AcceptingSocket<TCPSocket> > socket(new AcceptingSocket<TCPSocket>(new TCPSocket(*io)));
     //need to use boost bind to avoid TR1 errors about compatibility with boost::asio::placeholders
      
-    listen->async_accept(*socket,
-                         std::tr1::bind(&handleAccept,socket,listen,io,cb,_1));
+    listen->mAcceptor.async_accept(**socket,
+                         std::tr1::bind(&handleAccept,socket,listen,io,cb,datagrams,options,_1));
     return true;
 }
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+bool newUnixAcceptPhase(const std::tr1::shared_ptr<SharedAcceptor<UnixListener> >&listen, IOService* io,const Stream::SubstreamCallback &cb);
+void handleUnixAccept(const std::tr1::shared_ptr<AcceptingSocket<UnixSocket> >&local,const std::tr1::shared_ptr<SharedAcceptor<UnixListener> >&listen, IOService* io,const Stream::SubstreamCallback &cb,const boost::system::error_code& error){
+    if (error==boost::asio::error::operation_aborted) {
+        //the listener closed
+    }else if(error) {
+		boost::system::system_error se(error);
+		SILOG(tcpsst,error, "ERROR IN THE UNIX STREAM ACCEPTING PROCESS"<<se.what() << std::endl);
+        SILOG(tcpsst,error,"No more connections will be accepted on this Unix domain socket");
+    }else {
+        TCPSocket*socket=new TCPSocket(*io);
+        boost::system::error_code adoptError;
+        AdoptUnixSocket(*socket,**local,adoptError);
+        delete local->release();
+        if (adoptError) {
+            SILOG(tcpsst,error,"Could not take over Unix domain connection: "<<adoptError.message());
+            delete socket;
+        }else {
+            //a Unix domain connection never has a UDP side channel: its unreliable packets are as cheap on the socket
+            //nor any TCP options to give it
+            ASIOStreamBuilder::beginNewStream(socket,io,cb,std::tr1::shared_ptr<ASIODatagramChannel>(),TCPSocketOptions::systemDefaults());
+        }
+        newUnixAcceptPhase(listen,io,cb);
+    }
+}
+/**
+ * Removes the socket file at path if a listener that did not close left it behind, so that it may be bound again.
+ * Anything that is not a socket, or a socket something still accepts connections on, is left alone
+ */
+void removeStaleUnixSocket(IOService&io, const std::string&path) {
+    struct stat info;
+    if (lstat(path.c_str(),&info)!=0||!S_ISSOCK(info.st_mode))
+        return;
+    UnixSocket probe(io);
+    boost::system::error_code error;
+    probe.connect(boost::asio::local::stream_protocol::endpoint(path),error);
+    if (error==boost::asio::error::connection_refused)
+        std::remove(path.c_str());
+}
+bool newUnixAcceptPhase(const std::tr1::shared_ptr<SharedAcceptor<UnixListener> >&listen, IOService* io, const Stream::SubstreamCallback &cb) {
+    boost::lock_guard<boost::mutex> guard(listen->mLock);
+    if (listen->mClosed)
+        return false;
+    std::tr1::shared_ptr<AcceptingSocket<UnixSocket> > local(new AcceptingSocket<UnixSocket>(new UnixSocket(*io)));
+    listen->mAcceptor.async_accept(**local,
+                         std::tr1::bind(&handleUnixAccept,local,listen,io,cb,_1));
+    return true;
+}
+#endif
 bool TCPStreamListener::listen (const Address&address,
                                 const Stream::SubstreamCallback&newStreamCallback) {
+    if (address.isUnixDomain()) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        boost::asio::local::stream_protocol::endpoint endpoint(address.getService());
+        //a socket file left behind by a listener that did not close would make the bind fail
+        removeStaleUnixSocket(*mIOService,address.getService());
+        std::tr1::shared_ptr<SharedAcceptor<UnixListener> > acceptor(new SharedAcceptor<UnixListener>(*mIOService));
+        boost::system::error_code error;
+        acceptor->mAcceptor.open(endpoint.protocol(),error);
+        if (!error)
+            acceptor->mAcceptor.bind(endpoint,error);
+        if (!error)
+            acceptor->mAcceptor.listen(boost::asio::socket_base::max_connections,error);
+        if (error) {
+            SILOG(tcpsst,error,"Could not listen on Unix domain socket "<<address.getService()<<": "<<error.message());
+            return false;
+        }
+        mUnixPath=address.getService();
+        mUnixAcceptor=acceptor;
+        return newUnixAcceptPhase(mUnixAcceptor,mIOService,newStreamCallback);
+#else
+        SILOG(tcpsst,error,"Unix domain sockets are not supported on this platform");
+        return false;
+#endif
+    }
 
-    mTCPAcceptor = new TCPListener(*mIOService,tcp::endpoint(tcp::v4(), atoi(address.getService().c_str())));
-    return newAcceptPhase(mTCPAcceptor,mIOService,newStreamCallback);
+    tcp::endpoint endpoint(tcp::v4(), atoi(address.getService().c_str()));
+    std::vector<IOService*> services=mAcceptorServices;
+    if (services.empty())
+        services.push_back(mIOService);
+#ifndef SO_REUSEPORT
+    if (services.size()>1) {
+        SILOG(tcpsst,warning,"SO_REUSEPORT is not supported on this platform: accepting on a single service");
+        services.resize(1);
+    }
+#endif
+    for (std::vector<IOService*>::const_iterator i=services.begin(),ie=services.end();i!=ie;++i) {
+        std::tr1::shared_ptr<SharedAcceptor<TCPListener> > acceptor(new SharedAcceptor<TCPListener>(**i));
+        boost::system::error_code error;
+        openAcceptor(acceptor->mAcceptor,endpoint,services.size()>1,mTCPAcceptors.empty(),mSocketOptions,error);
+        if (error) {
+            SILOG(tcpsst,error,"Could not open acceptor "<<mTCPAcceptors.size()<<" on port "<<endpoint.port()<<": "<<error.message());
+            close();
+            return false;
+        }
+        //a port of 0 lets the first acceptor pick one, which the rest must share
+        endpoint=acceptor->mAcceptor.local_endpoint();
+        mTCPAcceptors.push_back(acceptor);
+    }
+    //accepted connections share one UDP socket whichever acceptor they came in on
+    tcp::endpoint local=mTCPAcceptors[0]->mAcceptor.local_endpoint();
+    mDatagramChannel = ASIODatagramChannel::listen(*mIOService,udp::endpoint(local.address(),local.port()));
+    for (size_t i=0;i<mTCPAcceptors.size();++i) {
+        newAcceptPhase(mTCPAcceptors[i],services[i],newStreamCallback,mDatagramChannel,mSocketOptions);
+    }
+    return true;
 }
 TCPStreamListener::~TCPStreamListener() {
-    delete mTCPAcceptor;
+    close();
 }
 String TCPStreamListener::listenAddressName() const {
+    if (mUnixAcceptor) {
+        return String(Address::UNIX_DOMAIN_SCHEME())+':'+mUnixPath;
+    }
     std::stringstream retval;
-    retval<<mTCPAcceptor->local_endpoint().address().to_string()<<':'<<mTCPAcceptor->local_endpoint().port();
+    retval<<mTCPAcceptors[0]->mAcceptor.local_endpoint().address().to_string()<<':'<<mTCPAcceptors[0]->mAcceptor.local_endpoint().port();
     return retval.str();
 }
 
 Address TCPStreamListener::listenAddress() const {
+    if (mUnixAcceptor) {
+        return Address::unixDomain(mUnixPath);
+    }
     std::stringstream port;
-    port << mTCPAcceptor->local_endpoint().port();
-    return Address(mTCPAcceptor->local_endpoint().address().to_string(),
+    port << mTCPAcceptors[0]->mAcceptor.local_endpoint().port();
+    return Address(mTCPAcceptors[0]->mAcceptor.local_endpoint().address().to_string(),
                    port.str());
 }
 void TCPStreamListener::close(){
-    delete mTCPAcceptor;
-    mTCPAcceptor=NULL;
+    //the accept handlers still waiting hold the acceptors until they run, and start no more accepts
+    for (size_t i=0;i<mTCPAcceptors.size();++i) {
+        mTCPAcceptors[i]->close();
+    }
+    mTCPAcceptors.clear();
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (mUnixAcceptor) {
+        mUnixAcceptor->close();
+        mUnixAcceptor=std::tr1::shared_ptr<SharedAcceptor<UnixListener> >();
+        std::remove(mUnixPath.c_str());
+    }
+#endif
+    if (mDatagramChannel) {
+        mDatagramChannel->release();
+        mDatagramChannel=std::tr1::shared_ptr<ASIODatagramChannel>();
+    }
 }
 
 } }
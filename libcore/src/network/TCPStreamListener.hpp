@@ -33,12 +33,17 @@
 #ifndef SIRIKATA_TCPStreamListener_HPP__
 #define SIRIKATA_TCPStreamListener_HPP__
 #include "StreamListener.hpp"
+#include "TCPSocketOptions.hpp"
 namespace Sirikata { namespace Network {
 class IOService;
 class TCPListener;
+class UnixListener;
+class ASIODatagramChannel;
+template <class Listener> class SharedAcceptor;
 /**
  * This class waits on a service and listens for incoming connections
  * It calls the callback whenever such connections are encountered
+ * An Address::unixDomain address listens on a Unix domain socket instead, for connections from the same machine
  */
 class SIRIKATA_EXPORT TCPStreamListener:public StreamListener{
 
@@ -52,11 +57,42 @@ public:
     virtual String listenAddressName()const;
     ///returns the name of the computer followed by a colon and then the service being listened on
     virtual Address listenAddress()const;
-    ///stops listening
+    ///stops listening: the acceptors are closed at once and freed once the last of their accept handlers has run
     virtual void close();
+    /**
+     * Makes a subsequent listen on a TCP address open an acceptor on each of services, all bound to the same port with
+     * SO_REUSEPORT so that the system spreads incoming connections among them. Connections are built on the service of
+     * the acceptor their first socket arrived at, and the other sockets of their handshake join them from any acceptor.
+     * A service may be listed more than once to accept on several threads of an IOServicePool.
+     * Where SO_REUSEPORT is not supported a single acceptor listens on the first service.
+     * Once the port is listened on, any process running as the same user may bind it with SO_REUSEPORT too and be
+     * handed a share of its connections, so only spread a listener over several services where every such process is trusted
+     */
+    void setAcceptorServices(const std::vector<IOService*>&services) {
+        mAcceptorServices=services;
+    }
+    /**
+     * Sets the options the TCP connections of a subsequent listen are given, in place of the global defaults.
+     * The buffer sizes are also set on the acceptors, so connections start out with them.
+     * The getConnectionStatistics of accepted streams report which took effect
+     */
+    void setSocketOptions(const TCPSocketOptions&options) {
+        mSocketOptions=options;
+    }
     virtual ~TCPStreamListener();
     IOService * mIOService;
-    TCPListener *mTCPAcceptor;
+    ///The options accepted TCP connections are given
+    TCPSocketOptions mSocketOptions;
+    ///The services acceptors run on, or empty to accept on mIOService alone
+    std::vector<IOService*> mAcceptorServices;
+    ///The acceptors of a TCP address, the first of which names the address listened on: their accept handlers share them
+    std::vector<std::tr1::shared_ptr<SharedAcceptor<TCPListener> > > mTCPAcceptors;
+    ///The acceptor for a Unix domain address, in place of mTCPAcceptors
+    std::tr1::shared_ptr<SharedAcceptor<UnixListener> > mUnixAcceptor;
+    ///The path of the Unix domain socket mUnixAcceptor listens on, which is removed when it closes
+    String mUnixPath;
+    ///The UDP socket bound to the listening port that accepted connections send unreliable packets over, or NULL: it stays open while they do
+    std::tr1::shared_ptr<ASIODatagramChannel> mDatagramChannel;
 };
 } }
 #endif
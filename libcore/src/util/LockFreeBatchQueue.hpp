@@ -0,0 +1,91 @@
+/*  Sirikata Utilities -- Sirikata Synchronization Utilities
+ *  LockFreeBatchQueue.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIRIKATA_LOCK_FREE_BATCH_QUEUE_HPP_
+#define _SIRIKATA_LOCK_FREE_BATCH_QUEUE_HPP_
+
+#include "AtomicTypes.hpp"
+
+namespace Sirikata {
+
+/**
+ * An intrusive queue that any number of threads may push onto without locking while a single consumer
+ * takes everything pushed so far in one step, oldest first.
+ * Items are linked through their NextPointer member, so pushing never allocates or copies,
+ * but an item may only be in one such queue at a time.
+ */
+template <class T, T* T::*NextPointer> class LockFreeBatchQueue {
+    ///The most recently pushed item, which links to the ones pushed before it
+    AtomicValue<T*> mNewest;
+    //copying would leave two queues sharing the same items
+    LockFreeBatchQueue(const LockFreeBatchQueue&);
+    LockFreeBatchQueue&operator=(const LockFreeBatchQueue&);
+public:
+    LockFreeBatchQueue():mNewest((T*)NULL) {
+    }
+    ///Adds item to the back of the queue: safe to call from any number of threads at once
+    void push(T*item) {
+        T*newest;
+        do {
+            newest=mNewest.read();
+            item->*NextPointer=newest;
+        } while (!mNewest.compareAndSwap(newest,item));
+    }
+    ///Returns true if nothing was in the queue at the moment of the call
+    bool probablyEmpty()const {
+        return mNewest.read()==NULL;
+    }
+    /**
+     * Removes everything pushed so far.
+     * Only one thread may pop from a queue at a time.
+     * \returns the oldest item, which links through NextPointer to the others in the order they were pushed, or NULL if the queue was empty
+     */
+    T*popAll() {
+        T*newest;
+        do {
+            newest=mNewest.read();
+        } while (newest!=NULL&&!mNewest.compareAndSwap(newest,NULL));
+        //the items are linked newest first: reverse them so they come out in the order they were pushed
+        T*oldest=NULL;
+        while (newest) {
+            T*next=newest->*NextPointer;
+            newest->*NextPointer=oldest;
+            oldest=newest;
+            newest=next;
+        }
+        return oldest;
+    }
+};
+
+}
+
+#endif //_SIRIKATA_LOCK_FREE_BATCH_QUEUE_HPP_
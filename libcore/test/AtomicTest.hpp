@@ -74,4 +74,16 @@ public:
         TS_ASSERT_EQUALS(test+1+235,output);
 #endif
     }
+    void testAtomicCompareAndSwap( void ) {
+        AtomicValue<Sirikata::uint32> a(5U);
+        TS_ASSERT(!a.compareAndSwap(4U,7U));
+        TS_ASSERT_EQUALS(a.read(),5U);
+        TS_ASSERT(a.compareAndSwap(5U,7U));
+        TS_ASSERT_EQUALS(a.read(),7U);
+        int x,y;
+        AtomicValue<int*> p(&x);
+        TS_ASSERT(!p.compareAndSwap(&y,(int*)NULL));
+        TS_ASSERT(p.compareAndSwap(&x,&y));
+        TS_ASSERT(p.read()==&y);
+    }
 };
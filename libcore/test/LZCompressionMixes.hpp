@@ -0,0 +1,136 @@
+/*  Sirikata Tests -- Sirikata Test Suite
+ *  LZCompressionMixes.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIRIKATA_LZCOMPRESSIONMIXES_HPP_
+#define _SIRIKATA_LZCOMPRESSIONMIXES_HPP_
+/**
+ * Messages like those the network layer sends, for LZCompressionTest to check and the benchmarks to time
+ */
+class LZCompressionMixes {
+public:
+    typedef std::vector<Sirikata::uint8> Message;
+    static void appendFloat(Message&message, float value) {
+        const Sirikata::uint8*bytes=(const Sirikata::uint8*)&value;
+        message.insert(message.end(),bytes,bytes+sizeof(float));
+    }
+    static void appendVarint(Message&message, Sirikata::uint64 value) {
+        while (value>=128) {
+            message.push_back((Sirikata::uint8)(value|128));
+            value>>=7;
+        }
+        message.push_back((Sirikata::uint8)value);
+    }
+    ///A protocol buffer encoded location update for one of a few hundred objects, much as the object host sends them
+    static void appendLocationUpdate(Message&message, int object, int frame) {
+        message.push_back(0x0a);
+        message.push_back(16);
+        for (int i=0;i<16;++i)
+            message.push_back((Sirikata::uint8)((object*2654435761U)>>(i%4*8))^(Sirikata::uint8)i);
+        message.push_back(0x12);
+        message.push_back(12);
+        appendFloat(message,object*10.0f+frame*0.1f);
+        appendFloat(message,5.0f);
+        appendFloat(message,object*-3.0f+frame*0.05f);
+        message.push_back(0x1a);
+        message.push_back(12);
+        appendFloat(message,1.0f);
+        appendFloat(message,0.0f);
+        appendFloat(message,0.5f);
+        message.push_back(0x22);
+        message.push_back(16);
+        appendFloat(message,0.0f);
+        appendFloat(message,0.7071f);
+        appendFloat(message,0.0f);
+        appendFloat(message,0.7071f);
+        message.push_back(0x28);
+        appendVarint(message,1250000000000ULL+frame*16667);
+    }
+    ///The bytes a message of length bytes takes to send if it compressed to compressedLength, or 0 if it did not fit
+    static size_t sentLength(size_t length, size_t compressedLength) {
+        //a compressed packet names its stream twice and carries its original length, about 5 extra bytes
+        return compressedLength&&compressedLength+5<length?compressedLength+5:length;
+    }
+    ///A mix of messages, each of which is compressed on its own as it would be by a stream
+    class MessageMix {
+    public:
+        const char*mName;
+        ///The most the mix may take to send, as a fraction of its original size
+        double mMaxSentFraction;
+        std::vector<Message> mMessages;
+        MessageMix(const char*name,double maxSentFraction):mName(name),mMaxSentFraction(maxSentFraction){}
+    };
+    static std::vector<MessageMix> makeMixes() {
+        std::vector<MessageMix> mixes;
+        mixes.push_back(MessageMix("single location updates",1.0));
+        for (int frame=0;frame<20;++frame) {
+            for (int object=0;object<200;++object) {
+                mixes.back().mMessages.push_back(Message());
+                appendLocationUpdate(mixes.back().mMessages.back(),object,frame);
+            }
+        }
+        mixes.push_back(MessageMix("batched location updates",0.5));
+        for (int frame=0;frame<20;++frame) {
+            for (int batch=0;batch<10;++batch) {
+                mixes.back().mMessages.push_back(Message());
+                for (int object=batch*20;object<batch*20+20;++object)
+                    appendLocationUpdate(mixes.back().mMessages.back(),object,frame);
+            }
+        }
+        mixes.push_back(MessageMix("chat text",0.85));
+        const char*words[]={"the ","green ","grasshopper ","fetched ","a ","blade ","of ","grass ","from ","playground ","hello ","world "};
+        for (int i=0;i<4000;++i) {
+            std::string line;
+            for (int j=0;j<5+i%20;++j)
+                line+=words[(i*7+j*13)%(sizeof(words)/sizeof(words[0]))];
+            mixes.back().mMessages.push_back(Message(line.begin(),line.end()));
+        }
+        mixes.push_back(MessageMix("scene markup",0.25));
+        for (int i=0;i<100;++i) {
+            std::ostringstream markup;
+            for (int j=0;j<200;++j)
+                markup<<"<vertex x=\""<<(i*j)%1000<<"\" y=\""<<j*3<<"\" z=\"0\" material=\"stone\"/>\n";
+            std::string text=markup.str();
+            mixes.back().mMessages.push_back(Message(text.begin(),text.end()));
+        }
+        mixes.push_back(MessageMix("compressed asset data",1.0));
+        Sirikata::uint32 seed=12345;
+        for (int i=0;i<100;++i) {
+            mixes.back().mMessages.push_back(Message(16384));
+            for (size_t j=0;j<16384;++j) {
+                seed=seed*1103515245+12345;
+                mixes.back().mMessages.back()[j]=(Sirikata::uint8)(seed>>16);
+            }
+        }
+        return mixes;
+    }
+};
+#endif
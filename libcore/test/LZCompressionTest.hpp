@@ -0,0 +1,103 @@
+/*  Sirikata Tests -- Sirikata Test Suite
+ *  LZCompressionTest.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cxxtest/TestSuite.h>
+#include "network/LZCompression.hpp"
+#include "LZCompressionMixes.hpp"
+
+using namespace Sirikata;
+using Sirikata::Network::LZCompression;
+class LZCompressionTest : public CxxTest::TestSuite
+{
+    typedef LZCompressionMixes::Message Message;
+    ///Compresses message into no more space than it had and checks that it decompresses back, returning the compressed length or 0
+    size_t roundTrip(const Message&message) {
+        Message compressed(message.size()+1);
+        size_t compressedLength=LZCompression::compress(&message[0],message.size(),&compressed[0],message.size());
+        if (compressedLength) {
+            Message decompressed(message.size());
+            TS_ASSERT(LZCompression::decompress(&compressed[0],compressedLength,&decompressed[0],decompressed.size()));
+            TS_ASSERT(decompressed==message);
+        }
+        return compressedLength;
+    }
+public:
+    void testRoundTrip( void ) {
+        Message repetitive;
+        for (int i=0;i<5000;++i)
+            repetitive.push_back((uint8)"abcabcabd"[i%9]);
+        size_t compressedLength=roundTrip(repetitive);
+        TS_ASSERT(compressedLength>0);
+        TS_ASSERT(compressedLength<repetitive.size()/10);
+        //a run longer than the longest match and a match right at the start of the data
+        Message run(1000,'x');
+        TS_ASSERT(roundTrip(run)>0);
+        for (size_t size=1;size<100;++size) {
+            Message mixed;
+            for (size_t i=0;i<size;++i)
+                mixed.push_back((uint8)((i*i)%7));
+            roundTrip(mixed);
+        }
+        Message noise(4096);
+        uint32 seed=1;
+        for (size_t i=0;i<noise.size();++i) {
+            seed=seed*1103515245+12345;
+            noise[i]=(uint8)(seed>>16);
+        }
+        //random data cannot fit in the space it had
+        TS_ASSERT_EQUALS(roundTrip(noise),0U);
+    }
+    void testCorruptInput( void ) {
+        Message repetitive(300,'y');
+        Message compressed(300);
+        size_t compressedLength=LZCompression::compress(&repetitive[0],repetitive.size(),&compressed[0],compressed.size());
+        TS_ASSERT(compressedLength>0);
+        Message decompressed(300);
+        TS_ASSERT(!LZCompression::decompress(&compressed[0],compressedLength-1,&decompressed[0],decompressed.size()));
+        TS_ASSERT(!LZCompression::decompress(&compressed[0],compressedLength,&decompressed[0],decompressed.size()-1));
+        //a match reaching back before the start of the output
+        uint8 badMatch[]={0x20,0x10};
+        TS_ASSERT(!LZCompression::decompress(badMatch,sizeof(badMatch),&decompressed[0],3));
+    }
+    void testMessageMixes( void ) {
+        std::vector<LZCompressionMixes::MessageMix> mixes=LZCompressionMixes::makeMixes();
+        for (size_t m=0;m<mixes.size();++m) {
+            const std::vector<Message>&messages=mixes[m].mMessages;
+            size_t originalBytes=0;
+            size_t sentBytes=0;
+            for (size_t i=0;i<messages.size();++i) {
+                originalBytes+=messages[i].size();
+                sentBytes+=LZCompressionMixes::sentLength(messages[i].size(),roundTrip(messages[i]));
+            }
+            TS_ASSERT(sentBytes<=originalBytes*mixes[m].mMaxSentFraction);
+        }
+    }
+};
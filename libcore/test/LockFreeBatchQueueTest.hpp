@@ -0,0 +1,122 @@
+/*  Sirikata Tests -- Sirikata Test Suite
+ *  LockFreeBatchQueueTest.hpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cxxtest/TestSuite.h>
+#include "util/LockFreeBatchQueue.hpp"
+#include <boost/thread.hpp>
+
+using namespace Sirikata;
+class LockFreeBatchQueueTest : public CxxTest::TestSuite
+{
+    struct Item {
+        Item*mNext;
+        int mProducer;
+        int mSequence;
+    };
+    typedef LockFreeBatchQueue<Item,&Item::mNext> BatchQueue;
+    enum {
+        NUM_ITEMS_PER_THREAD=10000,
+        MAX_THREADS=8
+    };
+    std::vector<Item> mItems;
+    AtomicValue<int> mStartedThreads;
+
+    void makeItems(int numThreads) {
+        mItems.resize(numThreads*NUM_ITEMS_PER_THREAD);
+        for (int i=0;i<numThreads;++i) {
+            for (int j=0;j<NUM_ITEMS_PER_THREAD;++j) {
+                Item&item=mItems[i*NUM_ITEMS_PER_THREAD+j];
+                item.mNext=NULL;
+                item.mProducer=i;
+                item.mSequence=j;
+            }
+        }
+    }
+    void waitForStart(int numThreads) {
+        ++mStartedThreads;
+        while (mStartedThreads.read()<numThreads)
+            boost::this_thread::yield();
+    }
+    void batchProducer(BatchQueue*queue, int producer, int numThreads) {
+        waitForStart(numThreads);
+        for (int j=0;j<NUM_ITEMS_PER_THREAD;++j)
+            queue->push(&mItems[producer*NUM_ITEMS_PER_THREAD+j]);
+    }
+    /**
+     * Pushes NUM_ITEMS_PER_THREAD items from each of numThreads threads while this thread drains the queue in batches,
+     * checking that each producer's items arrive in the order it pushed them
+     */
+    void runBatchQueue(int numThreads) {
+        makeItems(numThreads);
+        mStartedThreads=0;
+        BatchQueue queue;
+        std::vector<boost::thread*> threads;
+        for (int i=0;i<numThreads;++i)
+            threads.push_back(new boost::thread(std::tr1::bind(&LockFreeBatchQueueTest::batchProducer,this,&queue,i,numThreads+1)));
+        waitForStart(numThreads+1);
+        std::vector<int> nextSequence(numThreads,0);
+        int received=0;
+        bool inOrder=true;
+        while (received<numThreads*NUM_ITEMS_PER_THREAD) {
+            for (Item*item=queue.popAll();item;item=item->mNext) {
+                inOrder=inOrder&&item->mSequence==nextSequence[item->mProducer]++;
+                ++received;
+            }
+        }
+        for (int i=0;i<numThreads;++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
+        TS_ASSERT(inOrder);
+        TS_ASSERT(queue.probablyEmpty());
+    }
+public:
+    void testPushPopAll( void ) {
+        makeItems(1);
+        BatchQueue queue;
+        TS_ASSERT(queue.probablyEmpty());
+        TS_ASSERT(queue.popAll()==NULL);
+        for (int i=0;i<3;++i)
+            queue.push(&mItems[i]);
+        TS_ASSERT(!queue.probablyEmpty());
+        Item*item=queue.popAll();
+        for (int i=0;i<3;++i,item=item->mNext) {
+            TS_ASSERT(item==&mItems[i]);
+        }
+        TS_ASSERT(item==NULL);
+        TS_ASSERT(queue.probablyEmpty());
+    }
+    void testConcurrentProducers( void ) {
+        for (int numThreads=1;numThreads<=MAX_THREADS;numThreads*=2) {
+            runBatchQueue(numThreads);
+        }
+    }
+};
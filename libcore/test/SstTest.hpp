@@ -33,9 +33,22 @@
 #include "network/TCPStream.hpp"
 #include "network/TCPStreamListener.hpp"
 #include "network/IOServiceFactory.hpp"
+#include "network/IOServicePool.hpp"
+#include "network/TCPDefinitions.hpp"
+#include "network/PacketBuffer.hpp"
+#include "network/StreamIDMap.hpp"
+#include "network/PacketTrace.hpp"
+#include "network/HandlerMemory.hpp"
+#include "util/ThreadSafeQueue.hpp"
+#include "network/ASIOSocketWrapper.hpp"
+#include "network/MultiplexedSocket.hpp"
+#include "task/Time.hpp"
 #include <cxxtest/TestSuite.h>
 #include <boost/thread.hpp>
 #include <time.h>
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+#include <sys/stat.h>
+#endif
 using namespace Sirikata::Network;
 class SstTest : public CxxTest::TestSuite
 {
@@ -75,6 +88,9 @@ public:
         mDataMap[id].push_back(data);
         ++mCount;
     }
+    static void writableCallback(Sirikata::AtomicValue<int>*writable) {
+        ++*writable;
+    }
     void connectorDataRecvCallback(Stream *s,int id, const Chunk&data) {
         dataRecvCallback(s,id,data);
     }
@@ -107,6 +123,89 @@ public:
             runRoutine(newStream);
         }
     }
+    void datagramNewStreamCallback (Sirikata::AtomicValue<int>*received,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            mStreams.push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstTest::countDataRecvCallback,received,_1));
+        }
+    }
+    static void countDataRecvCallback(Sirikata::AtomicValue<int>*received, const Chunk&data) {
+        ++*received;
+    }
+    static void countConnectedCallback(Sirikata::AtomicValue<int>*connected, Stream::ConnectionStatus stat, const std::string&reason) {
+        if (stat==Stream::Connected)
+            ++*connected;
+    }
+    void adaptiveNewStreamCallback (Sirikata::AtomicValue<int>*received,Sirikata::AtomicValue<int>*misordered,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            mStreams.push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstTest::sequencedDataRecvCallback,received,misordered,std::tr1::shared_ptr<Sirikata::uint32>(new Sirikata::uint32(0)),_1));
+        }
+    }
+    ///Accepts streams from acceptors on several threads, keeping them in accepted rather than mStreams
+    static void lockedNewStreamCallback (boost::mutex*lock,std::vector<TCPStream*>*accepted,Sirikata::AtomicValue<int>*received,Sirikata::AtomicValue<int>*misordered,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            {
+                boost::lock_guard<boost::mutex> guard(*lock);
+                accepted->push_back((TCPStream*)newStream);
+            }
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstTest::sequencedDataRecvCallback,received,misordered,std::tr1::shared_ptr<Sirikata::uint32>(new Sirikata::uint32(0)),_1));
+        }
+    }
+    ///Counts the packets of the streams it accepts, keeping them in accepted rather than mStreams
+    static void acceptedNewStreamCallback (std::vector<TCPStream*>*accepted,Sirikata::AtomicValue<int>*received,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            accepted->push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstTest::countDataRecvCallback,received,_1));
+        }
+    }
+    ///Counts packets slowly enough to back up the sender, checking that those starting with a nonzero sequence number arrive in sequence
+    static void sequencedDataRecvCallback(Sirikata::AtomicValue<int>*received, Sirikata::AtomicValue<int>*misordered, const std::tr1::shared_ptr<Sirikata::uint32>&expected, const Chunk&data) {
+        boost::this_thread::sleep(boost::posix_time::microseconds(100));
+        Sirikata::uint32 sequence=0;
+        if (data.size()>=sizeof(sequence))
+            std::memcpy(&sequence,&*data.begin(),sizeof(sequence));
+        if (sequence) {
+            if (sequence!=++*expected)
+                ++*misordered;
+        }
+        ++*received;
+    }
+    void lastByteNewStreamCallback (Sirikata::AtomicValue<int>*received,Sirikata::AtomicValue<int>*lastByte,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            mStreams.push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstTest::lastByteRecvCallback,received,lastByte,_1));
+        }
+    }
+    ///Counts packets, remembering the last byte of the last packet longer than a byte
+    static void lastByteRecvCallback(Sirikata::AtomicValue<int>*received, Sirikata::AtomicValue<int>*lastByte, const Chunk&data) {
+        if (data.size()>1)
+            *lastByte=data.back();
+        ++*received;
+    }
+    void keepNewStreamCallback (boost::mutex*lock,std::vector<Chunk>*arrived,Stream * newStream, Stream::SetCallbacks& setCallbacks) {
+        if (newStream) {
+            mStreams.push_back((TCPStream*)newStream);
+            using std::tr1::placeholders::_1;
+            setCallbacks(&Stream::ignoreConnectionStatus,
+                         std::tr1::bind(&SstTest::keepDataRecvCallback,lock,arrived,_1));
+        }
+    }
+    ///Keeps the packets of every stream in the order they arrive
+    static void keepDataRecvCallback(boost::mutex*lock, std::vector<Chunk>*arrived, const Chunk&data) {
+        boost::lock_guard<boost::mutex> guard(*lock);
+        arrived->push_back(data);
+    }
     void ioThread(){
         TCPStreamListener s(*mIO);
         using std::tr1::placeholders::_1;
@@ -129,6 +228,8 @@ public:
     const char * ENDSTRING;
     volatile bool mAbortTest;
     volatile bool mReadyToConnect;
+    ///The port nextLoopback hands out next: every test listening on loopback takes its ports from there
+    unsigned short mNextPort;
     void validateSameness(
         int id,
         const std::vector<const Sirikata::Network::Chunk* >&netData,
@@ -216,7 +317,7 @@ public:
         validateSameness(id,orderedNetData,orderedKeyData);
         validateSameness(id,unorderedNetData,unorderedKeyData);
     }
-    SstTest():mIO(IOServiceFactory::makeIOService()),mCount(0),mDisconCount(0),mEndCount(0),ENDSTRING("T end"),mAbortTest(false),mReadyToConnect(false){
+    SstTest():mIO(IOServiceFactory::makeIOService()),mCount(0),mDisconCount(0),mEndCount(0),ENDSTRING("T end"),mAbortTest(false),mReadyToConnect(false),mNextPort(9143){
         mPort="9142";
         mThread= new boost::thread(boost::bind(&SstTest::ioThread,this));
         bool doUnorderedTest=true;
@@ -352,6 +453,40 @@ public:
                    std::tr1::bind(&SstTest::connectorDataRecvCallback,this,s,id,_1));
         --id;
     }
+    ///Sleeps until the service thread is running mIO
+    void waitForService() {
+        while (!mReadyToConnect) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+    }
+    ///A loopback address on a port no other test uses, so tests never collide or wait out each other's lingering sockets
+    Address nextLoopback() {
+        std::ostringstream port;
+        port<<mNextPort++;
+        return Address("127.0.0.1",port.str());
+    }
+    ///Sleeps until value reaches target or the seconds run out, returning whether it got there
+    static bool waitFor(Sirikata::AtomicValue<int>&value,int target,int seconds) {
+        time_t start=time(NULL);
+        while (value.read()<target) {
+            if (time(NULL)>=start+seconds)
+                return false;
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        return true;
+    }
+    /**
+     * Has listener accept streams on address with newStreamCallback once the service is running, and connects r to it
+     * ignoring whatever r hears back: r and listener should be set up first, as they start right away
+     */
+    void listenAndConnect(TCPStreamListener&listener,const Address&address,const Stream::SubstreamCallback&newStreamCallback,TCPStream&r) {
+        waitForService();
+        listener.listen(address,newStreamCallback);
+        r.connect(address,
+                  &Stream::ignoreSubstreamCallback,
+                  &Stream::ignoreConnectionStatus,
+                  &Stream::ignoreBytesReceived);
+    }
     void testInt30Serialization(void) {
         Sirikata::Network::Stream::uint30 a(10),b(129),c(257),d(384),e(16300),f(16385),g(32767),h(32768),i(65535),j(131073),guinea;
         uint8 buffer[Sirikata::Network::Stream::uint30::MAX_SERIALIZED_LENGTH];
@@ -424,7 +559,1428 @@ public:
 
             }            
         }
-        
+
+    }
+    void testPacketBufferPool(void) {
+        using Sirikata::Network::PacketBuffer;
+        const char*hello="hello world";
+        PacketBuffer*a=PacketBuffer::allocate((const uint8*)hello,(const uint8*)hello+strlen(hello));
+        TS_ASSERT_EQUALS(a->size(),strlen(hello));
+        TS_ASSERT(memcmp(&*a->begin(),hello,strlen(hello))==0);
+        a->ref();
+        a->unref();
+        TS_ASSERT_EQUALS(a->size(),strlen(hello));
+        PacketView world(a,6,5);
+        a->unref();
+        {
+            PacketView copy;
+            copy=world;
+            TS_ASSERT_EQUALS(copy.size(),5U);
+            TS_ASSERT(memcmp(copy.data(),"world",5)==0);
+            Chunk legacy=copy;
+            TS_ASSERT_EQUALS(legacy.size(),5U);
+            TS_ASSERT_EQUALS(legacy[0],'w');
+        }
+        TS_ASSERT_EQUALS(world[4],'d');
+        TS_ASSERT(PacketView().empty());
+        PacketBuffer*b=PacketBuffer::allocate(strlen(hello)+1);
+        TS_ASSERT_EQUALS(b->size(),strlen(hello)+1);
+        b->unref();
+        for (size_t size=1;size<(PacketBuffer::MIN_POOLED_SIZE<<PacketBuffer::NUM_SIZE_CLASSES);size*=3) {
+            PacketBuffer*c=PacketBuffer::allocate(size);
+            TS_ASSERT_EQUALS(c->size(),size);
+            (*c)[size-1]=(uint8)size;
+            c->unref();
+        }
+    }
+    void testStreamIDMap(void) {
+        StreamIDMap<int> map;
+        int values[4]={0,1,2,3};
+        TS_ASSERT(map.empty());
+        TS_ASSERT(map.get(Stream::StreamID(7))==NULL);
+        TS_ASSERT(map.begin()==map.end());
+        map.set(Stream::StreamID(1),&values[1]);
+        map.set(Stream::StreamID(3),&values[3]);
+        map.set(Stream::StreamID(100000),&values[2]);
+        map.set(Stream::StreamID(3),&values[0]);
+        TS_ASSERT_EQUALS(map.size(),3U);
+        TS_ASSERT(map.get(Stream::StreamID(1))==&values[1]);
+        TS_ASSERT(map.get(Stream::StreamID(3))==&values[0]);
+        TS_ASSERT(map.get(Stream::StreamID(2))==NULL);
+        TS_ASSERT(map.get(Stream::StreamID(99999))==NULL);
+        StreamIDMap<int>::const_iterator i=map.begin();
+        TS_ASSERT(i.id()==Stream::StreamID(1));
+        ++i;
+        TS_ASSERT(i.id()==Stream::StreamID(3));
+        ++i;
+        TS_ASSERT(i.id()==Stream::StreamID(100000));
+        TS_ASSERT(i.value()==&values[2]);
+        ++i;
+        TS_ASSERT(i==map.end());
+        TS_ASSERT(map.remove(Stream::StreamID(1))==&values[1]);
+        TS_ASSERT(map.remove(Stream::StreamID(1))==NULL);
+        TS_ASSERT_EQUALS(map.size(),2U);
+    }
+    void testStreamIDMapLargeIDs(void) {
+        StreamIDMap<int> map;
+        int values[3]={0,1,2};
+        //a peer picking IDs spread over the whole range must not make the table page them all in
+        for (unsigned int id=StreamIDMap<int>::MAX_DENSE_ID;id<(1U<<30);id+=(1U<<20)) {
+            map.set(Stream::StreamID(id),&values[id%3]);
+        }
+        map.set(Stream::StreamID(5),&values[0]);
+        TS_ASSERT_EQUALS(map.numPages(),1U);
+        TS_ASSERT_EQUALS(map.size(),1025U);
+        TS_ASSERT(map.get(Stream::StreamID(StreamIDMap<int>::MAX_DENSE_ID))==&values[StreamIDMap<int>::MAX_DENSE_ID%3]);
+        TS_ASSERT(map.get(Stream::StreamID(StreamIDMap<int>::MAX_DENSE_ID+1))==NULL);
+        TS_ASSERT(map.get(Stream::StreamID((1U<<30)-1))==NULL);
+        size_t visited=0;
+        for (StreamIDMap<int>::const_iterator i=map.begin(),ie=map.end();i!=ie;++i,++visited) {
+            TS_ASSERT(map.get(i.id())==i.value());
+        }
+        TS_ASSERT_EQUALS(visited,1025U);
+        TS_ASSERT(map.remove(Stream::StreamID(StreamIDMap<int>::MAX_DENSE_ID))!=NULL);
+        TS_ASSERT(map.get(Stream::StreamID(StreamIDMap<int>::MAX_DENSE_ID))==NULL);
+        TS_ASSERT_EQUALS(map.size(),1024U);
+        TS_ASSERT_EQUALS(map.numPages(),1U);
+    }
+    static void strandTask(Sirikata::AtomicValue<int>*inside, Sirikata::AtomicValue<int>*overlaps, Sirikata::AtomicValue<int>*done) {
+        if (++*inside!=1)
+            ++*overlaps;
+        for (volatile int i=0;i<1000;++i) {
+        }
+        --*inside;
+        ++*done;
+    }
+    void testIOServicePool(void) {
+        IOServicePool pool(4);
+        TS_ASSERT_EQUALS(pool.numThreads(),4U);
+        pool.run();
+        IOStrand strand(pool.service());
+        Sirikata::AtomicValue<int> inside(0),overlaps(0),done(0);
+        //work outside the strand keeps the other threads busy and may overlap freely
+        Sirikata::AtomicValue<int> unstrandedInside(0),unstrandedOverlaps(0);
+        const int numTasks=2000;
+        for (int i=0;i<numTasks;++i) {
+            strand.post(std::tr1::bind(&SstTest::strandTask,&inside,&overlaps,&done));
+            IOServiceFactory::dispatchServiceMessage(&pool.service(),std::tr1::bind(&SstTest::strandTask,&unstrandedInside,&unstrandedOverlaps,&done));
+        }
+        for (int i=0;i<10000&&done.read()<2*numTasks;++i) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        pool.stop();
+        TS_ASSERT_EQUALS(done.read(),2*numTasks);
+        //handlers in a strand never overlap even with several threads running the pool
+        TS_ASSERT_EQUALS(inside.read(),0);
+        TS_ASSERT_EQUALS(overlaps.read(),0);
+    }
+    void testUnreliableDatagrams(void) {
+        Sirikata::AtomicValue<int> received(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&received,_1,_2),r);
+            //unreliable packets go over TCP until the connector hears back from the listener's UDP port
+            Chunk position(64,'X');
+            int sent=0;
+            time_t start=time(NULL);
+            while ((sent<16||r.getDatagramsSent()<8)&&time(NULL)<start+10) {
+                r.send(position,Unreliable);
+                ++sent;
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT(r.getDatagramsSent()>=8);
+            //too large for a datagram, so it takes TCP
+            r.send(Chunk(4096,'X'),Unreliable);
+            ++sent;
+            waitFor(received,sent,10);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            r.close();
+        }
+    }
+    void testUnixDomainTransport(void) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        Address unixAddress=Address::unixDomain("sirikata_sst_test.sock");
+        TS_ASSERT(unixAddress.isUnixDomain());
+        TS_ASSERT(!nextLoopback().isUnixDomain());
+        boost::mutex lock;
+        std::vector<Chunk> arrived;
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            listenAndConnect(listener,unixAddress,std::tr1::bind(&SstTest::keepNewStreamCallback,this,&lock,&arrived,_1,_2),r);
+            Stream*substream=r.factory();
+            substream->cloneFrom(&r,&Stream::ignoreConnectionStatus,&Stream::ignoreBytesReceived);
+            //small packets on one stream and packets large enough to be fragmented on the other, each filled with its index
+            const int count=64;
+            const size_t largeSize=4*MultiplexedSocket::DEFAULT_FRAGMENT_SIZE+5;
+            for (int i=0;i<count;++i) {
+                ((i&1)?substream:(Stream*)&r)->send(Chunk((i&1)?largeSize:100,(uint8)i),ReliableOrdered);
+            }
+            time_t start=time(NULL);
+            size_t numArrived=0;
+            while (numArrived<(size_t)count&&time(NULL)<start+10) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+                boost::lock_guard<boost::mutex> guard(lock);
+                numArrived=arrived.size();
+            }
+            boost::lock_guard<boost::mutex> guard(lock);
+            TS_ASSERT_EQUALS(arrived.size(),(size_t)count);
+            std::vector<bool> seen(count,false);
+            for (size_t i=0;i<arrived.size();++i) {
+                TS_ASSERT(!arrived[i].empty());
+                if (arrived[i].empty())
+                    continue;
+                int index=arrived[i][0];
+                TS_ASSERT(index<count&&!seen[index]);
+                if (index>=count)
+                    continue;
+                seen[index]=true;
+                TS_ASSERT_EQUALS(arrived[i].size(),(index&1)?largeSize:(size_t)100);
+                TS_ASSERT(std::count(arrived[i].begin(),arrived[i].end(),(uint8)index)==(std::ptrdiff_t)arrived[i].size());
+            }
+            substream->close();
+            delete substream;
+            r.close();
+        }
+#endif
+    }
+    void testAdaptiveConnections(void) {
+        Sirikata::AtomicValue<int> received(0),misordered(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::adaptiveNewStreamCallback,this,&received,&misordered,_1,_2),r);
+            r.setSendWatermarks(65536,262144);
+            //grow on any backlog, retire once the connection carries less than 16KB a second
+            r.setAdaptiveConnections(4,1,16384);
+            Chunk message(16384,'A');
+            Sirikata::uint32 sequence=0;
+            int sent=0,sentAfterGrowth=0;
+            unsigned int mostConnections=0;
+            time_t start=time(NULL);
+            //keep the connection saturated until data has flowed over the added connections for a while
+            while (sentAfterGrowth<2000&&time(NULL)<start+20) {
+                std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                if (!r.trySend(message,ReliableOrdered)) {
+                    --sequence;
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+                    continue;
+                }
+                ++sent;
+                if ((sent&3)==0) {
+                    r.send(Chunk(1024,'\0'),ReliableUnordered);
+                    ++sent;
+                }
+                unsigned int connections=r.getNumConnections();
+                if (connections>mostConnections)
+                    mostConnections=connections;
+                if (mostConnections>1)
+                    ++sentAfterGrowth;
+            }
+            TS_ASSERT(mostConnections>1);
+            waitFor(received,sent,20);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            //an idle connection retires what it added
+            start=time(NULL);
+            while (r.getNumConnections()>1&&time(NULL)<start+10) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+            }
+            TS_ASSERT_EQUALS(r.getNumConnections(),1U);
+            for (int i=0;i<100;++i) {
+                std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                r.send(message,ReliableOrdered);
+                ++sent;
+            }
+            waitFor(received,sent,20);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            TS_ASSERT_EQUALS(misordered.read(),0);
+            r.close();
+        }
+    }
+    void testStaleUnreliable(void) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        Sirikata::AtomicValue<int> received(0),lastByte(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        //a Unix domain connection has no datagrams, which never wait in a send queue
+        Address address=Address::unixDomain("sirikata_sst_stale.sock");
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,address,std::tr1::bind(&SstTest::lastByteNewStreamCallback,this,&received,&lastByte,_1,_2),r);
+            r.send(Chunk(1,'\0'),ReliableOrdered);
+            waitFor(received,1,10);
+            TS_ASSERT_EQUALS(received.read(),1);
+            //hold everything sent from here on in the send queue until it is flushed
+            r.setCorking(Sirikata::Task::DeltaTime::seconds(30.0),1<<30);
+            Chunk update(256,'\0');
+            for (int i=0;i<10;++i) {
+                r.send(update,Unreliable,Sirikata::Task::DeltaTime::milliseconds(10.0));
+            }
+            //only the newest update with a key is worth sending
+            for (int i=1;i<=20;++i) {
+                update.back()=(unsigned char)i;
+                r.send(update,Unreliable,Sirikata::Task::DeltaTime::seconds(30.0),7);
+            }
+            r.send(Chunk(1,'\0'),ReliableOrdered);
+            //outlive the short lived packets before letting any of them go
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+            TS_ASSERT_EQUALS(received.read(),1);
+            r.flush();
+            waitFor(received,3,10);
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+            TS_ASSERT_EQUALS(received.read(),3);
+            TS_ASSERT_EQUALS(r.getStalePacketsDiscarded(),29U);
+            r.close();
+        }
+        //the update that survived was the newest one
+        TS_ASSERT_EQUALS(lastByte.read(),20);
+#endif
+    }
+    void testLatencyHistogram(void) {
+        TS_ASSERT_EQUALS(LatencyHistogram::bucket(0),0U);
+        TS_ASSERT_EQUALS(LatencyHistogram::bucket(1),1U);
+        TS_ASSERT_EQUALS(LatencyHistogram::bucket(3),2U);
+        TS_ASSERT_EQUALS(LatencyHistogram::bucket(4),3U);
+        TS_ASSERT_EQUALS(LatencyHistogram::bucket((Sirikata::int64)1<<40),(unsigned int)LatencyHistogram::NUM_BUCKETS-1);
+        AtomicLatencyHistogram recorder;
+        for (int i=0;i<99;++i) {
+            recorder.record(10);
+        }
+        recorder.record(5000);
+        LatencyHistogram histogram;
+        recorder.readInto(histogram);
+        TS_ASSERT_EQUALS(histogram.mCount,100U);
+        TS_ASSERT_EQUALS(histogram.mTotalMicroseconds,99U*10U+5000U);
+        TS_ASSERT_EQUALS(histogram.mMaxMicroseconds,5000U);
+        TS_ASSERT_EQUALS(histogram.percentile(0.5),16U);
+        TS_ASSERT_EQUALS(histogram.percentile(0.999),5000U);
+        histogram.merge(histogram);
+        TS_ASSERT_EQUALS(histogram.mCount,200U);
+    }
+    void testConnectionStatistics(void) {
+        Sirikata::AtomicValue<int> received(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        size_t firstAccepted=mStreams.size();
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&received,_1,_2),r);
+            TCPStream*substream=(TCPStream*)r.factory();
+            substream->cloneFrom(&r,&Stream::ignoreConnectionStatus,&Stream::ignoreBytesReceived);
+            r.setStatisticsDump(Sirikata::Task::DeltaTime::milliseconds(10.0));
+            for (int i=0;i<50;++i) {
+                r.send(Chunk(100,'S'),ReliableOrdered);
+            }
+            for (int i=0;i<30;++i) {
+                substream->send(Chunk(200,'S'),ReliableOrdered);
+            }
+            waitFor(received,80,10);
+            TS_ASSERT_EQUALS(received.read(),80);
+            TCPStream::ConnectionStatistics sent=r.getConnectionStatistics();
+            TS_ASSERT_EQUALS(sent.mTraffic.mPacketsSent,80U);
+            TS_ASSERT_EQUALS(sent.mTraffic.mBytesSent,50U*100U+30U*200U);
+            TS_ASSERT_EQUALS(r.getStreamStatistics().mBytesSent,50U*100U);
+            TS_ASSERT_EQUALS(substream->getStreamStatistics().mPacketsSent,30U);
+            //the connection's own control packets wait in the queues too
+            TS_ASSERT(sent.mQueueLatency.mCount>=80U);
+            TS_ASSERT(sent.mSendLatency.mCount>=1U);
+            TS_ASSERT(sent.mMaxQueuedBytes>=100U);
+            TS_ASSERT_EQUALS(mStreams.size(),firstAccepted+2);
+            if (mStreams.size()==firstAccepted+2) {
+                TCPStream::ConnectionStatistics accepted=mStreams[firstAccepted]->getConnectionStatistics();
+                TS_ASSERT_EQUALS(accepted.mTraffic.mPacketsReceived,80U);
+                TS_ASSERT_EQUALS(accepted.mTraffic.mBytesReceived,50U*100U+30U*200U);
+                TS_ASSERT_EQUALS(mStreams[firstAccepted]->getStreamStatistics().mPacketsReceived,50U);
+                TS_ASSERT_EQUALS(mStreams[firstAccepted+1]->getStreamStatistics().mBytesReceived,30U*200U);
+            }
+            //let the dump log a few times before turning it off
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+            r.setStatisticsDump(Sirikata::Task::DeltaTime::seconds(0.0));
+            substream->close();
+            delete substream;
+            r.close();
+        }
+    }
+    void testHandlerMemory(void) {
+        HandlerMemory memory;
+        void*first=memory.allocate(100);
+        //taken, then too large
+        void*second=memory.allocate(100);
+        void*third=memory.allocate(HandlerMemory::SIZE+1);
+        TS_ASSERT(first!=second);
+        TS_ASSERT_EQUALS(memory.heapAllocations(),2U);
+        memory.deallocate(second);
+        memory.deallocate(third);
+        memory.deallocate(first);
+        TS_ASSERT_EQUALS(memory.allocate(HandlerMemory::SIZE),first);
+        memory.deallocate(first);
+        TS_ASSERT_EQUALS(memory.heapAllocations(),2U);
+    }
+    void testHandlerAllocations(void) {
+        Sirikata::AtomicValue<int> received(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        size_t firstAccepted=mStreams.size();
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&received,_1,_2),r);
+            //one packet at a time so every send and every read goes through asio on its own
+            time_t start=time(NULL);
+            for (int i=0;i<200&&time(NULL)<start+10;++i) {
+                r.send(Chunk(64+i,'H'),ReliableOrdered);
+                waitFor(received,i+1,10);
+            }
+            //and bursts, so sends gather many packets and reads complete with many at once
+            for (int i=0;i<50;++i) {
+                r.send(Chunk(3000,'H'),ReliableOrdered);
+            }
+            waitFor(received,250,10);
+            TS_ASSERT_EQUALS(received.read(),250);
+            TS_ASSERT_EQUALS(r.getConnectionStatistics().mHandlerHeapAllocations,0U);
+            TS_ASSERT_EQUALS(mStreams.size(),firstAccepted+1);
+            if (mStreams.size()==firstAccepted+1) {
+                TS_ASSERT_EQUALS(mStreams[firstAccepted]->getConnectionStatistics().mHandlerHeapAllocations,0U);
+            }
+            r.close();
+        }
+    }
+    void testSharedConnection(void) {
+        waitForService();
+        Sirikata::AtomicValue<int> received(0),connected(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        size_t firstAccepted=mStreams.size();
+        Sirikata::Task::DeltaTime idleTimeout=Sirikata::Task::DeltaTime::milliseconds(200.0);
+        Address address=nextLoopback();
+        TCPStreamListener listener(*mIO);
+        listener.listen(address,std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&received,_1,_2));
+        TCPStream*streams[4];
+        for (int i=0;i<4;++i) {
+            streams[i]=new TCPStream(*mIO);
+            streams[i]->setConnectionSharing(true,idleTimeout);
+        }
+        time_t start=time(NULL);
+        streams[0]->connect(address,
+                            &Stream::ignoreSubstreamCallback,
+                            std::tr1::bind(&SstTest::countConnectedCallback,&connected,_1,_2),
+                            &Stream::ignoreBytesReceived);
+        waitFor(connected,1,10);
+        //the second stream joins the first one's connection and is told it is up without a handshake
+        streams[1]->connect(address,
+                            &Stream::ignoreSubstreamCallback,
+                            std::tr1::bind(&SstTest::countConnectedCallback,&connected,_1,_2),
+                            &Stream::ignoreBytesReceived);
+        waitFor(connected,2,10);
+        TS_ASSERT_EQUALS(connected.read(),2);
+        streams[0]->send(Chunk(10,'P'),ReliableOrdered);
+        streams[1]->send(Chunk(10,'P'),ReliableOrdered);
+        waitFor(received,2,10);
+        TS_ASSERT_EQUALS(received.read(),2);
+        TS_ASSERT_EQUALS(streams[0]->getConnectionStatistics().mTraffic.mPacketsSent,2U);
+        TS_ASSERT_EQUALS(mStreams.size(),firstAccepted+2);
+        if (mStreams.size()==firstAccepted+2) {
+            TS_ASSERT_EQUALS(mStreams[firstAccepted]->getConnectionStatistics().mTraffic.mPacketsReceived,2U);
+        }
+        //the connection outlives its streams for the idle timeout, so a connect soon after still joins it
+        streams[0]->close();
+        streams[1]->close();
+        delete streams[0];
+        delete streams[1];
+        streams[2]->connect(address,
+                            &Stream::ignoreSubstreamCallback,
+                            std::tr1::bind(&SstTest::countConnectedCallback,&connected,_1,_2),
+                            &Stream::ignoreBytesReceived);
+        streams[2]->send(Chunk(10,'P'),ReliableOrdered);
+        while ((connected.read()<3||received.read()<3)&&time(NULL)<start+10) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        TS_ASSERT_EQUALS(streams[2]->getConnectionStatistics().mTraffic.mPacketsSent,3U);
+        streams[2]->close();
+        delete streams[2];
+        //but once it has been idle that long a connect opens a connection of its own
+        boost::this_thread::sleep(boost::posix_time::microseconds(3*idleTimeout.toMicro()));
+        streams[3]->connect(address,
+                            &Stream::ignoreSubstreamCallback,
+                            std::tr1::bind(&SstTest::countConnectedCallback,&connected,_1,_2),
+                            &Stream::ignoreBytesReceived);
+        streams[3]->send(Chunk(10,'P'),ReliableOrdered);
+        while ((connected.read()<4||received.read()<4)&&time(NULL)<start+10) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        TS_ASSERT_EQUALS(connected.read(),4);
+        TS_ASSERT_EQUALS(streams[3]->getConnectionStatistics().mTraffic.mPacketsSent,1U);
+        streams[3]->close();
+        delete streams[3];
+    }
+    void testEarlyConnect(void) {
+        waitForService();
+        Sirikata::AtomicValue<int> received(0),misordered(0),connected(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        Address address=nextLoopback();
+        TCPStreamListener listener(*mIO);
+        listener.listen(address,std::tr1::bind(&SstTest::adaptiveNewStreamCallback,this,&received,&misordered,_1,_2));
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(4);
+            r.setEarlyConnect(true);
+            r.connect(address,
+                      &Stream::ignoreSubstreamCallback,
+                      std::tr1::bind(&SstTest::countConnectedCallback,&connected,_1,_2),
+                      &Stream::ignoreBytesReceived);
+            //ordered packets sent while the connections come up must still arrive in order
+            Chunk message(1024,'E');
+            Sirikata::uint32 sequence=0;
+            int sent=0;
+            for (;sent<2000;++sent) {
+                std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                r.send(message,ReliableOrdered);
+            }
+            time_t start=time(NULL);
+            while ((received.read()<sent||r.getNumConnections()<4)&&time(NULL)<start+20) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT_EQUALS(connected.read(),1);
+            TS_ASSERT_EQUALS(r.getNumConnections(),4U);
+            for (int i=0;i<500;++i) {
+                std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                r.send(message,ReliableOrdered);
+                ++sent;
+            }
+            waitFor(received,sent,20);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            TS_ASSERT_EQUALS(misordered.read(),0);
+            r.close();
+        }
+    }
+    void testReusePortAcceptors(void) {
+        waitForService();
+        Sirikata::AtomicValue<int> received(0),misordered(0),connected(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        IOServicePool pool(2);
+        pool.run();
+        boost::mutex acceptedLock;
+        std::vector<TCPStream*> accepted;
+        {
+            TCPStreamListener listener(*mIO);
+            std::vector<IOService*> services;
+            services.push_back(mIO);
+            services.push_back(&pool.service());
+            services.push_back(mIO);
+            services.push_back(&pool.service());
+            listener.setAcceptorServices(services);
+            Address address=nextLoopback();
+            listener.listen(address,std::tr1::bind(&SstTest::lockedNewStreamCallback,&acceptedLock,&accepted,&received,&misordered,_1,_2));
+            //sockets of one handshake land on whichever acceptor the system picks and must still make one connection
+            const int numClients=10;
+            std::vector<TCPStream*> clients;
+            int sent=0;
+            for (int i=0;i<numClients;++i) {
+                clients.push_back(new TCPStream(*mIO));
+                clients.back()->setNumConnections(4);
+                clients.back()->connect(address,
+                                        &Stream::ignoreSubstreamCallback,
+                                        std::tr1::bind(&SstTest::countConnectedCallback,&connected,_1,_2),
+                                        &Stream::ignoreBytesReceived);
+                Chunk message(256,'P');
+                for (Sirikata::uint32 sequence=1;sequence<=100;++sequence,++sent) {
+                    std::memcpy(&*message.begin(),&sequence,sizeof(sequence));
+                    clients.back()->send(message,ReliableOrdered);
+                }
+            }
+            time_t start=time(NULL);
+            while ((received.read()<sent||connected.read()<numClients)&&time(NULL)<start+20) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT_EQUALS(connected.read(),numClients);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            TS_ASSERT_EQUALS(misordered.read(),0);
+            {
+                boost::lock_guard<boost::mutex> guard(acceptedLock);
+                TS_ASSERT_EQUALS(accepted.size(),(size_t)numClients);
+                for (size_t i=0;i<accepted.size();++i) {
+                    TS_ASSERT_EQUALS(accepted[i]->getNumConnections(),4U);
+                }
+            }
+            for (size_t i=0;i<clients.size();++i) {
+                clients[i]->close();
+                delete clients[i];
+            }
+            boost::lock_guard<boost::mutex> guard(acceptedLock);
+            for (size_t i=0;i<accepted.size();++i) {
+                accepted[i]->close();
+                delete accepted[i];
+            }
+            accepted.clear();
+        }
+        //let the connections built on the pool finish closing before it stops
+        boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+        pool.stop();
+    }
+    ///Sends a packet over a single loopback connection with the given options on both sides, returning the statistics of each side
+    void socketOptionsRun(const TCPSocketOptions&options,const Address&address,TCPStream::ConnectionStatistics&client,TCPStream::ConnectionStatistics&listened) {
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        Sirikata::AtomicValue<int> received(0);
+        std::vector<TCPStream*> accepted;
+        client.mSocketOptionsApplied=listened.mSocketOptionsApplied=0;
+        client.mSendBufferSize=listened.mSendBufferSize=client.mReceiveBufferSize=listened.mReceiveBufferSize=0;
+        TCPStreamListener listener(*mIO);
+        listener.setSocketOptions(options);
+        listener.listen(address,std::tr1::bind(&SstTest::acceptedNewStreamCallback,&accepted,&received,_1,_2));
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            r.setSocketOptions(options);
+            r.connect(address,
+                      &Stream::ignoreSubstreamCallback,
+                      &Stream::ignoreConnectionStatus,
+                      &Stream::ignoreBytesReceived);
+            r.send(Chunk(128,'b'),ReliableOrdered);
+            waitFor(received,1,10);
+            TS_ASSERT_EQUALS(received.read(),1);
+            client=r.getConnectionStatistics();
+            TS_ASSERT_EQUALS(accepted.size(),1U);
+            if (accepted.size()==1)
+                listened=accepted[0]->getConnectionStatistics();
+            r.close();
+        }
+        for (size_t i=0;i<accepted.size();++i) {
+            delete accepted[i];
+        }
+    }
+    void testSocketOptions(void) {
+        waitForService();
+        TCPSocketOptions parsed("--tcpnodelay=false --tcpsendbuffer=65536 --tcpbusypoll=50");
+        TS_ASSERT(!parsed.mNoDelay);
+        TS_ASSERT_EQUALS(parsed.mSendBufferSize,65536U);
+        TS_ASSERT_EQUALS(parsed.mBusyPollMicroseconds,50U);
+        TS_ASSERT_EQUALS(parsed.requested(),(Sirikata::uint32)(TCPSocketOptions::SEND_BUFFER|TCPSocketOptions::BUSY_POLL));
+        //keepalive times only count once keepalive is on
+        TCPSocketOptions keepAliveTimes("--tcpkeepaliveidle=30 --tcpkeepaliveinterval=5");
+        TS_ASSERT_EQUALS(keepAliveTimes.requested(),(Sirikata::uint32)TCPSocketOptions::NO_DELAY);
+        TCPSocketOptions keepAlive("--tcpkeepalive=true --tcpkeepaliveidle=30");
+        TS_ASSERT(keepAlive.mKeepAlive);
+        TS_ASSERT_EQUALS(keepAlive.mKeepAliveIdleSeconds,30U);
+        TS_ASSERT_EQUALS(keepAlive.requested(),(Sirikata::uint32)(TCPSocketOptions::NO_DELAY|TCPSocketOptions::KEEP_ALIVE|TCPSocketOptions::KEEP_ALIVE_IDLE));
+        //the global defaults are left alone
+        TS_ASSERT(TCPSocketOptions().mNoDelay);
+        TS_ASSERT_EQUALS(TCPSocketOptions().mSendBufferSize,0U);
+        //each option on its own, against a socket left as the system makes it
+        std::vector<TCPSocketOptions> runs(7,TCPSocketOptions::systemDefaults());
+        runs[1].mNoDelay=true;
+        runs[2].mSendBufferSize=runs[2].mReceiveBufferSize=1<<20;
+        runs[3].mQuickAck=true;
+        runs[4].mBusyPollMicroseconds=50;
+        runs[5].mNotSentLowWater=16384;
+        runs[6].mKeepAlive=true;
+        runs[6].mKeepAliveIdleSeconds=30;
+        runs[6].mKeepAliveIntervalSeconds=5;
+        for (size_t i=0;i<runs.size();++i) {
+            TCPStream::ConnectionStatistics client,listened;
+            socketOptionsRun(runs[i],nextLoopback(),client,listened);
+            Sirikata::uint32 clientApplied=client.mSocketOptionsApplied,listenerApplied=listened.mSocketOptionsApplied;
+            Sirikata::uint32 requested=runs[i].requested();
+            //options the platform lacks may not take effect, but none that were not asked for may
+            TS_ASSERT_EQUALS(clientApplied&~requested,0U);
+            TS_ASSERT_EQUALS(listenerApplied&~requested,0U);
+            Sirikata::uint32 portable=requested&(TCPSocketOptions::NO_DELAY|TCPSocketOptions::SEND_BUFFER|TCPSocketOptions::RECEIVE_BUFFER|TCPSocketOptions::KEEP_ALIVE);
+            TS_ASSERT_EQUALS(clientApplied&portable,portable);
+            TS_ASSERT_EQUALS(listenerApplied&portable,portable);
+            //the system may double or clamp the buffer sizes, but reports what it kept
+            TS_ASSERT_EQUALS(client.mSendBufferSize!=0,(requested&TCPSocketOptions::SEND_BUFFER)!=0);
+            TS_ASSERT_EQUALS(listened.mReceiveBufferSize!=0,(requested&TCPSocketOptions::RECEIVE_BUFFER)!=0);
+        }
+    }
+    void testPacketTraceRing(void) {
+        //each record takes 14 bytes ahead of its packet, so four 30 byte packets fit
+        PacketTrace trace(200);
+        for (int i=0;i<10;++i) {
+            Chunk packet(30,(uint8)i);
+            trace.record((i&1)?PacketTrace::RECEIVED:PacketTrace::SENT,i%3,1000+i*10,&packet[0],10,&packet[10],20);
+        }
+        std::vector<uint8> tooLong(300);
+        trace.record(PacketTrace::SENT,0,2000,NULL,0,&tooLong[0],tooLong.size());
+        TS_ASSERT_EQUALS(trace.getDroppedRecords(),7U);
+        std::vector<PacketTrace::Record> records;
+        trace.snapshot(records);
+        TS_ASSERT_EQUALS(records.size(),4U);
+        TS_ASSERT(trace.write("sirikata_sst_ring.trace"));
+        std::vector<PacketTrace::Record> read;
+        TS_ASSERT(PacketTrace::read("sirikata_sst_ring.trace",read));
+        TS_ASSERT_EQUALS(read.size(),records.size());
+        for (size_t i=0;i<records.size()&&i<read.size();++i) {
+            TS_ASSERT_EQUALS(records[i].mTime,1060+(Sirikata::int64)i*10);
+            TS_ASSERT_EQUALS(read[i].mTime,records[i].mTime);
+            TS_ASSERT_EQUALS(read[i].mDirection,records[i].mDirection);
+            TS_ASSERT_EQUALS(read[i].mSocket,records[i].mSocket);
+            TS_ASSERT(read[i].mData==Chunk(30,(uint8)(6+i)));
+        }
+        std::remove("sirikata_sst_ring.trace");
+    }
+    void testPacketTraceReplay(void) {
+        waitForService();
+        Sirikata::AtomicValue<int> received(0),replayed(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        size_t firstAccepted=mStreams.size();
+        Address address=nextLoopback();
+        TCPStreamListener listener(*mIO);
+        listener.listen(address,std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&received,_1,_2));
+        std::vector<PacketTrace::Record> records;
+        {
+            TCPStream r(*mIO);
+            r.connect(address,
+                      &Stream::ignoreSubstreamCallback,
+                      &Stream::ignoreConnectionStatus,
+                      &Stream::ignoreBytesReceived);
+            r.send(Chunk(1,'\0'),ReliableOrdered);
+            waitFor(received,1,10);
+            TS_ASSERT_EQUALS(mStreams.size(),firstAccepted+1);
+            if (mStreams.size()!=firstAccepted+1)
+                return;
+            //a trace may start at any time since it keeps whole packets
+            mStreams[firstAccepted]->setPacketTrace(1<<20,"sirikata_sst_error.trace");
+            TCPStream*substream=(TCPStream*)r.factory();
+            substream->cloneFrom(&r,&Stream::ignoreConnectionStatus,&Stream::ignoreBytesReceived);
+            for (int i=0;i<50;++i) {
+                r.send(Chunk(100+i,'T'),ReliableOrdered);
+                substream->send(Chunk(20000,'R'),ReliableOrdered);
+            }
+            waitFor(received,101,10);
+            TS_ASSERT_EQUALS(received.read(),101);
+            TS_ASSERT(mStreams[firstAccepted]->writePacketTrace("sirikata_sst_replay.trace"));
+            TS_ASSERT(PacketTrace::read("sirikata_sst_replay.trace",records));
+            substream->close();
+            delete substream;
+            r.close();
+        }
+        int tracedReceives=0;
+        for (size_t i=0;i<records.size();++i) {
+            if (records[i].mDirection==PacketTrace::RECEIVED)
+                ++tracedReceives;
+        }
+        TS_ASSERT(tracedReceives>=100);
+        {
+            PacketTraceReplay replay(*mIO);
+            TS_ASSERT(replay.play(records,std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&replayed,_1,_2)));
+            time_t start=time(NULL);
+            while ((!replay.finished()||replayed.read()<100)&&time(NULL)<start+10) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT(replay.finished());
+            TS_ASSERT_EQUALS(replay.packetsPlayed(),(size_t)tracedReceives);
+            TS_ASSERT_EQUALS(replayed.read(),100);
+        }
+        //losing the connection wrote the trace to the error trace file
+        std::vector<PacketTrace::Record> errorRecords;
+        time_t start=time(NULL);
+        while (!PacketTrace::read("sirikata_sst_error.trace",errorRecords)&&time(NULL)<start+10) {
+            errorRecords.clear();
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        }
+        TS_ASSERT(errorRecords.size()>=records.size());
+        std::remove("sirikata_sst_replay.trace");
+        std::remove("sirikata_sst_error.trace");
+    }
+    void testGatherLimits(void) {
+        Sirikata::AtomicValue<int> received(0),misordered(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::adaptiveNewStreamCallback,this,&received,&misordered,_1,_2),r);
+            //limits of zero are raised to one packet of at least a byte per write rather than never writing anything
+            r.setGatherLimits(0,0);
+            Sirikata::uint32 sequence=0;
+            int sent=0;
+            for (int i=0;i<500;++i) {
+                Chunk message((i%50)?64:20000,'G');
+                std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                r.send(message,ReliableOrdered);
+                ++sent;
+            }
+            waitFor(received,sent,20);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            TS_ASSERT_EQUALS(misordered.read(),0);
+            //every packet went out in a write of its own
+            TCPStream::ConnectionStatistics stats=r.getConnectionStatistics();
+            TS_ASSERT(stats.mQueueLatency.mCount>=(Sirikata::uint64)sent);
+            TS_ASSERT(stats.mSendLatency.mCount>=stats.mQueueLatency.mCount);
+            r.close();
+        }
+    }
+    void testLeastOutstandingStrategy(void) {
+        //a service nobody runs, so packets stay queued on sockets that never send
+        IOService*io=IOServiceFactory::makeIOService();
+        {
+            std::tr1::shared_ptr<MultiplexedSocket> parent=MultiplexedSocket::construct(io,Stream::SubstreamCallback(&Stream::ignoreSubstreamCallback));
+            //the first packet on each socket opens a coalescing window that outlasts the test and holds everything back
+            parent->setCorking(Sirikata::Task::DeltaTime::seconds(3600.0),1<<30);
+            std::vector<ASIOSocketWrapper> sockets(4);
+            const Sirikata::uint32 load[4]={3000,1000,2000,5000};
+            for (size_t i=0;i<4;++i) {
+                sockets[i].rawSend(parent,PacketBuffer::allocate(load[i]),TCPStream::DefaultPriority);
+                TS_ASSERT_EQUALS(sockets[i].getOutstandingBytes(),load[i]);
+            }
+            //wherever the search starts it finds the least loaded socket
+            for (Sirikata::uint32 rotation=0;rotation<8;++rotation) {
+                TS_ASSERT_EQUALS(MultiplexedSocket::leastOutstandingStreamStrategy(sockets,4,rotation),1U);
+            }
+            //only the first numSockets are looked at, and sockets that are not active are passed over
+            TS_ASSERT_EQUALS(MultiplexedSocket::leastOutstandingStreamStrategy(sockets,1,3),0U);
+            sockets[1].setConnectionState(ASIOSocketWrapper::CONNECTION_RETIRING);
+            TS_ASSERT_EQUALS(MultiplexedSocket::leastOutstandingStreamStrategy(sockets,4,0),2U);
+            //equally loaded sockets take turns: 4000 bytes each on sockets 0 and 2
+            sockets[0].rawSend(parent,PacketBuffer::allocate(1000),TCPStream::DefaultPriority);
+            sockets[2].rawSend(parent,PacketBuffer::allocate(2000),TCPStream::DefaultPriority);
+            TS_ASSERT_EQUALS(MultiplexedSocket::leastOutstandingStreamStrategy(sockets,4,0),0U);
+            TS_ASSERT_EQUALS(MultiplexedSocket::leastOutstandingStreamStrategy(sockets,4,1),2U);
+            TS_ASSERT_EQUALS(MultiplexedSocket::leastOutstandingStreamStrategy(sockets,4,3),0U);
+            for (size_t i=0;i<4;++i) {
+                sockets[i].destroySocket();
+            }
+        }
+        IOServiceFactory::destroyIOService(io);
+    }
+    void testUnreliableDrops(void) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        Sirikata::AtomicValue<int> received(0),lastByte(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        //a Unix domain connection has no datagrams, so every unreliable packet faces the drop policy
+        Address address=Address::unixDomain("sirikata_sst_drops.sock");
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,address,std::tr1::bind(&SstTest::lastByteNewStreamCallback,this,&received,&lastByte,_1,_2),r);
+            //any packet at all reaches the high water mark, so the chance of dropping an unreliable one is 1.0
+            r.setUnreliableDropThresholds(0,1,Sirikata::Task::DeltaTime::seconds(3600.0),Sirikata::Task::DeltaTime::seconds(7200.0));
+            int reliable=0;
+            for (int i=0;i<300;++i) {
+                r.send(Chunk(64,'X'),Unreliable);
+                r.send(Chunk(64,(i&1)?'O':'U'),(i&1)?ReliableOrdered:ReliableUnordered);
+                ++reliable;
+            }
+            //everything goes over the one connection, so by the time the last packet arrives any unreliable one sent would have too
+            Chunk last(64,'L');
+            last.back()='!';
+            r.send(last,ReliableOrdered);
+            ++reliable;
+            time_t start=time(NULL);
+            while (lastByte.read()!='!'&&time(NULL)<start+20) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT_EQUALS(lastByte.read(),'!');
+            TS_ASSERT_EQUALS(received.read(),reliable);
+            r.close();
+        }
+#endif
+    }
+    ///Takes count packets off socket in the order it would send them, adding the number taken from each class to taken
+    static void takeScheduled(ASIOSocketWrapper&socket,const MultiplexedSocket&parent,int count,int taken[TCPStream::NumStreamPriorities]) {
+        for (int i=0;i<count;++i) {
+            int priority=-1;
+            PacketBuffer*packet=socket.takeScheduledChunk(parent,priority);
+            TS_ASSERT(packet!=NULL);
+            if (packet==NULL)
+                return;
+            ++taken[priority];
+            packet->unref();
+        }
+    }
+    void testWeightedPriorities(void) {
+        //a service nobody runs, so packets stay queued on sockets that never send
+        IOService*io=IOServiceFactory::makeIOService();
+        {
+            std::tr1::shared_ptr<MultiplexedSocket> parent=MultiplexedSocket::construct(io,Stream::SubstreamCallback(&Stream::ignoreSubstreamCallback));
+            parent->setCorking(Sirikata::Task::DeltaTime::seconds(3600.0),1<<30);
+            std::vector<ASIOSocketWrapper> sockets(3);
+            for (size_t i=0;i<sockets.size();++i) {
+                for (int j=0;j<100;++j) {
+                    sockets[i].rawSend(parent,PacketBuffer::allocate(MultiplexedSocket::PRIORITY_QUANTUM),TCPStream::DefaultPriority);
+                    sockets[i].rawSend(parent,PacketBuffer::allocate(MultiplexedSocket::PRIORITY_QUANTUM),TCPStream::BulkPriority);
+                }
+            }
+            //by default each class gets twice the share of the class after it, a round at a time
+            int taken[TCPStream::NumStreamPriorities]={0,0,0,0};
+            takeScheduled(sockets[0],*parent,4,taken);
+            TS_ASSERT_EQUALS(taken[TCPStream::DefaultPriority],4);
+            takeScheduled(sockets[0],*parent,2,taken);
+            TS_ASSERT_EQUALS(taken[TCPStream::BulkPriority],2);
+            takeScheduled(sockets[0],*parent,54,taken);
+            TS_ASSERT_EQUALS(taken[TCPStream::DefaultPriority],40);
+            TS_ASSERT_EQUALS(taken[TCPStream::BulkPriority],20);
+            //other weights share the same way
+            const Sirikata::uint32 weights[TCPStream::NumStreamPriorities]={1,3,1,1};
+            parent->setPriorityScheduling(false,weights);
+            int weighted[TCPStream::NumStreamPriorities]={0,0,0,0};
+            takeScheduled(sockets[1],*parent,80,weighted);
+            TS_ASSERT_EQUALS(weighted[TCPStream::DefaultPriority],60);
+            TS_ASSERT_EQUALS(weighted[TCPStream::BulkPriority],20);
+            //and strict scheduling drains the more urgent class first
+            parent->setPriorityScheduling(true,weights);
+            int strict[TCPStream::NumStreamPriorities]={0,0,0,0};
+            takeScheduled(sockets[2],*parent,100,strict);
+            TS_ASSERT_EQUALS(strict[TCPStream::DefaultPriority],100);
+            takeScheduled(sockets[2],*parent,100,strict);
+            TS_ASSERT_EQUALS(strict[TCPStream::BulkPriority],100);
+            int priority=-1;
+            TS_ASSERT(sockets[2].takeScheduledChunk(*parent,priority)==NULL);
+            TS_ASSERT_EQUALS(priority,-1);
+            for (size_t i=0;i<sockets.size();++i) {
+                sockets[i].destroySocket();
+            }
+        }
+        IOServiceFactory::destroyIOService(io);
+    }
+    void testFragmentInterleaving(void) {
+        boost::mutex lock;
+        std::vector<Chunk> arrived;
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::keepNewStreamCallback,this,&lock,&arrived,_1,_2),r);
+            Stream*small=r.factory();
+            small->cloneFrom(&r,&Stream::ignoreConnectionStatus,&Stream::ignoreBytesReceived);
+            //packets are only fragmented once the capabilities the other side sends right behind its handshake have arrived
+            small->send(Chunk(32,'S'),ReliableOrdered);
+            time_t start=time(NULL);
+            size_t numArrived=0;
+            while (numArrived==0&&time(NULL)<start+20) {
+                boost::lock_guard<boost::mutex> guard(lock);
+                numArrived=arrived.size();
+            }
+            //hold everything back until it is all queued, so the packets compete for the connection rather than for the sending thread
+            r.setCorking(Sirikata::Task::DeltaTime::seconds(10.0),1<<30);
+            //several times the fragment size, so it goes out in pieces that take turns with the small packets
+            const size_t largeSize=16*MultiplexedSocket::DEFAULT_FRAGMENT_SIZE+123;
+            const int numLarge=3,numSmall=200;
+            Chunk large(largeSize);
+            for (int i=0;i<numLarge;++i) {
+                large[0]='L';
+                for (size_t j=1;j<largeSize;++j) {
+                    large[j]=(uint8)((j*7+i)%251);
+                }
+                r.send(large,ReliableOrdered);
+                for (int j=0;j<numSmall/numLarge;++j) {
+                    small->send(Chunk(32,'S'),ReliableOrdered);
+                }
+            }
+            r.flush();
+            int numSent=1+numLarge+numSmall/numLarge*numLarge;
+            start=time(NULL);
+            while (numArrived<(size_t)numSent&&time(NULL)<start+20) {
+                boost::lock_guard<boost::mutex> guard(lock);
+                numArrived=arrived.size();
+            }
+            boost::lock_guard<boost::mutex> guard(lock);
+            TS_ASSERT_EQUALS(arrived.size(),(size_t)numSent);
+            int largeSeen=0,smallBeforeFirstLarge=0;
+            for (size_t i=0;i<arrived.size();++i) {
+                if (arrived[i].size()&&arrived[i][0]=='L') {
+                    TS_ASSERT_EQUALS(arrived[i].size(),largeSize);
+                    bool intact=arrived[i].size()==largeSize;
+                    for (size_t j=1;intact&&j<largeSize;++j) {
+                        intact=arrived[i][j]==(uint8)((j*7+largeSeen)%251);
+                    }
+                    TS_ASSERT(intact);
+                    ++largeSeen;
+                }else {
+                    TS_ASSERT_EQUALS(arrived[i].size(),32U);
+                    if (largeSeen==0&&i)
+                        ++smallBeforeFirstLarge;
+                }
+            }
+            TS_ASSERT_EQUALS(largeSeen,numLarge);
+            //small packets sent after the first large one overtook the rest of it
+            TS_ASSERT(smallBeforeFirstLarge>0);
+            small->close();
+            delete small;
+            r.close();
+        }
+    }
+    void testSendWatermarks(void) {
+        {
+            //a stream that never connected refuses data and ignores its settings
+            TCPStream unconnected(*mIO);
+            unconnected.setSendWatermarks(0,1);
+            unconnected.setCorking(Sirikata::Task::DeltaTime::milliseconds(1.0),1024);
+            unconnected.flush();
+            TS_ASSERT(!unconnected.trySend(Chunk(16,'U'),ReliableOrdered));
+        }
+        Sirikata::AtomicValue<int> received(0),misordered(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::adaptiveNewStreamCallback,this,&received,&misordered,_1,_2),r);
+            //a small high water mark makes trySend refuse a burst, and the refused stream hears once it drains
+            Sirikata::AtomicValue<int> writable(0);
+            r.setWritableCallback(std::tr1::bind(&SstTest::writableCallback,&writable));
+            r.setSendWatermarks(0,65536);
+            Chunk burst(16384,'B');
+            Sirikata::uint32 sequence=0;
+            int accepted=0;
+            while (accepted<4096) {
+                std::memcpy(&*burst.begin(),&++sequence,sizeof(sequence));
+                if (!r.trySend(burst,ReliableOrdered)) {
+                    --sequence;
+                    break;
+                }
+                ++accepted;
+            }
+            TS_ASSERT(accepted>0);
+            TS_ASSERT(accepted<4096);
+            time_t start=time(NULL);
+            while (writable.read()==0&&time(NULL)<start+10) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT_EQUALS(writable.read(),1);
+            r.setSendWatermarks(262144,1048576);
+            std::memcpy(&*burst.begin(),&++sequence,sizeof(sequence));
+            TS_ASSERT(r.trySend(burst,ReliableOrdered));
+            ++accepted;
+            r.setWritableCallback(Stream::WritableCallback());
+            waitFor(received,accepted,20);
+            TS_ASSERT_EQUALS(received.read(),accepted);
+            TS_ASSERT_EQUALS(misordered.read(),0);
+            r.close();
+        }
+    }
+    void testCompression(void) {
+        boost::mutex lock;
+        std::vector<Chunk> arrived;
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(2);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::keepNewStreamCallback,this,&lock,&arrived,_1,_2),r);
+            //packets are only compressed once the capabilities the other side sends right behind its handshake have arrived
+            r.send(Chunk(4,'\0'),ReliableOrdered);
+            time_t start=time(NULL);
+            size_t numArrived=0;
+            while (numArrived==0&&time(NULL)<start+20) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+                boost::lock_guard<boost::mutex> guard(lock);
+                numArrived=arrived.size();
+            }
+            TS_ASSERT_EQUALS(numArrived,1U);
+            //striped packets are sequenced too, so compressed sequenced packets are covered as well as plain ones
+            r.setCompression(true);
+            r.setOrderedStriping(true);
+            std::vector<Chunk> sent;
+            for (Sirikata::uint32 i=1;i<=200;++i) {
+                Chunk message((i%50)?1000:5*MultiplexedSocket::DEFAULT_FRAGMENT_SIZE,(uint8)('a'+i%26));
+                std::memcpy(&*message.begin(),&i,sizeof(i));
+                //short enough to be sent as it is
+                if (i%7==0)
+                    message.resize(MultiplexedSocket::COMPRESSION_THRESHOLD-1);
+                r.send(message,(i%3)?ReliableOrdered:ReliableUnordered);
+                sent.push_back(message);
+            }
+            start=time(NULL);
+            while (numArrived<sent.size()+1&&time(NULL)<start+20) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+                boost::lock_guard<boost::mutex> guard(lock);
+                numArrived=arrived.size();
+            }
+            boost::lock_guard<boost::mutex> guard(lock);
+            TS_ASSERT_EQUALS(arrived.size(),sent.size()+1);
+            //unordered packets may overtake ordered ones, but nothing may be changed on the way
+            std::map<Sirikata::uint32,Chunk> bySequence;
+            Sirikata::uint32 lastOrdered=0;
+            int misordered=0;
+            for (size_t i=1;i<arrived.size();++i) {
+                Sirikata::uint32 sequence=0;
+                std::memcpy(&sequence,&*arrived[i].begin(),sizeof(sequence));
+                bySequence[sequence]=arrived[i];
+                if (sequence%3) {
+                    if (sequence<lastOrdered)
+                        ++misordered;
+                    lastOrdered=sequence;
+                }
+            }
+            TS_ASSERT_EQUALS(misordered,0);
+            TS_ASSERT_EQUALS(bySequence.size(),sent.size());
+            for (size_t i=0;i<sent.size();++i) {
+                TS_ASSERT(bySequence[(Sirikata::uint32)(i+1)]==sent[i]);
+            }
+            r.close();
+        }
+    }
+    void testCorking(void) {
+        Sirikata::AtomicValue<int> received(0),misordered(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(1);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::adaptiveNewStreamCallback,this,&received,&misordered,_1,_2),r);
+            //the handshake is written before the packets being held back
+            r.send(Chunk(4,'\0'),ReliableOrdered);
+            int expected=1;
+            waitFor(received,expected,20);
+            //packets are held for a window nobody waits out until flush sends them, in order
+            r.setCorking(Sirikata::Task::DeltaTime::seconds(30.0),1<<20);
+            TCPStream::ConnectionStatistics before=r.getConnectionStatistics();
+            Sirikata::uint32 sequence=0;
+            for (int i=0;i<100;++i) {
+                Chunk message(40,'C');
+                std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                r.send(message,ReliableOrdered);
+            }
+            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            TS_ASSERT_EQUALS(received.read(),expected);
+            expected+=100;
+            r.flush();
+            waitFor(received,expected,10);
+            TS_ASSERT_EQUALS(received.read(),expected);
+            TCPStream::ConnectionStatistics after=r.getConnectionStatistics();
+            TS_ASSERT_EQUALS(after.mQueueLatency.mCount-before.mQueueLatency.mCount,100U);
+            //once maxBytes are held they go out without a flush
+            r.setCorking(Sirikata::Task::DeltaTime::seconds(30.0),400);
+            r.send(Chunk(40,'\0'),ReliableOrdered);
+            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            TS_ASSERT_EQUALS(received.read(),expected);
+            r.send(Chunk(1000,'\0'),ReliableOrdered);
+            expected+=2;
+            waitFor(received,expected,10);
+            TS_ASSERT_EQUALS(received.read(),expected);
+            //and a packet nobody flushes is held for the window and then goes out on its own
+            r.setCorking(Sirikata::Task::DeltaTime::milliseconds(500.0),1<<20);
+            r.send(Chunk(40,'\0'),ReliableOrdered);
+            boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            TS_ASSERT_EQUALS(received.read(),expected);
+            ++expected;
+            waitFor(received,expected,10);
+            TS_ASSERT_EQUALS(received.read(),expected);
+            r.close();
+        }
+        TS_ASSERT_EQUALS(misordered.read(),0);
+    }
+    void testStripedReorder(void) {
+        boost::mutex lock;
+        std::vector<TCPStream*> accepted;
+        Sirikata::AtomicValue<int> received(0),misordered(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        TCPStreamListener listener(*mIO);
+        {
+            TCPStream r(*mIO);
+            r.setNumConnections(2);
+            listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::lockedNewStreamCallback,&lock,&accepted,&received,&misordered,_1,_2),r);
+            //packets are only sequenced once the capabilities the other side sends right behind its handshake have arrived
+            r.send(Chunk(4,'\0'),ReliableOrdered);
+            time_t start=time(NULL);
+            while ((received.read()<1||r.getNumConnections()<2)&&time(NULL)<start+20) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            }
+            TS_ASSERT_EQUALS(r.getNumConnections(),2U);
+            r.setOrderedStriping(true);
+            //small packets take the idle connection while a large one is still arriving on the other, so they arrive early
+            Sirikata::uint32 sequence=0;
+            int sent=1;
+            for (int i=0;i<10;++i) {
+                Chunk message((i%2)?64:1<<20,'R');
+                for (int j=0;j<20;++j) {
+                    std::memcpy(&*message.begin(),&++sequence,sizeof(sequence));
+                    r.send(message,ReliableOrdered);
+                    ++sent;
+                    if (j==0)
+                        message.resize(64);
+                }
+            }
+            waitFor(received,sent,20);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            TS_ASSERT_EQUALS(misordered.read(),0);
+            boost::lock_guard<boost::mutex> guard(lock);
+            TS_ASSERT_EQUALS(accepted.size(),1U);
+            if (!accepted.empty()) {
+                TCPStream::ReorderStatistics reorder=accepted[0]->getReorderStatistics();
+                //the packets really were held back, and none still is
+                TS_ASSERT(reorder.mMaxReorderDepth>0U);
+                TS_ASSERT_EQUALS(reorder.mReorderDepth,0U);
+                TS_ASSERT_EQUALS(reorder.mReorderOverflows,0U);
+            }
+            r.close();
+        }
+        for (size_t i=0;i<accepted.size();++i) {
+            delete accepted[i];
+        }
+    }
+    void testUnixListenerPath(void) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        const char*path="sirikata_sst_path.sock";
+        Address unixAddress=Address::unixDomain(path);
+        struct stat info;
+        std::remove(path);
+        {
+            //a file that is not a socket is never removed to make way for a listener
+            std::FILE*file=std::fopen(path,"w");
+            TS_ASSERT(file!=NULL);
+            if (file)
+                std::fclose(file);
+            TCPStreamListener listener(*mIO);
+            TS_ASSERT(!listener.listen(unixAddress,&Stream::ignoreSubstreamCallback));
+            TS_ASSERT(lstat(path,&info)==0&&S_ISREG(info.st_mode));
+            std::remove(path);
+        }
+        {
+            TCPStreamListener first(*mIO);
+            TS_ASSERT(first.listen(unixAddress,&Stream::ignoreSubstreamCallback));
+            {
+                //nor is a socket another listener still accepts on
+                TCPStreamListener second(*mIO);
+                TS_ASSERT(!second.listen(unixAddress,&Stream::ignoreSubstreamCallback));
+            }
+            UnixSocket probe(*mIO);
+            boost::system::error_code error;
+            probe.connect(boost::asio::local::stream_protocol::endpoint(path),error);
+            TS_ASSERT(!error);
+        }
+        TS_ASSERT(lstat(path,&info)!=0);
+        {
+            //but a socket left behind by a listener that never closed is taken over
+            UnixListener stale(*mIO,boost::asio::local::stream_protocol::endpoint(path));
+            stale.close();
+            TS_ASSERT(lstat(path,&info)==0&&S_ISSOCK(info.st_mode));
+            TCPStreamListener listener(*mIO);
+            TS_ASSERT(listener.listen(unixAddress,&Stream::ignoreSubstreamCallback));
+        }
+        TS_ASSERT(lstat(path,&info)!=0);
+#endif
+    }
+    void testSimultaneousClose(void) {
+        Sirikata::AtomicValue<int> received(0),misordered(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        size_t firstAccepted=mStreams.size();
+        TCPStreamListener listener(*mIO);
+        TCPStream r(*mIO);
+        listenAndConnect(listener,nextLoopback(),std::tr1::bind(&SstTest::adaptiveNewStreamCallback,this,&received,&misordered,_1,_2),r);
+        r.send(Chunk(1,'\0'),ReliableOrdered);
+        waitFor(received,1,10);
+        TS_ASSERT_EQUALS(mStreams.size(),firstAccepted+1);
+        //both ends of each pair close, at once or one after the other has finished, and the IDs they free must each be handed out once
+        int sent=1;
+        for (int round=0;round<10;++round) {
+            size_t accepted=mStreams.size();
+            TCPStream*pair[2];
+            for (int i=0;i<2;++i) {
+                pair[i]=(TCPStream*)r.factory();
+                pair[i]->cloneFrom(&r,&Stream::ignoreConnectionStatus,&Stream::ignoreBytesReceived);
+                pair[i]->send(Chunk(1,'\0'),ReliableOrdered);
+                ++sent;
+            }
+            waitFor(received,sent,20);
+            TS_ASSERT_EQUALS(received.read(),sent);
+            TS_ASSERT_EQUALS(mStreams.size(),accepted+2);
+            if (mStreams.size()!=accepted+2)
+                break;
+            for (int i=0;i<2;++i) {
+                pair[i]->close();
+                if (round&1)
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+                mStreams[accepted+i]->close();
+                delete pair[i];
+            }
+            boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+        }
+        TS_ASSERT_EQUALS(misordered.read(),0);
+        r.close();
+    }
+    void testBaseSocketJoinTimeout(void) {
+        waitForService();
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        boost::mutex arrivedLock;
+        std::vector<Chunk> arrived;
+        size_t firstAccepted=mStreams.size();
+        Address address=nextLoopback();
+        TCPStreamListener listener(*mIO);
+        listener.listen(address,std::tr1::bind(&SstTest::keepNewStreamCallback,this,&arrivedLock,&arrived,_1,_2));
+        //a client that promises two sockets, can resize and never sends the second one
+        TCPSocket client(*mIO);
+        boost::system::error_code error;
+        client.connect(rawEndpoint(address),error);
+        TS_ASSERT(!error);
+        if (error)
+            return;
+        uint8 header[TCPStream::TcpSstHeaderSize];
+        std::memcpy(header,TCPStream::STRING_PREFIX(),TCPStream::STRING_PREFIX_LENGTH);
+        header[TCPStream::STRING_PREFIX_LENGTH]='0';
+        header[TCPStream::STRING_PREFIX_LENGTH+1]='2';
+        std::memcpy(header+TCPStream::STRING_PREFIX_LENGTH+2,Sirikata::UUID::random().getArray().begin(),Sirikata::UUID::static_size);
+        boost::asio::write(client,boost::asio::buffer(header,TCPStream::TcpSstHeaderSize),boost::asio::transfer_all(),error);
+        uint8 capabilities[4*Stream::uint30::MAX_SERIALIZED_LENGTH];
+        unsigned int size=Stream::uint30::MAX_SERIALIZED_LENGTH;
+        size+=Stream::StreamID().serialize(capabilities+size,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        capabilities[size++]=TCPStream::TCPStreamCapabilities;
+        size+=Stream::uint30(TCPStream::TCPStreamCapableOfResizing).serialize(capabilities+size,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        unsigned int lengthLength=Stream::uint30(size-Stream::uint30::MAX_SERIALIZED_LENGTH).serialize(capabilities,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        std::memmove(capabilities+lengthLength,capabilities+Stream::uint30::MAX_SERIALIZED_LENGTH,size-Stream::uint30::MAX_SERIALIZED_LENGTH);
+        size-=Stream::uint30::MAX_SERIALIZED_LENGTH-lengthLength;
+        boost::asio::write(client,boost::asio::buffer(capabilities,size),boost::asio::transfer_all(),error);
+        TS_ASSERT(!error);
+        time_t start=time(NULL);
+        while (mStreams.size()==firstAccepted&&time(NULL)<start+10) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        TS_ASSERT_EQUALS(mStreams.size(),firstAccepted+1);
+        if (mStreams.size()!=firstAccepted+1)
+            return;
+        //the close waits on the missing socket, and goes out on the first once the listener gives up on it
+        mStreams.back()->close();
+        std::vector<uint8> received;
+        bool closed=false;
+        size_t parsed=TCPStream::TcpSstHeaderSize;
+        while (!closed&&time(NULL)<start+MultiplexedSocket::BASE_JOIN_TIMEOUT_MILLISECONDS/1000+10) {
+            size_t available=client.available(error);
+            if (error)
+                break;
+            if (!available) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+                continue;
+            }
+            size_t previous=received.size();
+            received.resize(previous+available);
+            received.resize(previous+client.read_some(boost::asio::buffer(&received[previous],available),error));
+            Stream::uint30 packetLength;
+            unsigned int packetLengthLength;
+            while (received.size()>parsed
+                   &&packetLength.unserialize(&received[parsed],packetLengthLength=(unsigned int)(received.size()-parsed))
+                   &&received.size()>=parsed+packetLengthLength+packetLength.read()) {
+                const uint8*packet=&received[parsed+packetLengthLength];
+                Stream::StreamID id,closedId;
+                unsigned int idLength=packetLength.read(),closedIdLength;
+                if (id.unserialize(packet,idLength)&&id==Stream::StreamID()&&idLength<packetLength.read()
+                    &&packet[idLength]==TCPStream::TCPStreamCloseStream
+                    &&closedId.unserialize(packet+idLength+1,closedIdLength=packetLength.read()-idLength-1)
+                    &&closedId==Stream::StreamID(1)) {
+                    closed=true;
+                }
+                parsed+=packetLengthLength+packetLength.read();
+            }
+        }
+        TS_ASSERT(closed);
+        TS_ASSERT(time(NULL)>=start+MultiplexedSocket::BASE_JOIN_TIMEOUT_MILLISECONDS/1000-1);
+        client.close(error);
+    }
+    ///The endpoint of a numeric TCP address such as nextLoopback gives out, for tests that talk to a listener over a raw socket
+    static boost::asio::ip::tcp::endpoint rawEndpoint(const Address&address) {
+        return boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(address.getHostName()),(unsigned short)atoi(address.getService().c_str()));
+    }
+    ///Connects client to address and sends the handshake of a connection of a single socket, as a peer of its own would
+    bool rawHandshake(TCPSocket&client,const Address&address) {
+        boost::system::error_code error;
+        client.connect(rawEndpoint(address),error);
+        if (error)
+            return false;
+        uint8 header[TCPStream::TcpSstHeaderSize];
+        std::memcpy(header,TCPStream::STRING_PREFIX(),TCPStream::STRING_PREFIX_LENGTH);
+        header[TCPStream::STRING_PREFIX_LENGTH]='0';
+        header[TCPStream::STRING_PREFIX_LENGTH+1]='1';
+        std::memcpy(header+TCPStream::STRING_PREFIX_LENGTH+2,Sirikata::UUID::random().getArray().begin(),Sirikata::UUID::static_size);
+        boost::asio::write(client,boost::asio::buffer(header,TCPStream::TcpSstHeaderSize),boost::asio::transfer_all(),error);
+        return !error;
+    }
+    ///Frames the packet of stream id onto the end of wire
+    static void appendRawPacket(std::vector<uint8>&wire,const Stream::StreamID&id,const std::vector<uint8>&data) {
+        uint8 framing[2*Stream::uint30::MAX_SERIALIZED_LENGTH];
+        unsigned int idLength=id.serialize(framing+Stream::uint30::MAX_SERIALIZED_LENGTH,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        unsigned int lengthLength=Stream::uint30((Sirikata::uint32)(idLength+data.size())).serialize(framing,Stream::uint30::MAX_SERIALIZED_LENGTH);
+        wire.insert(wire.end(),framing,framing+lengthLength);
+        wire.insert(wire.end(),framing+Stream::uint30::MAX_SERIALIZED_LENGTH,framing+Stream::uint30::MAX_SERIALIZED_LENGTH+idLength);
+        wire.insert(wire.end(),data.begin(),data.end());
+    }
+    ///Frames the first fragment of a packet of totalLength bytes from stream id, carrying a byte of it, onto the end of wire
+    static void appendFirstFragment(std::vector<uint8>&wire,const Stream::StreamID&id,Sirikata::uint32 totalLength) {
+        std::vector<uint8> fragment(2+2*Stream::uint30::MAX_SERIALIZED_LENGTH);
+        fragment[0]=TCPStream::TCPStreamFragment;
+        fragment[1]=TCPStream::TCPStreamFirstFragment;
+        unsigned int size=2;
+        size+=id.serialize(&fragment[size],Stream::uint30::MAX_SERIALIZED_LENGTH);
+        size+=Stream::uint30(totalLength).serialize(&fragment[size],Stream::uint30::MAX_SERIALIZED_LENGTH);
+        fragment.resize(size);
+        fragment.push_back('F');
+        appendRawPacket(wire,Stream::StreamID(),fragment);
+    }
+    ///Reads and throws away what arrives on client until the other side closes it, returning false if that takes more than seconds
+    static bool waitForRawClose(TCPSocket&client,int seconds) {
+        boost::system::error_code error;
+        client.non_blocking(true,error);
+        uint8 discard[4096];
+        time_t start=time(NULL);
+        while (time(NULL)<start+seconds) {
+            client.read_some(boost::asio::buffer(discard),error);
+            if (error==boost::asio::error::would_block)
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            else if (error)
+                return true;
+        }
+        return false;
+    }
+    void testFragmentLimits(void) {
+        waitForService();
+        Sirikata::AtomicValue<int> received(0);
+        using std::tr1::placeholders::_1;
+        using std::tr1::placeholders::_2;
+        Address address=nextLoopback();
+        TCPStreamListener listener(*mIO);
+        listener.listen(address,std::tr1::bind(&SstTest::datagramNewStreamCallback,this,&received,_1,_2));
+        boost::system::error_code error;
+        {
+            //a first fragment of a packet larger than any sender fragments drops the connection rather than reserving room for it
+            TCPSocket client(*mIO);
+            TS_ASSERT(rawHandshake(client,address));
+            std::vector<uint8> wire;
+            appendFirstFragment(wire,Stream::StreamID(1),MultiplexedSocket::MAX_REASSEMBLED_LENGTH+1);
+            boost::asio::write(client,boost::asio::buffer(wire),boost::asio::transfer_all(),error);
+            TS_ASSERT(waitForRawClose(client,10));
+        }
+        {
+            //as does one packet more than may be reassembled at once
+            TCPSocket client(*mIO);
+            TS_ASSERT(rawHandshake(client,address));
+            std::vector<uint8> wire;
+            for (unsigned int i=1;i<=MultiplexedSocket::MAX_PARTIAL_PACKETS;++i) {
+                appendFirstFragment(wire,Stream::StreamID(i),1024);
+            }
+            //a whole packet behind the fragments shows the connection was still up after them
+            appendRawPacket(wire,Stream::StreamID(MultiplexedSocket::MAX_PARTIAL_PACKETS+1),std::vector<uint8>(16,'W'));
+            boost::asio::write(client,boost::asio::buffer(wire),boost::asio::transfer_all(),error);
+            waitFor(received,1,10);
+            TS_ASSERT_EQUALS(received.read(),1);
+            wire.clear();
+            appendFirstFragment(wire,Stream::StreamID(MultiplexedSocket::MAX_PARTIAL_PACKETS+2),1024);
+            boost::asio::write(client,boost::asio::buffer(wire),boost::asio::transfer_all(),error);
+            TS_ASSERT(waitForRawClose(client,10));
+        }
     }
     void testConnectSend (void )
     {
@@ -433,7 +1989,7 @@ public:
         bool doSubstreams=true;
         {
             TCPStream r(*mIO);
-            while (!mReadyToConnect);
+            waitForService();
             simpleConnect(&r,Address("127.0.0.1",mPort));
             runRoutine(&r);
             if (doSubstreams) {
@@ -0,0 +1,140 @@
+/*  Sirikata Network Utilities
+ *  main.cpp
+ *
+ *  Copyright (c) 2009, Daniel Reiter Horn
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Sirikata nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "util/Standard.hh"
+#include "network/TCPStream.hpp"
+#include "network/IOServicePool.hpp"
+#include "network/PacketTrace.hpp"
+#include "task/Time.hpp"
+#include <boost/thread.hpp>
+#include <iostream>
+
+/**
+ * Summarizes a packet trace written by TCPStream::writePacketTrace and plays the packets it received back through
+ * a fresh connection, reporting how quickly the connection delivered them to its streams.
+ * usage: ssttrace tracefile [pace]
+ * where pace scales the recorded time between packets: 1 replays them as they arrived, 0 (the default) as fast as possible
+ */
+namespace {
+using namespace Sirikata;
+using namespace Sirikata::Network;
+
+AtomicValue<uint32> sStreams(0);
+AtomicValue<uint32> sPackets(0);
+AtomicValue<uint64> sBytes(0);
+//filled in on the IO thread as the replay opens streams, and emptied on the main thread once the replay is over
+boost::mutex sOpenedStreamsLock;
+std::vector<Stream*> sOpenedStreams;
+
+void connectionStatus(Stream::ConnectionStatus status, const std::string&reason) {
+}
+void bytesReceived(const PacketView&data) {
+    ++sPackets;
+    sBytes+=(uint64)data.size();
+}
+void newStream(Stream*stream, Stream::SetCallbacks&setCallbacks) {
+    if (stream) {
+        {
+            boost::lock_guard<boost::mutex> lok(sOpenedStreamsLock);
+            sOpenedStreams.push_back(stream);
+        }
+        ++sStreams;
+        setCallbacks(&connectionStatus,&bytesReceived);
+    }
+}
+
+///Plays records back through a connection on pool, printing how quickly its streams received them; returns main's exit code
+int replayTrace(IOServicePool&pool,const std::vector<PacketTrace::Record>&records,double pace) {
+    PacketTraceReplay replay(pool.service());
+    Task::AbsTime start=Task::AbsTime::now();
+    if (!replay.play(records,&newStream,pace)) {
+        std::cerr<<"Could not replay the packet trace"<<std::endl;
+        return 1;
+    }
+    //the streams are not told when the last packet arrives, so wait until they stop hearing anything
+    Task::AbsTime lastProgress=start;
+    uint32 lastPackets=0;
+    for (;;) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        Task::AbsTime now=Task::AbsTime::now();
+        if (sPackets.read()!=lastPackets) {
+            lastPackets=sPackets.read();
+            lastProgress=now;
+        }else if (replay.finished()&&Task::DeltaTime::seconds(0.5)<now-lastProgress) {
+            break;
+        }
+    }
+    double seconds=(double)(lastProgress-start);
+    std::cout<<"replayed "<<replay.packetsPlayed()<<" packets into "<<sStreams.read()<<" streams, which received "
+             <<sPackets.read()<<" packets of "<<sBytes.read()<<" bytes in "<<seconds<<" seconds";
+    if (seconds>0.0)
+        std::cout<<": "<<sPackets.read()/seconds<<" packets/s, "<<sBytes.read()/seconds/1048576.0<<" MB/s";
+    std::cout<<std::endl;
+    return 0;
+}
+}
+
+int main(int argc,const char**argv) {
+    if (argc<2) {
+        std::cerr<<"usage: "<<argv[0]<<" tracefile [pace]"<<std::endl;
+        return 1;
+    }
+    std::vector<PacketTrace::Record> records;
+    if (!PacketTrace::read(argv[1],records)) {
+        std::cerr<<"Could not read packet trace "<<argv[1]<<std::endl;
+        return 1;
+    }
+    double pace=argc>2?atof(argv[2]):0.0;
+    size_t packets[2]={0,0};
+    uint64 bytes[2]={0,0};
+    for (std::vector<PacketTrace::Record>::const_iterator i=records.begin(),ie=records.end();i!=ie;++i) {
+        ++packets[i->mDirection];
+        bytes[i->mDirection]+=i->mData.size();
+    }
+    double tracedSeconds=records.empty()?0.0:(records.back().mTime-records.front().mTime)/1000000.0;
+    std::cout<<argv[1]<<": "<<tracedSeconds<<" seconds, sent "<<packets[PacketTrace::SENT]<<" packets of "<<bytes[PacketTrace::SENT]
+             <<" bytes, received "<<packets[PacketTrace::RECEIVED]<<" packets of "<<bytes[PacketTrace::RECEIVED]<<" bytes"<<std::endl;
+
+    IOServicePool pool(1);
+    pool.run();
+    int retval=replayTrace(pool,records,pace);
+    std::vector<Stream*> openedStreams;
+    {
+        boost::lock_guard<boost::mutex> lok(sOpenedStreamsLock);
+        openedStreams.swap(sOpenedStreams);
+    }
+    for (std::vector<Stream*>::iterator i=openedStreams.begin(),ie=openedStreams.end();i!=ie;++i) {
+        delete *i;
+    }
+    pool.stop();
+    return retval;
+}